@@ -0,0 +1,488 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// MICROBENCHMARKS
+//
+// Times each simulation hot path on its own over a range of sizes, and writes
+// the results as JSON. Run with "-bench [file]" (default benchmarks.json); the
+// program exits once the suite is done. "-benchlights [file]" runs only the
+// flash light binning and lighting, which need no device, without a window.
+//
+// Every result is reported per item (particle, noise sample, random number or
+// system) as ns/particle and particles/s. Each measurement is the best of
+// BENCH_REPEATS runs, and each run is repeated until it has lasted at least
+// BENCH_MIN_MS so small sizes are not swamped by timer resolution. The
+// systems' own benchmarks stop at PARTICLE_POOL_SIZE particles, the most one
+// system can have in the particle pool.
+//-----------------------------------------------------------------------------
+
+#include "ParticleSystem.h"
+#include "Lights.h"
+#include "PerlinNoise.h"
+#include <stdio.h>
+#include <string>
+
+#define BENCH_REPEATS	5
+#define BENCH_MIN_MS	20.0
+#define BENCH_LIFETIME	1000000		// Long enough that nothing dies while being timed.
+
+static const int BENCH_SIZES[] = { 100, 1000, 10000, 100000 };
+#define BENCH_SIZE_COUNT	((int)(sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0])))
+
+struct BENCH_RESULT
+{
+	std::string name_;
+	int size_;					// Number of items per iteration.
+	double ns_per_item_;
+	double items_per_s_;
+	unsigned int iterations_;	// Iterations in the best run.
+};
+
+class BENCHMARK_SUITE
+{
+public:
+	BENCHMARK_SUITE()
+	{
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency_ = (double)f.QuadPart;
+	}
+
+	// Run everything and write the results to 'filename'. Needs a valid 'device' (systems create vertex buffers).
+	bool run(const char *filename)
+	{
+		// Deterministic draws, so every run times the same work.
+		bool deterministic = g_World->deterministic_random_;
+		g_World->deterministic_random_ = true;
+		seed_show_random(1);
+
+		for (int i = 0; i < BENCH_SIZE_COUNT; ++i)
+		{
+			int n = BENCH_SIZES[i];
+
+			// A system can have no more than the whole pool - any bigger and its particles come from the heap, which
+			// is not what the show runs on. The largest size stops at PARTICLE_POOL_SIZE for those.
+			int pooled = n < PARTICLE_POOL_SIZE ? n : PARTICLE_POOL_SIZE;
+
+			bench_fountain_update(pooled);
+			bench_explosion_update(pooled);
+			bench_rocket_update(pooled);
+			bench_rocket_trail_update(pooled);
+			bench_start_single_particle(pooled);
+			bench_emit(pooled);
+			bench_find_next_dead_particle(pooled);
+			bench_fill_vertices(pooled);
+			bench_compact_encode(n);
+			bench_compact_particles(n);
+			bench_ground_collide(n);
+			bench_noise(n);
+			bench_random_number(n);
+			bench_system_churn(n / 10);
+			bench_timer_wheel(n);
+			bench_flash_lights(n / 100);
+		}
+
+		g_World->deterministic_random_ = deterministic;
+
+		return write_json(filename);
+	}
+
+	// Run only bench_flash_lights(), at the sizes run() gives it, and write the results to 'filename'. Needs no device.
+	bool run_lights(const char *filename)
+	{
+		bool deterministic = g_World->deterministic_random_;
+		g_World->deterministic_random_ = true;
+		seed_show_random(1);
+
+		for (int i = 0; i < BENCH_SIZE_COUNT; ++i) bench_flash_lights(BENCH_SIZES[i] / 100);
+
+		g_World->deterministic_random_ = deterministic;
+
+		return write_json(filename);
+	}
+
+	const std::vector<BENCH_RESULT> &results() const { return results_; }
+
+private:
+
+	// Fountains cannot start particles on their own, this one is only ever filled by the suite.
+	class BENCH_FOUNTAIN : public FOUNTAIN_CLASS
+	{
+		void start_particles() {}
+	};
+
+	double now() const
+	{
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		return (double)t.QuadPart * 1000.0 / frequency_;	// ms
+	}
+
+	// Time 'body' (one iteration over 'items' items) and record the best of BENCH_REPEATS runs.
+	// 'setup' is called before each run and is not timed.
+	template <class SETUP, class BODY>
+	void measure(const std::string &name, int items, SETUP setup, BODY body)
+	{
+		double best = 0;
+		unsigned int best_iterations = 0;
+
+		for (int r = 0; r < BENCH_REPEATS; ++r)
+		{
+			setup();
+
+			unsigned int iterations = 0;
+			double start = now(), elapsed = 0;
+
+			do
+			{
+				body();
+				++iterations;
+				elapsed = now() - start;
+			} while (elapsed < BENCH_MIN_MS);
+
+			double per_iteration = elapsed / iterations;
+			if (best_iterations == 0 || per_iteration < best)
+			{
+				best = per_iteration;
+				best_iterations = iterations;
+			}
+		}
+
+		BENCH_RESULT result;
+		result.name_ = name;
+		result.size_ = items;
+		result.ns_per_item_ = best * 1000000.0 / items;
+		result.items_per_s_ = result.ns_per_item_ > 0 ? 1000000000.0 / result.ns_per_item_ : 0;
+		result.iterations_ = best_iterations;
+		results_.push_back(result);
+	}
+
+	static void no_setup() {}
+
+	//-------------------------------------------------------------------------
+
+	// Fill every slot of 's' with a live particle.
+	static void start_all(PARTICLE_SYSTEM_BASE &s)
+	{
+		for (PARTICLE_VECTOR::iterator p(s.particles_.begin()); p != s.particles_.end(); ++p)
+		{
+			p->lifetime_ = 0;
+			s.start_single_particle(p);
+		}
+	}
+
+	void bench_fountain_update(int n)
+	{
+		BENCH_FOUNTAIN s;
+		s.max_particles_ = n;
+		s.max_lifetime_ = BENCH_LIFETIME;
+		s.time_increment_ = 0.01f;
+		s.gravity_ = -0.5f;
+		s.launch_angle_ = (float)D3DXToRadian(80);
+		s.launch_velocity_ = 5.0f;
+		if (FAILED(s.initialise())) return;
+
+		measure("fountain_update", n, [&]() { s.alive_particles_ = 0; start_all(s); }, [&]() { s.update(); });
+	}
+
+	void bench_explosion_update(int n)
+	{
+		std::shared_ptr<FIREWORK_EXPLOSION_CLASS> s;
+
+		// Explosions start all their particles in initialise(), so build a fresh one for each run. The last one
+		// goes first, and the pool is closed up after it, so each run's particles start at the same place in it.
+		measure("explosion_update", n,
+			[&]()
+			{
+				s.reset();
+				if (g_World->pool_.fragmented()) g_World->pool_.compact();
+
+				s.reset(new FIREWORK_EXPLOSION_CLASS);
+				s->max_particles_ = n;
+				s->max_lifetime_ = BENCH_LIFETIME;
+				s->gravity_ = -0.5f;
+				s->launch_velocity_ = 5.0f;
+				s->time_increment_ = 0.95f;
+				s->initialise();
+			},
+			[&]() { s->update(); });
+	}
+
+	void bench_rocket_update(int n)
+	{
+		FIREWORK_ROCKET_CLASS s;
+		s.max_particles_ = n;
+		s.max_lifetime_ = BENCH_LIFETIME;
+		s.launch_velocity_ = 1.0f;
+		s.time_increment_ = 0.05f;
+		s.rocketTime = 0;		// Times moving the trail, not starting it - the timer wheel is never advanced, so no bursts fire.
+		s.start_particles_ = 0;
+		s.start_interval_ = 1;
+		s.start_timer_ = 0;
+		s.RocketVel = D3DXVECTOR3(0, 6.0f, 0);
+		if (FAILED(s.initialise())) return;
+
+		measure("rocket_update", n, [&]() { s.alive_particles_ = 0; start_all(s); }, [&]() { s.update(); });
+	}
+
+	// Ribbon trail drawing 'n' sparks from the path history.
+	void bench_rocket_trail_update(int n)
+	{
+		FIREWORK_ROCKET_CLASS s;
+		s.ribbon_trail_ = true;
+		s.trail_sparks_ = 2;
+		s.max_lifetime_ = n / s.trail_sparks_;
+		s.launch_velocity_ = 1.0f;
+		s.time_increment_ = 0.05f;
+		s.rocketTime = (float)BENCH_LIFETIME;	// Still burning, so the history stays full.
+		s.RocketVel = D3DXVECTOR3(0, 6.0f, 0);
+		if (FAILED(s.initialise())) return;
+
+		// Fill the history before timing.
+		for (int i = 0; i < s.max_lifetime_; ++i) s.update();
+
+		measure("rocket_trail_update", n, no_setup, [&]() { s.update(); });
+	}
+
+	void bench_start_single_particle(int n)
+	{
+		FIREWORK_EXPLOSION_CLASS s;
+		s.max_particles_ = n;
+		s.max_lifetime_ = 100;
+		s.launch_velocity_ = 5.0f;
+		s.PARTICLE_SYSTEM_BASE::initialise();	// Without starting the particles.
+
+		measure("start_single_particle", n, no_setup,
+			[&]()
+			{
+				s.alive_particles_ = 0;
+				start_all(s);
+			});
+	}
+
+	// Starting every particle of an explosion in one batch (the time includes killing them all again).
+	void bench_emit(int n)
+	{
+		FIREWORK_EXPLOSION_CLASS s;
+		s.max_particles_ = n;
+		s.max_lifetime_ = 100;
+		s.launch_velocity_ = 5.0f;
+		s.PARTICLE_SYSTEM_BASE::initialise();
+
+		measure("emit", n, no_setup,
+			[&]()
+			{
+				for (PARTICLE_VECTOR::iterator p(s.particles_.begin()); p != s.particles_.end(); ++p) p->lifetime_ = 0;
+				s.alive_particles_ = 0;
+				s.emit(n);
+			});
+	}
+
+	void bench_find_next_dead_particle(int n)
+	{
+		FIREWORK_EXPLOSION_CLASS s;
+		s.max_particles_ = n;
+		s.max_lifetime_ = 100;
+		s.launch_velocity_ = 5.0f;
+		s.PARTICLE_SYSTEM_BASE::initialise();
+
+		// Worst case - only the last slot is free, so the whole array is scanned.
+		start_all(s);
+		s.particles_.back().lifetime_ = 0;
+
+		volatile bool found = false;
+		measure("find_next_dead_particle", n, no_setup, [&]() { found = s.find_next_dead_particle() != s.particles_.end(); });
+	}
+
+	void bench_fill_vertices(int n)
+	{
+		FIREWORK_EXPLOSION_CLASS s;
+		s.max_particles_ = n;
+		s.max_lifetime_ = BENCH_LIFETIME;
+		s.launch_velocity_ = 5.0f;
+		s.PARTICLE_SYSTEM_BASE::initialise();
+		start_all(s);
+
+		// Every other particle dead, like a system part way through its life.
+		for (int i = 0; i < n; i += 2) s.particles_[i].lifetime_ = 0;
+
+		std::vector<POINTVERTEX> points(n);
+		measure("fill_vertices", n, no_setup, [&]() { s.fill_vertices(&points[0]); });
+	}
+
+	// Quantizing a frame's vertices into the compact stream (range plus encode), on top of fill_vertices.
+	void bench_compact_encode(int n)
+	{
+		std::vector<POINTVERTEX> points(n);
+		for (int i = 0; i < n; ++i) points[i].position_ = D3DXVECTOR3((float)(i % 100), (float)(i % 37) * 3.0f, (float)(i % 71) - 35.0f);
+
+		std::vector<COMPACT_POINTVERTEX> compact(n);
+		D3DXVECTOR3 origin(0, 0, 0);
+
+		measure("compact_encode", n, no_setup,
+			[&]()
+			{
+				COMPACT_RANGE r = compact_range(&points[0].position_, n, sizeof(POINTVERTEX), origin);
+				encode_compact_vertices(&points[0].position_, NULL, n, sizeof(POINTVERTEX), r, &compact[0]);
+			});
+	}
+
+	// Packing a frame's particles to COMPACT_PARTICLEs and back - what -compactstate adds to each explosion update.
+	void bench_compact_particles(int n)
+	{
+		std::vector<PARTICLE> particles(n);
+		for (int i = 0; i < n; ++i)
+		{
+			particles[i].lifetime_ = i % 100 + 1;
+			particles[i].position_ = D3DXVECTOR3((float)(i % 100), (float)(i % 37) * 3.0f, (float)(i % 71) - 35.0f);
+			particles[i].velocity_ = D3DXVECTOR3((float)(i % 11) * 0.5f - 2.5f, 1.0f, -0.25f);
+			particles[i].time_ = 1.0f + (i % 50) * 0.95f;
+		}
+
+		COMPACT_PARTICLE_FRAME frame;
+		frame.origin_ = D3DXVECTOR3(0, 0, 0);
+		frame.start_time_ = 1.0f;
+		frame.time_increment_ = 0.95f;
+
+		std::vector<COMPACT_PARTICLE> packed(n);
+		measure("compact_particles", n, no_setup,
+			[&]()
+			{
+				encode_compact_particles(&particles[0], n, frame, &packed[0]);
+				decode_compact_particles(&packed[0], n, frame, &particles[0]);
+			});
+	}
+
+	// Bounce pass where half the particles are below the ground (the time includes putting them back below it).
+	void bench_ground_collide(int n)
+	{
+		std::vector<PARTICLE> particles(n);
+		for (int i = 0; i < n; ++i)
+		{
+			reset_particle(particles[i]);
+			particles[i].lifetime_ = BENCH_LIFETIME;
+			particles[i].velocity_ = D3DXVECTOR3(0.1f, -1.0f, 0.1f);
+		}
+
+		GROUND_COLLIDER ground;
+		ground.set_plane(0.0f);
+
+		measure("ground_collide", n, no_setup,
+			[&]()
+			{
+				for (int i = 0; i < n; ++i) particles[i].position_.y = (i & 1) ? 1.0f : -1.0f;
+				ground.collide(&particles[0], n, GROUND_BOUNCE, 0.5f);
+			});
+	}
+
+	void bench_noise(int n)
+	{
+		PerlinNoise pn(1);
+		volatile double sum = 0;
+
+		measure("perlin_noise", n, no_setup,
+			[&]()
+			{
+				double total = 0;
+				for (int i = 0; i < n; ++i) total += pn.noise(i * 0.01, i * 0.007, 0.8);
+				sum = total;
+			});
+	}
+
+	void bench_random_number(int n)
+	{
+		volatile unsigned int sink = 0;
+
+		g_World->deterministic_random_ = false;
+		measure("random_number_rand_s", n, no_setup, [&]() { for (int i = 0; i < n; ++i) sink = random_number(0, 360); });
+
+		g_World->deterministic_random_ = true;
+		measure("random_number_deterministic", n, no_setup, [&]() { for (int i = 0; i < n; ++i) sink = random_number(0, 360); });
+	}
+
+	// Insert and retire systems the way Update() does with the show's systems - 10% of them die each frame and are replaced.
+	void bench_system_churn(int n)
+	{
+		std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> systems;
+		SYSTEM_COMMAND_QUEUE queue;
+
+		measure("system_churn", n,
+			[&]()
+			{
+				systems.clear();
+				for (int i = 0; i < n; ++i) systems.push_back(std::shared_ptr<PARTICLE_SYSTEM_BASE>(new FIREWORK_EXPLOSION_CLASS));
+			},
+			[&]()
+			{
+				for (int i = 0; i < n; i += 10)
+				{
+					systems[(i * 7) % n]->safeToDelete = true;
+					queue.retire();
+				}
+
+				// Only the sweep - the replacements are never initialised, that would time creating vertex buffers.
+				queue.compact(systems);
+
+				while (systems.size() < (size_t)n) systems.push_back(std::shared_ptr<PARTICLE_SYSTEM_BASE>(new FIREWORK_EXPLOSION_CLASS));
+			});
+	}
+
+	// Schedule 'n' events spread over the next 4096 frames and advance until they have all fired - the
+	// per event cost of the spawner cues and rocket fuses, including the cascades between levels.
+	void bench_timer_wheel(int n)
+	{
+		TIMER_WHEEL wheel;
+		volatile int fired = 0;
+
+		measure("timer_wheel", n, no_setup,
+			[&]()
+			{
+				for (int i = 0; i < n; ++i) wheel.schedule(1 + (i * 2654435761u) % 4096, [&]() { ++fired; });
+				while (wheel.pending() > 0) wheel.advance();
+			});
+	}
+
+	// Binning 'n' explosion flashes into the clusters, and lighting the backdrop and ground through them - against
+	// every flash at every vertex. Per flash. Needs no device.
+	void bench_flash_lights(int n)
+	{
+		std::vector<FLASH_LIGHT> lights(n);
+		for (int i = 0; i < n; ++i)
+		{
+			lights[i].position_ = D3DXVECTOR3((float)random_number(0, 300) - 150.0f, (float)random_number(0, 250) - 100.0f, (float)random_number(0, 40) - 20.0f);
+			lights[i].r_ = lights[i].g_ = lights[i].b_ = 1.0f;
+		}
+
+		std::unique_ptr<LIT_SCENE> scene(new LIT_SCENE);
+		scene->build();
+
+		// A copy of the scene's clusters - a fresh LIGHT_CLUSTERS has nothing occupied, and would bin into nothing.
+		std::unique_ptr<LIGHT_CLUSTERS> clusters(new LIGHT_CLUSTERS(scene->clusters()));
+		measure("flash_bin", n, no_setup, [&]() { clusters->bin(&lights[0], n); });
+		if (clusters->lit() == 0) OutputDebugString("Benchmark: flash_bin lit no clusters, the timing is of an empty loop.\n");
+		measure("flash_light_clustered", n, no_setup, [&]() { scene->light(lights); });
+		measure("flash_light_all", n, no_setup, [&]() { scene->light_all(lights); });
+	}
+
+	//-------------------------------------------------------------------------
+
+	bool write_json(const char *filename) const
+	{
+		FILE *f = NULL;
+		if (fopen_s(&f, filename, "w") != 0 || f == NULL) return false;
+
+		fprintf(f, "{\n  \"benchmarks\": [\n");
+		for (size_t i = 0; i < results_.size(); ++i)
+		{
+			const BENCH_RESULT &r = results_[i];
+			fprintf(f, "    { \"name\": \"%s\", \"size\": %d, \"ns_per_particle\": %.3f, \"particles_per_s\": %.0f, \"iterations\": %u }%s\n",
+				r.name_.c_str(), r.size_, r.ns_per_item_, r.items_per_s_, r.iterations_, i + 1 < results_.size() ? "," : "");
+		}
+		fprintf(f, "  ]\n}\n");
+
+		fclose(f);
+		return true;
+	}
+
+	double frequency_;
+	std::vector<BENCH_RESULT> results_;
+};
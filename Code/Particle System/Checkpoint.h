@@ -0,0 +1,466 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// SHOW CHECKPOINTS
+//
+// Saves the complete simulation state (every system in the current show, their
+// particles, the chained 'nextSystems', the spawner counters, the wind and the
+// noise cursor) to a versioned binary file, and restores it again. Fountains
+// are left out: a show never has one, and they cannot be rebuilt on their own
+// (FOUNTAIN_CLASS has nothing to start its particles with). So are the systems
+// of a chain that have been started - they are in SHOW_WORLD::particles_ by
+// then and are written there, once.
+//
+// File layout (native packing, little endian):
+//   CHECKPOINT_HEADER
+//   CHECKPOINT_SPAWNER spawners [spawner_count_]
+//   system records [system_count_], each one being
+//       CHECKPOINT_SYSTEM
+//       PARTICLE   particles [particle_count_]	- raw copy of 'particles_'
+//       TRAIL_NODE trail [trail_nodes_]			- rocket path history (ribbon trails only)
+//       D3DXVECTOR3 trail velocities [trail_nodes_ * trail_sparks_]
+//       system records [next_count_]			- the 'nextSystems' chain, not yet started
+//
+// Particles are stored exactly as they sit in memory, so restoring a system
+// is one bulk copy out of the mapped file, not a per particle parse. The same
+// layout is kept in memory for the seek keyframes (see Seek.h).
+//-----------------------------------------------------------------------------
+
+#include "ParticleSystem.h"
+#include <stdio.h>
+
+#define CHECKPOINT_VERSION 6
+
+struct CHECKPOINT_HEADER
+{
+	char			magic_[4];			// "FWCK"
+	unsigned int	version_;			// CHECKPOINT_VERSION the file was written with.
+	unsigned int	frame_;				// Frame number the show was saved at.
+	float			windSpeed_;
+	float			windDrift_;			// SHOW_WORLD::wind_drift_.
+	unsigned int	noise_seed_;		// Seed used to build the wind noise table.
+	unsigned int	noise_index_;		// Position of the wind noise cursor in that table.
+	unsigned int	spawner_count_;
+	unsigned int	system_count_;		// Number of top level systems (SHOW_WORLD::particles_).
+};
+
+struct CHECKPOINT_SPAWNER
+{
+	int				counter_;			// FireworkSpawner::counter().
+	unsigned int	cue_order_;			// Firing order of its next cue (see TIMER_WHEEL::order()).
+};
+
+// Every field of every system type - unused fields are left zeroed.
+struct CHECKPOINT_SYSTEM
+{
+	int			type_;					// SYSTEM_TYPE.
+	int			texture_;				// Index for getTexture().
+	int			random_stream_;			// Random stream the system draws from.
+	int			initialised_;			// Non zero if initialise() had been called (i.e. the system was live).
+	int			max_particles_, alive_particles_, max_lifetime_;
+	D3DXVECTOR3	origin_;
+	float		time_increment_, particle_size_;
+	int			safeToDelete_, alpha_;
+	int			ground_response_;
+	float		restitution_;
+
+	// FIREWORK_EXPLOSION_CLASS / FIREWORK_ROCKET_CLASS ('launch_angle_' was the fountains', kept so the layout is unchanged)
+	int			terminate_on_floor_;
+	float		gravity_, floorY_, launch_angle_, launch_velocity_;
+
+	// FIREWORK_ROCKET_CLASS
+	float		rocketTime_;
+	D3DXVECTOR3	RocketVel_;
+	int			start_particles_, start_timer_, start_interval_, activated_;
+	unsigned int fuse_order_, burst_order_;	// Firing order of the fuse and burst timers.
+	int			ribbon_trail_, trail_sparks_, trail_head_, trail_count_, trail_clock_;
+	unsigned int trail_nodes_;			// Number of TRAIL_NODEs following the particles.
+
+	unsigned int particle_count_;		// Number of raw PARTICLEs following this record.
+	unsigned int next_count_;			// Number of 'nextSystems' records following the particles (the ones not yet started).
+};
+
+// Values restored alongside the systems that the application owns.
+struct CHECKPOINT_STATE
+{
+	unsigned int frame_;
+	unsigned int noise_seed_;
+	unsigned int noise_index_;
+};
+
+class SHOW_CHECKPOINT
+{
+public:
+
+	// Write the current show to 'filename'. Returns false if the file could not be written.
+	static bool save(const char *filename, const CHECKPOINT_STATE &state, const std::vector<std::shared_ptr<FireworkSpawner>> &spawners)
+	{
+		std::vector<char> out;
+		save(out, state, spawners);
+
+		FILE *f = NULL;
+		if (fopen_s(&f, filename, "wb") != 0 || f == NULL) return false;
+
+		bool ok = fwrite(&out[0], 1, out.size(), f) == out.size();
+		fclose(f);
+
+		return ok;
+	}
+
+	// Write the current show to 'out' (replacing its contents), in the same layout as the file.
+	static void save(std::vector<char> &out, const CHECKPOINT_STATE &state, const std::vector<std::shared_ptr<FireworkSpawner>> &spawners)
+	{
+		out.clear();
+
+		CHECKPOINT_HEADER header;
+		SecureZeroMemory(&header, sizeof(header));
+		memcpy(header.magic_, "FWCK", 4);
+		header.version_ = CHECKPOINT_VERSION;
+		header.frame_ = state.frame_;
+		header.windSpeed_ = g_World->wind_speed_;
+		header.windDrift_ = g_World->wind_drift_;
+		header.noise_seed_ = state.noise_seed_;
+		header.noise_index_ = state.noise_index_;
+		header.spawner_count_ = (unsigned int)spawners.size();
+		header.system_count_ = saved(g_World->particles_);
+		append(out, &header, sizeof(header));
+
+		for (auto &s : spawners)
+		{
+			CHECKPOINT_SPAWNER r;
+			r.counter_ = s->counter();
+			r.cue_order_ = s->cue_order();
+			append(out, &r, sizeof(r));
+		}
+
+		for (auto &s : g_World->particles_)
+		{
+			if (s->type() != SYSTEM_FOUNTAIN) write_system(out, *s);
+		}
+	}
+
+	// Replace the current show with the one in 'filename'.
+	// The file is memory mapped and the particle arrays are copied straight out of the view.
+	// On failure the current show is left untouched and false is returned.
+	static bool restore(const char *filename, CHECKPOINT_STATE &state, std::vector<std::shared_ptr<FireworkSpawner>> &spawners)
+	{
+		HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)sizeof(CHECKPOINT_HEADER))
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		const char *view = mapping ? (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+
+		bool ok = false;
+		if (view)
+		{
+			ok = read_show(view, view + size.QuadPart, state, spawners);
+			UnmapViewOfFile(view);
+		}
+
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+
+		return ok;
+	}
+
+	// Read the checkpoint in 'filename' into 'data', without restoring it. Returns false if it could not be read.
+	static bool load(const char *filename, std::vector<char> &data)
+	{
+		FILE *f = NULL;
+		if (fopen_s(&f, filename, "rb") != 0 || f == NULL) return false;
+
+		data.clear();
+		char buffer[4096];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) data.insert(data.end(), buffer, buffer + n);
+		fclose(f);
+
+		return data.size() >= sizeof(CHECKPOINT_HEADER);
+	}
+
+	// Replace the current show with the one saved in 'data', as restore() does with a file.
+	static bool restore(const std::vector<char> &data, CHECKPOINT_STATE &state, std::vector<std::shared_ptr<FireworkSpawner>> &spawners)
+	{
+		if (data.size() < sizeof(CHECKPOINT_HEADER)) return false;
+
+		return read_show(&data[0], &data[0] + data.size(), state, spawners);
+	}
+
+private:
+
+	static void append(std::vector<char> &out, const void *data, size_t bytes)
+	{
+		const char *c = (const char *)data;
+		out.insert(out.end(), c, c + bytes);
+	}
+
+	// True if initialise() has been called on 's' - it has a vertex buffer, or staged vertices when pipelined.
+	static bool live(const PARTICLE_SYSTEM_BASE &s)
+	{
+		return s.points_ != NULL || !s.staging_.empty();
+	}
+
+	// The number of 'systems' that are written - all but the fountains, and with 'chain' set the systems already
+	// started (those are top level systems by then, and written with the rest of SHOW_WORLD::particles_).
+	template <class SYSTEMS>
+	static unsigned int saved(const SYSTEMS &systems, bool chain = false)
+	{
+		unsigned int n = 0;
+		for (auto &s : systems)
+		{
+			if (s->type() != SYSTEM_FOUNTAIN && !(chain && live(*s))) ++n;
+		}
+
+		return n;
+	}
+
+	static void write_system(std::vector<char> &out, PARTICLE_SYSTEM_BASE &s)
+	{
+		CHECKPOINT_SYSTEM r;
+		SecureZeroMemory(&r, sizeof(r));
+
+		r.type_ = s.type();
+		r.texture_ = s.sprite_;
+		r.random_stream_ = s.random_stream_;
+		r.initialised_ = live(s);
+		r.max_particles_ = s.max_particles_;
+		r.alive_particles_ = s.alive_particles_;
+		r.max_lifetime_ = s.max_lifetime_;
+		r.origin_ = s.origin_;
+		r.time_increment_ = s.time_increment_;
+		r.particle_size_ = s.particle_size_;
+		r.safeToDelete_ = s.safeToDelete;
+		r.alpha_ = s.alpha;
+		r.ground_response_ = s.ground_response_;
+		r.restitution_ = s.restitution_;
+
+		switch (s.type())
+		{
+		case SYSTEM_EXPLOSION:
+		{
+			FIREWORK_EXPLOSION_CLASS &f = (FIREWORK_EXPLOSION_CLASS &)s;
+			r.terminate_on_floor_ = f.terminate_on_floor_;
+			r.gravity_ = f.gravity_;
+			r.floorY_ = f.floorY_;
+			r.launch_velocity_ = f.launch_velocity_;
+			break;
+		}
+		case SYSTEM_ROCKET:
+		{
+			FIREWORK_ROCKET_CLASS &f = (FIREWORK_ROCKET_CLASS &)s;
+			r.terminate_on_floor_ = f.terminate_on_floor_;
+			r.gravity_ = f.gravity_;
+			r.floorY_ = f.floorY_;
+			r.launch_velocity_ = f.launch_velocity_;
+			r.rocketTime_ = r.initialised_ ? f.fuse_remaining() : f.rocketTime;	// Live rockets count down on the timer wheel.
+			r.RocketVel_ = f.RocketVel;
+			r.start_particles_ = f.start_particles_;
+			r.start_timer_ = r.initialised_ ? f.burst_remaining() : f.start_timer_;
+			r.start_interval_ = f.start_interval_;
+			r.activated_ = f.activated;
+			r.fuse_order_ = f.timers_->order(f.fuse_);
+			r.burst_order_ = f.timers_->order(f.burst_);
+			r.ribbon_trail_ = f.ribbon_trail_;
+			r.trail_sparks_ = f.trail_sparks_;
+			r.trail_head_ = f.trail_head_;
+			r.trail_count_ = f.trail_count_;
+			r.trail_clock_ = f.trail_clock_;
+			r.trail_nodes_ = (unsigned int)f.trail_.size();
+			break;
+		}
+		case SYSTEM_FOUNTAIN:	// Never written (see save()).
+			break;
+		}
+
+		// Packed explosions are saved as PARTICLEs all the same (see CompactParticle.h).
+		std::vector<PARTICLE> unpacked;
+		const PARTICLE *particles = s.particles_.data();
+		r.particle_count_ = (unsigned int)s.particles_.size();
+
+		if (r.type_ == SYSTEM_EXPLOSION && ((FIREWORK_EXPLOSION_CLASS &)s).packed())
+		{
+			((FIREWORK_EXPLOSION_CLASS &)s).unpack(unpacked);
+			particles = unpacked.data();
+			r.particle_count_ = (unsigned int)unpacked.size();
+		}
+
+		r.next_count_ = saved(s.nextSystems, true);
+
+		append(out, &r, sizeof(r));
+		if (r.particle_count_ > 0) append(out, particles, r.particle_count_ * sizeof(PARTICLE));
+
+		if (r.trail_nodes_ > 0)
+		{
+			FIREWORK_ROCKET_CLASS &f = (FIREWORK_ROCKET_CLASS &)s;
+			append(out, &f.trail_[0], f.trail_.size() * sizeof(TRAIL_NODE));
+			append(out, &f.trail_velocity_[0], f.trail_velocity_.size() * sizeof(D3DXVECTOR3));
+		}
+
+		for (auto &n : s.nextSystems)
+		{
+			if (n->type() != SYSTEM_FOUNTAIN && !live(*n)) write_system(out, *n);
+		}
+	}
+
+	// Rebuild one system (and its chain) from 'p', advancing 'p' past it. Returns NULL if the data is bad.
+	static std::shared_ptr<PARTICLE_SYSTEM_BASE> read_system(const char *&p, const char *end)
+	{
+		if (end - p < (ptrdiff_t)sizeof(CHECKPOINT_SYSTEM)) return NULL;
+
+		CHECKPOINT_SYSTEM r;
+		memcpy(&r, p, sizeof(r));
+		p += sizeof(r);
+
+		std::shared_ptr<PARTICLE_SYSTEM_BASE> s;
+
+		switch (r.type_)
+		{
+		case SYSTEM_EXPLOSION:
+		{
+			std::shared_ptr<FIREWORK_EXPLOSION_CLASS> f(new FIREWORK_EXPLOSION_CLASS);
+			f->terminate_on_floor_ = r.terminate_on_floor_ != 0;
+			f->gravity_ = r.gravity_;
+			f->floorY_ = r.floorY_;
+			f->launch_velocity_ = r.launch_velocity_;
+			s = f;
+			break;
+		}
+		case SYSTEM_ROCKET:
+		{
+			std::shared_ptr<FIREWORK_ROCKET_CLASS> f(new FIREWORK_ROCKET_CLASS);
+			f->terminate_on_floor_ = r.terminate_on_floor_ != 0;
+			f->gravity_ = r.gravity_;
+			f->floorY_ = r.floorY_;
+			f->launch_velocity_ = r.launch_velocity_;
+			f->rocketTime = r.rocketTime_;
+			f->RocketVel = r.RocketVel_;
+			f->start_particles_ = r.start_particles_;
+			f->start_timer_ = r.start_timer_;
+			f->start_interval_ = r.start_interval_;
+			f->activated = r.activated_ != 0;
+			f->ribbon_trail_ = r.ribbon_trail_ != 0;
+			f->trail_sparks_ = r.trail_sparks_;
+			s = f;
+			break;
+		}
+		default:
+			return NULL;	// Includes SYSTEM_FOUNTAIN - fountains are never written.
+		}
+
+		s->sprite_ = r.texture_ >= 0 && r.texture_ < TEXTURE_COUNT ? r.texture_ : TEXTURE_COUNT - 1;
+		s->random_stream_ = r.random_stream_ >= 0 && r.random_stream_ < RANDOM_STREAMS ? r.random_stream_ : 0;
+		s->max_particles_ = r.max_particles_;
+		s->max_lifetime_ = r.max_lifetime_;
+		s->origin_ = r.origin_;
+		s->time_increment_ = r.time_increment_;
+		s->particle_size_ = r.particle_size_;
+		s->safeToDelete = r.safeToDelete_ != 0;
+		s->alpha = r.alpha_;
+		s->ground_response_ = (GROUND_RESPONSE)r.ground_response_;
+		s->restitution_ = r.restitution_;
+
+		// Sizes are checked against what is left of the data before anything is multiplied out or allocated.
+		size_t left = (size_t)(end - p);
+		if (r.trail_sparks_ < 0 || (size_t)r.trail_sparks_ > left / sizeof(D3DXVECTOR3)) return NULL;
+		if (r.particle_count_ > left / sizeof(PARTICLE)) return NULL;
+
+		size_t bytes = r.particle_count_ * sizeof(PARTICLE);
+		size_t node_bytes = sizeof(TRAIL_NODE) + r.trail_sparks_ * sizeof(D3DXVECTOR3);
+		if (r.trail_nodes_ > (left - bytes) / node_bytes) return NULL;
+
+		size_t trail_bytes = r.trail_nodes_ * node_bytes;
+
+		// A live ribbon trail has a node for every frame of 'max_lifetime_' - initialise() sizes it from that.
+		if (r.type_ == SYSTEM_ROCKET && r.ribbon_trail_ && r.initialised_ && r.trail_nodes_ != (unsigned int)r.max_lifetime_) return NULL;
+
+		if (r.initialised_)
+		{
+			// Explosions start their particles in initialise(), so only the base class part for them.
+			// Rockets light their fuse again from the saved 'rocketTime' and 'start_timer_'.
+			HRESULT hr = r.type_ == SYSTEM_EXPLOSION ? s->PARTICLE_SYSTEM_BASE::initialise() : s->initialise();
+			if (FAILED(hr)) return NULL;
+
+			if (r.type_ == SYSTEM_ROCKET)
+			{
+				FIREWORK_ROCKET_CLASS &f = (FIREWORK_ROCKET_CLASS &)*s;
+				f.timers_->set_order(f.fuse_, r.fuse_order_);
+				f.timers_->set_order(f.burst_, r.burst_order_);
+			}
+
+			s->particles_.resize(r.particle_count_);
+			if (bytes > 0) memcpy(&s->particles_[0], p, bytes);
+			s->alive_particles_ = r.alive_particles_;
+
+			if (r.type_ == SYSTEM_EXPLOSION) ((FIREWORK_EXPLOSION_CLASS &)*s).pack();
+
+			if (r.trail_nodes_ > 0)
+			{
+				FIREWORK_ROCKET_CLASS &f = (FIREWORK_ROCKET_CLASS &)*s;
+				if (f.trail_.size() != r.trail_nodes_) return NULL;
+
+				memcpy(&f.trail_[0], p + bytes, r.trail_nodes_ * sizeof(TRAIL_NODE));
+				memcpy(&f.trail_velocity_[0], p + bytes + r.trail_nodes_ * sizeof(TRAIL_NODE), f.trail_velocity_.size() * sizeof(D3DXVECTOR3));
+				f.trail_head_ = r.trail_head_;
+				f.trail_count_ = r.trail_count_;
+				f.trail_clock_ = r.trail_clock_;
+			}
+		}
+		p += bytes + trail_bytes;
+
+		for (unsigned int i = 0; i < r.next_count_; ++i)
+		{
+			std::shared_ptr<PARTICLE_SYSTEM_BASE> n = read_system(p, end);
+			if (!n) return NULL;
+			s->nextSystems.push_back(n);
+		}
+
+		return s;
+	}
+
+	static bool read_show(const char *p, const char *end, CHECKPOINT_STATE &state, std::vector<std::shared_ptr<FireworkSpawner>> &spawners)
+	{
+		CHECKPOINT_HEADER header;
+		memcpy(&header, p, sizeof(header));
+		p += sizeof(header);
+
+		if (memcmp(header.magic_, "FWCK", 4) != 0 || header.version_ != CHECKPOINT_VERSION) return false;
+		if (header.spawner_count_ != spawners.size()) return false;	// Saved from a different show layout.
+		if ((size_t)(end - p) < header.spawner_count_ * sizeof(CHECKPOINT_SPAWNER)) return false;
+
+		const CHECKPOINT_SPAWNER *counters = (const CHECKPOINT_SPAWNER *)p;
+		p += header.spawner_count_ * sizeof(CHECKPOINT_SPAWNER);
+
+		// Build everything before touching the live show, so a bad file changes nothing.
+		std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> systems;
+		systems.reserve(header.system_count_);
+
+		for (unsigned int i = 0; i < header.system_count_; ++i)
+		{
+			std::shared_ptr<PARTICLE_SYSTEM_BASE> s = read_system(p, end);
+			if (!s) return false;
+			systems.push_back(s);
+		}
+
+		for (unsigned int i = 0; i < header.spawner_count_; ++i)
+		{
+			spawners[i]->set_counter(counters[i].counter_, counters[i].cue_order_);
+		}
+
+		g_World->particles_.swap(systems);
+		g_World->buckets_.rebuild(g_World->particles_);
+		g_World->wind_speed_ = header.windSpeed_;
+		g_World->wind_drift_ = header.windDrift_;
+
+		state.frame_ = header.frame_;
+		state.noise_seed_ = header.noise_seed_;
+		state.noise_index_ = header.noise_index_;
+
+		return true;
+	}
+};
@@ -0,0 +1,189 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// COMPACT VERTEX STREAM
+//
+// Optional 8 byte particle vertex, against 12 bytes for POINTVERTEX:
+//   x, y, z	16 bit positions, quantized over the bounding box of the system's
+//				particles, relative to the system's origin_.
+//   w			packed size (high byte, 64 = the system's particle_size_) and
+//				brightness (low byte, 0 - 255).
+//
+// The box goes to the vertex shader as two constants per draw and the shader
+// decodes the positions. decode_compact_vertices() is the same decode on the
+// CPU, for checking a stream without a device.
+//
+// Quantization error is at most half a step, i.e. extent / 65534 per axis -
+// under 0.01 units for a 600 unit wide explosion.
+//-----------------------------------------------------------------------------
+
+#include <d3dx9.h>
+
+#define COMPACT_QUANT		32767.0f	// Largest quantized coordinate.
+#define COMPACT_UNIT_SIZE	64			// Packed size meaning 1 x particle_size_.
+
+struct COMPACT_POINTVERTEX
+{
+	short x_, y_, z_;
+	short w_;				// (size << 8) | brightness.
+};
+
+// Maps quantized coordinates back to world space: position = offset_ + q * scale_.
+struct COMPACT_RANGE
+{
+	D3DXVECTOR3 offset_;	// Centre of the box, in world space.
+	D3DXVECTOR3 scale_;		// Half the box size / COMPACT_QUANT.
+};
+
+bool							g_CompactVertices = false;		// Use the compact stream (-compact on the command line).
+LPDIRECT3DVERTEXDECLARATION9	g_CompactDeclaration = NULL;
+LPDIRECT3DVERTEXSHADER9			g_CompactShader = NULL;
+
+//-----------------------------------------------------------------------------
+// Encoding and decoding.
+
+// Box around 'count' positions, relative to 'origin'.
+COMPACT_RANGE compact_range(const D3DXVECTOR3 *positions, int count, int stride, const D3DXVECTOR3 &origin)
+{
+	D3DXVECTOR3 lo(0, 0, 0), hi(0, 0, 0);
+
+	const char *p = (const char *)positions;
+	for (int i = 0; i < count; ++i, p += stride)
+	{
+		D3DXVECTOR3 d = *(const D3DXVECTOR3 *)p - origin;
+		if (i == 0) lo = hi = d;
+
+		lo.x = d.x < lo.x ? d.x : lo.x;  hi.x = d.x > hi.x ? d.x : hi.x;
+		lo.y = d.y < lo.y ? d.y : lo.y;  hi.y = d.y > hi.y ? d.y : hi.y;
+		lo.z = d.z < lo.z ? d.z : lo.z;  hi.z = d.z > hi.z ? d.z : hi.z;
+	}
+
+	COMPACT_RANGE r;
+	r.offset_ = origin + (lo + hi) * 0.5f;
+
+	// Never a zero scale - a single point still needs to decode to itself.
+	D3DXVECTOR3 half = (hi - lo) * 0.5f;
+	r.scale_.x = (half.x > 1e-4f ? half.x : 1e-4f) / COMPACT_QUANT;
+	r.scale_.y = (half.y > 1e-4f ? half.y : 1e-4f) / COMPACT_QUANT;
+	r.scale_.z = (half.z > 1e-4f ? half.z : 1e-4f) / COMPACT_QUANT;
+
+	return r;
+}
+
+inline short compact_quantize(float v, float offset, float scale)
+{
+	float q = (v - offset) / scale;
+	q = q < -COMPACT_QUANT ? -COMPACT_QUANT : (q > COMPACT_QUANT ? COMPACT_QUANT : q);
+	return (short)(q < 0 ? q - 0.5f : q + 0.5f);
+}
+
+// Encode 'count' positions (every 'stride' bytes) with their brightness (NULL for full brightness).
+void encode_compact_vertices(const D3DXVECTOR3 *positions, const unsigned char *brightness, int count, int stride, const COMPACT_RANGE &r, COMPACT_POINTVERTEX *out)
+{
+	const char *p = (const char *)positions;
+	for (int i = 0; i < count; ++i, p += stride)
+	{
+		const D3DXVECTOR3 &v = *(const D3DXVECTOR3 *)p;
+		out[i].x_ = compact_quantize(v.x, r.offset_.x, r.scale_.x);
+		out[i].y_ = compact_quantize(v.y, r.offset_.y, r.scale_.y);
+		out[i].z_ = compact_quantize(v.z, r.offset_.z, r.scale_.z);
+		out[i].w_ = (short)((COMPACT_UNIT_SIZE << 8) | (brightness ? brightness[i] : 255));
+	}
+}
+
+// CPU reference of the shader's decode.
+void decode_compact_vertices(const COMPACT_POINTVERTEX *in, int count, const COMPACT_RANGE &r, D3DXVECTOR3 *positions, float *sizes, float *brightness)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		positions[i].x = r.offset_.x + in[i].x_ * r.scale_.x;
+		positions[i].y = r.offset_.y + in[i].y_ * r.scale_.y;
+		positions[i].z = r.offset_.z + in[i].z_ * r.scale_.z;
+
+		if (sizes) sizes[i] = (float)(in[i].w_ >> 8) / COMPACT_UNIT_SIZE;
+		if (brightness) brightness[i] = (float)(in[i].w_ & 0xFF) / 255.0f;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Rendering.
+
+// Constants: c0-c3 world * view * projection, c4 offset, c5 scale,
+// c6.x point size in pixels at distance 1 (viewport height * particle_size_).
+static const char g_CompactShaderSource[] =
+	"float4x4 wvp : register(c0);\n"
+	"float4 offset : register(c4);\n"
+	"float4 scale : register(c5);\n"
+	"float4 size : register(c6);\n"
+	"struct OUT { float4 pos : POSITION; float4 colour : COLOR0; float psize : PSIZE; };\n"
+	"OUT main(float4 q : POSITION)\n"
+	"{\n"
+	"	OUT o;\n"
+	"	float packed = q.w < 0 ? q.w + 65536 : q.w;\n"
+	"	float s = floor(packed / 256);\n"
+	"	float3 p = offset.xyz + q.xyz * scale.xyz;\n"
+	"	o.pos = mul(float4(p, 1), wvp);\n"
+	"	o.psize = size.x * (s / 64) / max(o.pos.w, 1);\n"
+	"	o.colour = float4(1, 1, 1, (packed - s * 256) / 255);\n"
+	"	return o;\n"
+	"}\n";
+
+// Compile the decode shader. Leaves the compact stream off if the device cannot run it.
+HRESULT SetupCompactVertices(LPDIRECT3DDEVICE9 device)
+{
+	D3DVERTEXELEMENT9 elements[] =
+	{
+		{ 0, 0, D3DDECLTYPE_SHORT4, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0 },
+		D3DDECL_END()
+	};
+
+	if (FAILED(device->CreateVertexDeclaration(elements, &g_CompactDeclaration))) return E_FAIL;
+
+	LPD3DXBUFFER code = NULL, errors = NULL;
+	HRESULT hr = D3DXCompileShader(g_CompactShaderSource, sizeof(g_CompactShaderSource) - 1, NULL, NULL, "main", "vs_2_0", 0, &code, &errors, NULL);
+
+	if (SUCCEEDED(hr))
+	{
+		hr = device->CreateVertexShader((const DWORD *)code->GetBufferPointer(), &g_CompactShader);
+	}
+
+	SAFE_RELEASE(code);
+	SAFE_RELEASE(errors);
+
+	if (FAILED(hr))
+	{
+		SAFE_RELEASE(g_CompactDeclaration);
+		g_CompactVertices = false;
+	}
+
+	return hr;
+}
+
+void CleanUpCompactVertices()
+{
+	SAFE_RELEASE(g_CompactShader);
+	SAFE_RELEASE(g_CompactDeclaration);
+}
+
+// Set up the decode shader for one system's draw.
+void SetCompactConstants(LPDIRECT3DDEVICE9 device, const COMPACT_RANGE &r, float particle_size)
+{
+	D3DXMATRIX world, view, projection, wvp;
+	device->GetTransform(D3DTS_WORLD, &world);
+	device->GetTransform(D3DTS_VIEW, &view);
+	device->GetTransform(D3DTS_PROJECTION, &projection);
+
+	wvp = world * view * projection;
+	D3DXMatrixTranspose(&wvp, &wvp);
+
+	D3DVIEWPORT9 viewport;
+	device->GetViewport(&viewport);
+
+	D3DXVECTOR4 offset(r.offset_.x, r.offset_.y, r.offset_.z, 0);
+	D3DXVECTOR4 scale(r.scale_.x, r.scale_.y, r.scale_.z, 0);
+	D3DXVECTOR4 size(viewport.Height * particle_size, 0, 0, 0);
+
+	device->SetVertexShaderConstantF(0, wvp, 4);
+	device->SetVertexShaderConstantF(4, offset, 1);
+	device->SetVertexShaderConstantF(5, scale, 1);
+	device->SetVertexShaderConstantF(6, size, 1);
+}
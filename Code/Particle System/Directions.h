@@ -0,0 +1,73 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// DIRECTION TABLES
+//
+// Unit directions worked out once at startup, so starting a particle is a
+// table lookup with a random index instead of turning a random number into an
+// angle and taking its sine and cosine.
+//
+//   sphere()   - DIRECTION_TABLE_SIZE points spread evenly over the unit sphere
+//                (a Fibonacci lattice - every point covers the same area), for
+//                the explosions. Picking an angle around and an angle up at
+//                random bunches the particles up at the poles, this doesn't.
+//   circle()   - DIRECTION_TABLE_SIZE evenly spaced directions around a circle
+//                in the X/Z plane, for the fountains.
+//   sin/cos_degrees() - whole degrees, for the rocket trail's cone, computed
+//                the same way as the trail always did (so it starts the same).
+//-----------------------------------------------------------------------------
+
+#include <d3dx9.h>
+#include <math.h>
+
+#define DIRECTION_TABLE_BITS	12
+#define DIRECTION_TABLE_SIZE	(1 << DIRECTION_TABLE_BITS)
+
+struct CIRCLE_DIRECTION
+{
+	float cos_, sin_;
+};
+
+class DIRECTION_TABLES
+{
+public:
+	DIRECTION_TABLES()
+	{
+		const double golden_angle = D3DX_PI * (3.0 - sqrt(5.0));
+
+		for (int i = 0; i < DIRECTION_TABLE_SIZE; ++i)
+		{
+			// Evenly spaced heights, each turned round by the golden angle from the last.
+			double y = 1.0 - (2.0 * i + 1.0) / DIRECTION_TABLE_SIZE;
+			double r = sqrt(1.0 - y * y);
+			double a = golden_angle * i;
+
+			sphere_[i] = D3DXVECTOR3((float)(r * cos(a)), (float)y, (float)(r * sin(a)));
+
+			double c = 2.0 * D3DX_PI * i / DIRECTION_TABLE_SIZE;
+			circle_[i].cos_ = (float)cos(c);
+			circle_[i].sin_ = (float)sin(c);
+		}
+
+		for (int d = 0; d < 360; ++d)
+		{
+			float radians = (float)(D3DXToRadian(d));
+			sin_degrees_[d] = (float)sin(radians);
+			cos_degrees_[d] = (float)cos(radians);
+		}
+	}
+
+	// Direction picked by random number 'r'.
+	const D3DXVECTOR3 &sphere(unsigned int r) const { return sphere_[r & (DIRECTION_TABLE_SIZE - 1)]; }
+	const CIRCLE_DIRECTION &circle(unsigned int r) const { return circle_[r & (DIRECTION_TABLE_SIZE - 1)]; }
+
+	// 'degrees' from 0 to 359.
+	float sin_degrees(unsigned int degrees) const { return sin_degrees_[degrees % 360]; }
+	float cos_degrees(unsigned int degrees) const { return cos_degrees_[degrees % 360]; }
+
+private:
+	D3DXVECTOR3 sphere_[DIRECTION_TABLE_SIZE];
+	CIRCLE_DIRECTION circle_[DIRECTION_TABLE_SIZE];
+	float sin_degrees_[360], cos_degrees_[360];
+};
+
+DIRECTION_TABLES g_Directions;
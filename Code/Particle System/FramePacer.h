@@ -0,0 +1,227 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// FRAME PACING
+//
+// The show advances one step per frame, so the frame rate is the speed of the
+// show. FRAME_PACER holds the main loop to a target rate: wait() returns when
+// the next frame is due, on a fixed grid of deadlines 1/hz apart.
+//
+// The wait sleeps for most of the time and spins only for the last part. The
+// sleep is a high resolution waitable timer where Windows has one, otherwise a
+// normal one with the system timer at 1 ms (timeBeginPeriod). On other systems
+// (the headless drivers) it is clock_nanosleep on the monotonic clock. How far
+// the sleep overshoots is measured every frame, and the spin is kept just long
+// enough to cover it - a timer that wakes on time costs almost no spinning.
+//
+// A frame that is already later than its deadline by a whole period has
+// missed it: the missed deadlines are counted and the grid starts again from
+// now, rather than running a burst of frames to catch up. status() reports how
+// late the frames woke (mean and worst over the last PACE_WINDOW frames), the
+// deadlines missed and the share of the time spent spinning.
+//-----------------------------------------------------------------------------
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+#include <string>
+
+#define PACE_WINDOW		120			// Frames the lateness figures are taken over.
+#define PACE_MIN_SPIN	0.0002		// Seconds spun at the end of every wait, at the least.
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002	// Windows 10 1803 on, not in older SDKs.
+#endif
+
+class FRAME_PACER
+{
+public:
+	FRAME_PACER() : period_(0), next_(0), spin_(0), missed_(0), frames_(0), slot_(0), spun_(0), waited_(0)
+	{
+#ifdef _WIN32
+		timer_ = NULL;
+		high_resolution_ = false;
+
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency_ = f.QuadPart;
+#else
+		frequency_ = 1000000000;	// Nanoseconds.
+#endif
+
+		for (int i = 0; i < PACE_WINDOW; ++i) lateness_[i] = 0;
+	}
+
+	~FRAME_PACER()
+	{
+		stop();
+	}
+
+	// Pace wait() to 'hz' frames a second - 0 for as fast as possible.
+	void start(double hz)
+	{
+		stop();
+		if (hz <= 0) return;
+
+		period_ = (long long)((double)frequency_ / hz);
+		spin_ = (long long)(PACE_MIN_SPIN * frequency_);
+
+#ifdef _WIN32
+		timer_ = CreateWaitableTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+		high_resolution_ = timer_ != NULL;
+
+		if (!high_resolution_)
+		{
+			// Older Windows - a normal timer, with the system timer ticking every ms.
+			timer_ = CreateWaitableTimer(NULL, TRUE, NULL);
+			timeBeginPeriod(1);
+		}
+#endif
+
+		next_ = now() + period_;
+	}
+
+	void stop()
+	{
+#ifdef _WIN32
+		if (timer_)
+		{
+			CloseHandle(timer_);
+			if (!high_resolution_) timeEndPeriod(1);
+		}
+		timer_ = NULL;
+#endif
+
+		period_ = 0;
+	}
+
+	bool pacing() const { return period_ > 0; }
+
+	// Wait for the next frame's deadline. Returns at once if not pacing, or if the frame is late.
+	void wait()
+	{
+		if (period_ == 0) return;
+
+		long long t = now();
+
+		// Sleep until the spin has to take over, then see how far past that the sleep went.
+		long long wake = next_ - spin_;
+		if (t < wake)
+		{
+			sleep(wake - t);
+			t = now();
+
+			long long overshoot = t - wake;
+			long long least = (long long)(PACE_MIN_SPIN * frequency_);
+
+			// Up at once to cover a longer sleep, down slowly - one oversleep in a while shouldn't be missed next time either.
+			if (overshoot + least > spin_) spin_ = overshoot + least;
+			else spin_ -= (spin_ - least) / 64;
+			if (spin_ > period_ / 2) spin_ = period_ / 2;
+		}
+
+		long long spin_from = t;
+		while (t < next_)
+		{
+			yield();
+			t = now();
+		}
+		spun_ += t - spin_from;
+		waited_ += period_;
+
+		long long late = t - next_;
+		lateness_[slot_] = late;
+		slot_ = (slot_ + 1) % PACE_WINDOW;
+		++frames_;
+
+		if (late >= period_)
+		{
+			missed_ += (int)(late / period_);
+			next_ = t + period_;
+		}
+		else
+		{
+			next_ += period_;
+		}
+	}
+
+	// One line for the on screen text.
+	std::string status() const
+	{
+		if (period_ == 0) return "Pacing: off";
+
+		int n = frames_ < PACE_WINDOW ? frames_ : PACE_WINDOW;
+		long long sum = 0, worst = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			sum += lateness_[i];
+			if (lateness_[i] > worst) worst = lateness_[i];
+		}
+
+		double mean = n ? ms(sum) / n : 0.0;
+		int spinning = waited_ ? (int)(100 * spun_ / waited_) : 0;
+
+		return "Pacing: " + std::to_string((double)frequency_ / (double)period_) + " Hz, late " + std::to_string(mean) + " ms (worst "
+			+ std::to_string(ms(worst)) + "), " + std::to_string(missed_) + " deadlines missed, spinning " + std::to_string(spinning) + "%"
+#ifdef _WIN32
+			+ (high_resolution_ ? "" : " (1 ms timer)")
+#endif
+			;
+	}
+
+private:
+
+#ifdef _WIN32
+	static void yield() { YieldProcessor(); }
+
+	long long now() const
+	{
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		return t.QuadPart;
+	}
+
+	void sleep(long long ticks)
+	{
+		LARGE_INTEGER due;
+		due.QuadPart = -(ticks * 10000000 / frequency_);	// Relative, in 100 ns units.
+
+		if (timer_ && SetWaitableTimer(timer_, &due, 0, NULL, NULL, FALSE)) WaitForSingleObject(timer_, INFINITE);
+		else Sleep((DWORD)(ticks * 1000 / frequency_));
+	}
+
+	HANDLE timer_;
+	bool high_resolution_;				// CREATE_WAITABLE_TIMER_HIGH_RESOLUTION worked.
+#else
+	static void yield() {}
+
+	long long now() const
+	{
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (long long)t.tv_sec * 1000000000 + t.tv_nsec;
+	}
+
+	void sleep(long long ticks)
+	{
+		timespec t;
+		t.tv_sec = (time_t)(ticks / 1000000000);
+		t.tv_nsec = (long)(ticks % 1000000000);
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &t, NULL);
+	}
+#endif
+
+	double ms(long long ticks) const { return (double)ticks * 1000.0 / (double)frequency_; }
+
+	long long frequency_;				// Ticks a second.
+	long long period_;					// Ticks between deadlines, 0 when not pacing.
+	long long next_;					// The next deadline.
+	long long spin_;					// Ticks spun before each deadline - covers the sleep's overshoot.
+
+	long long lateness_[PACE_WINDOW];	// How late each of the last PACE_WINDOW frames woke, in ticks.
+	int missed_;
+	int frames_;
+	int slot_;
+	long long spun_, waited_;			// Ticks spent spinning, and paced, since start().
+};
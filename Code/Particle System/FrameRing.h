@@ -0,0 +1,519 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// SHARED MEMORY FRAME RING
+//
+// Hands the show's frames to a renderer in another process, so that a crash
+// in the display driver takes down the renderer and not the show's clock.
+// "-ring" runs the simulation with no window and writes every frame into a
+// block of shared memory; "-ringview" (or any program using FRAME_RING_READER)
+// maps the same block and draws from it.
+//
+// The block is a FRAME_RING_HEADER followed by FRAME_RING_SLOTS slots, each
+// holding one frame: the draws (sprite, size, which vertices) and the
+// vertices themselves, as the float POINTVERTEX. The frame is not copied in:
+// while it is simulated its slot is open, and each system's lock_vertices()
+// hands out room in the slot instead of the system's own staging copy, so the
+// particles are written straight into shared memory. Handing the frame over is
+// then one store.
+//
+// Two counters coordinate the processes, each written by one side only:
+// written_ counts the frames the simulation has published and read_ those the
+// reader has finished with. Frame n goes in slot n % FRAME_RING_SLOTS. The
+// writer opens a slot only if the reader is done with it, and never waits - if
+// the ring is full the frame is simulated as usual, but not handed over, and
+// counted as dropped. The reader has the slots between read_ and written_, and
+// a slot stays its to read until it moves read_ past it.
+//
+// Every slot carries the time it was published on a clock both processes
+// share (the performance counter, CLOCK_MONOTONIC elsewhere), so the reader
+// can tell how long each frame took to reach it.
+//
+// This file is the whole of the library a reader needs - it depends on nothing
+// else in the program.
+//-----------------------------------------------------------------------------
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <atomic>
+#include <string>
+
+#define FRAME_RING_NAME			"FireworksFrames"	// Name of the shared block, unless given on the command line.
+#define FRAME_RING_MAGIC		0x474E4952			// "RING"
+#define FRAME_RING_VERSION		1
+#define FRAME_RING_SLOTS		4					// Frames in flight.
+#define FRAME_RING_MAX_DRAWS	1024				// Draws a slot has room for.
+#define FRAME_RING_MAX_VERTICES	(64 * 1024)			// Vertices a slot has room for.
+#define FRAME_RING_LINE			64					// Cache line - each counter has one of its own.
+
+// Laid out as POINTVERTEX.
+struct RING_VERTEX
+{
+	float x_, y_, z_;
+};
+
+// One system's draw within a slot.
+struct RING_DRAW
+{
+	int		sprite_;
+	float	particle_size_;
+	int		first_;					// First vertex in the slot.
+	int		count_;
+};
+
+struct FRAME_RING_SLOT
+{
+	unsigned int	sequence_;		// The value of written_ this frame was published as.
+	unsigned int	frame_;			// SHOW_WORLD::frame_.
+	long long		published_;		// Clock when published - see ring_clock().
+	int				draws_;
+	int				vertices_;
+	int				lost_;			// Vertices that didn't fit in the slot.
+	float			wind_;			// SHOW_WORLD::wind_speed_.
+	RING_DRAW		draw_[FRAME_RING_MAX_DRAWS];
+	RING_VERTEX		vertex_[FRAME_RING_MAX_VERTICES];
+};
+
+struct FRAME_RING_HEADER
+{
+	unsigned int	magic_;			// FRAME_RING_MAGIC once the writer has set the block up.
+	unsigned int	version_;
+	unsigned int	slots_;
+	unsigned int	slot_bytes_;	// sizeof(FRAME_RING_SLOT), for a reader built separately to check.
+	long long		frequency_;		// Ticks a second of the clock in 'published_'.
+	char			pad0_[FRAME_RING_LINE - 24];
+
+	std::atomic<unsigned int> written_;		// Frames published - the writer's.
+	std::atomic<unsigned int> dropped_;		// Frames not handed over because the ring was full - the writer's.
+	char			pad1_[FRAME_RING_LINE - 8];
+
+	std::atomic<unsigned int> read_;		// Frames finished with - the reader's.
+	char			pad2_[FRAME_RING_LINE - 4];
+};
+
+//-----------------------------------------------------------------------------
+// The clock and the shared block, for each system.
+
+#ifdef _WIN32
+inline long long ring_clock()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
+inline long long ring_clock_frequency()
+{
+	LARGE_INTEGER f;
+	QueryPerformanceFrequency(&f);
+	return f.QuadPart;
+}
+#else
+inline long long ring_clock()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+inline long long ring_clock_frequency() { return 1000000000; }
+#endif
+
+class SHARED_BLOCK
+{
+public:
+	SHARED_BLOCK() : data_(NULL), bytes_(0), owner_(false)
+	{
+#ifdef _WIN32
+		mapping_ = NULL;
+#endif
+	}
+
+	~SHARED_BLOCK()
+	{
+		close();
+	}
+
+	// Make a new block of 'bytes' called 'name', replacing any left behind. Zero filled.
+	bool create(const std::string &name, size_t bytes)
+	{
+		close();
+
+#ifdef _WIN32
+		mapping_ = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)bytes >> 32), (DWORD)bytes, ("Local\\" + name).c_str());
+		if (!mapping_) return false;
+
+		data_ = MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+#else
+		name_ = "/" + name;
+		shm_unlink(name_.c_str());
+
+		int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0) return false;
+
+		if (ftruncate(fd, (off_t)bytes) == 0)
+		{
+			data_ = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (data_ == MAP_FAILED) data_ = NULL;
+		}
+		::close(fd);
+#endif
+		bytes_ = bytes;
+		owner_ = true;
+
+		if (!data_) close();
+		return data_ != NULL;
+	}
+
+	// Map the existing block called 'name'.
+	bool open(const std::string &name)
+	{
+		close();
+
+#ifdef _WIN32
+		mapping_ = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, ("Local\\" + name).c_str());
+		if (!mapping_) return false;
+
+		data_ = MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+		MEMORY_BASIC_INFORMATION info;
+		if (data_ && VirtualQuery(data_, &info, sizeof(info))) bytes_ = info.RegionSize;
+#else
+		name_ = "/" + name;
+
+		int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+		if (fd < 0) return false;
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			bytes_ = (size_t)st.st_size;
+			data_ = mmap(NULL, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (data_ == MAP_FAILED) data_ = NULL;
+		}
+		::close(fd);
+#endif
+		owner_ = false;
+
+		if (!data_) close();
+		return data_ != NULL;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (data_) UnmapViewOfFile(data_);
+		if (mapping_) CloseHandle(mapping_);
+		mapping_ = NULL;
+#else
+		if (data_) munmap(data_, bytes_);
+		if (owner_ && !name_.empty()) shm_unlink(name_.c_str());
+		name_.clear();
+#endif
+		data_ = NULL;
+		bytes_ = 0;
+		owner_ = false;
+	}
+
+	void *data() const { return data_; }
+	size_t bytes() const { return bytes_; }
+
+private:
+	SHARED_BLOCK(const SHARED_BLOCK &);
+	SHARED_BLOCK &operator=(const SHARED_BLOCK &);
+
+	void *data_;
+	size_t bytes_;
+	bool owner_;						// Made by create() - the name goes when it is closed.
+#ifdef _WIN32
+	HANDLE mapping_;
+#else
+	std::string name_;
+#endif
+};
+
+//-----------------------------------------------------------------------------
+// The simulation's end. One frame at a time: begin_frame(), then reserve() and
+// commit() for each draw, then end_frame().
+
+class FRAME_RING_WRITER
+{
+public:
+	FRAME_RING_WRITER() : header_(NULL), slots_(NULL), slot_(NULL) {}
+
+	bool create(const char *name)
+	{
+		if (!block_.create(name, sizeof(FRAME_RING_HEADER) + FRAME_RING_SLOTS * sizeof(FRAME_RING_SLOT))) return false;
+
+		header_ = (FRAME_RING_HEADER *)block_.data();
+		slots_ = (FRAME_RING_SLOT *)(header_ + 1);
+
+		header_->version_ = FRAME_RING_VERSION;
+		header_->slots_ = FRAME_RING_SLOTS;
+		header_->slot_bytes_ = sizeof(FRAME_RING_SLOT);
+		header_->frequency_ = ring_clock_frequency();
+		header_->written_.store(0, std::memory_order_relaxed);
+		header_->dropped_.store(0, std::memory_order_relaxed);
+		header_->read_.store(0, std::memory_order_relaxed);
+
+		// Last - a reader doesn't touch the block until this is there.
+		std::atomic_thread_fence(std::memory_order_release);
+		header_->magic_ = FRAME_RING_MAGIC;
+
+		return true;
+	}
+
+	void close()
+	{
+		block_.close();
+		header_ = NULL;
+		slots_ = slot_ = NULL;
+	}
+
+	bool opened() const { return header_ != NULL; }
+
+	// True between begin_frame() and end_frame() - the systems write into the slot.
+	bool writing() const { return slot_ != NULL; }
+
+	// Open the next slot for 'frame'. False if the reader hasn't finished with it - the frame is dropped.
+	bool begin_frame(unsigned int frame)
+	{
+		if (!header_) return false;
+
+		unsigned int n = header_->written_.load(std::memory_order_relaxed);
+		if (n - header_->read_.load(std::memory_order_acquire) >= FRAME_RING_SLOTS)
+		{
+			header_->dropped_.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		slot_ = &slots_[n % FRAME_RING_SLOTS];
+		slot_->frame_ = frame;
+		slot_->draws_ = slot_->vertices_ = slot_->lost_ = 0;
+
+		return true;
+	}
+
+	// Room for up to 'capacity' vertices, straight after the last draw's. NULL if the slot hasn't got that much left.
+	RING_VERTEX *reserve(int capacity)
+	{
+		return slot_->vertices_ + capacity <= FRAME_RING_MAX_VERTICES ? &slot_->vertex_[slot_->vertices_] : NULL;
+	}
+
+	// Add a draw of 'count' vertices. Those written where reserve() said stay where they are; from anywhere
+	// else (NULL from reserve()) as many as fit are copied in.
+	void commit(int sprite, float particle_size, int count, const void *vertices)
+	{
+		if (count <= 0) return;
+
+		int room = FRAME_RING_MAX_VERTICES - slot_->vertices_;
+		if (slot_->draws_ == FRAME_RING_MAX_DRAWS) room = 0;
+
+		if (count > room)
+		{
+			slot_->lost_ += count - room;
+			count = room;
+			if (count == 0) return;
+		}
+
+		RING_VERTEX *to = &slot_->vertex_[slot_->vertices_];
+		if (vertices != to) memcpy(to, vertices, count * sizeof(RING_VERTEX));
+
+		RING_DRAW &d = slot_->draw_[slot_->draws_++];
+		d.sprite_ = sprite;
+		d.particle_size_ = particle_size;
+		d.first_ = slot_->vertices_;
+		d.count_ = count;
+
+		slot_->vertices_ += count;
+	}
+
+	// Hand the frame over.
+	void end_frame(float wind)
+	{
+		if (!slot_) return;
+
+		unsigned int n = header_->written_.load(std::memory_order_relaxed);
+
+		slot_->wind_ = wind;
+		slot_->sequence_ = n + 1;
+		slot_->published_ = ring_clock();
+		header_->written_.store(n + 1, std::memory_order_release);
+
+		slot_ = NULL;
+	}
+
+	// One line for the on screen text.
+	std::string status() const
+	{
+		if (!header_) return "Ring: off";
+
+		unsigned int written = header_->written_.load(std::memory_order_relaxed);
+		unsigned int read = header_->read_.load(std::memory_order_relaxed);
+
+		return "Ring: " + std::to_string(written) + " frames handed over, " + std::to_string(written - read) + " waiting, "
+			+ std::to_string(header_->dropped_.load(std::memory_order_relaxed)) + " dropped";
+	}
+
+private:
+	SHARED_BLOCK block_;
+	FRAME_RING_HEADER *header_;
+	FRAME_RING_SLOT *slots_;
+	FRAME_RING_SLOT *slot_;				// The open slot, NULL between frames.
+};
+
+//-----------------------------------------------------------------------------
+// The renderer's end. Take a frame with acquire() (every frame in turn) or
+// latest() (skipping to the newest), read it in place, then release() it.
+
+class FRAME_RING_READER
+{
+public:
+	FRAME_RING_READER() : header_(NULL), slots_(NULL), held_(false), frames_(0), skipped_(0), latency_(0), worst_(0), first_(0), last_(0), bytes_(0) {}
+
+	// Map the ring called 'name'. False if there isn't one, or it was written by a different version.
+	bool open(const char *name)
+	{
+		if (!block_.open(name) || block_.bytes() < sizeof(FRAME_RING_HEADER)) return fail();
+
+		header_ = (FRAME_RING_HEADER *)block_.data();
+		if (header_->magic_ != FRAME_RING_MAGIC || header_->version_ != FRAME_RING_VERSION || header_->slot_bytes_ != sizeof(FRAME_RING_SLOT)
+			|| block_.bytes() < sizeof(FRAME_RING_HEADER) + header_->slots_ * sizeof(FRAME_RING_SLOT))
+		{
+			return fail();
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		slots_ = (FRAME_RING_SLOT *)(header_ + 1);
+		held_ = false;
+
+		return true;
+	}
+
+	void close()
+	{
+		if (held_) release();
+
+		block_.close();
+		header_ = NULL;
+		slots_ = NULL;
+	}
+
+	bool opened() const { return header_ != NULL; }
+
+	// The oldest frame not yet read, or NULL if there is none. Valid until release().
+	const FRAME_RING_SLOT *acquire()
+	{
+		if (!header_) return NULL;
+		if (held_) return current();
+
+		unsigned int r = header_->read_.load(std::memory_order_relaxed);
+		if (header_->written_.load(std::memory_order_acquire) == r) return NULL;
+
+		held_ = true;
+		taken(*current());
+
+		return current();
+	}
+
+	// The newest frame - the one held already if nothing newer has been published. Frames in between are skipped.
+	const FRAME_RING_SLOT *latest()
+	{
+		if (!header_) return NULL;
+
+		unsigned int written = header_->written_.load(std::memory_order_acquire);
+		unsigned int r = header_->read_.load(std::memory_order_relaxed);
+
+		if (written - r > (held_ ? 1u : 0u))
+		{
+			skipped_ += written - 1 - r - (held_ ? 1 : 0);
+			header_->read_.store(written - 1, std::memory_order_release);
+			held_ = true;
+			taken(*current());
+		}
+
+		return held_ ? current() : NULL;
+	}
+
+	// Done with the frame from acquire() or latest() - the writer may have its slot back.
+	void release()
+	{
+		if (!held_) return;
+
+		held_ = false;
+		header_->read_.fetch_add(1, std::memory_order_release);
+	}
+
+	// Frames dropped by the writer because the reader kept it waiting.
+	unsigned int dropped() const { return header_ ? header_->dropped_.load(std::memory_order_relaxed) : 0; }
+
+	int frames() const { return frames_; }
+	unsigned int skipped() const { return skipped_; }
+
+	// From publish to acquire, in ms.
+	double mean_latency() const { return frames_ ? ms(latency_) / frames_ : 0.0; }
+	double worst_latency() const { return ms(worst_); }
+
+	// Frames and bytes a second, from the first frame taken to the last.
+	double frame_rate() const { return last_ > first_ ? (frames_ - 1) / (ms(last_ - first_) / 1000.0) : 0.0; }
+	double byte_rate() const { return last_ > first_ ? (double)bytes_ / (ms(last_ - first_) / 1000.0) : 0.0; }
+
+	// One line for the on screen text.
+	std::string status() const
+	{
+		if (!header_) return "Ring: not connected";
+
+		return "Ring: " + std::to_string(frames_) + " frames, " + std::to_string(frame_rate()) + " a second, " + std::to_string(byte_rate() / (1024.0 * 1024.0))
+			+ " MB/s, handover " + std::to_string(mean_latency()) + " ms (worst " + std::to_string(worst_latency()) + "), " + std::to_string(skipped_) + " skipped, "
+			+ std::to_string(dropped()) + " dropped by the writer";
+	}
+
+private:
+
+	bool fail()
+	{
+		block_.close();
+		header_ = NULL;
+		return false;
+	}
+
+	FRAME_RING_SLOT *current() const
+	{
+		return &slots_[header_->read_.load(std::memory_order_relaxed) % header_->slots_];
+	}
+
+	// Count a frame just taken.
+	void taken(const FRAME_RING_SLOT &s)
+	{
+		long long now = ring_clock();
+		long long latency = now - s.published_;
+
+		latency_ += latency;
+		if (latency > worst_) worst_ = latency;
+
+		if (frames_ == 0) first_ = now;
+		last_ = now;
+		bytes_ += s.draws_ * sizeof(RING_DRAW) + s.vertices_ * sizeof(RING_VERTEX);
+		++frames_;
+	}
+
+	double ms(long long ticks) const { return header_ ? (double)ticks * 1000.0 / (double)header_->frequency_ : 0.0; }
+
+	SHARED_BLOCK block_;
+	FRAME_RING_HEADER *header_;
+	FRAME_RING_SLOT *slots_;
+	bool held_;							// The slot at read_ is being read.
+
+	int frames_;
+	unsigned int skipped_;				// Frames latest() passed over.
+	long long latency_, worst_;			// Publish to acquire, in clock ticks - summed, and the longest.
+	long long first_, last_;			// Clock at the first and last frame taken.
+	double bytes_;						// Draws and vertices taken.
+};
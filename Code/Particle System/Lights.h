@@ -0,0 +1,415 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// EXPLOSION FLASHES
+//
+// Every explosion lights up its surroundings: a point light at its origin_, in
+// the colour of its sprite, that fades away over the first second or so after
+// the burst (FLASH_DECAY). The lights fall on the backdrop (the skybox quad)
+// and on the ground the spawners stand on, which are drawn as grids of
+// vertices lit on the CPU - the fixed function pipeline has 8 lights at most,
+// and a finale has dozens of bursts going at once.
+//
+// Working out every light at every vertex costs lights x vertices, so the
+// lights are binned first. The scene's box is cut into a CLUSTER_X x CLUSTER_Y
+// x CLUSTER_Z grid of clusters, and each light is added to every cluster its
+// sphere of influence (FLASH_RADIUS) reaches - only those with some of the
+// surfaces in them, most of the box is empty sky. A cluster keeps
+// CLUSTER_LIGHTS lights at most - the brightest at its centre - so a vertex
+// only ever adds up the few lights of the cluster it is in, however busy the
+// sky gets.
+//
+// The ground takes the light as a lit surface does (by the angle it comes in
+// at); the backdrop glows by distance alone, as the sky behind a burst.
+//
+// The lights are gathered on the simulation thread, so they are carried in
+// the pipeline's FRAME_SNAPSHOT (see Pipeline.h). Frames from shards and
+// remote viewers have none, and are drawn without flashes.
+//-----------------------------------------------------------------------------
+
+#include "ParticleSystem.h"
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define FLASH_BRIGHTNESS	1.5f		// Brightness of a flash at the burst.
+#define FLASH_DECAY			20.0f		// Updates for a flash to fade to 1/e of that.
+#define FLASH_MIN			0.02f		// Flashes fainter than this are dropped.
+#define FLASH_RADIUS		250.0f		// Furthest a flash reaches.
+
+#define SCENE_MIN			-200.0f		// The box the backdrop and the ground are in, every way.
+#define SCENE_MAX			200.0f
+
+#define CLUSTER_X			8
+#define CLUSTER_Y			8
+#define CLUSTER_Z			8
+#define CLUSTERS			(CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+#define CLUSTER_LIGHTS		8			// Most lights a cluster keeps.
+
+#define LIT_DIVISIONS		32			// Squares along each side of the lit surfaces.
+
+// A flash, with its brightness folded into its colour.
+struct FLASH_LIGHT
+{
+	D3DXVECTOR3 position_;
+	float r_, g_, b_;
+};
+
+// Colours of the flashes, by sprite - in the order of g_SpriteFiles.
+const float g_FlashColours[TEXTURE_COUNT][3] = { { 0.3f, 1.0f, 0.3f }, { 1.0f, 0.3f, 0.2f }, { 0.3f, 0.4f, 1.0f }, { 1.0f, 0.9f, 0.4f } };
+
+// Add the flash of every explosion in 'systems' to 'lights'.
+void GatherFlashLights(const std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> &systems, std::vector<FLASH_LIGHT> &lights)
+{
+	for (auto &s : systems)
+	{
+		if (s->safeToDelete || s->type() != SYSTEM_EXPLOSION) continue;
+
+		float brightness = FLASH_BRIGHTNESS * expf(-((const FIREWORK_EXPLOSION_CLASS &)*s).age() / FLASH_DECAY);
+		if (brightness < FLASH_MIN) continue;
+
+		const float *c = g_FlashColours[s->sprite_ >= 0 && s->sprite_ < TEXTURE_COUNT ? s->sprite_ : 0];
+
+		FLASH_LIGHT l;
+		l.position_ = s->origin_;
+		l.r_ = c[0] * brightness;
+		l.g_ = c[1] * brightness;
+		l.b_ = c[2] * brightness;
+		lights.push_back(l);
+	}
+}
+
+// How much of light 'l' reaches 'p' - falling smoothly to nothing at FLASH_RADIUS. With a 'normal' the
+// surface takes less the further the light is off it, without one it glows by distance alone.
+inline float FlashFalloff(const FLASH_LIGHT &l, const D3DXVECTOR3 &p, const D3DXVECTOR3 *normal)
+{
+	D3DXVECTOR3 d = l.position_ - p;
+	float d2 = D3DXVec3LengthSq(&d);
+	if (d2 >= FLASH_RADIUS * FLASH_RADIUS) return 0;
+
+	float f = 1.0f - d2 / (FLASH_RADIUS * FLASH_RADIUS);
+	f *= f;
+
+	if (normal)
+	{
+		float cosine = D3DXVec3Dot(normal, &d);
+		if (cosine <= 0) return 0;
+		f *= cosine / sqrtf(d2);
+	}
+
+	return f;
+}
+
+//-----------------------------------------------------------------------------
+// The lights binned into the cluster grid.
+
+class LIGHT_CLUSTERS
+{
+public:
+	LIGHT_CLUSTERS() : lights_(0), dropped_(0), lit_(0)
+	{
+		for (int c = 0; c < CLUSTERS; ++c) counts_[c] = 0;
+	}
+
+	// Mark the cluster 'p' is in as having something in it to light. Only those clusters are binned into.
+	void occupy(const D3DXVECTOR3 &p)
+	{
+		int c = cluster(p);
+		if (std::find(occupied_.begin(), occupied_.end(), c) == occupied_.end()) occupied_.push_back(c);
+	}
+
+	// Bin 'count' lights from 'lights' - the lights stay where they are, the clusters keep their index.
+	void bin(const FLASH_LIGHT *lights, int count)
+	{
+		for (int c : occupied_) counts_[c] = 0;
+		lights_ = count;
+		dropped_ = 0;
+		lit_ = 0;
+
+		for (int i = 0; i < count; ++i)
+		{
+			const FLASH_LIGHT &l = lights[i];
+			float brightness = l.r_ > l.g_ ? (l.r_ > l.b_ ? l.r_ : l.b_) : (l.g_ > l.b_ ? l.g_ : l.b_);
+
+			// Every occupied cluster the light's sphere reaches into.
+			for (int c : occupied_)
+			{
+				int x = c % CLUSTER_X, y = c / CLUSTER_X % CLUSTER_Y, z = c / (CLUSTER_X * CLUSTER_Y);
+				if (distance_to_cluster(l.position_, x, y, z) >= FLASH_RADIUS * FLASH_RADIUS) continue;
+
+				D3DXVECTOR3 centre(corner(x + 0.5f, CLUSTER_X), corner(y + 0.5f, CLUSTER_Y), corner(z + 0.5f, CLUSTER_Z));
+				add(c, i, brightness * FlashFalloff(l, centre, NULL));
+			}
+		}
+	}
+
+	// The cluster 'p' is in - points outside the box are put in the nearest one.
+	int cluster(const D3DXVECTOR3 &p) const
+	{
+		return (cell(p.z, CLUSTER_Z) * CLUSTER_Y + cell(p.y, CLUSTER_Y)) * CLUSTER_X + cell(p.x, CLUSTER_X);
+	}
+
+	int count(int cluster) const { return counts_[cluster]; }
+	int lit() const { return lit_; }
+	const unsigned short *lights(int cluster) const { return index_[cluster]; }
+
+	// One line for the on screen text.
+	std::string status() const
+	{
+		return "Flashes: " + std::to_string(lights_) + " lights in " + std::to_string(lit_) + " of " + std::to_string(occupied_.size()) + " clusters, "
+			+ std::to_string(dropped_) + " over the cap of " + std::to_string(CLUSTER_LIGHTS);
+	}
+
+private:
+
+	// Cell of a coordinate along an axis cut into 'cells'.
+	static int cell(float v, int cells)
+	{
+		int c = (int)floorf((v - SCENE_MIN) * cells / (SCENE_MAX - SCENE_MIN));
+		return c < 0 ? 0 : (c >= cells ? cells - 1 : c);
+	}
+
+	// Coordinate of cell boundary 'c' (fractions for inside a cell).
+	static float corner(float c, int cells)
+	{
+		return SCENE_MIN + c * (SCENE_MAX - SCENE_MIN) / cells;
+	}
+
+	// Squared distance from 'p' to the nearest point of cluster (x, y, z).
+	static float distance_to_cluster(const D3DXVECTOR3 &p, int x, int y, int z)
+	{
+		float dx = axis_distance(p.x, corner((float)x, CLUSTER_X), corner((float)x + 1, CLUSTER_X));
+		float dy = axis_distance(p.y, corner((float)y, CLUSTER_Y), corner((float)y + 1, CLUSTER_Y));
+		float dz = axis_distance(p.z, corner((float)z, CLUSTER_Z), corner((float)z + 1, CLUSTER_Z));
+		return dx * dx + dy * dy + dz * dz;
+	}
+
+	static float axis_distance(float v, float lo, float hi)
+	{
+		return v < lo ? lo - v : (v > hi ? v - hi : 0.0f);
+	}
+
+	// Add light 'light' to cluster 'c', 'score' bright at its centre - in place of the faintest there if the cluster is full.
+	void add(int c, int light, float score)
+	{
+		int n = counts_[c];
+		if (n == 0) ++lit_;
+
+		if (n < CLUSTER_LIGHTS)
+		{
+			index_[c][n] = (unsigned short)light;
+			score_[c][n] = score;
+			counts_[c] = (unsigned char)(n + 1);
+			return;
+		}
+
+		++dropped_;
+
+		int faintest = 0;
+		for (int k = 1; k < CLUSTER_LIGHTS; ++k)
+		{
+			if (score_[c][k] < score_[c][faintest]) faintest = k;
+		}
+
+		if (score > score_[c][faintest])
+		{
+			index_[c][faintest] = (unsigned short)light;
+			score_[c][faintest] = score;
+		}
+	}
+
+	std::vector<int> occupied_;		// Clusters with something in them to light.
+	unsigned char counts_[CLUSTERS];
+	unsigned short index_[CLUSTERS][CLUSTER_LIGHTS];
+	float score_[CLUSTERS][CLUSTER_LIGHTS];
+
+	int lights_;			// Lights binned.
+	int dropped_;			// Times a light was left out of a full cluster.
+	int lit_;				// Clusters with any light.
+};
+
+//-----------------------------------------------------------------------------
+// The backdrop and the ground, lit by the flashes.
+
+struct LIT_VERTEX
+{
+	D3DXVECTOR3 position_;
+	D3DCOLOR colour_;
+	float u_, v_;
+};
+
+#define D3DFVF_LITVERTEX (D3DFVF_XYZ | D3DFVF_DIFFUSE | D3DFVF_TEX1)
+
+// One surface - a grid of (LIT_DIVISIONS + 1) squared vertices.
+struct LIT_SURFACE
+{
+	std::vector<LIT_VERTEX> vertices_;
+	std::vector<int> clusters_;		// The cluster each vertex is in.
+	D3DXVECTOR3 normal_;
+	bool glows_;					// Lit by distance alone (no angle).
+	float base_[3];					// Colour with no flashes.
+	float scale_;					// Vertex colour of full brightness.
+};
+
+class LIT_SCENE
+{
+public:
+	// Build the surfaces. Call once, before lighting them.
+	HRESULT build()
+	{
+		backdrop_.vertices_.clear();
+		backdrop_.clusters_.clear();
+		ground_.vertices_.clear();
+		ground_.clusters_.clear();
+		indices_.clear();
+
+		// The backdrop - the quad the skybox was always drawn on, textured the same way.
+		// MODULATE2X: half grey is the texture as it is, flashes brighten it.
+		surface(backdrop_, D3DXVECTOR3(SCENE_MIN, SCENE_MIN, SCENE_MIN), D3DXVECTOR3(SCENE_MAX - SCENE_MIN, 0, 0), D3DXVECTOR3(0, SCENE_MAX - SCENE_MIN, 0), D3DXVECTOR3(0, 0, -1));
+		backdrop_.glows_ = true;
+		backdrop_.base_[0] = backdrop_.base_[1] = backdrop_.base_[2] = 1.0f;
+		backdrop_.scale_ = 0.5f;
+
+		// The ground under the spawners, dark until something lights it.
+		surface(ground_, D3DXVECTOR3(SCENE_MIN, SCENE_MIN, SCENE_MIN), D3DXVECTOR3(SCENE_MAX - SCENE_MIN, 0, 0), D3DXVECTOR3(0, 0, SCENE_MAX - SCENE_MIN), D3DXVECTOR3(0, 1, 0));
+		ground_.glows_ = false;
+		ground_.base_[0] = ground_.base_[1] = 0.08f;
+		ground_.base_[2] = 0.1f;
+		ground_.scale_ = 1.0f;
+
+		// Two triangles a square, the same for both surfaces.
+		for (int j = 0; j < LIT_DIVISIONS; ++j)
+		{
+			for (int i = 0; i < LIT_DIVISIONS; ++i)
+			{
+				unsigned short v = (unsigned short)(j * (LIT_DIVISIONS + 1) + i);
+				unsigned short quad[6] = { v, (unsigned short)(v + LIT_DIVISIONS + 1), (unsigned short)(v + 1),
+					(unsigned short)(v + 1), (unsigned short)(v + LIT_DIVISIONS + 1), (unsigned short)(v + LIT_DIVISIONS + 2) };
+				indices_.insert(indices_.end(), quad, quad + 6);
+			}
+		}
+
+		return S_OK;
+	}
+
+	// Light both surfaces by 'lights', through the clusters.
+	void light(const std::vector<FLASH_LIGHT> &lights)
+	{
+		clusters_.bin(lights.empty() ? NULL : &lights[0], (int)lights.size());
+		light_surface(backdrop_, lights, true);
+		light_surface(ground_, lights, true);
+	}
+
+	// Light both surfaces by every one of 'lights' at every vertex, without the clusters (to compare against).
+	void light_all(const std::vector<FLASH_LIGHT> &lights)
+	{
+		light_surface(backdrop_, lights, false);
+		light_surface(ground_, lights, false);
+	}
+
+	// Draw the backdrop with 'sky' on it, and the ground.
+	void render(LPDIRECT3DDEVICE9 device, LPDIRECT3DTEXTURE9 sky) const
+	{
+		if (indices_.empty()) return;
+
+		DWORD lighting;
+		device->GetRenderState(D3DRS_LIGHTING, &lighting);
+		device->SetRenderState(D3DRS_LIGHTING, FALSE);
+		device->SetFVF(D3DFVF_LITVERTEX);
+
+		device->SetTexture(0, sky);
+		device->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+		device->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
+		device->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE2X);
+		draw(device, backdrop_);
+
+		device->SetTexture(0, NULL);
+		device->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_DIFFUSE);
+		device->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+		draw(device, ground_);
+
+		device->SetRenderState(D3DRS_LIGHTING, lighting);
+	}
+
+	const LIGHT_CLUSTERS &clusters() const { return clusters_; }
+
+	// Vertices lit, for the benchmark.
+	int vertices() const { return (int)(backdrop_.vertices_.size() + ground_.vertices_.size()); }
+
+private:
+
+	// Fill 's' with a grid from 'origin' across 'across' and 'up', facing 'normal'.
+	void surface(LIT_SURFACE &s, const D3DXVECTOR3 &origin, const D3DXVECTOR3 &across, const D3DXVECTOR3 &up, const D3DXVECTOR3 &normal)
+	{
+		s.normal_ = normal;
+
+		for (int j = 0; j <= LIT_DIVISIONS; ++j)
+		{
+			for (int i = 0; i <= LIT_DIVISIONS; ++i)
+			{
+				float u = (float)i / LIT_DIVISIONS, v = (float)j / LIT_DIVISIONS;
+
+				LIT_VERTEX l;
+				l.position_ = origin + across * u + up * v;
+				l.colour_ = D3DCOLOR_XRGB(255, 255, 255);
+				l.u_ = u;
+				l.v_ = 1.0f - v;
+
+				s.vertices_.push_back(l);
+				s.clusters_.push_back(clusters_.cluster(l.position_));
+				clusters_.occupy(l.position_);
+			}
+		}
+	}
+
+	void light_surface(LIT_SURFACE &s, const std::vector<FLASH_LIGHT> &lights, bool clustered)
+	{
+		const D3DXVECTOR3 *normal = s.glows_ ? NULL : &s.normal_;
+
+		for (size_t v = 0; v < s.vertices_.size(); ++v)
+		{
+			LIT_VERTEX &l = s.vertices_[v];
+			float c[3] = { s.base_[0], s.base_[1], s.base_[2] };
+
+			if (clustered)
+			{
+				int cluster = s.clusters_[v];
+				const unsigned short *index = clusters_.lights(cluster);
+
+				for (int k = clusters_.count(cluster); k-- > 0;)
+				{
+					add(c, lights[index[k]], l.position_, normal);
+				}
+			}
+			else
+			{
+				for (auto &light : lights) add(c, light, l.position_, normal);
+			}
+
+			l.colour_ = D3DCOLOR_XRGB(channel(c[0] * s.scale_), channel(c[1] * s.scale_), channel(c[2] * s.scale_));
+		}
+	}
+
+	static void add(float *c, const FLASH_LIGHT &light, const D3DXVECTOR3 &p, const D3DXVECTOR3 *normal)
+	{
+		float f = FlashFalloff(light, p, normal);
+		c[0] += light.r_ * f;
+		c[1] += light.g_ * f;
+		c[2] += light.b_ * f;
+	}
+
+	static int channel(float c)
+	{
+		return c >= 1.0f ? 255 : (c <= 0 ? 0 : (int)(c * 255.0f));
+	}
+
+	void draw(LPDIRECT3DDEVICE9 device, const LIT_SURFACE &s) const
+	{
+		device->DrawIndexedPrimitiveUP(D3DPT_TRIANGLELIST, 0, (UINT)s.vertices_.size(), (UINT)indices_.size() / 3, &indices_[0], D3DFMT_INDEX16,
+			&s.vertices_[0], sizeof(LIT_VERTEX));
+	}
+
+	LIGHT_CLUSTERS clusters_;
+	LIT_SURFACE backdrop_, ground_;
+	std::vector<unsigned short> indices_;
+};
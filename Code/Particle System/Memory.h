@@ -0,0 +1,266 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// MEMORY ACCOUNTING
+//
+// Every significant allocation in the show is charged to a MEMORY_TAG - the
+// containers through TRACKED_ALLOCATOR, the systems themselves through their
+// operator new, and textures by hand when they are created. For each tag
+// g_Memory keeps the live and peak bytes, the total number of allocations and
+// the allocations made during the last frame.
+//
+// Update() marks the systems update loop as the hot loop. Nothing in there
+// should allocate once the show is running, so if more than MEMORY_HOT_LIMIT
+// allocations a frame are made in it, averaged over MEMORY_WINDOW frames, the
+// alarm is raised on screen and in the debug output. Only the simulating
+// thread's own allocations count - the capture, preview, trajectory and
+// stream threads allocate whenever they like.
+//-----------------------------------------------------------------------------
+
+#include <d3dx9.h>
+#include <atomic>
+#include <new>
+#include <string>
+
+#define MEMORY_WINDOW		60		// Frames the hot loop allocation rate is averaged over.
+#define MEMORY_HOT_LIMIT	1.0		// Allocations per frame in the hot loop that raise the alarm.
+
+#ifdef _MSC_VER
+#define SHOW_THREAD_LOCAL __declspec(thread)
+#else
+#define SHOW_THREAD_LOCAL __thread
+#endif
+
+enum MEMORY_TAG
+{
+	MEM_PARTICLES,		// Particle arrays and rocket path histories.
+	MEM_SYSTEMS,		// The particle system objects.
+	MEM_STAGING,		// Vertices on their way to the GPU.
+	MEM_NOISE,			// The wind noise table.
+	MEM_CHAINS,			// 'nextSystems' lists.
+	MEM_TEXTURES,		// Texture memory (estimated from the size and format).
+	MEMORY_TAGS
+};
+
+SHOW_THREAD_LOCAL long long g_ThreadAllocations = 0;		// Tracked allocations made by this thread, over all tags.
+
+class MEMORY_ACCOUNTS
+{
+public:
+	MEMORY_ACCOUNTS() : hot_start_(0), hot_frame_(0), hot_total_(0), alarm_(false)
+	{
+		for (int i = 0; i < MEMORY_TAGS; ++i)
+		{
+			ACCOUNT &a = accounts_[i];
+			a.live_ = a.peak_ = a.allocations_ = a.frame_allocations_ = a.frame_bytes_ = 0;
+			a.last_allocations_ = a.last_bytes_ = 0;
+		}
+
+		for (int i = 0; i < MEMORY_WINDOW; ++i) hot_history_[i] = 0;
+	}
+
+	// Safe to call from any thread.
+	void allocated(MEMORY_TAG tag, size_t bytes)
+	{
+		ACCOUNT &a = accounts_[tag];
+
+		long long live = (a.live_ += (long long)bytes);
+		long long peak = a.peak_;
+		while (live > peak && !a.peak_.compare_exchange_weak(peak, live)) {}
+
+		++a.allocations_;
+		++a.frame_allocations_;
+		a.frame_bytes_ += (long long)bytes;
+		++g_ThreadAllocations;
+	}
+
+	void freed(MEMORY_TAG tag, size_t bytes)
+	{
+		accounts_[tag].live_ -= (long long)bytes;
+	}
+
+	long long live(MEMORY_TAG tag) const { return accounts_[tag].live_; }
+	long long peak(MEMORY_TAG tag) const { return accounts_[tag].peak_; }
+
+	// Bracket the hot loop, on the thread simulating the show - allocations that thread makes in between count
+	// towards the alarm.
+	void begin_hot()
+	{
+		hot_start_ = g_ThreadAllocations;
+	}
+
+	void end_hot()
+	{
+		int n = (int)(g_ThreadAllocations - hot_start_);
+
+		hot_total_ += n - hot_history_[hot_frame_];
+		hot_history_[hot_frame_] = n;
+		hot_frame_ = (hot_frame_ + 1) % MEMORY_WINDOW;
+
+		bool alarm = hot_total_ > MEMORY_HOT_LIMIT * MEMORY_WINDOW;
+		if (alarm && !alarm_)
+		{
+			OutputDebugString(("Memory: " + std::to_string(hot_total_.load()) + " allocations in the hot loop over the last " + std::to_string(MEMORY_WINDOW) + " frames.\n").c_str());
+		}
+		alarm_ = alarm;
+	}
+
+	bool alarm() const { return alarm_; }
+
+	// Call once per frame, after the simulation - moves this frame's counts to the ones reported.
+	void end_frame()
+	{
+		for (int i = 0; i < MEMORY_TAGS; ++i)
+		{
+			ACCOUNT &a = accounts_[i];
+			a.last_allocations_ = a.frame_allocations_.exchange(0);
+			a.last_bytes_ = a.frame_bytes_.exchange(0);
+		}
+	}
+
+	// One line per tag for the on screen text.
+	std::string status() const
+	{
+		std::string s;
+
+		for (int i = 0; i < MEMORY_TAGS; ++i)
+		{
+			const ACCOUNT &a = accounts_[i];
+			s += name((MEMORY_TAG)i) + std::string(": ") + kb(a.live_) + " (peak " + kb(a.peak_) + "), "
+				+ std::to_string(a.last_allocations_) + " allocs / " + kb(a.last_bytes_) + " last frame\n";
+		}
+
+		if (alarm_) s += "ALLOCATING IN THE HOT LOOP: " + std::to_string(hot_total_.load()) + " in " + std::to_string(MEMORY_WINDOW) + " frames\n";
+
+		return s;
+	}
+
+	// Peak and total figures for every tag - written to the debug output at exit.
+	std::string report() const
+	{
+		std::string s = "Memory:";
+		long long peak = 0;
+
+		for (int i = 0; i < MEMORY_TAGS; ++i)
+		{
+			const ACCOUNT &a = accounts_[i];
+			s += std::string(" ") + name((MEMORY_TAG)i) + " peak " + kb(a.peak_) + " in " + std::to_string(a.allocations_) + " allocs,";
+			peak += a.peak_;
+		}
+
+		return s + " sum of peaks " + kb(peak) + "\n";
+	}
+
+	static const char *name(MEMORY_TAG tag)
+	{
+		static const char *names[MEMORY_TAGS] = { "particles", "systems", "staging", "noise", "chains", "textures" };
+		return names[tag];
+	}
+
+private:
+	static std::string kb(long long bytes)
+	{
+		return std::to_string((bytes + 512) / 1024) + " KB";
+	}
+
+	struct ACCOUNT
+	{
+		std::atomic<long long> live_, peak_;
+		std::atomic<long long> allocations_;						// Since startup.
+		std::atomic<long long> frame_allocations_, frame_bytes_;	// So far this frame.
+		long long last_allocations_, last_bytes_;					// During the last complete frame.
+	};
+
+	ACCOUNT accounts_[MEMORY_TAGS];
+
+	// Only the simulating thread touches these, apart from status() reading the last two.
+	long long hot_start_;					// g_ThreadAllocations at begin_hot().
+	int hot_history_[MEMORY_WINDOW];		// Hot loop allocations in each of the last MEMORY_WINDOW frames.
+	int hot_frame_;
+	std::atomic<int> hot_total_;
+	std::atomic<bool> alarm_;
+};
+
+MEMORY_ACCOUNTS g_Memory;		// Defined before anything that allocates through it.
+
+//-----------------------------------------------------------------------------
+// Standard allocator that charges everything to 'TAG'.
+
+template <class T, MEMORY_TAG TAG>
+class TRACKED_ALLOCATOR
+{
+public:
+	typedef T value_type;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T &reference;
+	typedef const T &const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <class U> struct rebind { typedef TRACKED_ALLOCATOR<U, TAG> other; };
+
+	TRACKED_ALLOCATOR() {}
+	template <class U> TRACKED_ALLOCATOR(const TRACKED_ALLOCATOR<U, TAG> &) {}
+
+	T *allocate(size_t n, const void * = 0)
+	{
+		T *p = (T *)::operator new(n * sizeof(T));
+		g_Memory.allocated(TAG, n * sizeof(T));
+		return p;
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		g_Memory.freed(TAG, n * sizeof(T));
+		::operator delete(p);
+	}
+
+	size_t max_size() const { return ((size_t)-1) / sizeof(T); }
+
+	template <class U, class... ARGS> void construct(U *p, ARGS &&... args) { ::new((void *)p) U(std::forward<ARGS>(args)...); }
+	template <class U> void destroy(U *p) { p->~U(); }
+};
+
+template <class T, class U, MEMORY_TAG TAG> bool operator==(const TRACKED_ALLOCATOR<T, TAG> &, const TRACKED_ALLOCATOR<U, TAG> &) { return true; }
+template <class T, class U, MEMORY_TAG TAG> bool operator!=(const TRACKED_ALLOCATOR<T, TAG> &, const TRACKED_ALLOCATOR<U, TAG> &) { return false; }
+
+//-----------------------------------------------------------------------------
+// Textures - charged by hand, from the size and format of every level.
+
+size_t TextureBytes(LPDIRECT3DTEXTURE9 texture)
+{
+	if (!texture) return 0;
+
+	size_t bytes = 0;
+	for (DWORD level = 0; level < texture->GetLevelCount(); ++level)
+	{
+		D3DSURFACE_DESC desc;
+		if (FAILED(texture->GetLevelDesc(level, &desc))) break;
+
+		size_t texels = (size_t)desc.Width * desc.Height;
+		switch (desc.Format)
+		{
+		case D3DFMT_DXT1:
+			bytes += texels / 2;
+			break;
+		case D3DFMT_DXT2: case D3DFMT_DXT3: case D3DFMT_DXT4: case D3DFMT_DXT5:
+			bytes += texels;
+			break;
+		default:
+			bytes += texels * 4;	// The 32 bit formats the show loads into.
+			break;
+		}
+	}
+
+	return bytes;
+}
+
+void TrackTexture(LPDIRECT3DTEXTURE9 texture)
+{
+	if (texture) g_Memory.allocated(MEM_TEXTURES, TextureBytes(texture));
+}
+
+void UntrackTexture(LPDIRECT3DTEXTURE9 texture)
+{
+	if (texture) g_Memory.freed(MEM_TEXTURES, TextureBytes(texture));
+}
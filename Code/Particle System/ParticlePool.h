@@ -0,0 +1,261 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// PARTICLE POOL
+//
+// Every system's particles live in one contiguous array, the show's
+// PARTICLE_POOL (each SHOW_WORLD has one), instead of a vector of their own
+// scattered through the heap. A system holds
+// a PARTICLE_RANGE - where its particles start in the pool, how many there
+// are and how many it has room for - which looks like the vector it replaces
+// (begin/end, operator[], erase, resize), so the particle loops don't change.
+//
+// Ranges are handed out from the top of the pool, so they sit in the order
+// they were made, which is the order systems are added to the show: the
+// update takes each type's systems in that order (see SYSTEM_BUCKETS), and so
+// walks the pool the same way, forward through memory with each system's
+// particles after the last one's. A range that is released leaves a hole; once the holes add up to
+// more than 1/PARTICLE_POOL_SLACK of the used part compact() slides the ranges
+// after them down, keeping their order. That is done between frames (see
+// SYSTEM_COMMAND_QUEUE::apply()), never in the middle of an update, so a
+// pointer into the pool stays good for the whole frame. A range that doesn't
+// fit gets a block of its own from the heap instead, and is counted on screen.
+//
+// The pool belongs to the thread running the show - it is not locked. A range
+// goes back to the pool it came from, whichever show is current at the time.
+//-----------------------------------------------------------------------------
+
+#include <d3dx9.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "Memory.h"
+
+#define PARTICLE_POOL_SIZE	(64 * 1024)	// Particles the pool holds.
+#define PARTICLE_POOL_SLACK	4				// Compact once more than 1/PARTICLE_POOL_SLACK of the used part is holes.
+
+struct PARTICLE
+{
+	int			lifetime_;
+	D3DXVECTOR3 position_, velocity_;
+	float		time_;
+};
+
+class PARTICLE_RANGE;
+
+class PARTICLE_POOL
+{
+public:
+	PARTICLE_POOL() : particles_(NULL), top_(0), used_(0), peak_(0), compactions_(0), overflows_(0) {}
+
+	~PARTICLE_POOL()
+	{
+		if (!particles_) return;
+
+		g_Memory.freed(MEM_PARTICLES, PARTICLE_POOL_SIZE * sizeof(PARTICLE));
+		::operator delete(particles_);
+	}
+
+	// Room for 'capacity' particles at the top of the pool, for 'r'. NULL if the pool is full.
+	PARTICLE *allocate(PARTICLE_RANGE *r, int capacity);
+
+	// Give back the particles of 'r' (which must be in the pool).
+	void release(PARTICLE_RANGE *r);
+
+	// Slide every range down over the holes, keeping their order. Invalidates every pointer into the pool.
+	void compact();
+
+	// True if enough has been released that compact() is worth doing.
+	bool fragmented() const { return (top_ - used_) * PARTICLE_POOL_SLACK > top_; }
+
+	// Particles between the start of the pool and the end of the last range - what a sweep over it covers.
+	int top() const { return top_; }
+
+	// One line for the on screen text.
+	std::string status() const
+	{
+		return "Pool: " + std::to_string(used_) + " particles in " + std::to_string(ranges_.size()) + " ranges, " + std::to_string(top_ - used_)
+			+ " in holes, peak " + std::to_string(peak_) + " of " + std::to_string(PARTICLE_POOL_SIZE) + ", " + std::to_string(compactions_)
+			+ " compactions, " + std::to_string(overflows_) + " outside";
+	}
+
+private:
+	friend class PARTICLE_RANGE;
+
+	PARTICLE *particles_;						// PARTICLE_POOL_SIZE particles, allocated the first time one is wanted.
+	std::vector<PARTICLE_RANGE *> ranges_;		// Every range in the pool, in the order they sit in it.
+	int top_;									// End of the last range.
+	int used_;									// Particles the ranges have room for - the rest below 'top_' are holes.
+	int peak_;
+	int compactions_;
+	int overflows_;								// Ranges that have had to go on the heap.
+};
+
+PARTICLE_POOL &WorldParticlePool();		// The current show's pool (see World.h).
+
+//-----------------------------------------------------------------------------
+// A system's particles - stands in for std::vector<PARTICLE>. Not copyable,
+// the pool keeps track of it by address.
+
+class PARTICLE_RANGE
+{
+public:
+	typedef PARTICLE value_type;
+	typedef PARTICLE *iterator;
+	typedef const PARTICLE *const_iterator;
+
+	PARTICLE_RANGE() : data_(NULL), pool_(NULL), first_(-1), size_(0), capacity_(0) {}
+
+	~PARTICLE_RANGE()
+	{
+		release();
+	}
+
+	iterator begin() { return data_; }
+	iterator end() { return data_ + size_; }
+	const_iterator begin() const { return data_; }
+	const_iterator end() const { return data_ + size_; }
+
+	size_t size() const { return (size_t)size_; }
+	bool empty() const { return size_ == 0; }
+	PARTICLE *data() { return data_; }
+	const PARTICLE *data() const { return data_; }
+
+	PARTICLE &operator[](size_t i) { return data_[i]; }
+	const PARTICLE &operator[](size_t i) const { return data_[i]; }
+	PARTICLE &back() { return data_[size_ - 1]; }
+
+	// Remove 'p', moving the ones after it down - the range keeps its room.
+	iterator erase(iterator p)
+	{
+		memmove(p, p + 1, (end() - (p + 1)) * sizeof(PARTICLE));
+		--size_;
+		return p;
+	}
+
+	void clear() { size_ = 0; }
+
+	// Give the room back to the pool - the range must be empty.
+	void release_room()
+	{
+		if (size_ == 0) release();
+	}
+
+	void resize(size_t n)
+	{
+		PARTICLE p;
+		ZeroMemory(&p, sizeof(PARTICLE));
+		resize(n, p);
+	}
+
+	void resize(size_t n, const PARTICLE &value)
+	{
+		if ((int)n > capacity_) reserve((int)n);
+		for (int i = size_; i < (int)n; ++i) data_[i] = value;
+		size_ = (int)n;
+	}
+
+	// Room for 'n' particles - moves the range to the top of the pool (or the heap) if it hasn't got it.
+	void reserve(int n)
+	{
+		if (n <= capacity_) return;
+
+		PARTICLE *old = data_;
+		int old_capacity = capacity_;
+		bool pooled = first_ >= 0;
+
+		// Out of the pool first - if this was the last range the new one starts in the same place.
+		if (!pool_) pool_ = &WorldParticlePool();
+		if (pooled) pool_->release(this);
+
+		data_ = pool_->allocate(this, n);
+		if (!data_)
+		{
+			data_ = TRACKED_ALLOCATOR<PARTICLE, MEM_PARTICLES>().allocate(n);
+			++pool_->overflows_;
+		}
+		capacity_ = n;
+
+		if (old && old != data_) memmove(data_, old, size_ * sizeof(PARTICLE));
+		if (old && !pooled) TRACKED_ALLOCATOR<PARTICLE, MEM_PARTICLES>().deallocate(old, old_capacity);
+	}
+
+	// Where the range starts in its pool, -1 if it is on the heap (or empty).
+	int first() const { return first_; }
+
+private:
+	friend class PARTICLE_POOL;
+
+	PARTICLE_RANGE(const PARTICLE_RANGE &);
+	PARTICLE_RANGE &operator=(const PARTICLE_RANGE &);
+
+	void release()
+	{
+		if (!data_) return;
+
+		if (first_ >= 0) pool_->release(this);
+		else TRACKED_ALLOCATOR<PARTICLE, MEM_PARTICLES>().deallocate(data_, capacity_);
+
+		data_ = NULL;
+		size_ = capacity_ = 0;
+	}
+
+	PARTICLE *data_;
+	PARTICLE_POOL *pool_;	// The show's pool, from the first reserve().
+	int first_;			// Index of data_[0] in the pool, -1 when it isn't in the pool.
+	int size_;
+	int capacity_;
+};
+
+PARTICLE *PARTICLE_POOL::allocate(PARTICLE_RANGE *r, int capacity)
+{
+	if (!particles_)
+	{
+		particles_ = (PARTICLE *)::operator new(PARTICLE_POOL_SIZE * sizeof(PARTICLE));
+		g_Memory.allocated(MEM_PARTICLES, PARTICLE_POOL_SIZE * sizeof(PARTICLE));
+	}
+
+	if (capacity > PARTICLE_POOL_SIZE - top_) return NULL;
+
+	r->first_ = top_;
+	ranges_.push_back(r);
+
+	top_ += capacity;
+	used_ += capacity;
+	if (top_ > peak_) peak_ = top_;
+
+	return particles_ + r->first_;
+}
+
+void PARTICLE_POOL::release(PARTICLE_RANGE *r)
+{
+	used_ -= r->capacity_;
+
+	// Usually one of the oldest, so search from the front.
+	ranges_.erase(std::find(ranges_.begin(), ranges_.end(), r));
+	r->first_ = -1;
+
+	// Nothing above it any more - lower the top to the end of the range below.
+	top_ = ranges_.empty() ? 0 : ranges_.back()->first_ + ranges_.back()->capacity_;
+}
+
+void PARTICLE_POOL::compact()
+{
+	if (top_ == used_) return;
+
+	int to = 0;
+	for (PARTICLE_RANGE *r : ranges_)
+	{
+		if (r->first_ != to)
+		{
+			memmove(particles_ + to, r->data_, r->size_ * sizeof(PARTICLE));
+			r->first_ = to;
+			r->data_ = particles_ + to;
+		}
+
+		to += r->capacity_;
+	}
+
+	top_ = to;
+	++compactions_;
+}
@@ -7,18 +7,33 @@
 #include <d3dx9.h>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <emmintrin.h>	// SSE2, for the ground collision pass.
 
 #define SAFE_DELETE(p)       {if(p) {delete (p);     (p)=NULL;}}
 #define SAFE_DELETE_ARRAY(p) {if(p) {delete[] (p);   (p)=NULL;}}
 #define SAFE_RELEASE(p)      {if(p) {(p)->Release(); (p)=NULL;}}
 
+#include "Memory.h"
+#include "CompactVertex.h"
+#include "SpriteAtlas.h"
+#include "TimerWheel.h"
+#include "Directions.h"
+#include "ParticlePool.h"
+#include "CompactParticle.h"
+#include "World.h"
+#include "FrameRing.h"
+
 //initialisers (I think)
 class PARTICLE_SYSTEM_BASE;
+class SHOW_CHECKPOINT;
+class BENCHMARK_SUITE;
+class STREAM_CODEC;
 
 //global vars
 LPDIRECT3DDEVICE9       device = NULL;	// The rendering device
-std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> g_Particles;
-float windSpeed = 0.0f;
+bool g_PipelinedRender = false;	// Systems are simulated on a worker and drawn from frame snapshots (see Pipeline.h).
+FRAME_RING_WRITER g_FrameRing;	// Frames written straight into shared memory for another process to draw (-ring, see FrameRing.h).
 
 LPDIRECT3DTEXTURE9	blueTex = NULL, redTex = NULL, yellowTex = NULL, greenTex = NULL, skyboxTex = NULL;
 
@@ -26,26 +41,14 @@ LPDIRECT3DTEXTURE9	blueTex = NULL, redTex = NULL, yellowTex = NULL, greenTex = N
 // PARTICLE CLASSES
 //-----------------------------------------------------------------------------
 
-unsigned int random_number()
-{
-	unsigned int n;
-	rand_s(&n);
-	return n;
-}
-
-unsigned int random_number(unsigned int a, unsigned int b)	// return a random number between a and b.
-{
-	unsigned int n;
-	rand_s(&n);
-	return a + (n % (b - a));
-}
-
 // A structure for point sprites.
 struct POINTVERTEX
 {
     D3DXVECTOR3 position_;		// X, Y, Z position of the point (sprite).
 };
 
+static_assert(sizeof(POINTVERTEX) == sizeof(RING_VERTEX), "The frame ring holds POINTVERTEXs as they are.");
+
 // The structure of a vertex in our vertex buffer...
 #define D3DFVF_POINTVERTEX D3DFVF_XYZ
 
@@ -54,42 +57,385 @@ inline DWORD FtoDW(float f) {return *((DWORD*)&f); }
 
 //-----------------------------------------------------------------------------
 
-struct PARTICLE
+typedef PARTICLE_RANGE PARTICLE_VECTOR;	// A system's particles, in the show's pool.
+
+#define reset_particle(p) SecureZeroMemory(&p, sizeof(PARTICLE));
+
+// A point on a rocket's path, kept so the trail can be drawn from the path history.
+struct TRAIL_NODE
 {
-	int			lifetime_;
-	D3DXVECTOR3 position_, velocity_;
-	float		time_;
+	D3DXVECTOR3 position_;		// Rocket origin when the node was recorded.
+	float		wind_;			// SHOW_WORLD::wind_drift_ when the node was recorded, less that frame's wind (the sparks feel it).
+	int			born_;			// Value of the rocket's 'trail_clock_' when the node was recorded.
 };
 
-#define reset_particle(p) SecureZeroMemory(&p, sizeof(PARTICLE));
+//-----------------------------------------------------------------------------
+// GROUND COLLISION
+//-----------------------------------------------------------------------------
+
+// What happens to a particle that ends up below the ground.
+enum GROUND_RESPONSE
+{
+	GROUND_NONE = 0,	// Falls through.
+	GROUND_KILL,		// Dies (lifetime set to zero).
+	GROUND_BOUNCE,		// Reflected back up, losing speed by the restitution.
+	GROUND_STICK		// Stops dead on the surface.
+};
+
+// The ground - a flat plane, or a heightfield sampled on a regular grid in X/Z.
+// collide() is run by the particle updates over a whole system's particles at once,
+// four at a time with SSE. Every lane computes every result and the response is
+// applied with masks, so there is no per particle branch.
+
+class GROUND_COLLIDER
+{
+	public:
+		GROUND_COLLIDER() : planeY_(-200.0f), width_(0), depth_(0), minX_(0), minZ_(0), cell_(1.0f), friction_(0.8f) {}
+
+		void set_plane(float y)
+		{
+			planeY_ = y;
+			heights_.clear();
+			width_ = depth_ = 0;
+		}
+
+		// 'heights' is 'width' x 'depth' samples, row by row in Z, 'cell' apart starting at (minX, minZ).
+		// Outside the grid the edge samples carry on.
+		void set_heightfield(const std::vector<float> &heights, int width, int depth, float minX, float minZ, float cell)
+		{
+			if (width < 2 || depth < 2 || (int)heights.size() != width * depth || cell <= 0) return;
+
+			heights_ = heights;
+			width_ = width;
+			depth_ = depth;
+			minX_ = minX;
+			minZ_ = minZ;
+			cell_ = cell;
+		}
+
+		// Ground height below (x, z), bilinearly interpolated.
+		float height(float x, float z) const
+		{
+			if (heights_.empty()) return planeY_;
+
+			float gx = (x - minX_) / cell_;
+			float gz = (z - minZ_) / cell_;
+			gx = gx < 0 ? 0 : (gx > width_ - 1.001f ? width_ - 1.001f : gx);
+			gz = gz < 0 ? 0 : (gz > depth_ - 1.001f ? depth_ - 1.001f : gz);
+
+			int ix = (int)gx, iz = (int)gz;
+			float fx = gx - ix, fz = gz - iz;
+
+			const float *row = &heights_[iz * width_ + ix];
+			float h0 = row[0] + (row[1] - row[0]) * fx;
+			float h1 = row[width_] + (row[width_ + 1] - row[width_]) * fx;
+			return h0 + (h1 - h0) * fz;
+		}
+
+		// Collide the live particles among 'count' particles from 'p' with the ground.
+		// 'restitution' is the fraction of vertical speed kept by a bounce.
+		// Returns the number of particles killed (GROUND_KILL only).
+		int collide(PARTICLE *p, int count, GROUND_RESPONSE response, float restitution) const
+		{
+			if (response == GROUND_NONE || count <= 0) return 0;
+
+			int killed = 0;
+			int i = 0;
+
+			const __m128 r = _mm_set1_ps(restitution);
+			const __m128 friction = _mm_set1_ps(friction_);
+			const __m128 zero = _mm_setzero_ps();
+
+			for (; i + 4 <= count; i += 4)
+			{
+				PARTICLE *q = p + i;
+
+				__m128 h = heights_.empty() ? _mm_set1_ps(planeY_) :
+					_mm_setr_ps(height(q[0].position_.x, q[0].position_.z), height(q[1].position_.x, q[1].position_.z),
+								height(q[2].position_.x, q[2].position_.z), height(q[3].position_.x, q[3].position_.z));
+
+				__m128 y = _mm_setr_ps(q[0].position_.y, q[1].position_.y, q[2].position_.y, q[3].position_.y);
+				__m128i life = _mm_setr_epi32(q[0].lifetime_, q[1].lifetime_, q[2].lifetime_, q[3].lifetime_);
+
+				// Lanes that are alive and below the ground.
+				__m128 hit = _mm_and_ps(_mm_cmplt_ps(y, h), _mm_castsi128_ps(_mm_cmpgt_epi32(life, _mm_setzero_si128())));
+
+				int mask = _mm_movemask_ps(hit);
+				if (mask == 0) continue;	// Nothing near the ground - the usual case for a whole batch.
+
+				if (response == GROUND_KILL)
+				{
+					__m128i l = _mm_andnot_si128(_mm_castps_si128(hit), life);
+					store(l, q);
+					killed += ((mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1));
+					continue;
+				}
+
+				__m128 vx = _mm_setr_ps(q[0].velocity_.x, q[1].velocity_.x, q[2].velocity_.x, q[3].velocity_.x);
+				__m128 vy = _mm_setr_ps(q[0].velocity_.y, q[1].velocity_.y, q[2].velocity_.y, q[3].velocity_.y);
+				__m128 vz = _mm_setr_ps(q[0].velocity_.z, q[1].velocity_.z, q[2].velocity_.z, q[3].velocity_.z);
+
+				__m128 ny, nvx, nvy, nvz;
+				if (response == GROUND_BOUNCE)
+				{
+					// Reflect the penetration and the vertical speed, scaled by the restitution.
+					ny = _mm_add_ps(h, _mm_mul_ps(_mm_sub_ps(h, y), r));
+					nvy = _mm_sub_ps(zero, _mm_mul_ps(vy, r));
+					nvx = _mm_mul_ps(vx, friction);
+					nvz = _mm_mul_ps(vz, friction);
+				}
+				else
+				{
+					ny = h;
+					nvx = nvy = nvz = zero;
+				}
+
+				store(select(hit, ny, y), select(hit, nvx, vx), select(hit, nvy, vy), select(hit, nvz, vz), q);
+			}
+
+			// The last few particles one at a time.
+			for (; i < count; ++i)
+			{
+				PARTICLE &q = p[i];
+				if (q.lifetime_ <= 0) continue;
+
+				float h = height(q.position_.x, q.position_.z);
+				if (q.position_.y >= h) continue;
+
+				switch (response)
+				{
+				case GROUND_KILL:
+					q.lifetime_ = 0;
+					++killed;
+					break;
+				case GROUND_BOUNCE:
+					q.position_.y = h + (h - q.position_.y) * restitution;
+					q.velocity_.y = -q.velocity_.y * restitution;
+					q.velocity_.x *= friction_;
+					q.velocity_.z *= friction_;
+					break;
+				default:
+					q.position_.y = h;
+					q.velocity_ = D3DXVECTOR3(0, 0, 0);
+					break;
+				}
+			}
+
+			return killed;
+		}
+
+		float planeY_;				// Height of the ground when there is no heightfield.
+
+	private:
+		static __m128 select(__m128 mask, __m128 a, __m128 b)	// mask ? a : b
+		{
+			return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+		}
+
+		static void store(__m128i lifetime, PARTICLE *q)
+		{
+			__declspec(align(16)) int l[4];
+			_mm_store_si128((__m128i *)l, lifetime);
+			q[0].lifetime_ = l[0]; q[1].lifetime_ = l[1]; q[2].lifetime_ = l[2]; q[3].lifetime_ = l[3];
+		}
+
+		static void store(__m128 y, __m128 vx, __m128 vy, __m128 vz, PARTICLE *q)
+		{
+			__declspec(align(16)) float a[4], b[4], c[4], d[4];
+			_mm_store_ps(a, y);
+			_mm_store_ps(b, vx);
+			_mm_store_ps(c, vy);
+			_mm_store_ps(d, vz);
+
+			for (int k = 0; k < 4; ++k)
+			{
+				q[k].position_.y = a[k];
+				q[k].velocity_ = D3DXVECTOR3(b[k], c[k], d[k]);
+			}
+		}
+
+		std::vector<float> heights_;
+		int width_, depth_;
+		float minX_, minZ_, cell_;
+		float friction_;			// Fraction of horizontal speed kept by a bounce.
+};
+
+GROUND_COLLIDER g_Ground;	// The ground the spawners stand on.
+
+//-----------------------------------------------------------------------------
+
+// Concrete system types - used to tag systems when saving/restoring the show.
+enum SYSTEM_TYPE
+{
+	SYSTEM_FOUNTAIN = 0,
+	SYSTEM_EXPLOSION = 1,
+	SYSTEM_ROCKET = 2
+};
+
+//-----------------------------------------------------------------------------
+// Particle sprites - packed into g_SpriteAtlas, or one texture each if it could not be built.
+
+#define TEXTURE_COUNT 4
+
+const char *const g_SpriteFiles[TEXTURE_COUNT] = { "green.png", "red.png", "blue.png", "yellow.png" };
+
+LPDIRECT3DTEXTURE9 getTexture(int i)
+{
+	if (g_SpriteAtlas.texture()) return g_SpriteAtlas.texture();
+
+	switch (i)
+	{
+	case 0:
+		return greenTex;
+		break;
+	case 1:
+		return redTex;
+		break;
+	case 2:
+		return blueTex;
+		break;
+	default:
+		return yellowTex;
+		break;
+	}
+}
+
+// Part of getTexture(i) that sprite 'i' covers - u, v, width, height.
+D3DXVECTOR4 getSpriteRect(int i)
+{
+	return g_SpriteAtlas.texture() ? g_SpriteAtlas.rect(i) : D3DXVECTOR4(0, 0, 1, 1);
+}
+
+int getRandomSprite()
+{
+	int i = random_number(0, TEXTURE_COUNT);
+	return i < TEXTURE_COUNT ? i : TEXTURE_COUNT - 1;	// Yellow for the top of the range, as before.
+}
+
+//-----------------------------------------------------------------------------
+// Render states for drawing a batch of point sprites - shared by the systems
+// and the pipelined renderer. Sets up the compact stream's shader when in use,
+// its constants still have to be set for each draw.
+
+void BeginPointSprites(int sprite, float size)
+{
+	// Enable point sprites, and set the size of the point.
+	device -> SetRenderState(D3DRS_POINTSPRITEENABLE, true);
+	device-> SetRenderState(D3DRS_POINTSCALEENABLE,  true);
+
+	// Disable z buffer while rendering the particles. Makes rendering quicker and
+	// stops any visual (alpha) 'artefacts' on screen while rendering.
+	device-> SetRenderState(D3DRS_ZENABLE, false);
+    
+	// Scale the points according to distance...
+	device-> SetRenderState(D3DRS_POINTSIZE,     FtoDW(size));
+	device-> SetRenderState(D3DRS_POINTSIZE_MIN, FtoDW(0.00f));
+	device-> SetRenderState(D3DRS_POINTSCALE_A,  FtoDW(0.00f));
+	device-> SetRenderState(D3DRS_POINTSCALE_B,  FtoDW(0.00f));
+	device-> SetRenderState(D3DRS_POINTSCALE_C,  FtoDW(1.00f));
+
+	// Now select the texture for the points...
+	// Use texture colour and alpha components.
+	device-> SetTexture(0, getTexture(sprite));
+	device-> SetRenderState(D3DRS_ALPHABLENDENABLE, true);
+	device-> SetRenderState(D3DRS_SRCBLEND,  D3DBLEND_SRCALPHA);
+	device-> SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+
+	device-> SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+	device-> SetTextureStageState(0, D3DTSS_COLOROP,	D3DTOP_SELECTARG1);
+	device-> SetTextureStageState(0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
+	device-> SetTextureStageState(0, D3DTSS_ALPHAOP,   D3DTOP_SELECTARG1);
+
+	if (g_CompactVertices)
+	{
+		// The shader decodes the positions and sizes the points, brightness comes through as diffuse alpha.
+		device-> SetTextureStageState(0, D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
+		device-> SetTextureStageState(0, D3DTSS_ALPHAOP,   D3DTOP_MODULATE);
+		device-> SetVertexDeclaration(g_CompactDeclaration);
+		device-> SetVertexShader(g_CompactShader);
+	}
+	else
+	{
+		device-> SetFVF(D3DFVF_POINTVERTEX);
+	}
+
+	if (g_SpriteAtlas.shader())
+	{
+		// Draw this sprite's part of the atlas.
+		D3DXVECTOR4 rect = getSpriteRect(sprite);
+		D3DXVECTOR4 fade(g_CompactVertices ? 1.0f : 0.0f, 0, 0, 0);
+
+		device-> SetPixelShader(g_SpriteAtlas.shader());
+		device-> SetPixelShaderConstantF(0, rect, 1);
+		device-> SetPixelShaderConstantF(1, fade, 1);
+	}
+}
+
+void EndPointSprites()
+{
+	// Reset the render states.
+	if (g_CompactVertices) device-> SetVertexShader(NULL);
+	if (g_SpriteAtlas.shader()) device-> SetPixelShader(NULL);
+
+	device-> SetRenderState(D3DRS_POINTSPRITEENABLE, false);
+	device-> SetRenderState(D3DRS_POINTSCALEENABLE,  false);
+	device-> SetRenderState(D3DRS_ALPHABLENDENABLE,  false);
+	device-> SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_DIFFUSE);
+	device-> SetRenderState(D3DRS_ZENABLE, D3DZB_TRUE);
+}
 
 //-----------------------------------------------------------------------------
 
 class PARTICLE_SYSTEM_BASE
 {
 	public:
-		PARTICLE_SYSTEM_BASE() : max_particles_(0), alive_particles_(0), max_lifetime_(0), origin_(D3DXVECTOR3(0, 0, 0)), points_(NULL), particle_size_(1.0f), safeToDelete(false), alpha(255)
+		PARTICLE_SYSTEM_BASE() : max_particles_(0), alive_particles_(0), max_lifetime_(0), sprite_(0), origin_(D3DXVECTOR3(0, 0, 0)), points_(NULL), particle_size_(1.0f), safeToDelete(false), alpha(255), ground_response_(GROUND_NONE), restitution_(0.5f), random_stream_(g_World->random_stream_), serial_(++g_World->system_serial_), staged_count_(0), staged_brightness_(NULL), ring_vertices_(NULL)
 		{}
 
-		~PARTICLE_SYSTEM_BASE()
+		virtual ~PARTICLE_SYSTEM_BASE()
 		{
 
 			// Destructor - release the points buffer.
 			SAFE_RELEASE(points_);
 		}
 
+		// The system objects themselves are charged to MEM_SYSTEMS.
+		static void *operator new(size_t bytes)
+		{
+			void *p = ::operator new(bytes);
+			g_Memory.allocated(MEM_SYSTEMS, bytes);
+			return p;
+		}
+
+		static void operator delete(void *p, size_t bytes)
+		{
+			g_Memory.freed(MEM_SYSTEMS, bytes);
+			::operator delete(p);
+		}
+
 		virtual HRESULT initialise()
 		{			
 			PARTICLE p;
 			reset_particle(p);
 			particles_.resize(max_particles_, p);	// Create a vector of empty particles - make 'max_particles_' copies of particle 'p'.
 
+			return create_vertex_buffer(max_particles_);
+		}
+
+		HRESULT create_vertex_buffer(int vertices)
+		{
 			// Create a vertex buffer for the particles (each particule represented as an individual vertex).
-			int buffer_size = max_particles_ * sizeof(POINTVERTEX);
+			int buffer_size = vertices * (g_CompactVertices ? sizeof(COMPACT_POINTVERTEX) : sizeof(POINTVERTEX));
+
+			// The compact stream and the pipelined renderer are filled from here first (see lock_vertices()).
+			if (g_CompactVertices || g_PipelinedRender) staging_.resize(vertices);
+
+			// Pipelined systems live on the simulation thread and never touch the device - they are drawn from snapshots.
+			if (g_PipelinedRender) return S_OK;
 
 			// The data in the buffer doesn't exist at this point, but the memory space
 			// is allocated and the pointer to it (g_pPointBuffer) also exists.
-			if (FAILED(device -> CreateVertexBuffer(buffer_size, 0, D3DFVF_POINTVERTEX, D3DPOOL_DEFAULT, &points_, NULL)))
+			if (FAILED(device -> CreateVertexBuffer(buffer_size, 0, g_CompactVertices ? 0 : D3DFVF_POINTVERTEX, D3DPOOL_DEFAULT, &points_, NULL)))
 			{
 				return E_FAIL; // Return if the vertex buffer culd not be created.
 			}
@@ -100,64 +446,60 @@ class PARTICLE_SYSTEM_BASE
 		virtual void update() = 0;	// Specific implementations to provide this - this is to update the positions
 									// of the particles.
 
+		virtual SYSTEM_TYPE type() const = 0;
+
+		const PARTICLE_VECTOR &particles() const { return particles_; }
+
 		void render()
 		{
-			// Enable point sprites, and set the size of the point.
-			device -> SetRenderState(D3DRS_POINTSPRITEENABLE, true);
-			device-> SetRenderState(D3DRS_POINTSCALEENABLE,  true);
-
-			// Disable z buffer while rendering the particles. Makes rendering quicker and
-			// stops any visual (alpha) 'artefacts' on screen while rendering.
-			device-> SetRenderState(D3DRS_ZENABLE, false);
-		    
-			// Scale the points according to distance...
-			device-> SetRenderState(D3DRS_POINTSIZE,     FtoDW(particle_size_));
-			device-> SetRenderState(D3DRS_POINTSIZE_MIN, FtoDW(0.00f));
-			device-> SetRenderState(D3DRS_POINTSCALE_A,  FtoDW(0.00f));
-			device-> SetRenderState(D3DRS_POINTSCALE_B,  FtoDW(0.00f));
-			device-> SetRenderState(D3DRS_POINTSCALE_C,  FtoDW(1.00f));
-
-			// Now select the texture for the points...
-			// Use texture colour and alpha components.
-			device-> SetTexture(0, particle_texture_);
-			device-> SetRenderState(D3DRS_ALPHABLENDENABLE, true);
-			device-> SetRenderState(D3DRS_SRCBLEND,  D3DBLEND_SRCALPHA);
-			device-> SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
-
-			device-> SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
-			device-> SetTextureStageState(0, D3DTSS_COLOROP,	D3DTOP_SELECTARG1);
-			device-> SetTextureStageState(0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
-			device-> SetTextureStageState(0, D3DTSS_ALPHAOP,   D3DTOP_SELECTARG1);
+			BeginPointSprites(sprite_, particle_size_);
 
 			// Render the contents of the vertex buffer.
-			device-> SetStreamSource(0, points_, 0, sizeof(POINTVERTEX));
-			device-> SetFVF(D3DFVF_POINTVERTEX);
+			if (g_CompactVertices)
+			{
+				SetCompactConstants(device, compact_range_, particle_size_);
+				device-> SetStreamSource(0, points_, 0, sizeof(COMPACT_POINTVERTEX));
+			}
+			else
+			{
+				device-> SetStreamSource(0, points_, 0, sizeof(POINTVERTEX));
+			}
+
 			device-> DrawPrimitive(D3DPT_POINTLIST, 0, alive_particles_);
 
-			// Reset the render states.
-			device-> SetRenderState(D3DRS_POINTSPRITEENABLE, false);
-			device-> SetRenderState(D3DRS_POINTSCALEENABLE,  false);
-			device-> SetRenderState(D3DRS_ALPHABLENDENABLE,  false);
-			device-> SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_DIFFUSE);
-			device-> SetRenderState(D3DRS_ZENABLE, D3DZB_TRUE);
+			EndPointSprites();
 		}
 
+		// The vertices written by the last update, for the pipelined renderer to copy out.
+		const POINTVERTEX *staged_vertices() const { return staging_.data(); }
+		const unsigned char *staged_brightness() const { return staged_brightness_; }
+		int staged_count() const { return staged_count_; }
+
 		int max_particles_;						// The maximum number of particles in this particle system.
 
 		int alive_particles_;					// The number of particles that are currently alive.
 		int max_lifetime_;					    // The start age of each particle (count down from this, kill particle when zero).
 
-		LPDIRECT3DTEXTURE9 particle_texture_;	// The texture for the points.				
+		int sprite_;							// Which sprite to draw the points with - see getTexture().
 		D3DXVECTOR3 origin_;					// Vectors for origin of the particle system.
 
 		float time_increment_;					// Used to increase the value of 'time'for each particle - used to calculate vertical position.
 		float particle_size_;					// Size of the point.
 		bool safeToDelete;
-		std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> nextSystems;
+		std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>, TRACKED_ALLOCATOR<std::shared_ptr<PARTICLE_SYSTEM_BASE>, MEM_CHAINS>> nextSystems;
 		int alpha;
 
+		GROUND_RESPONSE ground_response_;		// What the particles do when they reach g_Ground.
+		float restitution_;						// Vertical speed kept when they bounce off it.
+		int random_stream_;						// Random stream the system draws from - the one current when it was created.
+		unsigned int serial_;					// Unique to this system - identifies it in the live stream (see Stream.h).
+
 	private:
 
+		friend class SHOW_CHECKPOINT;	// Needs raw access to 'particles_' to save/restore the show.
+		friend class BENCHMARK_SUITE;	// Times the protected hot paths in isolation.
+		friend class STREAM_CODEC;		// Rebuilds explosions from their streamed parameters.
+
 		class is_particle_dead			// This is a private class, only available inside 'PARTICLE_SYSTEM_BASE' - functor to determine if a particle is alive or dead.
 		{	
 			public:	
@@ -169,104 +511,507 @@ class PARTICLE_SYSTEM_BASE
 
 	protected:
 
-		std::vector<PARTICLE>::iterator find_next_dead_particle()
+		// Copy the positions of the live particles into 'points', returns the number written.
+		int fill_vertices(POINTVERTEX *points)
+		{
+			int P(0);
+
+			for (PARTICLE_VECTOR::iterator p(particles_.begin()); p != particles_.end(); ++p)
+			{
+				if (p->lifetime_ > 0)
+				{
+					points[P].position_.y = p->position_.y;
+					points[P].position_.x = p->position_.x;
+					points[P].position_.z = p->position_.z;
+					++P;
+				}
+			}
+
+			return P;
+		}
+
+		// Fill the vertex buffer - after the update has been performed, just in case a particle has died in the process.
+		void update_vertex_buffer()
+		{
+			if (g_World->fast_forward_) return;
+
+			// Create a pointer to the first vertex in the buffer
+			// Also lock it, so nothing else can touch it while the values are being inserted.
+			POINTVERTEX *points = lock_vertices();
+
+			unlock_vertices(fill_vertices(points), NULL);
+		}
+
+		// Where to write this frame's vertices - the vertex buffer itself, or the staging
+		// copy when the compact stream is in use. Must be followed by unlock_vertices().
+		POINTVERTEX *lock_vertices()
+		{
+			// Straight into the frame ring's open slot, if it has room for every particle.
+			if (g_FrameRing.writing() && g_World == &g_MainWorld)
+			{
+				ring_vertices_ = (POINTVERTEX *)g_FrameRing.reserve((int)staging_.size());
+				if (ring_vertices_) return ring_vertices_;
+			}
+
+			if (g_CompactVertices || g_PipelinedRender) return staging_.data();
+
+			POINTVERTEX *points;
+			points_->Lock(0, 0, (void**)&points, 0);
+			return points;
+		}
+
+		// Finish writing 'count' vertices. With the compact stream they are quantized into the
+		// vertex buffer here, with 'brightness' per vertex (NULL for full brightness).
+		void unlock_vertices(int count, const unsigned char *brightness)
+		{
+			if (g_FrameRing.writing() && g_World == &g_MainWorld)
+			{
+				// Already in the slot, or copied in from 'staging_' if the slot was short of room.
+				g_FrameRing.commit(sprite_, particle_size_, count, ring_vertices_ ? (const POINTVERTEX *)ring_vertices_ : staging_.data());
+				ring_vertices_ = NULL;
+				staged_count_ = 0;
+				return;
+			}
+
+			if (g_PipelinedRender)
+			{
+				// Left in 'staging_' for the snapshot, which quantizes them itself.
+				staged_count_ = count;
+				staged_brightness_ = brightness;
+				return;
+			}
+
+			if (g_CompactVertices)
+			{
+				compact_range_ = compact_range(&staging_.data()->position_, count, sizeof(POINTVERTEX), origin_);
+
+				COMPACT_POINTVERTEX *points;
+				points_->Lock(0, count * sizeof(COMPACT_POINTVERTEX), (void**)&points, 0);
+				encode_compact_vertices(&staging_.data()->position_, brightness, count, sizeof(POINTVERTEX), compact_range_, points);
+			}
+
+			points_->Unlock();
+		}
+
+		PARTICLE_VECTOR::iterator find_next_dead_particle()
 		{
 			return std::find_if(particles_.begin(), particles_.end(), is_particle_dead());
 		}
 	
 		virtual void start_particles() = 0;
 
-		std::vector<PARTICLE>	particles_;
+		PARTICLE_VECTOR			particles_;
 
 		LPDIRECT3DVERTEXBUFFER9 points_;  // Vertex buffer for the points.
+		std::vector<POINTVERTEX, TRACKED_ALLOCATOR<POINTVERTEX, MEM_STAGING>> staging_;	// Full precision vertices, before they are quantized into 'points_' (compact stream only).
+		COMPACT_RANGE compact_range_;		// How this frame's compact vertices decode.
+		int staged_count_;					// Vertices in 'staging_' (pipelined renderer only).
+		const unsigned char *staged_brightness_;
+		POINTVERTEX *ring_vertices_;		// Room in the frame ring's slot, from lock_vertices() (see FrameRing.h).
 		
 		// Specific implemention to define to policy for starting/creating a single particle.
-		virtual void start_single_particle(std::vector<PARTICLE>::iterator &) = 0;
+		virtual void start_single_particle(PARTICLE_VECTOR::iterator &) = 0;
 
 		//start next system in chain
-		void startNextSystem()
+		void startNextSystem();
+};
+
+void SYSTEM_COMMAND_QUEUE::apply()
+{
+	std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> &systems = g_World->particles_;
+	bool changed = retired_ != 0 || !spawns_.empty();
+
+	compact(systems);
+
+	// Close up the holes the retired systems left, before the new ones go on the top.
+	if (g_World->pool_.fragmented()) g_World->pool_.compact();
+
+	append_spawns(systems);
+
+	if (changed) g_World->buckets_.rebuild(systems);
+}
+
+void SYSTEM_COMMAND_QUEUE::compact(std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> &systems)
+{
+	if (retired_ == 0) return;
+
+	systems.erase(std::remove_if(systems.begin(), systems.end(), is_retired), systems.end());
+	retired_ = 0;
+}
+
+bool SYSTEM_COMMAND_QUEUE::is_retired(const std::shared_ptr<PARTICLE_SYSTEM_BASE> &s)
+{
+	return s->safeToDelete;
+}
+
+void SYSTEM_COMMAND_QUEUE::append_spawns(std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> &systems)
+{
+	if (spawns_.empty()) return;
+
+	for (auto &s : spawns_)
+	{
+		RANDOM_STREAM_SCOPE stream(s->random_stream_);
+		s->initialise();
+	}
+
+	systems.insert(systems.end(), spawns_.begin(), spawns_.end());
+	spawns_.clear();
+}
+
+void PARTICLE_SYSTEM_BASE::startNextSystem()
+{
+	for (auto &s : nextSystems)
+	{
+		s->origin_ = origin_;
+		g_World->queue_.spawn(s);
+	}
+}
+
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+// PARTICLE BEHAVIOURS
+//
+// The particle update of each system type is put together at compile time from
+// behaviour modules, listed in the order they act on a particle:
+//
+//     class FOUNTAIN_CLASS : public PARTICLE_EMITTER<FOUNTAIN_CLASS, BALLISTIC, CLOCK, LIFETIME, FLOOR_KILL>
+//
+// PARTICLE_EMITTER::update_particles() runs one loop over the particles with
+// every module's step() inlined into it, so there is no virtual call and no
+// test for a behaviour the type doesn't have. A module can provide:
+//
+//     force(s, f)         - add its per frame acceleration to 'f', worked out once before the loop.
+//     step(s, p, f)       - act on live particle 'p'. Returns false if it killed the particle,
+//                           which skips the modules after it.
+//     finish(s, p, n)     - act on all 'n' particles at once after the loop, returns the number killed.
+//     ERASES              - dead particles are erased from the array (and counted) on their next
+//                           update instead of having their slots reused.
+//
+// Anything left out comes from BEHAVIOUR_MODULE and does nothing. 's' is the
+// system itself (the DERIVED class), so a module reads whatever settings it
+// needs from it - gravity_, floorY_ and so on.
+//
+// Starting particles goes the same way: emit() calls the derived class's
+// launch(), again without a virtual call per particle. emit(count) starts a
+// whole batch in one pass over the array, rather than searching it from the
+// start again for every particle.
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+
+struct BEHAVIOUR_MODULE
+{
+	enum { ERASES = 0 };
+
+	template <class S> static void force(const S &, D3DXVECTOR3 &) {}
+	template <class S> static bool step(S &, PARTICLE &, const D3DXVECTOR3 &) { return true; }
+	template <class S> static int finish(S &, PARTICLE *, int) { return 0; }
+};
+
+// Constant pull down (or up) the y axis, 'gravity_' a frame.
+struct GRAVITY : BEHAVIOUR_MODULE
+{
+	template <class S> static void force(const S &s, D3DXVECTOR3 &f) { f.y += s.gravity_; }
+};
+
+// The wind along the x axis, 'wind_speed_' a frame.
+struct WIND : BEHAVIOUR_MODULE
+{
+	template <class S> static void force(const S &, D3DXVECTOR3 &f) { f.x += g_World->wind_speed_; }
+};
+
+// Moves the particle on by its velocity plus the forces, every frame.
+struct INERTIA : BEHAVIOUR_MODULE
+{
+	template <class S> static bool step(S &, PARTICLE &p, const D3DXVECTOR3 &f)
+	{
+		p.position_ += p.velocity_ + f;
+		return true;
+	}
+};
+
+// Position worked out from the particle's time - s = ut + gt^2 from the origin (the forces aren't used).
+struct BALLISTIC : BEHAVIOUR_MODULE
+{
+	template <class S> static bool step(S &s, PARTICLE &p, const D3DXVECTOR3 &)
+	{
+		// Vertical distance.
+		float d = (p.velocity_.y * p.time_) + (s.gravity_ * p.time_ * p.time_);
+
+		p.position_.y = d + s.origin_.y;
+		p.position_.x = (p.velocity_.x * p.time_) + s.origin_.x;
+		p.position_.z = (p.velocity_.z * p.time_) + s.origin_.z;
+		return true;
+	}
+};
+
+// Slows the particle down - the system's 'time_increment_' is the fraction of its velocity kept each frame.
+struct DRAG : BEHAVIOUR_MODULE
+{
+	template <class S> static bool step(S &s, PARTICLE &p, const D3DXVECTOR3 &)
+	{
+		p.velocity_ *= s.time_increment_;
+		return true;
+	}
+};
+
+// Advances the particle's time.
+struct CLOCK : BEHAVIOUR_MODULE
+{
+	template <class S> static bool step(S &s, PARTICLE &p, const D3DXVECTOR3 &)
+	{
+		p.time_ += s.time_increment_;
+		return true;
+	}
+};
+
+// Counts the particle's lifetime down, and kills it at zero (its slot is reused by the next particle started).
+struct LIFETIME : BEHAVIOUR_MODULE
+{
+	template <class S> static bool step(S &s, PARTICLE &p, const D3DXVECTOR3 &)
+	{
+		if (--(p.lifetime_) > 0) return true;
+
+		--s.alive_particles_;
+		return false;
+	}
+};
+
+// Counts the particle's lifetime down - at zero it is erased from the array on the next update.
+struct LIFETIME_ERASE : BEHAVIOUR_MODULE
+{
+	enum { ERASES = 1 };
+
+	template <class S> static bool step(S &, PARTICLE &p, const D3DXVECTOR3 &)
+	{
+		return --(p.lifetime_) > 0;
+	}
+};
+
+// Kills particles that drop below 'floorY_', if 'terminate_on_floor_' is set.
+struct FLOOR_KILL : BEHAVIOUR_MODULE
+{
+	template <class S> static bool step(S &s, PARTICLE &p, const D3DXVECTOR3 &)
+	{
+		if (!s.terminate_on_floor_ || p.position_.y >= s.floorY_) return true;
+
+		p.lifetime_ = 0;
+		--s.alive_particles_;
+		return false;
+	}
+};
+
+// Collides every particle with g_Ground after they have moved (see GROUND_COLLIDER::collide()).
+struct GROUND : BEHAVIOUR_MODULE
+{
+	template <class S> static int finish(S &s, PARTICLE *p, int n)
+	{
+		return g_Ground.collide(p, n, s.ground_response_, s.restitution_);
+	}
+};
+
+//-----------------------------------------------------------------------------
+// A list of modules, applied in order.
+
+template <class... MODULES> struct BEHAVIOUR;
+
+template <> struct BEHAVIOUR<> : BEHAVIOUR_MODULE {};
+
+template <class MODULE, class... REST>
+struct BEHAVIOUR<MODULE, REST...>
+{
+	enum { ERASES = MODULE::ERASES || BEHAVIOUR<REST...>::ERASES };
+
+	template <class S> static void force(const S &s, D3DXVECTOR3 &f)
+	{
+		MODULE::force(s, f);
+		BEHAVIOUR<REST...>::force(s, f);
+	}
+
+	template <class S> static bool step(S &s, PARTICLE &p, const D3DXVECTOR3 &f)
+	{
+		return MODULE::step(s, p, f) && BEHAVIOUR<REST...>::step(s, p, f);
+	}
+
+	template <class S> static int finish(S &s, PARTICLE *p, int n)
+	{
+		int killed = MODULE::finish(s, p, n);
+		return killed + BEHAVIOUR<REST...>::finish(s, p, n);
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Storage for the system objects of type T. They are made SYSTEM_SLAB_COUNT at
+// a time in one block, so systems of one type sit side by side in memory
+// rather than wherever the heap put each one, and a finished system's place is
+// given to the next one made - usually the next frame - while it is still in
+// the cache. The blocks are kept for the rest of the run, and charged to
+// MEM_SYSTEMS as they are made. Every show shares them, so they are locked -
+// only for the moment it takes to make or finish a system.
+
+#define SYSTEM_SLAB_COUNT	64		// Systems in each block.
+
+template <class T>
+class SYSTEM_SLAB
+{
+	public:
+		static void *allocate()
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			if (!free_) grow();
+
+			SLOT *s = free_;
+			free_ = s->next_;
+
+			// Cleared - not every member is set by the constructors, and what a system saves
+			// in a checkpoint shouldn't depend on which system had the slot before it.
+			memset(s, 0, sizeof(SLOT));
+			return s;
+		}
+
+		static void release(void *p)
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			SLOT *s = (SLOT *)p;
+			s->next_ = free_;
+			free_ = s;
+		}
+
+	private:
+		union SLOT
+		{
+			SLOT *next_;					// While it is free.
+			char object_[sizeof(T)];
+			double align_;
+		};
+
+		static void grow()
 		{
-			for (auto s : nextSystems)
+			SLOT *block = (SLOT *)::operator new(SYSTEM_SLAB_COUNT * sizeof(SLOT));
+			g_Memory.allocated(MEM_SYSTEMS, SYSTEM_SLAB_COUNT * sizeof(SLOT));
+
+			// In address order, so a run of new systems fills the block front to back.
+			for (int i = SYSTEM_SLAB_COUNT; i-- > 0;)
 			{
-				s->origin_ = origin_;
-				s->initialise();
-				g_Particles.push_back(s);
+				block[i].next_ = free_;
+				free_ = &block[i];
 			}
 		}
+
+		static SLOT *free_;
+		static std::mutex lock_;
 };
 
-//-----------------------------------------------------------------------------------------------------------------------------------------------------
+template <class T> typename SYSTEM_SLAB<T>::SLOT *SYSTEM_SLAB<T>::free_ = NULL;
+template <class T> std::mutex SYSTEM_SLAB<T>::lock_;
 
-class FOUNTAIN_CLASS : public PARTICLE_SYSTEM_BASE
+//-----------------------------------------------------------------------------
+// Base for the system types built from modules. DERIVED provides launch(PARTICLE &)
+// to set up a particle as it starts.
+
+template <class DERIVED, class... MODULES>
+class PARTICLE_EMITTER : public PARTICLE_SYSTEM_BASE
 {
 	public:
-		FOUNTAIN_CLASS() : PARTICLE_SYSTEM_BASE(), gravity_(0), terminate_on_floor_(false), floorY_(0) {}
+		typedef BEHAVIOUR<MODULES...> BEHAVIOURS;
 
-		// Update the positions of the particles, and start new particles if necessary.
-		void update()
+		// Each type comes from its own SYSTEM_SLAB.
+		static void *operator new(size_t bytes)
 		{
-			// Start particles, if necessary...
-			start_particles();
+			return bytes == sizeof(DERIVED) ? SYSTEM_SLAB<DERIVED>::allocate() : PARTICLE_SYSTEM_BASE::operator new(bytes);
+		}
 
-			// Update the particles that are still alive...
-			for (std::vector<PARTICLE>::iterator p(particles_.begin()); p != particles_.end(); ++p)
+		static void operator delete(void *p, size_t bytes)
+		{
+			if (bytes == sizeof(DERIVED)) SYSTEM_SLAB<DERIVED>::release(p);
+			else PARTICLE_SYSTEM_BASE::operator delete(p, bytes);
+		}
+
+	protected:
+
+		// Move every live particle on a frame.
+		void update_particles()
+		{
+			DERIVED &self = static_cast<DERIVED &>(*this);
+
+			D3DXVECTOR3 f(0, 0, 0);
+			BEHAVIOURS::force(self, f);
+
+			for (int i = 0; i < (int)particles_.size(); ++i)
 			{
-				if (p -> lifetime_ > 0)	// Update only if this particle is alive.
+				PARTICLE &p = particles_[i];
+
+				if (p.lifetime_ > 0)	// Update only if this particle is alive.
+				{
+					BEHAVIOURS::step(self, p, f);
+				}
+				else if (BEHAVIOURS::ERASES)
 				{
-					--(p->lifetime_);
-					// Calculate the new position of the particle...
-
-					// Vertical distance.
-					float s = (p -> velocity_.y * p -> time_) + (gravity_ * p -> time_ * p -> time_);
-
-					p -> position_.y = s + origin_.y;
-					p -> position_.x = (p -> velocity_.x * p -> time_) + origin_.x;
-					p -> position_.z = (p -> velocity_.z * p -> time_) + origin_.z;
-
-					p -> time_ += time_increment_;
-					
-
-					if (p -> lifetime_ == 0)	// Has this particle come to the end of it's life?
-					{
-						--alive_particles_;		// If so, terminate it.
-					}
-					else
-					{
-						if (terminate_on_floor_)	// or has the particle hit the floor? if so, terminate it. Flag to determine if to do this.
-						{
-							if (p -> position_.y < floorY_)
-							{
-								p -> lifetime_ = 0;
-								--alive_particles_;
-							}
-						}
-					}
+					particles_.erase(particles_.begin() + i);	//remove the particle, its no longer needed.
+					--alive_particles_;
 				}
 			}
 
-			// Create a pointer to the first vertex in the buffer
-			// Also lock it, so nothing else can touch it while the values are being inserted.
-			POINTVERTEX *points;
-			points_ -> Lock(0, 0, (void**)&points, 0);
+			if (!particles_.empty())
+			{
+				int killed = BEHAVIOURS::finish(self, &particles_[0], (int)particles_.size());
 
-			// Fill the vertex buffers with data...
-			int P(0);
+				// When dead particles are erased, those killed here are removed (and counted) with the rest next frame.
+				if (!BEHAVIOURS::ERASES) alive_particles_ -= killed;
+			}
+		}
 
-			// Now update the vertex buffer - after the update has been
-			// performed, just in case this particle has died in the process.
+		// Start up to 'count' particles in the first dead slots. Returns the number started.
+		int emit(int count)
+		{
+			DERIVED &self = static_cast<DERIVED &>(*this);
 
-			for (std::vector<PARTICLE>::iterator p(particles_.begin()); p != particles_.end(); ++p)
+			int started = 0;
+			for (PARTICLE_VECTOR::iterator p(particles_.begin()); p != particles_.end() && started < count; ++p)
 			{
-				if (p -> lifetime_ > 0)
+				if (p->lifetime_ == 0)
 				{
-					points[P].position_.y = p -> position_.y;
-					points[P].position_.x = p -> position_.x;
-					points[P].position_.z = p -> position_.z;
-					++P;
+					self.launch(*p);
+					++started;
 				}
 			}
 
-			points_ -> Unlock();
+			alive_particles_ += started;
+			return started;
+		}
+
+		// Start particle 'p' (from find_next_dead_particle()).
+		void emit(PARTICLE_VECTOR::iterator p)
+		{
+			if (p == particles_.end()) return;	// Safety net - if there are no dead particles, don't start any new ones...
+
+			static_cast<DERIVED &>(*this).launch(*p);
+
+			++alive_particles_;
+		}
+
+		virtual void start_single_particle(PARTICLE_VECTOR::iterator &p)	// Initialise/start particle 'p'.
+		{
+			emit(p);
+		}
+};
+
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+
+class FOUNTAIN_CLASS : public PARTICLE_EMITTER<FOUNTAIN_CLASS, BALLISTIC, CLOCK, LIFETIME, FLOOR_KILL>
+{
+	public:
+		FOUNTAIN_CLASS() : gravity_(0), terminate_on_floor_(false), floorY_(0) {}
+
+		SYSTEM_TYPE type() const { return SYSTEM_FOUNTAIN; }
+
+		// Update the positions of the particles, and start new particles if necessary.
+		void update()
+		{
+			// Start particles, if necessary...
+			start_particles();
+
+			// Update the particles that are still alive...
+			update_particles();
+
+			update_vertex_buffer();
 		}
 
 		bool  terminate_on_floor_;		// Flag to indicate that particles will die when they hit the floor (floorY_).
@@ -274,40 +1019,49 @@ class FOUNTAIN_CLASS : public PARTICLE_SYSTEM_BASE
 
 	private:
 
-		virtual void start_single_particle(std::vector<PARTICLE>::iterator &p)	// Initialise/start particle 'p'.
-		{
-			if (p == particles_.end()) return;	// Safety net - if there are no dead particles, don't start any new ones...
+		friend class PARTICLE_EMITTER<FOUNTAIN_CLASS, BALLISTIC, CLOCK, LIFETIME, FLOOR_KILL>;
+		friend class BENCHMARK_SUITE;
 
+		void launch(PARTICLE &p)	// Initialise/start particle 'p'.
+		{
 			// Reset the particle's time (for calculating it's position with s = ut+0.5t*t)
-			p -> time_ = 0;
+			p.time_ = 0;
 
 			// Now calculate the particle's horizontal and depth components.
 			// The particle can be ejected at a random angle, around a circle.
-			float direction_angle = (float)(D3DXToRadian(random_number()));
+			const CIRCLE_DIRECTION &direction = g_Directions.circle(random_number());
 
 			// Calculate the vertical component of velocity.
-			p -> velocity_.y = launch_velocity_ * (float)sin(launch_angle_);
+			p.velocity_.y = launch_velocity_ * (float)sin(launch_angle_);
 
 			// Calculate the horizontal components of velocity.
 			// This is X and Z dimensions.
-			p -> velocity_.x = launch_velocity_ * (float)cos(launch_angle_) * (float)cos(direction_angle);
-			p -> velocity_.z = launch_velocity_ * (float)cos(launch_angle_) * (float)sin(direction_angle);
+			p.velocity_.x = launch_velocity_ * (float)cos(launch_angle_) * direction.cos_;
+			p.velocity_.z = launch_velocity_ * (float)cos(launch_angle_) * direction.sin_;
 
-			p -> lifetime_ = max_lifetime_;
-
-			++alive_particles_;
+			p.lifetime_ = max_lifetime_;
 		}
 };
 
 //-----------------------------------------------------------------------------------------------------------------------------------------------------
 
-class FIREWORK_EXPLOSION_CLASS : public PARTICLE_SYSTEM_BASE
+class FIREWORK_EXPLOSION_CLASS : public PARTICLE_EMITTER<FIREWORK_EXPLOSION_CLASS, GRAVITY, WIND, INERTIA, DRAG, CLOCK, LIFETIME_ERASE, GROUND>
 {
 public:
-	FIREWORK_EXPLOSION_CLASS() : PARTICLE_SYSTEM_BASE(), gravity_(0), terminate_on_floor_(false), floorY_(0) {}
+	FIREWORK_EXPLOSION_CLASS() : gravity_(0), terminate_on_floor_(false), floorY_(0), packed_(false), packed_count_(0) {}
+
+	SYSTEM_TYPE type() const { return SYSTEM_EXPLOSION; }
 
 	HRESULT initialise()
 	{
+		// Kept packed between updates, if asked for and the lifetimes fit (see CompactParticle.h).
+		if (g_CompactParticles && max_lifetime_ <= COMPACT_PARTICLE_MAX_LIFE)
+		{
+			HRESULT temp = create_vertex_buffer(max_particles_);
+			start_packed();
+			return temp;
+		}
+
 		HRESULT temp = PARTICLE_SYSTEM_BASE::initialise();
 		start_particles();
 		return temp;	
@@ -316,55 +1070,17 @@ public:
 	// Update the positions of the particles, and start new particles if necessary.
 	void update()
 	{
-		// Update the particles that are still alive...
-		//for (std::vector<PARTICLE>::iterator p(particles_.begin()); p != particles_.end(); ++p)
-		for(int i = 0; i < particles_.size(); ++i)
+		// Update the particles that are still alive, erasing the dead ones...
+		if (packed_)
 		{
-			if (particles_[i].lifetime_ > 0)	// Update only if this particle is alive.
-			{
-				// Calculate the new position of the particle...
-				particles_[i].position_.y += particles_[i].velocity_.y + gravity_;
-				particles_[i].position_.x += particles_[i].velocity_.x + windSpeed;
-				particles_[i].position_.z += particles_[i].velocity_.z;
-
-				particles_[i].velocity_.y *= time_increment_;
-				particles_[i].velocity_.x *= time_increment_;
-				particles_[i].velocity_.z *= time_increment_;
-
-				particles_[i].time_ += time_increment_;
-				--(particles_[i].lifetime_);
-			}
-			else
-			{
-				particles_.erase(particles_.begin()+i);	//remove the particle, its no longer needed.
-				--alive_particles_;
-			}
+			update_packed();
 		}
-		
-
-		// Create a pointer to the first vertex in the buffer
-		// Also lock it, so nothing else can touch it while the values are being inserted.
-		POINTVERTEX *points;
-		points_->Lock(0, 0, (void**)&points, 0);
-
-		// Fill the vertex buffers with data...
-		int P(0);
-
-		// Now update the vertex buffer - after the update has been
-		// performed, just in case this particle has died in the process.
-
-		for (std::vector<PARTICLE>::iterator p(particles_.begin()); p != particles_.end(); ++p)
+		else
 		{
-			if (p->lifetime_ > 0)
-			{
-				points[P].position_.y = p->position_.y;
-				points[P].position_.x = p->position_.x;
-				points[P].position_.z = p->position_.z;
-				++P;
-			}
-		}
+			update_particles();
 
-		points_->Unlock();
+			update_vertex_buffer();
+		}
 
 		if (alive_particles_ <= 0)
 		{
@@ -375,10 +1091,40 @@ public:
 	void start_particles()
 	{
 		// start all the particles
-		for (int i(0); i < max_particles_; ++i)
-		{
-			if (alive_particles_ < max_particles_) start_single_particle(find_next_dead_particle());
-		}
+		emit(max_particles_ - alive_particles_);
+	}
+
+	// Updates since the burst, from the particles' clocks - they all started together (see CLOCK).
+	float age() const
+	{
+		if (packed_) return packed_count_ > 0 && time_increment_ > 0 ? (float)(packed_particles()[0].lifetime_ & 0xFF) : 0;
+
+		if (particles_.empty() || time_increment_ <= 0) return 0;
+		return (particles_[0].time_ - 1) / time_increment_;
+	}
+
+	// True if the particles are kept as COMPACT_PARTICLEs rather than in 'particles_'.
+	bool packed() const { return packed_; }
+
+	// The packed particles as PARTICLEs, for a checkpoint.
+	void unpack(std::vector<PARTICLE> &out) const
+	{
+		out.resize(packed_count_);
+		if (packed_count_ > 0) decode_compact_particles(packed_particles(), packed_count_, packed_frame(), &out[0]);
+	}
+
+	// Pack the particles a checkpoint has put in 'particles_', if explosions are being kept packed.
+	void pack()
+	{
+		if (!g_CompactParticles || max_lifetime_ > COMPACT_PARTICLE_MAX_LIFE) return;
+
+		packed_ = true;
+		packed_count_ = (int)particles_.size();
+		packed_range_.resize((packed_count_ + 1) / 2);
+		if (packed_count_ > 0) encode_compact_particles(&particles_[0], packed_count_, packed_frame(), packed_particles());
+
+		particles_.clear();
+		particles_.release_room();
 	}
 
 	bool  terminate_on_floor_;		// Flag to indicate that particles will die when they hit the floor (floorY_).
@@ -386,187 +1132,369 @@ public:
 
 private:
 
-	virtual void start_single_particle(std::vector<PARTICLE>::iterator &p)	// Initialise/start particle 'p'.
-	{
-		if (p == particles_.end()) return;	// Safety net - if there are no dead particles, don't start any new ones...
+	friend class PARTICLE_EMITTER<FIREWORK_EXPLOSION_CLASS, GRAVITY, WIND, INERTIA, DRAG, CLOCK, LIFETIME_ERASE, GROUND>;
+	friend class BENCHMARK_SUITE;
 
+	void launch(PARTICLE &p)	// Initialise/start particle 'p'.
+	{
 		// Reset the particle's time (for calculating it's position with s = ut+0.5t*t)
-		p->time_ = 1;
+		p.time_ = 1;
 
-		// Now calculate the particle's horizontal and depth components.
-		// The particle can be ejected at a random angle, around a sphere.
-		float direction_angle = (float)(D3DXToRadian(random_number()));
-		float launch_angle_ = (float)(D3DXToRadian(random_number()));
+		// The particle is ejected in a random direction, evenly over a sphere.
+		const D3DXVECTOR3 &direction = g_Directions.sphere(random_number());
 
 		float mod = ((float)random_number(95, 105)) / 100.0f;
 
-		// Calculate the vertical component of velocity.
-		p->velocity_.y = (launch_velocity_ * (float)sin(launch_angle_))*mod;
-
-		// Calculate the horizontal components of velocity.
-		// This is X and Z dimensions.
-		p->velocity_.x = (launch_velocity_ * (float)cos(launch_angle_) * (float)cos(direction_angle))*mod;
-		p->velocity_.z = (launch_velocity_ * (float)cos(launch_angle_) * (float)sin(direction_angle))*mod;
+		p.velocity_ = direction * (launch_velocity_ * mod);
 
 		//have random lifetime
 		int n = random_number(0, max_lifetime_);
 
 		//set initial position
-		p->position_ = origin_;
-
-		p->lifetime_ = n;
+		p.position_ = origin_;
 
-		++alive_particles_;
+		p.lifetime_ = n;
 	}
-};
 
-//-----------------------------------------------------------------------------------------------------------------------------------------------------
+	//-------------------------------------------------------------------------
+	// Packed particles. Two COMPACT_PARTICLEs take the room of one PARTICLE in the pool.
 
-class FIREWORK_ROCKET_CLASS : public PARTICLE_SYSTEM_BASE
-{
-public:
-	FIREWORK_ROCKET_CLASS() : PARTICLE_SYSTEM_BASE(), gravity_(0), terminate_on_floor_(false), floorY_(0), activated(false) {}
+	COMPACT_PARTICLE *packed_particles() { return (COMPACT_PARTICLE *)packed_range_.data(); }
+	const COMPACT_PARTICLE *packed_particles() const { return (const COMPACT_PARTICLE *)packed_range_.data(); }
 
-	// Update the positions of the particles, and start new particles if necessary.
-	void update()
+	COMPACT_PARTICLE_FRAME packed_frame() const
+	{
+		COMPACT_PARTICLE_FRAME frame;
+		frame.origin_ = origin_;
+		frame.start_time_ = 1;		// As launch() sets it.
+		frame.time_increment_ = time_increment_;
+		return frame;
+	}
+
+	// Start every particle, as start_particles() does, a block at a time straight into the packed array.
+	void start_packed()
 	{
-		// Start particles, if necessary...
-		//and if rocket is still alive
-		if (rocketTime > 0)
+		packed_ = true;
+		packed_range_.resize((max_particles_ + 1) / 2);
+
+		COMPACT_PARTICLE_FRAME frame = packed_frame();
+		PARTICLE block[COMPACT_PARTICLE_BLOCK];
+
+		for (int first = 0; first < max_particles_; first += COMPACT_PARTICLE_BLOCK)
 		{
-			start_particles();
+			int n = max_particles_ - first < COMPACT_PARTICLE_BLOCK ? max_particles_ - first : COMPACT_PARTICLE_BLOCK;
+
+			for (int i = 0; i < n; ++i) launch(block[i]);
+			encode_compact_particles(block, n, frame, packed_particles() + first);
 		}
 
-		// Update the particles that are still alive...
-		for (std::vector<PARTICLE>::iterator p(particles_.begin()); p != particles_.end(); ++p)
+		packed_count_ = max_particles_;
+		alive_particles_ = max_particles_;
+	}
+
+	// update_particles() and update_vertex_buffer() in one pass, decoding a block of particles onto
+	// the stack at a time and encoding what is left of it back behind the last.
+	void update_packed()
+	{
+		COMPACT_PARTICLE_FRAME frame = packed_frame();
+		COMPACT_PARTICLE *packed = packed_particles();
+
+		D3DXVECTOR3 f(0, 0, 0);
+		BEHAVIOURS::force(*this, f);
+
+		POINTVERTEX *points = g_World->fast_forward_ ? NULL : lock_vertices();
+		int P = 0, kept = 0;
+
+		// update_particles() passes over the particle after each one it erases - the same ones are left here.
+		bool pass = false;
+
+		PARTICLE block[COMPACT_PARTICLE_BLOCK];
+		for (int first = 0; first < packed_count_; first += COMPACT_PARTICLE_BLOCK)
 		{
-			if (p->lifetime_ > 0)	// Update only if this particle is alive.
+			int n = packed_count_ - first < COMPACT_PARTICLE_BLOCK ? packed_count_ - first : COMPACT_PARTICLE_BLOCK;
+			decode_compact_particles(packed + first, n, frame, block);
+
+			int live = 0;
+			for (int i = 0; i < n; ++i)
 			{
-				p->position_ += p->velocity_;
-				p->position_.x += windSpeed;
+				if (pass)
+				{
+					pass = false;
+				}
+				else if (block[i].lifetime_ > 0)
+				{
+					BEHAVIOURS::step(*this, block[i], f);
+				}
+				else
+				{
+					--alive_particles_;		// Erased - not written back.
+					pass = true;
+					continue;
+				}
+
+				block[live++] = block[i];
+			}
 
-				p->time_ += time_increment_;
-				--(p->lifetime_);
+			// Those killed here are erased (and counted) next update, as in update_particles().
+			BEHAVIOURS::finish(*this, block, live);
 
-				if (p->lifetime_ == 0)	// Has this particle come to the end of it's life?
+			if (points)
+			{
+				for (int i = 0; i < live; ++i)
 				{
-					--alive_particles_;		// If so, terminate it.
+					if (block[i].lifetime_ > 0) points[P++].position_ = block[i].position_;
 				}
 			}
+
+			encode_compact_particles(block, live, frame, packed + kept);
+			kept += live;
 		}
 
-		// Create a pointer to the first vertex in the buffer
-		// Also lock it, so nothing else can touch it while the values are being inserted.
-		POINTVERTEX *points;
-		points_->Lock(0, 0, (void**)&points, 0);
+		packed_count_ = kept;
+		packed_range_.resize((kept + 1) / 2);
 
-		// Fill the vertex buffers with data...
-		int P(0);
+		if (points) unlock_vertices(P, NULL);
+	}
+
+	bool packed_;					// The particles are in 'packed_range_', not 'particles_'.
+	int packed_count_;				// Particles in 'packed_range_'.
+	PARTICLE_VECTOR packed_range_;	// (packed_count_ + 1) / 2 PARTICLEs' room in the pool, holding COMPACT_PARTICLEs.
+};
+
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+
+class FIREWORK_ROCKET_CLASS : public PARTICLE_EMITTER<FIREWORK_ROCKET_CLASS, WIND, INERTIA, CLOCK, LIFETIME, GROUND>
+{
+public:
+	FIREWORK_ROCKET_CLASS() : gravity_(0), terminate_on_floor_(false), floorY_(0), ribbon_trail_(false), trail_sparks_(2), activated(false), timers_(&g_World->timers_), trail_head_(0), trail_count_(0), trail_clock_(0) {}
 
-		// Now update the vertex buffer - after the update has been
-		// performed, just in case this particle has died in the process.
+	~FIREWORK_ROCKET_CLASS()
+	{
+		timers_->cancel(fuse_);
+		timers_->cancel(burst_);
+	}
+
+	SYSTEM_TYPE type() const { return SYSTEM_ROCKET; }
+
+	HRESULT initialise()
+	{
+		// Light the fuse - it burns for another 'rocketTime' updates, and the rocket goes off on the one after.
+		timers_->cancel(fuse_);
+		if (!activated) fuse_ = timers_->schedule((unsigned int)rocketTime + 1, [this]() { RANDOM_STREAM_SCOPE stream(random_stream_); explode(); });
 
-		for (std::vector<PARTICLE>::iterator p(particles_.begin()); p != particles_.end(); ++p)
+		if (!ribbon_trail_)
 		{
-			if (p->lifetime_ > 0)
-			{
-				points[P].position_.y = p->position_.y;
-				points[P].position_.x = p->position_.x;
-				points[P].position_.z = p->position_.z;
-				++P;
-			}
+			// The first batch of trail particles goes after 'start_timer_' updates.
+			timers_->cancel(burst_);
+			if (!activated) burst_ = timers_->schedule(start_timer_ + 1, [this]() { RANDOM_STREAM_SCOPE stream(random_stream_); start_particles(); });
+
+			return PARTICLE_SYSTEM_BASE::initialise();
 		}
 
-		points_->Unlock();
+		// No particles - just the path history, one node for each frame a trail particle would have lived.
+		// Cleared by hand - D3DXVECTOR3 doesn't clear itself, and the slots not yet used are saved in checkpoints.
+		TRAIL_NODE blank;
+		ZeroMemory(&blank, sizeof(blank));
+		trail_.assign(max_lifetime_, blank);
+		trail_velocity_.assign(max_lifetime_ * trail_sparks_, D3DXVECTOR3(0, 0, 0));
+		trail_head_ = trail_count_ = 0;
 
-		//move the rocket up along the y axis a little
-		origin_ += RocketVel;
-		origin_.x += windSpeed;
+		return create_vertex_buffer(max_lifetime_ * trail_sparks_);
+	}
 
-		//check if time to explode
-		if (!activated)
+	// Update the positions of the particles, and start new particles if necessary.
+	void update()
+	{
+		if (ribbon_trail_)
 		{
-			if (rocketTime > 0)
-			{
-				--rocketTime;
-			}
-			else
-			{
-				activated = true;
-				startNextSystem();
-			}
+			update_trail();
 		}
 		else
 		{
-			if (alive_particles_ == 0)
-			{
-				safeToDelete = true;
-			}
+			// New particles are started by the burst timer (see start_particles()).
+
+			// Update the particles that are still alive...
+			update_particles();
+
+			update_vertex_buffer();
+		}
+
+		//move the rocket up along the y axis a little
+		origin_ += RocketVel;
+		origin_.x += g_World->wind_speed_;
+
+		//the fuse timer sets it off (see explode()), after that just wait for the trail to die
+		if (activated && alive_particles_ == 0)
+		{
+			safeToDelete = true;
 		}
-			
 	}
 
+	// Burst timer - start a batch of particles and set up the next one, for as long as the rocket is burning.
 	void start_particles()
 	{
-		// Only start a new particle when the time is right and there are enough dead (inactive) particles.
-		if (start_timer_ == 0 && alive_particles_ < max_particles_)
+		// Only start particles when there are enough dead (inactive) particles.
+		if (alive_particles_ < max_particles_)
 		{
 			// Number of particles to start in this batch...
-			for (int i(0); i < start_particles_; ++i)
-			{
-				if (alive_particles_ < max_particles_) start_single_particle(find_next_dead_particle());
-			}
-
-			// Reset the start timer for the next batch of particles.
-			start_timer_ = start_interval_;
-		}
-		else
-		{
-			// Otherwise decrease the start timer.
-			--start_timer_;
+			emit(start_particles_ < max_particles_ - alive_particles_ ? start_particles_ : max_particles_ - alive_particles_);
 		}
+
+		// The next batch goes 'start_interval_' updates after this one.
+		if (!activated) burst_ = timers_->schedule(start_interval_ + 1, [this]() { RANDOM_STREAM_SCOPE stream(random_stream_); start_particles(); });
+	}
+
+	// Fuse timer - the rocket has burnt out, start the next systems in the chain.
+	void explode()
+	{
+		activated = true;
+		timers_->cancel(burst_);
+		startNextSystem();
+	}
+
+	// Updates left before the fuse burns out, as 'rocketTime' counted down.
+	float fuse_remaining() const
+	{
+		return timers_->live(fuse_) ? (float)(timers_->remaining(fuse_) - 1) : 0.0f;
+	}
+
+	// Updates until the next burst, as 'start_timer_' counted down.
+	int burst_remaining() const
+	{
+		return timers_->live(burst_) ? (int)timers_->remaining(burst_) - 1 : 0;
 	}
 
 	bool  terminate_on_floor_;		// Flag to indicate that particles will die when they hit the floor (floorY_).
 	float gravity_, floorY_, launch_velocity_;
-	float rocketTime;
+	float rocketTime;						// Length of the fuse in updates, from initialise() - see fuse_remaining() after that.
 	D3DXVECTOR3 RocketVel;
 
 	int start_particles_;					// Number of particles to start in each batch.
-	int start_timer_;						// Count-down timer, start another particle when zero.		
-	int start_interval_;		     		// Interval between starting a new particle (used to initialise 'start_timer_').
+	int start_timer_;						// Updates before the first batch, from initialise() - see burst_remaining() after that.
+	int start_interval_;		     		// Interval between starting a new particle.
+
+	bool ribbon_trail_;						// Draw the trail from the rocket's path history instead of emitting particles.
+	int  trail_sparks_;						// Number of sparks drawn for each node of the path history.
 
 private:
 
-	bool activated;
+	friend class PARTICLE_EMITTER<FIREWORK_ROCKET_CLASS, WIND, INERTIA, CLOCK, LIFETIME, GROUND>;
+	friend class SHOW_CHECKPOINT;
+	friend class BENCHMARK_SUITE;
 
-	virtual void start_single_particle(std::vector<PARTICLE>::iterator &p)	// Initialise/start particle 'p'.
+	bool activated;
+	TIMER_ID fuse_;							// Goes off when the rocket explodes.
+	TIMER_ID burst_;						// Next batch of trail particles (not used by the ribbon trail).
+	TIMER_WHEEL *timers_;					// The wheel 'fuse_' and 'burst_' are on - the show's that was current when the rocket was made.
+
+	// Ring buffer of the rocket's last 'max_lifetime_' origins, and 'trail_sparks_' drift velocities for each.
+	std::vector<TRAIL_NODE, TRACKED_ALLOCATOR<TRAIL_NODE, MEM_PARTICLES>>   trail_;
+	std::vector<D3DXVECTOR3, TRACKED_ALLOCATOR<D3DXVECTOR3, MEM_PARTICLES>> trail_velocity_;
+	std::vector<unsigned char, TRACKED_ALLOCATOR<unsigned char, MEM_STAGING>> trail_shade_;	// Brightness of each spark (compact stream only).
+	int trail_head_;						// Slot the next node is written to.
+	int trail_count_;						// Number of nodes in the ring.
+	int trail_clock_;						// Number of trail updates so far (ages the nodes).
+
+	// Velocity of a trail particle leaving the rocket.
+	D3DXVECTOR3 trail_velocity()
 	{
-		if (p == particles_.end()) return;	// Safety net - if there are no dead particles, don't start any new ones...
-
-											// Reset the particle's time (for calculating it's position with s = ut+0.5t*t)
-		p->time_ = 0;
-
-		//set initial position
-		p->position_ = origin_;
-
 		// Now calculate the particle's horizontal and depth components.
-		// The particle can be ejected at a random angle, around a sphere.
-		float direction_angle = (float)(D3DXToRadian(random_number(85, 95)));
-		float launch_angle_ = (float)(D3DXToRadian(random_number(0, 50)));
+		// The particle can be ejected at a random angle, in a narrow fan (whole degrees).
+		unsigned int direction_angle = random_number(85, 95);
+		unsigned int launch_angle_ = random_number(0, 50);
+
+		D3DXVECTOR3 v;
 
 		// Calculate the vertical component of velocity.
 		//p->velocity_.y = ((float)random_number(200, 300)) / 100 * -1;
-		p->velocity_.y = launch_velocity_ * (float)sin(launch_angle_);
+		v.y = launch_velocity_ * g_Directions.sin_degrees(launch_angle_);
 
 		// Calculate the horizontal components of velocity.
 		// This is X and Z dimensions.
-		p->velocity_.x = launch_velocity_ * (float)cos(launch_angle_) * (float)cos(direction_angle);
-		p->velocity_.z = launch_velocity_ * (float)cos(launch_angle_) * (float)sin(direction_angle);
+		v.x = launch_velocity_ * g_Directions.cos_degrees(launch_angle_) * g_Directions.cos_degrees(direction_angle);
+		v.z = launch_velocity_ * g_Directions.cos_degrees(launch_angle_) * g_Directions.sin_degrees(direction_angle);
+
+		return v;
+	}
+
+	// Record the rocket's position, retire nodes older than a trail particle's lifetime and
+	// draw each node's sparks where the equivalent particles would be by now. A particle
+	// moves in a straight line plus the wind, so its position follows directly from its age.
+	void update_trail()
+	{
+		++trail_clock_;
+
+		int capacity = (int)trail_.size();
+		if (capacity == 0) return;
+
+		if (!activated)
+		{
+			TRAIL_NODE &n = trail_[trail_head_];
+			n.position_ = origin_;
+			n.wind_ = g_World->wind_drift_ - g_World->wind_speed_;
+			n.born_ = trail_clock_;
+
+			for (int k = 0; k < trail_sparks_; ++k)
+			{
+				trail_velocity_[trail_head_ * trail_sparks_ + k] = trail_velocity();
+			}
+
+			trail_head_ = (trail_head_ + 1) % capacity;
+			if (trail_count_ < capacity) ++trail_count_;
+		}
+
+		// Oldest first - drop the nodes whose sparks would have died.
+		int first = (trail_head_ - trail_count_ + capacity) % capacity;
+		while (trail_count_ > 0 && trail_clock_ - trail_[first].born_ >= max_lifetime_)
+		{
+			first = (first + 1) % capacity;
+			--trail_count_;
+		}
+
+		if (g_World->fast_forward_)
+		{
+			alive_particles_ = trail_count_ * trail_sparks_;
+			return;
+		}
+
+		POINTVERTEX *points = lock_vertices();
+
+		// The compact stream can fade the sparks out as they age.
+		if (g_CompactVertices) trail_shade_.resize(trail_.size() * trail_sparks_);
+
+		int P(0);
+		for (int i = 0, slot = first; i < trail_count_; ++i, slot = (slot + 1) % capacity)
+		{
+			const TRAIL_NODE &n = trail_[slot];
+			float age = (float)(trail_clock_ - n.born_ + 1);
+			float drift = g_World->wind_drift_ - n.wind_;
+			unsigned char shade = (unsigned char)(255 - 255 * (int)(age - 1) / max_lifetime_);
+
+			for (int k = 0; k < trail_sparks_; ++k)
+			{
+				points[P].position_ = n.position_ + trail_velocity_[slot * trail_sparks_ + k] * age;
+				points[P].position_.x += drift;
+				if (g_CompactVertices) trail_shade_[P] = shade;
+				++P;
+			}
+		}
+
+		unlock_vertices(P, trail_shade_.data());
 
-		p->lifetime_ = max_lifetime_;
+		alive_particles_ = P;
+	}
+
+	void launch(PARTICLE &p)	// Initialise/start particle 'p'.
+	{
+		// Reset the particle's time (for calculating it's position with s = ut+0.5t*t)
+		p.time_ = 0;
 
-		++alive_particles_;
+		//set initial position
+		p.position_ = origin_;
+
+		p.velocity_ = trail_velocity();
+
+		p.lifetime_ = max_lifetime_;
 	}
 };
 
@@ -576,27 +1504,6 @@ private:
 // FIREWORK CREATORS
 //-----------------------------------------------------------------------------
 
-LPDIRECT3DTEXTURE9 &getRandomTexture()
-{
-	int i = random_number(0, 4);
-
-	switch (i)
-	{
-	case 0:
-		return greenTex;
-		break;
-	case 1:
-		return redTex;
-		break;
-	case 2:
-		return blueTex;
-		break;
-	default:
-		return yellowTex;
-		break;
-	}
-}
-
 std::shared_ptr<FIREWORK_ROCKET_CLASS> CreateRocket(D3DXVECTOR3 startLocation)
 {
 	std::shared_ptr<FIREWORK_ROCKET_CLASS> f(new FIREWORK_ROCKET_CLASS);
@@ -612,6 +1519,8 @@ std::shared_ptr<FIREWORK_ROCKET_CLASS> CreateRocket(D3DXVECTOR3 startLocation)
 	f->max_lifetime_ = 20;
 	f->start_particles_ = 20;
 	f->particle_size_ = 0.5f;
+	f->ribbon_trail_ = true;
+	f->trail_sparks_ = 2;
 
 	//slightly random vel
 	float x = (float)random_number(0, 30);
@@ -620,7 +1529,7 @@ std::shared_ptr<FIREWORK_ROCKET_CLASS> CreateRocket(D3DXVECTOR3 startLocation)
 	z = ((z - 15) / 100);
 	f->RocketVel = D3DXVECTOR3(x, 6.0f, z);
 
-	f->particle_texture_ = getRandomTexture();
+	f->sprite_ = getRandomSprite();
 	return f;
 }
 
@@ -636,12 +1545,54 @@ std::shared_ptr<FIREWORK_EXPLOSION_CLASS> CreateExplosion(D3DXVECTOR3 startLocat
 	f->time_increment_ = 0.95;
 	f->max_lifetime_ = 100;
 	f->particle_size_ = 2.5f;
+	f->ground_response_ = GROUND_BOUNCE;	// Embers that reach the ground bounce along it.
+	f->restitution_ = 0.4f;
 
-	f->particle_texture_ = getRandomTexture();
+	f->sprite_ = getRandomSprite();
 
 	return f;
 }
 
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+
+void SYSTEM_BUCKETS::rebuild(const std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> &systems)
+{
+	fountains_.clear();
+	explosions_.clear();
+	rockets_.clear();
+
+	for (auto &s : systems)
+	{
+		switch (s->type())
+		{
+			case SYSTEM_FOUNTAIN:	fountains_.push_back(static_cast<FOUNTAIN_CLASS *>(s.get())); break;
+			case SYSTEM_EXPLOSION:	explosions_.push_back(static_cast<FIREWORK_EXPLOSION_CLASS *>(s.get())); break;
+			case SYSTEM_ROCKET:		rockets_.push_back(static_cast<FIREWORK_ROCKET_CLASS *>(s.get())); break;
+		}
+	}
+}
+
+int SYSTEM_BUCKETS::update()
+{
+	return update(fountains_) + update(explosions_) + update(rockets_);
+}
+
+template <class T>
+int SYSTEM_BUCKETS::update(const std::vector<T *> &bucket)
+{
+	int retired = 0;
+
+	for (T *s : bucket)
+	{
+		RANDOM_STREAM_SCOPE stream(s->random_stream_);
+		s->T::update();		// Named, so it is a direct call.
+
+		if (s->safeToDelete) ++retired;
+	}
+
+	return retired;
+}
+
 class FireworkTemplates
 {
 public:
@@ -652,8 +1603,7 @@ public:
 		std::shared_ptr<FIREWORK_EXPLOSION_CLASS> second = CreateExplosion(startLocation);
 		first->nextSystems.push_back(second);
 
-		first->initialise();
-		g_Particles.push_back(first);
+		g_World->queue_.spawn(first);
 	}
 
 	void BasicRocket(D3DXVECTOR3 startLocation)
@@ -661,8 +1611,7 @@ public:
 		//create a complete firework for testing
 		std::shared_ptr<FIREWORK_ROCKET_CLASS> first = CreateRocket(startLocation);
 		first->start_particles_ = 5;
-		first->initialise();
-		g_Particles.push_back(first);
+		g_World->queue_.spawn(first);
 	}
 
 	void ThickRocket(D3DXVECTOR3 startLocation)
@@ -672,8 +1621,7 @@ public:
 		first->max_lifetime_ = 50;
 		//first->start_particles_ = 5;
 		first->particle_size_ = 2.0f;
-		first->initialise();
-		g_Particles.push_back(first);
+		g_World->queue_.spawn(first);
 	}
 
 	void SprinklerRocket(D3DXVECTOR3 startLocation)
@@ -691,8 +1639,7 @@ public:
 			first->max_lifetime_ = 50;
 			//first->start_particles_ = 5;
 			first->particle_size_ = 2.0f;
-			first->initialise();
-			g_Particles.push_back(first);
+			g_World->queue_.spawn(first);
 		}		
 	}
 
@@ -710,8 +1657,7 @@ public:
 			first->nextSystems.push_back(second);
 		}
 
-		first->initialise();
-		g_Particles.push_back(first);
+		g_World->queue_.spawn(first);
 	}
 
 	void DoubleRocketExplosion(D3DXVECTOR3 startLocation)
@@ -734,8 +1680,7 @@ public:
 			first->nextSystems.push_back(second);
 		}
 
-		first->initialise();
-		g_Particles.push_back(first);
+		g_World->queue_.spawn(first);
 	}
 };
 
@@ -747,246 +1692,190 @@ class FireworkSpawner
 {
 public:
 	FireworkSpawner(D3DXVECTOR3 Loc)
-		: MAX_COUNTER(2000), counter(0), Location(Loc) {};
-	~FireworkSpawner() {};
+		: MAX_COUNTER(2000), Location(Loc), timers_(&g_World->timers_), base_(timers_->now() + 1), random_stream_(0) {};
+	virtual ~FireworkSpawner()
+	{
+		timers_->cancel(next_);
+	}
 
 	D3DXVECTOR3 Location;
-	int counter;
 	const int MAX_COUNTER;
 	FireworkTemplates t;
 
-	void Update()
+	// Start waiting for the next cue. Call once the cues have been added.
+	void Start()
 	{
-		if (counter == MAX_COUNTER)
-		{
-			counter = 0;
-		}
-		else
+		schedule_next();
+	}
+
+	// Draw this spawner's fireworks from random stream 's' - never 0, which is the show's own. False (and
+	// left as it was) if there is no stream 's': a show has room for RANDOM_STREAMS - 1 spawners.
+	bool set_random_stream(int s)
+	{
+		if (s < 1 || s >= RANDOM_STREAMS) return false;
+
+		random_stream_ = s;
+		return true;
+	}
+
+	// Position in the MAX_COUNTER + 1 frame cycle that the next frame will run at.
+	int counter() const
+	{
+		return (int)((timers_->now() + 1 - base_) % (MAX_COUNTER + 1));
+	}
+
+	// Firing order of the next cue among the events due on the same frame (see TIMER_WHEEL::order()).
+	unsigned int cue_order() const
+	{
+		return timers_->order(next_);
+	}
+
+	// Jump to position 'c' in the cycle (restoring a checkpoint) and wait for the next cue from there, in firing order 'order'.
+	void set_counter(int c, unsigned int order)
+	{
+		base_ = timers_->now() + 1 - (unsigned int)c;
+		schedule_next();
+		timers_->set_order(next_, order);
+	}
+
+protected:
+	typedef void (FireworkTemplates::*LAUNCH)(D3DXVECTOR3);
+
+	// Launch 'launch' when the counter reaches 'at' - cues must be added in order.
+	void cue(int at, LAUNCH launch)
+	{
+		CUE c;
+		c.at_ = at;
+		c.launch_ = launch;
+		cues_.push_back(c);
+	}
+
+private:
+	struct CUE
+	{
+		int at_;
+		LAUNCH launch_;
+	};
+
+	// Schedule the first cue at or after the next frame's counter, going round into the next cycle if need be.
+	void schedule_next()
+	{
+		timers_->cancel(next_);
+		if (cues_.empty()) return;
+
+		int c = counter();
+		size_t i = 0;
+		while (i < cues_.size() && cues_[i].at_ < c) ++i;
+
+		int wait = i < cues_.size() ? cues_[i].at_ - c : (MAX_COUNTER + 1 - c) + cues_[0].at_;
+		if (i == cues_.size()) i = 0;
+
+		next_ = timers_->schedule(wait + 1, [this, i]()
 		{
-			LaunchFirework();
-			++counter;
-		}
+			RANDOM_STREAM_SCOPE stream(random_stream_);
+			(t.*cues_[i].launch_)(Location);
+			schedule_next();
+		});
 	}
 
-	virtual void LaunchFirework() = 0;
+	std::vector<CUE> cues_;
+	TIMER_WHEEL *timers_;		// The wheel the cues are on - the show's that was current when the spawner was made.
+	unsigned int base_;			// The timer wheel's now() when the counter was last 0.
+	TIMER_ID next_;
+	int random_stream_;
 };
 
 class FireworkSpawnerAlpha : public FireworkSpawner
 {
 public:
-	FireworkSpawnerAlpha(D3DXVECTOR3 Loc) : FireworkSpawner(Loc) {};
-	~FireworkSpawnerAlpha() {};
-
-	void LaunchFirework()
-	{
-		switch (counter)
-		{
-		case 10:
-			t.ThickRocket(Location);
-			break;
-		case 50:
-			t.RocketWithExplosion(Location);
-			break;
-		case 200:
-			t.ThickRocket(Location);
-			break;
-		case 250:
-			t.ThickRocket(Location);
-			break;
-		case 410:
-			t.ThickRocket(Location);
-			break;
-		case 650:
-			t.DoubleRocketExplosion(Location);
-			break;
-		case 1050:
-			t.ThickRocket(Location);
-			break;
-		case 1200:
-			t.SprinklerRocket(Location);
-			break;
-		case 1400:
-			t.SprinklerRocket(Location);
-			break;
-		case 1700:
-			t.DoubleRocketExplosion(Location);
-			break;
-		}
+	FireworkSpawnerAlpha(D3DXVECTOR3 Loc) : FireworkSpawner(Loc)
+	{
+		cue(10, &FireworkTemplates::ThickRocket);
+		cue(50, &FireworkTemplates::RocketWithExplosion);
+		cue(200, &FireworkTemplates::ThickRocket);
+		cue(250, &FireworkTemplates::ThickRocket);
+		cue(410, &FireworkTemplates::ThickRocket);
+		cue(650, &FireworkTemplates::DoubleRocketExplosion);
+		cue(1050, &FireworkTemplates::ThickRocket);
+		cue(1200, &FireworkTemplates::SprinklerRocket);
+		cue(1400, &FireworkTemplates::SprinklerRocket);
+		cue(1700, &FireworkTemplates::DoubleRocketExplosion);
 	}
+	~FireworkSpawnerAlpha() {};
 };
 
 class FireworkSpawnerBravo : public FireworkSpawner
 {
 public:
-	FireworkSpawnerBravo(D3DXVECTOR3 Loc) : FireworkSpawner(Loc) {};
-	~FireworkSpawnerBravo() {};
-
-	void LaunchFirework()
-	{
-		switch (counter)
-		{
-		case 10:
-			t.ThickRocket(Location);
-			break;
-		case 70:
-			t.RocketWithExplosion(Location);
-			break;
-		case 200:
-			t.ThickRocket(Location);
-			break;
-		case 270:
-			t.ThickRocket(Location);
-			break;
-		case 390:
-			t.ThickRocket(Location);
-			break;
-		case 430:
-			t.ThickRocket(Location);
-			break;
-		case 1060:
-			t.ThickRocket(Location);
-			break;
-		case 1300:
-			t.SprinklerRocket(Location);
-			break;
-		case 1450:
-			t.RocketWithExplosion(Location);
-			break;
-		}
+	FireworkSpawnerBravo(D3DXVECTOR3 Loc) : FireworkSpawner(Loc)
+	{
+		cue(10, &FireworkTemplates::ThickRocket);
+		cue(70, &FireworkTemplates::RocketWithExplosion);
+		cue(200, &FireworkTemplates::ThickRocket);
+		cue(270, &FireworkTemplates::ThickRocket);
+		cue(390, &FireworkTemplates::ThickRocket);
+		cue(430, &FireworkTemplates::ThickRocket);
+		cue(1060, &FireworkTemplates::ThickRocket);
+		cue(1300, &FireworkTemplates::SprinklerRocket);
+		cue(1450, &FireworkTemplates::RocketWithExplosion);
 	}
+	~FireworkSpawnerBravo() {};
 };
 
 class FireworkSpawnerCharlie : public FireworkSpawner
 {
 public:
-	FireworkSpawnerCharlie(D3DXVECTOR3 Loc) : FireworkSpawner(Loc) {};
-	~FireworkSpawnerCharlie() {};
-
-	void LaunchFirework()
-	{
-		switch (counter)
-		{
-		case 10:
-			t.ThickRocket(Location);
-			break;
-		case 90:
-			t.RocketWithExplosion(Location);
-			break;
-		case 200:
-			t.ThickRocket(Location);
-			break;
-		case 290:
-			t.ThickRocket(Location);
-			break;
-		case 370:
-			t.ThickRocket(Location);
-			break;
-		case 450:
-			t.ThickRocket(Location);
-			break;
-		case 500:
-			t.DoubleRocketExplosion(Location);
-			break;
-		case 950:
-			t.SprinklerRocket(Location);
-			break;
-		case 1070:
-			t.ThickRocket(Location);
-			break;
-		case 1200:
-			t.SprinklerRocket(Location);
-			break;
-		case 1400:
-			t.RocketWithExplosion(Location);
-			break;
-		case 1600:
-			t.DoubleRocketExplosion(Location);
-			break;
-		}
+	FireworkSpawnerCharlie(D3DXVECTOR3 Loc) : FireworkSpawner(Loc)
+	{
+		cue(10, &FireworkTemplates::ThickRocket);
+		cue(90, &FireworkTemplates::RocketWithExplosion);
+		cue(200, &FireworkTemplates::ThickRocket);
+		cue(290, &FireworkTemplates::ThickRocket);
+		cue(370, &FireworkTemplates::ThickRocket);
+		cue(450, &FireworkTemplates::ThickRocket);
+		cue(500, &FireworkTemplates::DoubleRocketExplosion);
+		cue(950, &FireworkTemplates::SprinklerRocket);
+		cue(1070, &FireworkTemplates::ThickRocket);
+		cue(1200, &FireworkTemplates::SprinklerRocket);
+		cue(1400, &FireworkTemplates::RocketWithExplosion);
+		cue(1600, &FireworkTemplates::DoubleRocketExplosion);
 	}
+	~FireworkSpawnerCharlie() {};
 };
 
 class FireworkSpawnerDelta : public FireworkSpawner
 {
 public:
-	FireworkSpawnerDelta(D3DXVECTOR3 Loc) : FireworkSpawner(Loc) {};
-	~FireworkSpawnerDelta() {};
-
-	void LaunchFirework()
-	{
-		switch (counter)
-		{
-		case 10:
-			t.ThickRocket(Location);
-			break;
-		case 110:
-			t.RocketWithExplosion(Location);
-			break;
-		case 200:
-			t.ThickRocket(Location);
-			break;
-		case 310:
-			t.ThickRocket(Location);
-			break;
-		case 350:
-			t.ThickRocket(Location);
-			break;
-		case 470:
-			t.ThickRocket(Location);
-			break;
-		case 1080:
-			t.ThickRocket(Location);
-			break;
-		case 1300:
-			t.SprinklerRocket(Location);
-			break;
-		case 1450:
-			t.RocketWithExplosion(Location);
-			break;
-		}
+	FireworkSpawnerDelta(D3DXVECTOR3 Loc) : FireworkSpawner(Loc)
+	{
+		cue(10, &FireworkTemplates::ThickRocket);
+		cue(110, &FireworkTemplates::RocketWithExplosion);
+		cue(200, &FireworkTemplates::ThickRocket);
+		cue(310, &FireworkTemplates::ThickRocket);
+		cue(350, &FireworkTemplates::ThickRocket);
+		cue(470, &FireworkTemplates::ThickRocket);
+		cue(1080, &FireworkTemplates::ThickRocket);
+		cue(1300, &FireworkTemplates::SprinklerRocket);
+		cue(1450, &FireworkTemplates::RocketWithExplosion);
 	}
+	~FireworkSpawnerDelta() {};
 };
 
 class FireworkSpawnerEcho : public FireworkSpawner
 {
 public:
-	FireworkSpawnerEcho(D3DXVECTOR3 Loc) : FireworkSpawner(Loc) {};
-	~FireworkSpawnerEcho() {};
-
-	void LaunchFirework()
-	{
-		switch (counter)
-		{
-		case 10:
-			t.ThickRocket(Location);
-			break;
-		case 130:
-			t.RocketWithExplosion(Location);
-			break;
-		case 200:
-			t.ThickRocket(Location);
-			break;
-		case 330:
-			t.ThickRocket(Location);
-			break;
-		case 490:
-			t.ThickRocket(Location);
-			break;
-		case 800:
-			t.DoubleRocketExplosion(Location);
-			break;
-		case 1090:
-			t.ThickRocket(Location);
-			break;
-		case 1200:
-			t.SprinklerRocket(Location);
-			break;
-		case 1400:
-			t.SprinklerRocket(Location);
-			break;
-		case 1700:
-			t.DoubleRocketExplosion(Location);
-			break;
-		}
+	FireworkSpawnerEcho(D3DXVECTOR3 Loc) : FireworkSpawner(Loc)
+	{
+		cue(10, &FireworkTemplates::ThickRocket);
+		cue(130, &FireworkTemplates::RocketWithExplosion);
+		cue(200, &FireworkTemplates::ThickRocket);
+		cue(330, &FireworkTemplates::ThickRocket);
+		cue(490, &FireworkTemplates::ThickRocket);
+		cue(800, &FireworkTemplates::DoubleRocketExplosion);
+		cue(1090, &FireworkTemplates::ThickRocket);
+		cue(1200, &FireworkTemplates::SprinklerRocket);
+		cue(1400, &FireworkTemplates::SprinklerRocket);
+		cue(1700, &FireworkTemplates::DoubleRocketExplosion);
 	}
+	~FireworkSpawnerEcho() {};
 };
@@ -6,10 +6,24 @@
 
 #define _CRT_RAND_S	// Define this before any includes to select correct rand function in stdlib.h.
 
+#include <winsock2.h>	// Before Windows.h, which would otherwise bring in the old winsock.h (see Shard.h).
 #include <Windows.h>	// Windows library (for window functions, menus, dialog boxes, etc)
 #include "ParticleSystem.h"
 #include <string>
 #include "PerlinNoise.h"
+#include "Checkpoint.h"
+#include "Seek.h"
+#include "Replay.h"
+#include "Benchmark.h"
+#include "Pipeline.h"
+#include "Views.h"
+#include "Shard.h"
+#include "Stream.h"
+#include "FramePacer.h"
+#include "Trajectory.h"
+#include <map>
+#include <mutex>
+#include <thread>
 
 //---------------------------------------------------------------------------------------------------------------------------------
 // Global variables
@@ -17,27 +31,52 @@
 LPDIRECT3D9             d3d		= NULL;	// Used to create the device
 LPD3DXMESH g_BoxMesh = NULL;						// Mesh used for the floor.
 
-std::vector<std::shared_ptr<FireworkSpawner>> g_Spawners;
-
 //noise
-std::vector<double> g_noise;
-std::vector<double>::iterator CurrentNoise;
+std::map<unsigned int, std::weak_ptr<const NOISE_TABLE>> g_NoiseTables;	// Every table a show is using, by seed (see SharedNoise()).
+std::mutex g_NoiseLock;
+
+#define CHECKPOINT_FILE "show.chk"				// F5 saves the show here, F9 restores it.
+#define ATLAS_CACHE "sprites.atlas"				// Packed particle sprites, ready to upload.
+
+SHOW_RECORDER g_Recorder;						// Records or replays the show (-record / -replay on the command line).
+std::atomic<unsigned int> g_PendingInputs(0);	// INPUT_xxx flags gathered since the last frame.
+std::atomic<bool> g_SaveRequested(false);		// F5 - checkpoint before the next frame is simulated.
+
+#define SEEK_STEP 600							// Frames the arrow keys seek by (ten seconds).
+
+SHOW_SEEKER g_Seeker;							// Keyframes for seeking (see Seek.h).
+std::atomic<int> g_SeekRequested(0);			// Frames to seek by before the next frame is simulated (arrow keys).
+double g_SeekMs = 0;							// Time the last seek took.
+unsigned int g_SeekHeld = 0;					// Frame the last arrow key seek was held to, short of the one asked for - 0 if it wasn't.
+
+SIMULATION_PIPELINE g_Pipeline;					// Simulation thread (-pipeline on the command line).
+SNAPSHOT_RENDERER g_SnapshotRenderer;			// Draws the pipeline's snapshots.
+SHOW_VIEWS g_Views;								// Several cameras on the show at once (-views on the command line).
+SHARD_COMPOSITOR g_Compositor;					// Merges the frames of the shard processes (-composite on the command line).
+FRAME_SNAPSHOT g_CompositeFrame;				// The last frame merged from the shards.
+int g_ShardIndex = 0;							// Which spawners this process simulates - those whose index % g_ShardCount == g_ShardIndex.
+int g_ShardCount = 1;
+
+STREAM_SERVER g_StreamServer;					// Sends the show to remote viewers (-stream on the command line).
+STREAM_VIEWER g_StreamViewer;					// Draws a show streamed from elsewhere (-view on the command line).
+FRAME_RING_READER g_RingReader;					// Draws a show simulated in another process (-ringview on the command line).
+
+#define SHOW_FPS 60								// The rate the show runs at, unless -fps says otherwise.
+
+FRAME_PACER g_Pacer;							// Holds the main loop to the show's frame rate.
+
+TRAJECTORY_RECORDER g_Trajectory;				// Logs where everything goes, for offline analysis (-trajectory on the command line).
+
+LONGLONG g_LastPresent = 0;						// Performance counter at the last Present, for the frame time.
+double g_FrameMs = 0;
 
 //testing for text
 ID3DXFont *font;
 RECT fRectangle;
 std::string message;
 
-LPDIRECT3DVERTEXBUFFER9 g_pVertexBuffer = NULL; // Buffer to hold vertices for the rectangle
-
-struct CUSTOMVERTEX
-{
-	D3DXVECTOR3 position;	// Position
-	FLOAT u, v;				// Texture co-ordinates.
-};
-
-// The structure of a vertex in our vertex buffer...
-#define D3DFVF_CUSTOMVERTEX (D3DFVF_XYZ | D3DFVF_TEX1)
+LIT_SCENE g_LitScene;							// The backdrop and the ground, lit by the explosions.
+std::vector<FLASH_LIGHT> g_Flashes;				// This frame's flashes, when not drawing from a snapshot.
 
 //---------------------------------------------------------------------------------------------------------------------------------
 // Initialise Direct 3D.
@@ -77,10 +116,24 @@ HRESULT SetupD3D(HWND hWnd)
 void CleanUp()
 {
     SAFE_RELEASE(g_BoxMesh);
+	g_SnapshotRenderer.release();
+	g_SpriteAtlas.release();
+	CleanUpCompactVertices();
 	SAFE_RELEASE(device);
     SAFE_RELEASE(d3d);
 	SAFE_RELEASE(font);
+	UntrackTexture(skyboxTex);
 	SAFE_RELEASE(skyboxTex);
+
+	// The sprite textures, if the atlas could not be used.
+	UntrackTexture(yellowTex);
+	SAFE_RELEASE(yellowTex);
+	UntrackTexture(redTex);
+	SAFE_RELEASE(redTex);
+	UntrackTexture(blueTex);
+	SAFE_RELEASE(blueTex);
+	UntrackTexture(greenTex);
+	SAFE_RELEASE(greenTex);
 }
 
 //-----------------------------------------------------------------------------
@@ -88,69 +141,8 @@ void CleanUp()
 
 HRESULT SetupGeometry()
 {
-	// Calculate the number of vertices required, and the size of the buffer to hold them.
-	int Vertices = 2 * 3;	// Six vertices for the square.
-	int BufferSize = Vertices * sizeof(CUSTOMVERTEX);
-
-	// Create the vertex buffer.
-	if (FAILED(device->CreateVertexBuffer(BufferSize, 0, D3DFVF_CUSTOMVERTEX, D3DPOOL_DEFAULT, &g_pVertexBuffer, NULL)))
-	{
-		return E_FAIL; // if the vertex buffer could not be created.
-	}
-
-	// Fill the buffer with appropriate vertices to describe the cube...
-
-	// Create a pointer to the first vertex in the buffer.
-	CUSTOMVERTEX *pVertices;
-	if (FAILED(g_pVertexBuffer->Lock(0, 0, (void**)&pVertices, 0)))
-	{
-		return E_FAIL;  // if the pointer to the vertex buffer could not be established.
-	}
-
-	// Fill the vertex buffers with data...
-
-	// Side 1 - Front face
-	pVertices[0].position.x = -200;	// Vertex co-ordinate.
-	pVertices[0].position.y = -200;
-	pVertices[0].position.z = -200;
-	pVertices[0].u = 0;
-	pVertices[0].v = 1;
-
-	pVertices[1].position.x = -200;
-	pVertices[1].position.y = 200;
-	pVertices[1].position.z = -200;
-	pVertices[1].u = 0;
-	pVertices[1].v = 0;
-
-	pVertices[2].position.x = 200;
-	pVertices[2].position.y = -200;
-	pVertices[2].position.z = -200;
-	pVertices[2].u = 1;
-	pVertices[2].v = 1;
-
-	pVertices[3].position.x = 200;
-	pVertices[3].position.y = -200;
-	pVertices[3].position.z = -200;
-	pVertices[3].u = 1;
-	pVertices[3].v = 1;
-
-	pVertices[4].position.x = -200;
-	pVertices[4].position.y = 200;
-	pVertices[4].position.z = -200;
-	pVertices[4].u = 0;
-	pVertices[4].v = 0;
-
-	pVertices[5].position.x = 200;
-	pVertices[5].position.y = 200;
-	pVertices[5].position.z = -200;
-	pVertices[5].u = 1;
-	pVertices[5].v = 0;
-
-
-	// Unlock the vertex buffer...
-	g_pVertexBuffer->Unlock();
-
-	return S_OK;
+	// The skybox's quad and the ground, as grids of vertices for the flashes to light.
+	return g_LitScene.build();
 }
 
 //-----------------------------------------------------------------------------
@@ -213,49 +205,99 @@ void SetupLights()
 
 void Update()
 {
+	++g_World->frame_;
+
 	//UPDATE WIND
 	if(random_number(1, 100) >= 95)
 	{
-		if (CurrentNoise != g_noise.end())
+		if (g_World->noise_cursor_ != g_World->noise_->end())
 		{
-			++CurrentNoise;
+			++g_World->noise_cursor_;
 		}
 		else
 		{
-			CurrentNoise = g_noise.begin();
+			g_World->noise_cursor_ = g_World->noise_->begin();
 		}
 
-		float f = (float)(*CurrentNoise);
+		float f = (float)(*g_World->noise_cursor_);
 		//d is between 0 and 255
 		f = f * 2.0f;
 		f -= 1.0f;
 
-		windSpeed = f;
+		g_World->wind_speed_ = f;
 	}
 
-	//UPDATE ALL SPAWNERS
+	g_World->wind_drift_ += g_World->wind_speed_;
 
-	for (auto s : g_Spawners)
-	{
-		s->Update();
-	}
+	//FIRE EVERYTHING DUE THIS FRAME - spawner cues, rocket fuses and trail bursts
+
+	g_World->timers_.advance();
+
+	//UPDATE ALL PARTICLES - the hot loop, nothing in here should allocate
+
+	// The alarm watches the show in the window - other shows' allocations would be counted in with it.
+	bool watched = g_World == &g_MainWorld;
+	if (watched) g_Memory.begin_hot();
+
+	// Type by type - see SYSTEM_BUCKETS. Those that are done are removed by apply() below.
+	g_World->queue_.retire(g_World->buckets_.update());
+
+	if (watched) g_Memory.end_hot();
+
+	//ADD AND REMOVE SYSTEMS
+
+	g_World->queue_.apply();
+}
+
+
+//-----------------------------------------------------------------------------
+// On screen text for the frame just simulated.
+
+std::string StatusText()
+{
+	std::string text = "Wind Speed: " + std::to_string(g_World->wind_speed_) + "\n" + g_Recorder.status() + "\n" + g_Memory.status();
+	text += g_World->pool_.status() + "\n";
+	if (g_CompactParticles) text += std::string("Explosions packed to 16 byte particles, velocities by ") + (g_CompactF16C ? "F16C" : "software") + "\n";
+	text += g_Seeker.status() + ", last seek " + std::to_string(g_SeekMs) + " ms";
+	if (g_SeekHeld) text += ", held to frame " + std::to_string(g_SeekHeld) + " - play on to seek further";
+	text += "\n";
+	if (g_StreamServer.running()) text += g_StreamServer.status() + "\n";
+	if (g_Trajectory.recording()) text += g_Trajectory.status() + "\n";
+
+	return text;
+}
+
+//-----------------------------------------------------------------------------
+// Draw 's' once for each view, each into its own part of the window. The
+// frame is uploaded once, and the views only differ in which of its draws they
+// make and in what order.
 
-	//UPDATE ALL PARTICLES
+void RenderViews(const FRAME_SNAPSHOT &s)
+{
+	D3DVIEWPORT9 window;
+	device -> GetViewport(&window);
+
+	g_Views.prepare(s, (int)window.Width, (int)window.Height);
+	bool uploaded = g_SnapshotRenderer.upload(s);
 
-	//for (auto &it = g_ParticlesAll.rbegin(); it != g_ParticlesAll.rend(); ++it)
-	for (int i = 0; i < g_Particles.size(); ++i)
+	for (VIEW_PASS &p : g_Views.passes())
 	{
-		g_Particles[i]->update();
+		device -> SetViewport(&p.viewport());
+		device -> SetTransform(D3DTS_VIEW, &p.view_matrix());
+		device -> SetTransform(D3DTS_PROJECTION, &p.projection());
+
+		g_LitScene.render(device, skyboxTex);
 
-		//check if particle should be removed
-		if (g_Particles[i]->safeToDelete)
+		if (!uploaded) continue;
+
+		for (int i : p.order())
 		{
-			g_Particles.erase(g_Particles.begin() + i);
-			--i;
+			g_SnapshotRenderer.draw(s.draws_[i]);
 		}
 	}
-}
 
+	device -> SetViewport(&window);
+}
 
 //-----------------------------------------------------------------------------
 // Render the scene.
@@ -282,24 +324,78 @@ void render()
 		D3DXMatrixTransformation(&TransformMatrix, &ScalingCentre, &ScalingRotation, &Scaling, &RotationCentre, &Rotation, &Translate);
 		device -> SetTransform(D3DTS_WORLD, &TransformMatrix);
 
-		device->SetTexture(0, skyboxTex);
-		device->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
-		device->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+		// The frame to draw - a snapshot, or the show itself.
+		const FRAME_SNAPSHOT *snapshot = NULL;
+		const FRAME_RING_SLOT *ringFrame = NULL;
 
-		// Render the contents of the vertex buffer.
-		device->SetStreamSource(0, g_pVertexBuffer, 0, sizeof(CUSTOMVERTEX));
-		device->SetFVF(D3DFVF_CUSTOMVERTEX);
-		device->DrawPrimitive(D3DPT_TRIANGLELIST, 0, 2);
+		if (g_StreamViewer.viewing())
+		{
+			// Draw the newest frame received.
+			snapshot = &g_StreamViewer.acquire();
+			message = snapshot->text_ + "\n" + g_StreamViewer.status();
+		}
+		else if (g_RingReader.opened())
+		{
+			// Draw the newest frame the simulation process has handed over, straight out of the ring.
+			ringFrame = g_RingReader.latest();
+			g_Flashes.clear();
+			message = (ringFrame ? "Wind Speed: " + std::to_string(ringFrame->wind_) : std::string("Waiting for the simulation")) + "\n" + g_RingReader.status();
+		}
+		else if (g_PipelinedRender)
+		{
+			// Draw the newest frame the simulation thread has finished.
+			snapshot = &g_Pipeline.acquire();
+			message = snapshot->text_ + "\n" + g_Pipeline.status();
+		}
+		else if (g_Compositor.running())
+		{
+			// Wait for every shard to finish the next frame, and draw them all together.
+			if (!g_Compositor.receive(g_CompositeFrame))
+			{
+				OutputDebugString("Shards: lost a shard, or it stopped sending frames - simulating here instead.\n");
+			}
+			snapshot = &g_CompositeFrame;
+			message = g_CompositeFrame.text_ + "\n" + g_Compositor.status();
+		}
+		else
+		{
+			g_Flashes.clear();
+			GatherFlashLights(g_World->particles_, g_Flashes);
+			message = StatusText();
+		}
+
+		// The skybox and the ground, lit by this frame's explosions.
+		g_LitScene.light(snapshot ? snapshot->lights_ : g_Flashes);
 
-		for (auto &p : g_Particles)
+		if (snapshot && g_Views.enabled())
+		{
+			RenderViews(*snapshot);
+			message += "\n" + g_Views.status();
+		}
+		else if (snapshot)
+		{
+			g_LitScene.render(device, skyboxTex);
+			g_SnapshotRenderer.render(*snapshot);
+		}
+		else if (ringFrame)
+		{
+			g_LitScene.render(device, skyboxTex);
+			g_SnapshotRenderer.render(*ringFrame);
+		}
+		else
 		{
-			p->render();
+			g_LitScene.render(device, skyboxTex);
+
+			for (auto &p : g_World->particles_)
+			{
+				p->render();
+			}
 		}
 
 		//draw text
 		if (font)
 		{
-			message = "Wind Speed: " + std::to_string(windSpeed);
+			message += "\nFrame: " + std::to_string(g_FrameMs) + " ms\n" + g_Pacer.status() + "\n" + g_LitScene.clusters().status();
 			font->DrawTextA(NULL, message.c_str(), -1, &fRectangle, DT_LEFT, D3DCOLOR_XRGB(255,255,255));
 		}
 
@@ -308,29 +404,31 @@ void render()
 
     // Present the backbuffer to the display.
     device -> Present(NULL, NULL, NULL, NULL);
+
+	if (g_PipelinedRender) g_Pipeline.presented();
+
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	if (g_LastPresent) g_FrameMs = (double)(now.QuadPart - g_LastPresent) * 1000.0 / (double)frequency.QuadPart;
+	g_LastPresent = now.QuadPart;
 }
 
 //-----------------------------------------------------------------------------
-// Initialise the parameters for the particle system.
+// The wind noise table for 'seed'. Shows built from the same seed share one
+// table - it is only read - which is kept for as long as any of them is using it.
 
-void SetupParticleSystems()
+std::shared_ptr<const NOISE_TABLE> SharedNoise(unsigned int seed)
 {
-	D3DXCreateTextureFromFile(device, "yellow.png", &yellowTex);
-	D3DXCreateTextureFromFile(device, "red.png", &redTex);
-	D3DXCreateTextureFromFile(device, "blue.png", &blueTex);
-	D3DXCreateTextureFromFile(device, "green.png", &greenTex);
+	std::lock_guard<std::mutex> lock(g_NoiseLock);
 
-	//setup text
-	font = NULL;
-	D3DXCreateFont(device, 20, 15, FW_NORMAL, 1, false, DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, 
-		ANTIALIASED_QUALITY, FF_DONTCARE, "Arial", &font);
+	std::shared_ptr<const NOISE_TABLE> shared = g_NoiseTables[seed].lock();
+	if (shared) return shared;
 
-	SetRect(&fRectangle, 0, 0, 500, 300);
+	std::shared_ptr<NOISE_TABLE> table(new NOISE_TABLE);
+	table->reserve(600 * 600);
 
-	message = "";
-
-	//setup noise
-	PerlinNoise pn(random_number());
+	PerlinNoise pn(seed);
 
 	for (unsigned int i = 0; i < 600; ++i)
 	{     // y
@@ -342,14 +440,209 @@ void SetupParticleSystems()
 			// Typical Perlin noise
 			double n = pn.noise(10 * x, 10 * y, 0.8);
 
-			g_noise.push_back(n);
+			table->push_back(n);
 		}
 	}
 
-	CurrentNoise = g_noise.begin();
+	g_NoiseTables[seed] = table;
+	return table;
+}
 
-	//setup skybox
-	D3DXCreateTextureFromFile(device, "skybox.jpg", &skyboxTex);
+// Give the current show the noise table for 'seed', with the cursor at the start.
+void BuildNoise(unsigned int seed)
+{
+	g_World->noise_ = SharedNoise(seed);
+	g_World->noise_seed_ = seed;
+	g_World->noise_cursor_ = g_World->noise_->begin();
+}
+
+//-----------------------------------------------------------------------------
+// Save and restore the whole show.
+
+// The application's part of a checkpoint.
+CHECKPOINT_STATE ShowState()
+{
+	CHECKPOINT_STATE state;
+	state.frame_ = g_World->frame_;
+	state.noise_seed_ = g_World->noise_seed_;
+	state.noise_index_ = (unsigned int)(g_World->noise_cursor_ - g_World->noise_->begin());
+
+	return state;
+}
+
+// Carry on from 'state', once the systems have been restored.
+void ResumeShow(const CHECKPOINT_STATE &state)
+{
+	g_World->queue_.clear();
+
+	if (!g_World->noise_ || state.noise_seed_ != g_World->noise_seed_) BuildNoise(state.noise_seed_);
+
+	g_World->noise_cursor_ = g_World->noise_->begin() + (state.noise_index_ < g_World->noise_->size() ? state.noise_index_ : 0);
+	g_World->frame_ = state.frame_;
+}
+
+void SaveShow(const char *filename)
+{
+	if (!SHOW_CHECKPOINT::save(filename, ShowState(), g_World->spawners_))
+	{
+		OutputDebugString("Checkpoint: could not save the show.\n");
+	}
+}
+
+// Carry on from a checkpoint just restored.
+void RestartShow(const CHECKPOINT_STATE &state)
+{
+	ResumeShow(state);
+
+	// The keyframes belong to the show that was replaced - start again from here.
+	g_Seeker.clear();
+	g_Seeker.keep(ShowState(), g_World->spawners_);
+}
+
+void RestoreShow(const std::vector<char> &checkpoint)
+{
+	CHECKPOINT_STATE state;
+
+	if (!SHOW_CHECKPOINT::restore(checkpoint, state, g_World->spawners_))
+	{
+		OutputDebugString("Checkpoint: could not restore the show.\n");
+		return;
+	}
+
+	RestartShow(state);
+}
+
+void RestoreShow(const char *filename)
+{
+	// Recording - the checkpoint itself goes in the log, so the replay doesn't depend on the file.
+	if (g_Recorder.mode() == RECORD_ON)
+	{
+		std::vector<char> checkpoint;
+		if (!SHOW_CHECKPOINT::load(filename, checkpoint))
+		{
+			OutputDebugString("Checkpoint: could not restore the show.\n");
+			return;
+		}
+
+		g_Recorder.restored(checkpoint);
+		RestoreShow(checkpoint);
+		return;
+	}
+
+	CHECKPOINT_STATE state;
+
+	if (!SHOW_CHECKPOINT::restore(filename, state, g_World->spawners_))
+	{
+		OutputDebugString("Checkpoint: could not restore the show.\n");
+		return;
+	}
+
+	RestartShow(state);
+}
+
+//-----------------------------------------------------------------------------
+// Seek to the end of frame 'frame' - from the last keyframe before it, or from
+// where the show is now if that is closer, simulating the rest of the way
+// without writing any vertices.
+
+void KeepKeyframe()
+{
+	if (g_Seeker.due(g_World->frame_)) g_Seeker.keep(ShowState(), g_World->spawners_);
+}
+
+// With 'capped' set (the arrow keys) a seek goes no further than one interval past the
+// furthest frame the show has reached, so it never costs more than one interval of frames.
+// Without it (-seek on the command line) it simulates however many frames it takes.
+
+void SeekShow(unsigned int frame, bool capped)
+{
+	if (g_Recorder.mode() != RECORD_OFF)
+	{
+		OutputDebugString("Seek: not while recording or replaying - the log cannot follow a seek.\n");
+		return;
+	}
+
+	if (capped)
+	{
+		unsigned int limit = g_Seeker.furthest(g_World->frame_) + g_Seeker.interval();
+		g_SeekHeld = frame > limit ? limit : 0;
+		if (frame > limit) frame = limit;
+	}
+
+	LARGE_INTEGER start, end, frequency;
+	QueryPerformanceCounter(&start);
+
+	const SHOW_KEYFRAME *k = g_Seeker.before(frame);
+	if (k && (frame < g_World->frame_ || k->frame_ > g_World->frame_))
+	{
+		CHECKPOINT_STATE state;
+		if (!g_Seeker.restore(*k, state, g_World->spawners_))
+		{
+			OutputDebugString("Seek: could not restore the keyframe.\n");
+			return;
+		}
+
+		ResumeShow(state);
+	}
+	else if (frame < g_World->frame_)
+	{
+		OutputDebugString("Seek: no keyframe that far back.\n");
+		return;
+	}
+
+	g_World->fast_forward_ = true;
+	while (g_World->frame_ < frame)
+	{
+		KeepKeyframe();
+		Update();
+	}
+	g_World->fast_forward_ = false;
+
+	QueryPerformanceCounter(&end);
+	QueryPerformanceFrequency(&frequency);
+	g_SeekMs = (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+}
+
+//-----------------------------------------------------------------------------
+// Simulate one frame, applying any inputs and keeping the recorder in step.
+// Runs on the simulation thread when pipelined, so the window only ever passes
+// requests to it through g_SaveRequested and g_PendingInputs.
+
+void SimulateFrame()
+{
+	if (g_SaveRequested.exchange(false)) SaveShow(CHECKPOINT_FILE);
+
+	unsigned int inputs = g_Recorder.begin_frame(g_PendingInputs.exchange(0));
+
+	// A replay restores the checkpoint in the log.
+	if (inputs & INPUT_RESTORE)
+	{
+		if (g_Recorder.mode() != RECORD_REPLAY) RestoreShow(CHECKPOINT_FILE);
+		else if (!g_Recorder.checkpoint().empty()) RestoreShow(g_Recorder.checkpoint());
+	}
+
+	int seek = g_SeekRequested.exchange(0);
+	if (seek != 0) SeekShow(seek < 0 && (unsigned int)-seek > g_World->frame_ ? 0 : g_World->frame_ + seek, true);
+
+	KeepKeyframe();
+
+	Update();
+	g_Memory.end_frame();
+
+	g_StreamServer.send_frame(g_World->frame_);
+	g_Trajectory.capture(g_World->frame_);
+
+	g_Recorder.end_frame(g_Recorder.mode() != RECORD_OFF ? HashShow(g_World->spawners_) : 0);
+}
+
+//-----------------------------------------------------------------------------
+// Build the wind and the spawners - everything the simulation needs, without
+// touching the device.
+
+void SetupShow()
+{
+	//setup noise
+	BuildNoise(random_number());
 
 	//---------------------------------------
 	// SPAWNERS
@@ -362,12 +655,252 @@ void SetupParticleSystems()
 	std::shared_ptr<FireworkSpawner> e(new FireworkSpawnerEcho(D3DXVECTOR3(-150.0f, -200.0f, 0)));
 
 
-	g_Spawners.push_back(a);
-	g_Spawners.push_back(b);
-	g_Spawners.push_back(c);
-	g_Spawners.push_back(d);
-	g_Spawners.push_back(e);
+	g_World->spawners_.push_back(a);
+	g_World->spawners_.push_back(b);
+	g_World->spawners_.push_back(c);
+	g_World->spawners_.push_back(d);
+	g_World->spawners_.push_back(e);
+
+	// Each spawner has a random stream of its own - two sharing one would draw each other's numbers, and come out
+	// differently when sharded apart. Spawners past the last stream are left out of the show.
+	if (g_World->spawners_.size() > RANDOM_STREAMS - 1)
+	{
+		OutputDebugString(("Show: " + std::to_string(g_World->spawners_.size()) + " spawners, but random streams for only "
+			+ std::to_string(RANDOM_STREAMS - 1) + " - the rest are left out.\n").c_str());
+		g_World->spawners_.resize(RANDOM_STREAMS - 1);
+	}
+
+	// Only this shard's spawners are started - all of them in a single process.
+	for (size_t i = 0; i < g_World->spawners_.size(); ++i)
+	{
+		g_World->spawners_[i]->set_random_stream((int)i + 1);
+		if ((int)i % g_ShardCount == g_ShardIndex) g_World->spawners_[i]->Start();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Initialise the parameters for the particle system.
+
+void SetupParticleSystems()
+{
+	// Decode the images on worker threads while the rest of setup goes ahead.
+	// The sprites are not needed at all if the packed atlas is cached.
+	ASSET_LOADER loader;
+	bool cached = g_SpriteAtlas.load_cache(ATLAS_CACHE, g_SpriteFiles, TEXTURE_COUNT);
+
+	int sprites[TEXTURE_COUNT];
+	for (int i = 0; i < TEXTURE_COUNT && !cached; ++i) sprites[i] = loader.load(g_SpriteFiles[i]);
+	int skybox = loader.load("skybox.jpg");
+
+	loader.start();
+
+	//setup text
+	font = NULL;
+	D3DXCreateFont(device, 20, 15, FW_NORMAL, 1, false, DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, 
+		ANTIALIASED_QUALITY, FF_DONTCARE, "Arial", &font);
+
+	SetRect(&fRectangle, 0, 0, 900, 500);
+
+	message = "";
+
+	// The show itself, while the images finish decoding.
+	SetupShow();
+
+	//---------------------------------------
+	// TEXTURES
+	//---------------------------------------
+
+	loader.wait();
+
+	if (!cached)
+	{
+		const IMAGE *images[TEXTURE_COUNT];
+		for (int i = 0; i < TEXTURE_COUNT; ++i) images[i] = &loader.image(sprites[i]);
+
+		if (g_SpriteAtlas.build(images, TEXTURE_COUNT)) g_SpriteAtlas.save_cache(ATLAS_CACHE, g_SpriteFiles, TEXTURE_COUNT);
+	}
+
+	// One texture per sprite, as before, if the atlas cannot be used.
+	if (FAILED(g_SpriteAtlas.create(device)))
+	{
+		D3DXCreateTextureFromFile(device, "yellow.png", &yellowTex);
+		D3DXCreateTextureFromFile(device, "red.png", &redTex);
+		D3DXCreateTextureFromFile(device, "blue.png", &blueTex);
+		D3DXCreateTextureFromFile(device, "green.png", &greenTex);
+	}
+
+	//setup skybox
+	if (FAILED(CreateTextureFromImage(device, loader.image(skybox), &skyboxTex)))
+	{
+		D3DXCreateTextureFromFile(device, "skybox.jpg", &skyboxTex);
+	}
+
+	TrackTexture(skyboxTex);
+	TrackTexture(yellowTex);
+	TrackTexture(redTex);
+	TrackTexture(blueTex);
+	TrackTexture(greenTex);
+}
+
+//-----------------------------------------------------------------------------
+// Run as shard 'index' of 'count' for the compositor listening on 'port' (see
+// Shard.h) - simulate this shard's spawners and send every frame back, until
+// the compositor goes away.
+
+int RunShard(int index, int count, unsigned short port)
+{
+	SHARD_CLIENT client;
+	unsigned int seed;
+	if (index < 0 || index >= count || !client.connect(index, count, port, seed)) return 1;
+
+	g_ShardIndex = index;
+	g_ShardCount = count;
+
+	seed_show_random(seed);
+	g_World->deterministic_random_ = true;
+	g_PipelinedRender = true;	// The systems stage their vertices in memory - there is no device.
+	g_CompactVertices = true;	// Frames go over the wire quantized.
+
+	SetupShow();
+
+	FRAME_SNAPSHOT frame;
+	do
+	{
+		Update();
+		g_Memory.end_frame();
+		frame.capture(g_World->frame_, "");
+	}
+	while (client.send_frame(frame, g_World->wind_speed_));
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Simulate 'count' variants of the show from 'seed' (see seed_show_random())
+// for 'frames' frames each, several at once on a pool of threads, and save
+// where each one got to as a checkpoint for -restore to draw. Every variant is
+// a SHOW_WORLD of its own - they share the wind's noise table, and nothing is
+// drawn, so the device and textures are not needed at all.
+
+#define PREVIEW_FILE "preview_"				// Variant n is saved as preview_n.chk.
+
+int RunPreviews(int count, int frames, unsigned int seed)
+{
+	g_PipelinedRender = true;	// The systems stage their vertices in memory - there is no device.
+
+	std::atomic<int> next(0), failed(0);
+
+	auto worker = [&]()
+	{
+		for (int v = next++; v < count; v = next++)
+		{
+			SHOW_WORLD world;
+			WORLD_SCOPE scope(&world);
+
+			seed_show_random(seed, (unsigned int)v);
+			world.deterministic_random_ = true;
+
+			SetupShow();
+			while (world.frame_ < (unsigned int)frames) Update();
+
+			std::string file = PREVIEW_FILE + std::to_string(v) + ".chk";
+			if (!SHOW_CHECKPOINT::save(file.c_str(), ShowState(), world.spawners_)) ++failed;
+		}
+	};
+
+	int threads = (int)std::thread::hardware_concurrency();
+	if (threads < 1) threads = 1;
+	if (threads > count) threads = count;
 
+	std::vector<std::thread> pool;
+	for (int i = 1; i < threads; ++i) pool.push_back(std::thread(worker));
+	worker();
+	for (std::thread &t : pool) t.join();
+
+	if (failed > 0) OutputDebugString(("Previews: " + std::to_string(failed) + " could not be saved.\n").c_str());
+	return failed > 0 ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Simulate the show from 'seed' for 'frames' frames with no window, and draw
+// where it got to from every view on the CPU (see Views.h), at the window's
+// size. Each view is saved as a greyscale image. The show is simulated and
+// captured once, however many views there are.
+
+#define VIEW_SHOT_FILE "view_"				// Each view is saved as view_<name>.pgm.
+#define VIEW_SHOT_WIDTH 1280
+#define VIEW_SHOT_HEIGHT 960
+
+int RunViewShots(int frames, unsigned int seed)
+{
+	g_PipelinedRender = true;	// The systems stage their vertices in memory - there is no device.
+
+	seed_show_random(seed);
+	g_World->deterministic_random_ = true;
+
+	SetupShow();
+	while (g_World->frame_ < (unsigned int)frames) Update();
+
+	FRAME_SNAPSHOT frame;
+	frame.capture(g_World->frame_, "");
+
+	if (!g_Views.enabled()) g_Views.add_standard();
+	g_Views.prepare(frame, VIEW_SHOT_WIDTH, VIEW_SHOT_HEIGHT);
+
+	int failed = 0;
+	CPU_VIEW_TARGET target;
+
+	for (VIEW_PASS &p : g_Views.passes())
+	{
+		target.clear((int)p.viewport().Width, (int)p.viewport().Height);
+		target.draw(frame, p);
+
+		std::string name = p.view().name_;
+		std::replace(name.begin(), name.end(), ' ', '_');
+		if (!target.save((VIEW_SHOT_FILE + name + ".pgm").c_str())) ++failed;
+
+		OutputDebugString(("Views: " + p.view().name_ + " drew " + std::to_string(target.drawn()) + " sprites, " + std::to_string(target.clipped())
+			+ " outside, " + std::to_string(target.lit()) + " pixels lit.\n").c_str());
+	}
+
+	OutputDebugString((g_Views.status() + "\n").c_str());
+	return failed > 0 ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Simulate the show with no window at 'fps' frames a second, handing every
+// frame to the process drawing it through the frame ring called 'name' (see
+// FrameRing.h). Runs for 'frames' frames, or until stopped if that is 0.
+
+int RunRing(int frames, const char *name, double fps)
+{
+	g_PipelinedRender = true;	// The systems stage their vertices in memory - there is no device.
+
+	if (!g_FrameRing.create(name))
+	{
+		OutputDebugString("Ring: could not make the shared memory.\n");
+		return 1;
+	}
+
+	SetupShow();
+	g_Pacer.start(fps);
+
+	while (frames <= 0 || g_World->frame_ < (unsigned int)frames)
+	{
+		g_Pacer.wait();
+
+		// The systems write their vertices into the slot as they update.
+		g_FrameRing.begin_frame(g_World->frame_ + 1);
+		Update();
+		g_Memory.end_frame();
+		g_FrameRing.end_frame(g_World->wind_speed_);
+	}
+
+	OutputDebugString((g_FrameRing.status() + ", " + g_Pacer.status() + "\n").c_str());
+
+	g_Pacer.stop();
+	g_FrameRing.close();
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -382,16 +915,127 @@ LRESULT WINAPI MsgProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
             PostQuitMessage(0);
             return 0;
 		}
+
+		case WM_KEYDOWN:
+		{
+			// Both applied at the start of the next frame - not while replaying, which takes its restores from the log.
+			if (wParam == VK_F5 && g_Recorder.mode() != RECORD_REPLAY) g_SaveRequested = true;
+			if (wParam == VK_F9 && g_Recorder.mode() != RECORD_REPLAY) g_PendingInputs |= INPUT_RESTORE;
+			if (wParam == VK_LEFT) g_SeekRequested -= SEEK_STEP;
+			if (wParam == VK_RIGHT) g_SeekRequested += SEEK_STEP;
+			return 0;
+		}
     }
 
     return DefWindowProc(hWnd, msg, wParam, lParam);
 }
 
+//-----------------------------------------------------------------------------
+// Command line options - words separated by spaces.
+
+std::vector<std::string> SplitCommandLine(const char *cmdLine)
+{
+	std::vector<std::string> words;
+	std::string word;
+
+	for (const char *c = cmdLine; c && *c; ++c)
+	{
+		if (*c == ' ')
+		{
+			if (!word.empty()) words.push_back(word);
+			word.clear();
+		}
+		else word += *c;
+	}
+	if (!word.empty()) words.push_back(word);
+
+	return words;
+}
+
+bool HasOption(const char *cmdLine, const char *option)
+{
+	std::vector<std::string> words = SplitCommandLine(cmdLine);
+	return std::find(words.begin(), words.end(), option) != words.end();
+}
+
+// Return the word following 'option', or "" if it is not there.
+std::string GetOption(const char *cmdLine, const char *option)
+{
+	std::vector<std::string> words = SplitCommandLine(cmdLine);
+	std::vector<std::string>::iterator w = std::find(words.begin(), words.end(), option);
+
+	if (w == words.end() || w + 1 == words.end() || (*(w + 1))[0] == '-') return "";
+	return *(w + 1);
+}
+
 //-----------------------------------------------------------------------------
 // WinMain() - The application's entry point.
 
-int WINAPI WinMain(HINSTANCE hInst, HINSTANCE, LPSTR, int)
+int WINAPI WinMain(HINSTANCE hInst, HINSTANCE, LPSTR lpCmdLine, int)
 {
+	// "-shard <index> <count> <port>" - a worker launched by a compositor, with no window.
+	std::vector<std::string> words = SplitCommandLine(lpCmdLine);
+	std::vector<std::string>::iterator shard = std::find(words.begin(), words.end(), "-shard");
+	if (words.end() - shard > 3)
+	{
+		return RunShard(atoi(shard[1].c_str()), atoi(shard[2].c_str()), (unsigned short)atoi(shard[3].c_str()));
+	}
+
+	// "-previews <count> <frames> [seed]" - save that many variants of the show at that frame, and quit.
+	std::vector<std::string>::iterator previews = std::find(words.begin(), words.end(), "-previews");
+	if (words.end() - previews > 2)
+	{
+		unsigned int seed = words.end() - previews > 3 && previews[3][0] != '-' ? (unsigned int)strtoul(previews[3].c_str(), NULL, 10) : 1;
+		return RunPreviews(atoi(previews[1].c_str()), atoi(previews[2].c_str()), seed);
+	}
+
+	// "-viewshots <frames> [seed]" - draw the show at that frame from every view, without a window, and quit.
+	std::vector<std::string>::iterator viewshots = std::find(words.begin(), words.end(), "-viewshots");
+	if (words.end() - viewshots > 1)
+	{
+		unsigned int seed = words.end() - viewshots > 2 && viewshots[2][0] != '-' ? (unsigned int)strtoul(viewshots[2].c_str(), NULL, 10) : 1;
+		return RunViewShots(atoi(viewshots[1].c_str()), seed);
+	}
+
+	// "-ring <frames> [name]" - simulate the show for another process to draw, with no window, and quit after that many frames (0 for never).
+	std::vector<std::string>::iterator ring = std::find(words.begin(), words.end(), "-ring");
+	if (words.end() - ring > 1)
+	{
+		std::string name = words.end() - ring > 2 && ring[2][0] != '-' ? ring[2] : FRAME_RING_NAME;
+		std::string fps = GetOption(lpCmdLine, "-fps");
+		return RunRing(atoi(ring[1].c_str()), name.c_str(), fps.empty() ? SHOW_FPS : atof(fps.c_str()));
+	}
+
+	// "-benchlights [file]" - time the flash light binning (see Benchmark.h), without a window, and quit.
+	if (HasOption(lpCmdLine, "-benchlights"))
+	{
+		std::string benchFile = GetOption(lpCmdLine, "-benchlights");
+
+		BENCHMARK_SUITE suite;
+		if (!suite.run_lights(benchFile.empty() ? "benchmarks.json" : benchFile.c_str()))
+		{
+			OutputDebugString("Benchmark: could not write the results.\n");
+			return 1;
+		}
+		return 0;
+	}
+
+	// "-landing <trajectory> [csv]" - map where the particles in a trajectory log came down, and quit.
+	std::string landingFile = GetOption(lpCmdLine, "-landing");
+	if (!landingFile.empty())
+	{
+		std::vector<std::string>::iterator csv = std::find(words.begin(), words.end(), "-landing") + 2;
+		std::string csvFile = csv < words.end() && (*csv)[0] != '-' ? *csv : landingFile + ".landing.csv";
+
+		LANDING_MAP map;
+		if (!map.build(landingFile.c_str()) || !map.write(csvFile.c_str()))
+		{
+			OutputDebugString(("Trajectory: could not map " + landingFile + ".\n").c_str());
+			return 1;
+		}
+		return 0;
+	}
+
     // Register the window class
     WNDCLASSEX wc = {sizeof(WNDCLASSEX), CS_CLASSDC, MsgProc, 0L, 0L, GetModuleHandle(NULL), NULL, NULL, NULL, NULL, "PSystem", NULL};
     RegisterClassEx(&wc);
@@ -405,6 +1049,28 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE, LPSTR, int)
 	QueryPerformanceCounter(&counter);	
 	srand(counter.LowPart);
 
+	// Record or replay the show - this has to happen before anything draws a random number.
+	std::string recordFile = GetOption(lpCmdLine, "-record");
+	std::string replayFile = GetOption(lpCmdLine, "-replay");
+
+	bool logging = true;
+	if (!recordFile.empty()) logging = g_Recorder.start_recording(recordFile.c_str(), counter.LowPart);
+	else if (!replayFile.empty()) logging = g_Recorder.start_replay(replayFile.c_str());
+
+	if (!logging)
+	{
+		OutputDebugString(("Replay: could not " + (recordFile.empty() ? "replay " + replayFile + " (missing, or from another version)" : "write " + recordFile) + ".\n").c_str());
+		UnregisterClass("PSystem", wc.hInstance);
+		return 1;
+	}
+
+	// Otherwise the show plays on the seeded streams as well, so a seek back plays on the way it went the first time (see Seek.h).
+	if (g_Recorder.mode() == RECORD_OFF)
+	{
+		seed_show_random(counter.LowPart);
+		g_World->deterministic_random_ = true;
+	}
+
     // Initialize Direct3D
     if (SUCCEEDED(SetupD3D(hWnd)))
     {
@@ -418,8 +1084,108 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE, LPSTR, int)
 			// Set up the light.
 			SetupLights();
 
+			// "-compact" uploads the particles as quantized 8 byte vertices - falls back to the float stream if the shader will not build.
+			if (HasOption(lpCmdLine, "-compact"))
+			{
+				g_CompactVertices = true;
+				SetupCompactVertices(device);
+			}
+
+			// "-compactstate" keeps the explosions' particles in 16 bytes rather than 32 (see CompactParticle.h).
+			// Streaming, recording and the trajectory log read the float particles, so it is left off with those.
+			g_CompactParticles = HasOption(lpCmdLine, "-compactstate") && !HasOption(lpCmdLine, "-stream") && !HasOption(lpCmdLine, "-trajectory")
+				&& recordFile.empty() && replayFile.empty();
+
+			// "-ringview [name]" draws the frames a "-ring" process simulates, and simulates nothing here.
+			if (HasOption(lpCmdLine, "-ringview"))
+			{
+				std::string ringName = GetOption(lpCmdLine, "-ringview");
+				g_CompactVertices = false;	// The ring holds float vertices.
+
+				if (!g_RingReader.open(ringName.empty() ? FRAME_RING_NAME : ringName.c_str()))
+				{
+					OutputDebugString("Ring: no simulation to draw - start one with -ring first.\n");
+				}
+			}
+
+			// "-views" splits the window between the audience, a drone and a camera looking down (see Views.h).
+			bool views = HasOption(lpCmdLine, "-views");
+			if (views) g_Views.add_standard();
+
+			// "-pipeline" simulates on a second thread while the last frame is drawn.
+			// Streaming and viewing need the staged vertices of that mode too, and so do the views - they draw from
+			// the snapshots - unless the shards are simulating.
+			std::string viewHost = GetOption(lpCmdLine, "-view");
+			g_PipelinedRender = HasOption(lpCmdLine, "-pipeline") || HasOption(lpCmdLine, "-stream") || !viewHost.empty()
+				|| (views && !HasOption(lpCmdLine, "-composite"));
+
 			SetupParticleSystems();
 
+			// "-bench [file]" times the simulation hot paths, writes them out and quits.
+			if (HasOption(lpCmdLine, "-bench"))
+			{
+				std::string benchFile = GetOption(lpCmdLine, "-bench");
+
+				BENCHMARK_SUITE suite;
+				suite.run(benchFile.empty() ? "benchmarks.json" : benchFile.c_str());
+
+				CleanUp();
+				UnregisterClass("PSystem", wc.hInstance);
+				return 0;
+			}
+
+			// "-restore <checkpoint>" jumps straight to that point in the show.
+			std::string restoreFile = GetOption(lpCmdLine, "-restore");
+			// Not when replaying - a restore at the start of the recording is in the log.
+			if (!restoreFile.empty() && g_Recorder.mode() != RECORD_REPLAY) RestoreShow(restoreFile.c_str());
+
+			// "-seek <frames>" starts that many frames further into the show (or the checkpoint).
+			std::string seekFrame = GetOption(lpCmdLine, "-seek");
+			if (!seekFrame.empty() && atoi(seekFrame.c_str()) > 0) SeekShow(g_World->frame_ + atoi(seekFrame.c_str()), false);
+
+			// "-trajectory <file>" logs every particle's path through the show, from here on.
+			std::string trajectoryFile = GetOption(lpCmdLine, "-trajectory");
+			if (!trajectoryFile.empty() && !g_Trajectory.start(trajectoryFile.c_str(), g_World->spawners_))
+			{
+				OutputDebugString(("Trajectory: could not write " + trajectoryFile + ".\n").c_str());
+			}
+
+			// "-view <host>[:port]" draws a show streamed from another machine, and simulates nothing here.
+			if (!viewHost.empty() && !g_StreamViewer.start(viewHost))
+			{
+				OutputDebugString(("Stream: could not connect to " + viewHost + ".\n").c_str());
+			}
+
+			// "-stream [port]" sends the show to any viewers that connect.
+			if (HasOption(lpCmdLine, "-stream"))
+			{
+				std::string port = GetOption(lpCmdLine, "-stream");
+				if (!g_StreamServer.start(port.empty() ? STREAM_PORT : (unsigned short)atoi(port.c_str())))
+				{
+					OutputDebugString("Stream: could not listen for viewers.\n");
+				}
+			}
+
+			if (g_PipelinedRender && !g_StreamViewer.viewing())
+			{
+				g_Pipeline.start([]() { SimulateFrame(); return (int)g_World->frame_; }, StatusText);
+			}
+
+			// "-composite <count>" simulates the show in that many shard processes instead, and only draws it here.
+			std::string shards = GetOption(lpCmdLine, "-composite");
+			if (!shards.empty() && g_PipelinedRender)
+			{
+				OutputDebugString("Shards: -composite cannot be used with -pipeline, -stream or -view, simulating here instead.\n");
+			}
+			else if (!shards.empty() && !g_Compositor.start(atoi(shards.c_str()), counter.LowPart))
+			{
+				OutputDebugString("Shards: could not start the shard processes, simulating here instead.\n");
+			}
+
+			// "-fps <rate>" runs the show at that many frames a second - 0 for as fast as the machine goes.
+			std::string fps = GetOption(lpCmdLine, "-fps");
+			g_Pacer.start(fps.empty() ? SHOW_FPS : atof(fps.c_str()));
+
             // Enter the message loop
             MSG msg;
             ZeroMemory(&msg, sizeof(msg));
@@ -432,9 +1198,12 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE, LPSTR, int)
                 }
                 else
 				{
+					// Sleep until the next frame is due.
+					g_Pacer.wait();
+
 					SetupViewMatrices();
 
-					Update();
+					if (!g_PipelinedRender && !g_Compositor.running() && !g_RingReader.opened()) SimulateFrame();
 
 					render();
 				}
@@ -442,6 +1211,18 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE, LPSTR, int)
         }
     }
 
+	g_Pacer.stop();
+	g_Pipeline.stop();
+	g_Trajectory.stop();
+	g_Compositor.stop();
+	g_StreamViewer.stop();
+	g_StreamServer.stop();
+	g_RingReader.close();
+
+	g_Recorder.finish();
+
+	OutputDebugString(g_Memory.report().c_str());
+
 	CleanUp();
 
     UnregisterClass("PSystem", wc.hInstance);
@@ -0,0 +1,363 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// PIPELINED SIMULATION AND RENDERING
+//
+// With -pipeline on the command line the show is simulated on a worker thread
+// while the main thread draws the previous frame. After each frame the worker
+// copies everything render() needs (the vertices of every system, one draw per
+// system, the explosion flashes and the on screen text) into a FRAME_SNAPSHOT, and hands it over
+// through a lock free triple buffer. The systems themselves never touch the
+// device in this mode - SNAPSHOT_RENDERER uploads each snapshot into a single
+// dynamic vertex buffer and draws it from there.
+//
+// The worker simulates at most one frame ahead of the one being drawn: it
+// waits before publishing a new snapshot until the main thread has taken the
+// last one (asleep on an event, so the main thread's frame pacing holds the
+// worker to the same rate without it spinning). The status line reports how far behind the simulation the screen
+// is, in frames and in ms from the end of a frame's simulation to its Present.
+//-----------------------------------------------------------------------------
+
+#include "ParticleSystem.h"
+#include "Lights.h"
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+// One system's draw within a snapshot.
+struct SNAPSHOT_DRAW
+{
+	int sprite_;
+	float particle_size_;
+	int first_;					// First vertex in the snapshot's buffer.
+	int count_;
+	COMPACT_RANGE range_;		// How the vertices decode (compact stream only).
+};
+
+// Everything needed to draw one simulated frame.
+struct FRAME_SNAPSHOT
+{
+	FRAME_SNAPSHOT() : frame_(-1), captured_(0) {}
+
+	// Copy the vertices of every system out of the simulation. Call on the simulation thread, straight after Update().
+	void capture(int frame, const std::string &text)
+	{
+		frame_ = frame;
+		text_ = text;
+		draws_.clear();
+		points_.clear();
+		compact_.clear();
+		lights_.clear();
+
+		GatherFlashLights(g_World->particles_, lights_);
+
+		for (auto &s : g_World->particles_)
+		{
+			int n = s->staged_count();
+			if (n == 0 || s->safeToDelete) continue;
+
+			SNAPSHOT_DRAW d;
+			d.sprite_ = s->sprite_;
+			d.particle_size_ = s->particle_size_;
+			d.count_ = n;
+
+			const POINTVERTEX *v = s->staged_vertices();
+
+			if (g_CompactVertices)
+			{
+				d.first_ = (int)compact_.size();
+				d.range_ = compact_range(&v->position_, n, sizeof(POINTVERTEX), s->origin_);
+
+				compact_.resize(d.first_ + n);
+				encode_compact_vertices(&v->position_, s->staged_brightness(), n, sizeof(POINTVERTEX), d.range_, &compact_[d.first_]);
+			}
+			else
+			{
+				d.first_ = (int)points_.size();
+				points_.insert(points_.end(), v, v + n);
+			}
+
+			draws_.push_back(d);
+		}
+
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		captured_ = t.QuadPart;
+	}
+
+	int frame_;									// SHOW_WORLD::frame_ when captured, -1 for an empty snapshot.
+	LONGLONG captured_;							// Performance counter when captured.
+	std::vector<SNAPSHOT_DRAW> draws_;
+	std::vector<POINTVERTEX, TRACKED_ALLOCATOR<POINTVERTEX, MEM_STAGING>> points_;
+	std::vector<COMPACT_POINTVERTEX, TRACKED_ALLOCATOR<COMPACT_POINTVERTEX, MEM_STAGING>> compact_;	// Used instead of 'points_' with the compact stream.
+	std::vector<FLASH_LIGHT> lights_;			// Explosion flashes (see Lights.h).
+	std::string text_;							// On screen text.
+};
+
+//-----------------------------------------------------------------------------
+// Lock free triple buffer for one writer and one reader. The writer fills
+// write_buffer() and publishes it, the reader picks up the newest published
+// buffer with acquire() and reads it from read_buffer(). The buffer itself
+// never blocks either side, but SIMULATION_PIPELINE::run() waits for taken()
+// before each publish(), so the writer is at most one frame ahead and the
+// handoff works like a double buffer with a wait - the third slot lets the
+// writer fill the next frame while the reader still has the last one.
+
+template <class T>
+class TRIPLE_BUFFER
+{
+public:
+	TRIPLE_BUFFER() : back_(0), middle_(1), front_(2) {}
+
+	T &write_buffer() { return slots_[back_]; }
+	const T &read_buffer() const { return slots_[front_]; }
+
+	// True once the reader has taken the last buffer published.
+	bool taken() const { return (middle_.load(std::memory_order_acquire) & FRESH) == 0; }
+
+	// Swap the written buffer into the middle, and carry on with whatever was there.
+	void publish()
+	{
+		back_ = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	// Swap the newest published buffer to the front. False if nothing new has been published.
+	bool acquire()
+	{
+		if (middle_.load(std::memory_order_relaxed) & FRESH)
+		{
+			front_ = middle_.exchange(front_, std::memory_order_acq_rel) & INDEX;
+			return true;
+		}
+		return false;
+	}
+
+private:
+	enum { INDEX = 0x03, FRESH = 0x04 };
+
+	T slots_[3];
+	int back_;						// Writer's slot.
+	std::atomic<int> middle_;		// Slot in between, with FRESH set when it has not been read yet.
+	int front_;						// Reader's slot.
+};
+
+//-----------------------------------------------------------------------------
+// Runs the simulation on a worker thread, feeding snapshots to the main thread.
+
+class SIMULATION_PIPELINE
+{
+public:
+	SIMULATION_PIPELINE() : running_(false), simulated_(0), sim_ticks_(0), sim_frames_(0), latency_ticks_(0), latency_frames_(0), depth_(0)
+	{
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency_ = f.QuadPart;
+
+		taken_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+
+	~SIMULATION_PIPELINE()
+	{
+		stop();
+		if (taken_) CloseHandle(taken_);
+	}
+
+	bool running() const { return running_; }
+
+	// Start the worker. 'simulate' runs one frame and returns its number, 'text' gives the on screen text for it.
+	void start(std::function<int()> simulate, std::function<std::string()> text)
+	{
+		if (running_) return;
+
+		simulate_ = simulate;
+		text_ = text;
+		running_ = true;
+		worker_ = std::thread(&SIMULATION_PIPELINE::run, this);
+	}
+
+	void stop()
+	{
+		running_ = false;
+		if (worker_.joinable()) worker_.join();
+	}
+
+	// The newest simulated frame, for the main thread to draw. Never waits - the same frame is drawn again if nothing new is ready.
+	const FRAME_SNAPSHOT &acquire()
+	{
+		buffers_.acquire();
+		if (taken_) SetEvent(taken_);
+
+		return buffers_.read_buffer();
+	}
+
+	// Call after presenting the frame returned by acquire().
+	void presented()
+	{
+		const FRAME_SNAPSHOT &s = buffers_.read_buffer();
+		if (s.frame_ < 0) return;
+
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+
+		latency_ticks_ += t.QuadPart - s.captured_;
+		++latency_frames_;
+		depth_ = simulated_ - s.frame_;
+	}
+
+	// One line summary for the on screen text.
+	std::string status() const
+	{
+		double sim = sim_frames_ ? (double)sim_ticks_ * 1000.0 / (double)frequency_ / (double)sim_frames_ : 0.0;
+		double latency = latency_frames_ ? (double)latency_ticks_ * 1000.0 / (double)frequency_ / (double)latency_frames_ : 0.0;
+
+		return "Pipelined: simulate " + std::to_string(sim) + " ms/frame, latency " + std::to_string(latency) + " ms, " + std::to_string(depth_) + " frame(s) behind";
+	}
+
+private:
+
+	void run()
+	{
+		while (running_)
+		{
+			LARGE_INTEGER start, end;
+			QueryPerformanceCounter(&start);
+
+			int frame = simulate_();
+			buffers_.write_buffer().capture(frame, text_());
+
+			QueryPerformanceCounter(&end);
+			sim_ticks_ += end.QuadPart - start.QuadPart;
+			++sim_frames_;
+
+			// Keep at most one frame ahead of the screen.
+			while (running_ && !buffers_.taken())
+			{
+				if (taken_) WaitForSingleObject(taken_, 1);		// Times out now and then to see if it has been stopped.
+				else std::this_thread::yield();
+			}
+
+			buffers_.publish();
+			simulated_ = frame;
+		}
+	}
+
+	TRIPLE_BUFFER<FRAME_SNAPSHOT> buffers_;
+	std::thread worker_;
+	std::atomic<bool> running_;
+	std::function<int()> simulate_;
+	std::function<std::string()> text_;
+	HANDLE taken_;						// Set by acquire(), for the worker to wait on.
+
+	std::atomic<int> simulated_;		// Frame number of the last snapshot published.
+	LONGLONG frequency_;
+	std::atomic<LONGLONG> sim_ticks_;	// Time spent simulating and capturing, for status().
+	std::atomic<int> sim_frames_;
+	LONGLONG latency_ticks_;			// Capture to Present, summed over every frame drawn.
+	int latency_frames_;
+	int depth_;							// Frames simulated but not yet drawn, at the last Present.
+};
+
+//-----------------------------------------------------------------------------
+// Draws snapshots on the main thread, from one dynamic vertex buffer.
+
+class SNAPSHOT_RENDERER
+{
+public:
+	SNAPSHOT_RENDERER() : vertices_(NULL), capacity_(0) {}
+
+	~SNAPSHOT_RENDERER()
+	{
+		release();
+	}
+
+	void release()
+	{
+		SAFE_RELEASE(vertices_);
+		capacity_ = 0;
+	}
+
+	void render(const FRAME_SNAPSHOT &s)
+	{
+		if (!upload(s)) return;
+
+		for (const SNAPSHOT_DRAW &d : s.draws_)
+		{
+			draw(d);
+		}
+	}
+
+	// Draw a frame handed over through the frame ring, straight from the shared memory (see FrameRing.h).
+	void render(const FRAME_RING_SLOT &s)
+	{
+		if (g_CompactVertices || !upload(s.vertex_, s.vertices_)) return;
+
+		for (int i = 0; i < s.draws_; ++i)
+		{
+			SNAPSHOT_DRAW d;
+			d.sprite_ = s.draw_[i].sprite_;
+			d.particle_size_ = s.draw_[i].particle_size_;
+			d.first_ = s.draw_[i].first_;
+			d.count_ = s.draw_[i].count_;
+			draw(d);
+		}
+	}
+
+	// Copy the whole frame into the vertex buffer in one go. False if there is nothing to draw.
+	bool upload(const FRAME_SNAPSHOT &s)
+	{
+		if (g_CompactVertices) return upload(s.compact_.data(), (int)s.compact_.size());
+		return upload(s.points_.data(), (int)s.points_.size());
+	}
+
+	// Copy 'count' vertices - compact ones with the compact stream - into the vertex buffer.
+	bool upload(const void *vertices, int count)
+	{
+		int stride = g_CompactVertices ? sizeof(COMPACT_POINTVERTEX) : sizeof(POINTVERTEX);
+		if (count == 0) return false;
+
+		if (count > capacity_ && FAILED(grow(count))) return false;
+
+		void *data;
+		if (FAILED(vertices_->Lock(0, count * stride, &data, D3DLOCK_DISCARD))) return false;
+		memcpy(data, vertices, count * stride);
+		vertices_->Unlock();
+
+		return true;
+	}
+
+	// Draw one of the uploaded frame's systems, with the transforms and viewport already set.
+	void draw(const SNAPSHOT_DRAW &d)
+	{
+		int stride = g_CompactVertices ? sizeof(COMPACT_POINTVERTEX) : sizeof(POINTVERTEX);
+
+		BeginPointSprites(d.sprite_, d.particle_size_);
+		if (g_CompactVertices) SetCompactConstants(device, d.range_, d.particle_size_);
+
+		device-> SetStreamSource(0, vertices_, 0, stride);
+		device-> DrawPrimitive(D3DPT_POINTLIST, d.first_, d.count_);
+
+		EndPointSprites();
+	}
+
+private:
+
+	HRESULT grow(int count)
+	{
+		release();
+
+		// Leave some room, so the buffer is not recreated every time the show gets a little busier.
+		int capacity = count + count / 2;
+		int stride = g_CompactVertices ? sizeof(COMPACT_POINTVERTEX) : sizeof(POINTVERTEX);
+
+		if (FAILED(device->CreateVertexBuffer(capacity * stride, D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY, g_CompactVertices ? 0 : D3DFVF_POINTVERTEX, D3DPOOL_DEFAULT, &vertices_, NULL)))
+		{
+			return E_FAIL;
+		}
+
+		capacity_ = capacity;
+		return S_OK;
+	}
+
+	LPDIRECT3DVERTEXBUFFER9 vertices_;
+	int capacity_;						// In vertices.
+};
@@ -0,0 +1,343 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// SHOW RECORD AND REPLAY
+//
+// Recording switches random_number() over to the seedable SHOW_RANDOM and logs
+// the seed, then one small record per frame:
+//   varint  number of random numbers drawn during the frame
+//   byte    external inputs applied at the start of the frame (INPUT_xxx)
+//   uint    hash of the show state at the end of the frame
+//   varint  size of the checkpoint restored, and the checkpoint itself - only
+//           with INPUT_RESTORE (F9, or "-restore" before the first frame)
+//
+// Replaying seeds the generator the same way and feeds the logged inputs back
+// in on the same frames, so the show runs exactly as it did when recorded. A
+// restore restores the checkpoint from the log, not whatever the file holds by
+// then, and F5 and F9 are ignored while replaying.
+// Every frame's draw count and state hash are checked against the log and the
+// first frame that differs is reported. The time spent simulating is measured
+// as well, so a replay doubles as a repeatable benchmark for the update code.
+//-----------------------------------------------------------------------------
+
+#include "ParticleSystem.h"
+#include <stdio.h>
+#include <string>
+
+#define REPLAY_VERSION 6
+
+// External inputs that change the show, logged per frame.
+#define INPUT_RESTORE	0x01		// Checkpoint restored (F9).
+
+enum RECORD_MODE
+{
+	RECORD_OFF,
+	RECORD_ON,
+	RECORD_REPLAY
+};
+
+struct REPLAY_HEADER
+{
+	char			magic_[4];		// "FWRP"
+	unsigned int	version_;
+	unsigned int	seed_;			// Seed for every random stream.
+};
+
+struct REPLAY_FRAME
+{
+	unsigned int draws_;
+	unsigned int inputs_;
+	unsigned int hash_;
+	std::vector<char> checkpoint_;	// Restored at the start of the frame (INPUT_RESTORE).
+};
+
+//-----------------------------------------------------------------------------
+// FNV-1a hash of everything that makes up the state of the show.
+
+class SHOW_HASH
+{
+public:
+	SHOW_HASH() : h_(2166136261u) {}
+
+	void add(const void *data, size_t bytes)
+	{
+		const unsigned char *c = (const unsigned char *)data;
+		for (size_t i = 0; i < bytes; ++i)
+		{
+			h_ = (h_ ^ c[i]) * 16777619u;
+		}
+	}
+
+	unsigned int value() const { return h_; }
+
+private:
+	unsigned int h_;
+};
+
+unsigned int HashShow(const std::vector<std::shared_ptr<FireworkSpawner>> &spawners)
+{
+	SHOW_HASH h;
+
+	h.add(&g_World->wind_speed_, sizeof(g_World->wind_speed_));
+	h.add(&g_World->wind_drift_, sizeof(g_World->wind_drift_));
+
+	for (auto &s : spawners)
+	{
+		int counter = s->counter();
+		h.add(&counter, sizeof(counter));
+	}
+
+	for (auto &s : g_World->particles_)
+	{
+		int type = s->type();
+		h.add(&type, sizeof(type));
+		h.add(&s->origin_, sizeof(s->origin_));
+		h.add(&s->alive_particles_, sizeof(s->alive_particles_));
+
+		const PARTICLE_VECTOR &particles = s->particles();
+		if (!particles.empty()) h.add(&particles[0], particles.size() * sizeof(PARTICLE));
+	}
+
+	return h.value();
+}
+
+//-----------------------------------------------------------------------------
+
+class SHOW_RECORDER
+{
+public:
+	SHOW_RECORDER() : mode_(RECORD_OFF), file_(NULL), frame_(0), draws_(0), inputs_(0), restored_(false), diverged_frame_(-1), update_ticks_(0), frames_timed_(0)
+	{
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency_ = f.QuadPart;
+	}
+
+	~SHOW_RECORDER()
+	{
+		finish();
+	}
+
+	RECORD_MODE mode() const { return mode_; }
+
+	// Start logging to 'filename'. Must be called before anything draws a random number.
+	bool start_recording(const char *filename, unsigned int seed)
+	{
+		if (fopen_s(&file_, filename, "wb") != 0 || file_ == NULL) return false;
+
+		REPLAY_HEADER header;
+		memcpy(header.magic_, "FWRP", 4);
+		header.version_ = REPLAY_VERSION;
+		header.seed_ = seed;
+		fwrite(&header, sizeof(header), 1, file_);
+
+		seed_show_random(seed);
+		g_World->deterministic_random_ = true;
+		mode_ = RECORD_ON;
+		return true;
+	}
+
+	// Load the log in 'filename' and set up to reproduce it. Must be called before anything draws a random number.
+	bool start_replay(const char *filename)
+	{
+		FILE *f = NULL;
+		if (fopen_s(&f, filename, "rb") != 0 || f == NULL) return false;
+
+		std::vector<unsigned char> data;
+		unsigned char buffer[4096];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) data.insert(data.end(), buffer, buffer + n);
+		fclose(f);
+
+		REPLAY_HEADER header;
+		if (data.size() < sizeof(header)) return false;
+		memcpy(&header, &data[0], sizeof(header));
+		if (memcmp(header.magic_, "FWRP", 4) != 0 || header.version_ != REPLAY_VERSION) return false;
+
+		// Decode the frame records.
+		size_t p = sizeof(header);
+		while (p < data.size())
+		{
+			REPLAY_FRAME r;
+			if (!read_varint(data, p, r.draws_) || p + 5 > data.size()) break;
+			r.inputs_ = data[p++];
+			memcpy(&r.hash_, &data[p], 4);
+			p += 4;
+
+			if (r.inputs_ & INPUT_RESTORE)
+			{
+				unsigned int bytes;
+				if (!read_varint(data, p, bytes) || bytes > data.size() - p) break;
+				r.checkpoint_.assign(data.begin() + p, data.begin() + p + bytes);
+				p += bytes;
+			}
+
+			frames_.push_back(r);
+		}
+
+		seed_show_random(header.seed_);
+		g_World->deterministic_random_ = true;
+		mode_ = RECORD_REPLAY;
+		return true;
+	}
+
+	// Call before simulating a frame with the inputs gathered since the last one.
+	// Returns the inputs that should actually be applied this frame.
+	unsigned int begin_frame(unsigned int inputs)
+	{
+		if (mode_ == RECORD_REPLAY)
+		{
+			// Live inputs are ignored, the logged ones are used instead.
+			inputs = frame_ < frames_.size() ? frames_[frame_].inputs_ : 0;
+		}
+
+		inputs_ = inputs | (restored_ ? INPUT_RESTORE : 0);	// Including a restore before the first frame.
+		draws_ = g_World->random_draws_;
+
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		start_ticks_ = t.QuadPart;
+
+		return inputs;
+	}
+
+	// Call after simulating a frame with HashShow() of the result.
+	void end_frame(unsigned int hash)
+	{
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+
+		if (mode_ == RECORD_OFF) return;
+
+		update_ticks_ += t.QuadPart - start_ticks_;
+		++frames_timed_;
+
+		unsigned int draws = g_World->random_draws_ - draws_;
+
+		if (mode_ == RECORD_ON)
+		{
+			unsigned char record[10];
+			int n = write_varint(record, draws);
+			record[n++] = (unsigned char)inputs_;
+			fwrite(record, 1, n, file_);
+			fwrite(&hash, sizeof(hash), 1, file_);
+
+			if (inputs_ & INPUT_RESTORE)
+			{
+				// Empty if the checkpoint could not be read - the replay restores nothing either.
+				n = write_varint(record, (unsigned int)restore_.size());
+				fwrite(record, 1, n, file_);
+				if (!restore_.empty()) fwrite(&restore_[0], 1, restore_.size(), file_);
+			}
+
+			restore_.clear();
+			restored_ = false;
+		}
+		else
+		{
+			if (frame_ >= frames_.size())
+			{
+				finish();	// End of the log - carry on live from here.
+				return;
+			}
+
+			if (diverged_frame_ < 0 && (frames_[frame_].draws_ != draws || frames_[frame_].hash_ != hash))
+			{
+				diverged_frame_ = (int)frame_;
+				OutputDebugString(("Replay: diverged from the recording at frame " + std::to_string(frame_) + "\n").c_str());
+			}
+		}
+
+		++frame_;
+	}
+
+	// Log the checkpoint 'data' as restored this frame (or, before the first frame, as restored at the start of it).
+	void restored(const std::vector<char> &data)
+	{
+		if (mode_ != RECORD_ON) return;
+
+		restore_ = data;
+		restored_ = true;
+		inputs_ |= INPUT_RESTORE;
+	}
+
+	// The checkpoint to restore this frame, when replaying. Empty if there is none.
+	const std::vector<char> &checkpoint() const
+	{
+		return mode_ == RECORD_REPLAY && frame_ < frames_.size() ? frames_[frame_].checkpoint_ : restore_;
+	}
+
+	// Stop recording or replaying and report the result.
+	void finish()
+	{
+		if (mode_ == RECORD_OFF) return;
+
+		if (file_)
+		{
+			fclose(file_);
+			file_ = NULL;
+		}
+
+		report_ = status();
+		OutputDebugString(("Replay: " + report_ + "\n").c_str());
+
+		mode_ = RECORD_OFF;
+	}
+
+	// One line summary for the on screen text.
+	std::string status() const
+	{
+		if (mode_ == RECORD_OFF) return report_;
+
+		double ms = frames_timed_ ? (double)update_ticks_ * 1000.0 / (double)frequency_ / (double)frames_timed_ : 0.0;
+		std::string s = (mode_ == RECORD_ON ? "Recording" : "Replaying") + std::string(" frame ") + std::to_string(frame_);
+
+		if (mode_ == RECORD_REPLAY)
+		{
+			s += " of " + std::to_string(frames_.size());
+			s += diverged_frame_ < 0 ? " (matching)" : " (DIVERGED at frame " + std::to_string(diverged_frame_) + ")";
+		}
+
+		return s + ", update " + std::to_string(ms) + " ms/frame";
+	}
+
+private:
+
+	static int write_varint(unsigned char *out, unsigned int v)
+	{
+		int n = 0;
+		while (v >= 0x80)
+		{
+			out[n++] = (unsigned char)(v | 0x80);
+			v >>= 7;
+		}
+		out[n++] = (unsigned char)v;
+		return n;
+	}
+
+	static bool read_varint(const std::vector<unsigned char> &data, size_t &p, unsigned int &v)
+	{
+		v = 0;
+		for (int shift = 0; shift < 35 && p < data.size(); shift += 7)
+		{
+			unsigned char c = data[p++];
+			v |= (unsigned int)(c & 0x7F) << shift;
+			if (!(c & 0x80)) return true;
+		}
+		return false;
+	}
+
+	RECORD_MODE mode_;
+	FILE *file_;						// Log being written (RECORD_ON).
+	std::vector<REPLAY_FRAME> frames_;	// Log being replayed (RECORD_REPLAY).
+	unsigned int frame_;				// Frames recorded / replayed so far.
+
+	unsigned int draws_;				// SHOW_WORLD::random_draws_ at the start of the frame.
+	unsigned int inputs_;				// Inputs applied this frame.
+	std::vector<char> restore_;			// Checkpoint restored this frame, for the log (RECORD_ON) - always empty otherwise.
+	bool restored_;						// 'restore_' goes in the log with this frame (or the first, before it starts).
+	int diverged_frame_;				// First frame that did not match the log, -1 if none.
+
+	LONGLONG frequency_, start_ticks_, update_ticks_;
+	unsigned int frames_timed_;
+	std::string report_;				// Final status, kept once finished.
+};
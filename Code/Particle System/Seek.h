@@ -0,0 +1,150 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// SEEKING
+//
+// Jumping to a frame of the show without running it from the start. Every
+// 'interval' frames the whole show is kept as a keyframe - the checkpoint
+// layout, in memory (see Checkpoint.h), plus the random streams, which the
+// checkpoint file leaves out. To get to frame T the show is restored from the
+// last keyframe at or before T and simulated the rest of the way with
+// SHOW_WORLD::fast_forward_ set, so no vertices are written. That is never more than one
+// interval of frames for a T up to the furthest keyframe - past it there is nothing to
+// start from but the show as it is now, and getting there costs every frame in between.
+//
+// The positions are not worked out in closed form from T: rocket climbs, wind
+// drift and explosion decay are running float sums, and the show has to carry
+// on from the seek exactly as it would have got there by playing, down to the
+// last bit. Simulating a few frames from a keyframe gives that for free, as
+// long as the show draws from its seeded streams (SHOW_WORLD::random_, put back
+// with the keyframe) rather than rand_s - WinMain() sets that up for every show,
+// not just recorded ones, so a seek back and playing on again follows the same
+// timeline, and the keyframes further on still hold.
+//
+// Keyframes are taken as the show plays (or fast forwards), so seeking past
+// the furthest frame reached so far costs the frames in between, once. The
+// arrow keys are held to one interval past furthest() for that reason (see
+// SeekShow(), which says so in the status text); only "-seek" on the command
+// line goes further. If the keyframes
+// use more than SEEK_BUDGET bytes every other one is dropped and the interval
+// doubled.
+//-----------------------------------------------------------------------------
+
+#include "Checkpoint.h"
+#include <deque>
+#include <string>
+#include <vector>
+
+#define SEEK_INTERVAL	120				// Frames between keyframes, to start with.
+#define SEEK_BUDGET		(64 << 20)		// Bytes of keyframes kept before they are thinned out.
+
+struct SHOW_KEYFRAME
+{
+	unsigned int frame_;
+	std::vector<char> checkpoint_;				// SHOW_CHECKPOINT::save() of the show.
+	SHOW_RANDOM random_[RANDOM_STREAMS];		// SHOW_WORLD::random_.
+	unsigned int random_draws_;					// SHOW_WORLD::random_draws_.
+};
+
+class SHOW_SEEKER
+{
+public:
+	SHOW_SEEKER() : interval_(SEEK_INTERVAL), bytes_(0) {}
+
+	// True if a keyframe should be kept at 'frame' - one every 'interval_' frames, past the last one kept.
+	bool due(unsigned int frame) const
+	{
+		return frame % interval_ == 0 && (keyframes_.empty() || frame > keyframes_.back().frame_);
+	}
+
+	// Keep the current show as the keyframe for 'state.frame_'.
+	void keep(const CHECKPOINT_STATE &state, const std::vector<std::shared_ptr<FireworkSpawner>> &spawners)
+	{
+		keyframes_.push_back(SHOW_KEYFRAME());
+		SHOW_KEYFRAME &k = keyframes_.back();
+
+		k.frame_ = state.frame_;
+		SHOW_CHECKPOINT::save(k.checkpoint_, state, spawners);
+		for (int i = 0; i < RANDOM_STREAMS; ++i) k.random_[i] = g_World->random_[i];
+		k.random_draws_ = g_World->random_draws_;
+
+		bytes_ += k.checkpoint_.size();
+		if (bytes_ > SEEK_BUDGET) thin();
+	}
+
+	// The furthest frame there is a keyframe for, or 'current' (the frame the show is at) if that is further.
+	unsigned int furthest(unsigned int current) const
+	{
+		return !keyframes_.empty() && keyframes_.back().frame_ > current ? keyframes_.back().frame_ : current;
+	}
+
+	unsigned int interval() const { return interval_; }
+
+	// The last keyframe at or before 'frame', NULL if there is none.
+	const SHOW_KEYFRAME *before(unsigned int frame) const
+	{
+		for (size_t i = keyframes_.size(); i-- > 0;)
+		{
+			if (keyframes_[i].frame_ <= frame) return &keyframes_[i];
+		}
+
+		return NULL;
+	}
+
+	// Replace the show with keyframe 'k'.
+	bool restore(const SHOW_KEYFRAME &k, CHECKPOINT_STATE &state, std::vector<std::shared_ptr<FireworkSpawner>> &spawners) const
+	{
+		if (!SHOW_CHECKPOINT::restore(k.checkpoint_, state, spawners)) return false;
+
+		for (int i = 0; i < RANDOM_STREAMS; ++i) g_World->random_[i] = k.random_[i];
+		g_World->random_draws_ = k.random_draws_;
+
+		return true;
+	}
+
+	// Forget every keyframe (the show has been replaced by something else).
+	void clear()
+	{
+		keyframes_.clear();
+		bytes_ = 0;
+		interval_ = SEEK_INTERVAL;
+	}
+
+	// One line for the on screen text.
+	std::string status() const
+	{
+		unsigned int last = keyframes_.empty() ? 0 : keyframes_.back().frame_;
+
+		return "Seek: " + std::to_string(keyframes_.size()) + " keyframes every " + std::to_string(interval_) + " frames up to "
+			+ std::to_string(last) + ", " + std::to_string((bytes_ + 512) / 1024) + " KB";
+	}
+
+private:
+
+	// Drop every other keyframe and double the interval.
+	void thin()
+	{
+		interval_ *= 2;
+
+		std::deque<SHOW_KEYFRAME> kept;
+		bytes_ = 0;
+
+		for (auto &k : keyframes_)
+		{
+			if (k.frame_ % interval_ != 0) continue;
+
+			kept.push_back(SHOW_KEYFRAME());
+			kept.back().frame_ = k.frame_;
+			kept.back().checkpoint_.swap(k.checkpoint_);
+			for (int i = 0; i < RANDOM_STREAMS; ++i) kept.back().random_[i] = k.random_[i];
+			kept.back().random_draws_ = k.random_draws_;
+
+			bytes_ += kept.back().checkpoint_.size();
+		}
+
+		keyframes_.swap(kept);
+	}
+
+	std::deque<SHOW_KEYFRAME> keyframes_;		// In frame order - a deque, so keeping one never copies the others.
+	unsigned int interval_;
+	size_t bytes_;
+};
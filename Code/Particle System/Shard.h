@@ -0,0 +1,410 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// SHARDED SIMULATION
+//
+// "-composite N" splits the show over N worker processes. The windowed process
+// becomes the compositor: it listens on a loopback port and launches N copies
+// of the program with "-shard <index> <count> <port>". A shard simulates only
+// the spawners whose index % count is its own index, along with every system
+// they launch, and never opens a window or a device.
+//
+// The shards stay in lockstep by frame number. On connecting each one is sent
+// the show seed, and since every spawner draws from its own random stream (see
+// RANDOM_STREAMS) its fireworks come out exactly as they would in one process.
+// The wind comes from stream 0, which every shard draws from in the same way.
+// After each frame a shard sends its particles to the compositor and waits for
+// that frame to be acknowledged before simulating the next, so no shard ever
+// gets more than a frame ahead of the others.
+//
+// Each frame on the wire:
+//   SHARD_FRAME_HEADER
+//   SNAPSHOT_DRAW			[draws_]	- 'first_' counts from this shard's first vertex
+//   COMPACT_POINTVERTEX	[vertices_]	- quantized as in CompactVertex.h
+// The compositor merges the frames of every shard into one FRAME_SNAPSHOT and
+// draws it with the SNAPSHOT_RENDERER, as in pipelined mode.
+//-----------------------------------------------------------------------------
+
+#include "Pipeline.h"
+#include <winsock2.h>
+#include <string>
+#include <vector>
+
+#define SHARD_MAGIC				0x44524853	// "SHRD"
+#define SHARD_CONNECT_TIMEOUT	10			// Seconds to wait for every shard to connect.
+#define SHARD_EXIT_TIMEOUT		2000		// ms to wait for a shard to exit before it is terminated.
+#define SHARD_FRAME_TIMEOUT		5000		// ms to wait for a shard's frame before giving up on the shards.
+
+// Exchanged when a shard connects - the shard sends its index, the compositor answers with the seed.
+struct SHARD_HELLO
+{
+	unsigned int	magic_;
+	unsigned int	seed_;
+	int				index_;
+	int				count_;
+};
+
+struct SHARD_FRAME_HEADER
+{
+	unsigned int	magic_;
+	int				frame_;			// SHOW_WORLD::frame_ on the shard.
+	int				draws_;
+	int				vertices_;
+	float			wind_;			// SHOW_WORLD::wind_speed_, the same on every shard.
+};
+
+//-----------------------------------------------------------------------------
+// Socket helpers.
+
+bool SendAll(SOCKET s, const void *data, int bytes)
+{
+	const char *p = (const char *)data;
+	while (bytes > 0)
+	{
+		int n = send(s, p, bytes, 0);
+		if (n <= 0) return false;
+		p += n;
+		bytes -= n;
+	}
+	return true;
+}
+
+bool ReceiveAll(SOCKET s, void *data, int bytes)
+{
+	char *p = (char *)data;
+	while (bytes > 0)
+	{
+		int n = recv(s, p, bytes, 0);
+		if (n <= 0) return false;
+		p += n;
+		bytes -= n;
+	}
+	return true;
+}
+
+// Small messages both ways every frame - send them straight away.
+void SetNoDelay(SOCKET s)
+{
+	BOOL on = TRUE;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+}
+
+// Make recv() on 's' fail after 'ms' milliseconds with nothing received, rather than wait for ever.
+void SetReceiveTimeout(SOCKET s, DWORD ms)
+{
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&ms, sizeof(ms));
+}
+
+//-----------------------------------------------------------------------------
+// The shard's end of the connection.
+
+class SHARD_CLIENT
+{
+public:
+	SHARD_CLIENT() : socket_(INVALID_SOCKET), started_(false) {}
+
+	~SHARD_CLIENT()
+	{
+		close();
+	}
+
+	// Connect to the compositor on 'port' and get the show seed from it.
+	bool connect(int index, int count, unsigned short port, unsigned int &seed)
+	{
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+		started_ = true;
+
+		socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (socket_ == INVALID_SOCKET) return false;
+
+		sockaddr_in address;
+		ZeroMemory(&address, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(port);
+
+		if (::connect(socket_, (const sockaddr *)&address, sizeof(address)) == SOCKET_ERROR) return false;
+		SetNoDelay(socket_);
+
+		SHARD_HELLO hello;
+		hello.magic_ = SHARD_MAGIC;
+		hello.seed_ = 0;
+		hello.index_ = index;
+		hello.count_ = count;
+
+		if (!SendAll(socket_, &hello, sizeof(hello)) || !ReceiveAll(socket_, &hello, sizeof(hello))) return false;
+		if (hello.magic_ != SHARD_MAGIC) return false;
+
+		seed = hello.seed_;
+		return true;
+	}
+
+	// Send the frame in 's' (captured with the compact stream) and wait for the compositor to take it.
+	bool send_frame(const FRAME_SNAPSHOT &s, float wind)
+	{
+		SHARD_FRAME_HEADER header;
+		header.magic_ = SHARD_MAGIC;
+		header.frame_ = s.frame_;
+		header.draws_ = (int)s.draws_.size();
+		header.vertices_ = (int)s.compact_.size();
+		header.wind_ = wind;
+
+		if (!SendAll(socket_, &header, sizeof(header))) return false;
+		if (header.draws_ > 0 && !SendAll(socket_, &s.draws_[0], header.draws_ * sizeof(SNAPSHOT_DRAW))) return false;
+		if (header.vertices_ > 0 && !SendAll(socket_, &s.compact_[0], header.vertices_ * sizeof(COMPACT_POINTVERTEX))) return false;
+
+		int ack;
+		return ReceiveAll(socket_, &ack, sizeof(ack)) && ack == s.frame_;
+	}
+
+	void close()
+	{
+		if (socket_ != INVALID_SOCKET) closesocket(socket_);
+		socket_ = INVALID_SOCKET;
+
+		if (started_) WSACleanup();
+		started_ = false;
+	}
+
+private:
+	SOCKET socket_;
+	bool started_;
+};
+
+//-----------------------------------------------------------------------------
+// The compositor - launches the shards and merges their frames.
+
+class SHARD_COMPOSITOR
+{
+public:
+	SHARD_COMPOSITOR() : listen_(INVALID_SOCKET), started_(false), frame_(-1), wind_(0), bytes_(0), mismatches_(0) {}
+
+	~SHARD_COMPOSITOR()
+	{
+		stop();
+	}
+
+	bool running() const { return !shards_.empty(); }
+
+	// Launch 'count' shards of this program and wait for them all to connect.
+	bool start(int count, unsigned int seed)
+	{
+		WSADATA wsa;
+		if (count < 1 || WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+		started_ = true;
+
+		// Any free port on the loopback address - the shards are told which.
+		listen_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listen_ == INVALID_SOCKET) return fail();
+
+		sockaddr_in address;
+		ZeroMemory(&address, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = 0;
+
+		int length = sizeof(address);
+		if (bind(listen_, (const sockaddr *)&address, sizeof(address)) == SOCKET_ERROR || listen(listen_, count) == SOCKET_ERROR
+			|| getsockname(listen_, (sockaddr *)&address, &length) == SOCKET_ERROR)
+		{
+			return fail();
+		}
+
+		char program[MAX_PATH];
+		GetModuleFileName(NULL, program, MAX_PATH);
+
+		for (int i = 0; i < count; ++i)
+		{
+			std::string command = "\"" + std::string(program) + "\" -shard " + std::to_string(i) + " " + std::to_string(count) + " " + std::to_string(ntohs(address.sin_port));
+
+			STARTUPINFO startup;
+			ZeroMemory(&startup, sizeof(startup));
+			startup.cb = sizeof(startup);
+
+			PROCESS_INFORMATION process;
+			std::vector<char> line(command.begin(), command.end());
+			line.push_back(0);
+
+			if (!CreateProcess(NULL, &line[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process)) return fail();
+
+			CloseHandle(process.hThread);
+			processes_.push_back(process.hProcess);
+		}
+
+		// Order the connections by shard index.
+		std::vector<SOCKET> shards(count, INVALID_SOCKET);
+		for (int connected = 0; connected < count; ++connected)
+		{
+			fd_set ready;
+			FD_ZERO(&ready);
+			FD_SET(listen_, &ready);
+
+			timeval timeout = { SHARD_CONNECT_TIMEOUT, 0 };
+			if (select(0, &ready, NULL, NULL, &timeout) != 1) break;
+
+			SOCKET s = accept(listen_, NULL, NULL);
+			if (s == INVALID_SOCKET) break;
+			SetNoDelay(s);
+			SetReceiveTimeout(s, SHARD_FRAME_TIMEOUT);	// receive() runs on the render thread - a hung shard must not hang the window.
+
+			SHARD_HELLO hello;
+			if (!ReceiveAll(s, &hello, sizeof(hello)) || hello.magic_ != SHARD_MAGIC || hello.index_ < 0 || hello.index_ >= count
+				|| hello.count_ != count || shards[hello.index_] != INVALID_SOCKET)
+			{
+				closesocket(s);
+				break;
+			}
+
+			hello.seed_ = seed;
+			shards[hello.index_] = s;
+			if (!SendAll(s, &hello, sizeof(hello))) break;
+		}
+
+		closesocket(listen_);
+		listen_ = INVALID_SOCKET;
+		shards_.swap(shards);
+
+		for (SOCKET s : shards_)
+		{
+			if (s == INVALID_SOCKET) return fail();
+		}
+
+		return true;
+	}
+
+	// Receive the next frame from every shard into 's' and let them carry on. Blocks until they have all sent it,
+	// or gives up on every shard (and stops them) if one has sent nothing for SHARD_FRAME_TIMEOUT.
+	bool receive(FRAME_SNAPSHOT &s)
+	{
+		if (!running()) return false;
+
+		s.draws_.clear();
+		s.points_.clear();
+		s.compact_.clear();
+
+		int bytes = 0;
+		for (size_t i = 0; i < shards_.size(); ++i)
+		{
+			SHARD_FRAME_HEADER header;
+			if (!ReceiveAll(shards_[i], &header, sizeof(header)) || header.magic_ != SHARD_MAGIC || header.draws_ < 0 || header.vertices_ < 0) return fail();
+
+			draws_.resize(header.draws_);
+			vertices_.resize(header.vertices_);
+			if (header.draws_ > 0 && !ReceiveAll(shards_[i], &draws_[0], header.draws_ * sizeof(SNAPSHOT_DRAW))) return fail();
+			if (header.vertices_ > 0 && !ReceiveAll(shards_[i], &vertices_[0], header.vertices_ * sizeof(COMPACT_POINTVERTEX))) return fail();
+
+			if (i == 0)
+			{
+				frame_ = header.frame_;
+				wind_ = header.wind_;
+			}
+			else if (header.frame_ != frame_)
+			{
+				++mismatches_;		// Should never happen - the acknowledgements keep them together.
+			}
+
+			append(s, header.vertices_);
+			bytes += sizeof(header) + header.draws_ * sizeof(SNAPSHOT_DRAW) + header.vertices_ * sizeof(COMPACT_POINTVERTEX);
+		}
+
+		// Everyone can go on to the next frame.
+		for (SOCKET shard : shards_)
+		{
+			if (!SendAll(shard, &frame_, sizeof(frame_))) return fail();
+		}
+
+		bytes_ = bytes;
+		s.frame_ = frame_;
+		s.text_ = "Wind Speed: " + std::to_string(wind_);
+
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		s.captured_ = t.QuadPart;
+
+		return true;
+	}
+
+	// One line summary for the on screen text.
+	std::string status() const
+	{
+		std::string s = "Sharded: " + std::to_string(shards_.size()) + " processes, frame " + std::to_string(frame_) + ", " + std::to_string(bytes_ / 1024) + " KB/frame";
+		if (mismatches_) s += ", " + std::to_string(mismatches_) + " frames out of step";
+		return s;
+	}
+
+	// Disconnect - the shards exit when their connection closes.
+	void stop()
+	{
+		if (listen_ != INVALID_SOCKET) closesocket(listen_);
+		listen_ = INVALID_SOCKET;
+
+		for (SOCKET s : shards_)
+		{
+			if (s != INVALID_SOCKET) closesocket(s);
+		}
+		shards_.clear();
+
+		for (HANDLE p : processes_)
+		{
+			if (WaitForSingleObject(p, SHARD_EXIT_TIMEOUT) != WAIT_OBJECT_0) TerminateProcess(p, 1);
+			CloseHandle(p);
+		}
+		processes_.clear();
+
+		if (started_) WSACleanup();
+		started_ = false;
+	}
+
+private:
+
+	bool fail()
+	{
+		stop();
+		return false;
+	}
+
+	// Add the frame just received (in 'draws_' and 'vertices_') to 's', in the form the renderer wants.
+	void append(FRAME_SNAPSHOT &s, int vertices)
+	{
+		int first = g_CompactVertices ? (int)s.compact_.size() : (int)s.points_.size();
+
+		if (g_CompactVertices)
+		{
+			s.compact_.insert(s.compact_.end(), vertices_.begin(), vertices_.end());
+		}
+		else
+		{
+			s.points_.resize(first + vertices);
+		}
+
+		for (SNAPSHOT_DRAW d : draws_)
+		{
+			if (d.first_ < 0 || d.count_ < 0 || d.first_ + d.count_ > vertices) continue;
+
+			if (!g_CompactVertices)
+			{
+				for (int v = 0; v < d.count_; ++v)
+				{
+					const COMPACT_POINTVERTEX &c = vertices_[d.first_ + v];
+					s.points_[first + d.first_ + v].position_ = d.range_.offset_ + D3DXVECTOR3(c.x_ * d.range_.scale_.x, c.y_ * d.range_.scale_.y, c.z_ * d.range_.scale_.z);
+				}
+			}
+
+			d.first_ += first;
+			s.draws_.push_back(d);
+		}
+	}
+
+	SOCKET listen_;
+	bool started_;
+	std::vector<SOCKET> shards_;		// Indexed by shard.
+	std::vector<HANDLE> processes_;
+
+	std::vector<SNAPSHOT_DRAW> draws_;	// One shard's frame, as received.
+	std::vector<COMPACT_POINTVERTEX> vertices_;
+
+	int frame_;
+	float wind_;
+	int bytes_;							// Received for the last frame, over every shard.
+	int mismatches_;
+};
@@ -0,0 +1,421 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// ASSET LOADING AND THE SPRITE ATLAS
+//
+// ASSET_LOADER decodes image files to 32 bit BGRA on worker threads (with WIC),
+// so setup can carry on while they load. Only creating the textures needs the
+// device, and that is left for the main thread once wait() returns.
+//
+// SPRITE_ATLAS packs the particle sprites into one texture, so every particle
+// draw binds the same texture. Each sprite is kept apart from its neighbours
+// by a one texel border copied from its own edge, and its UV rect is handed to
+// a small pixel shader per draw (point sprites always get 0 - 1 coordinates).
+//
+// The packed pixels can be cached in a blob that is uploaded as it is on the
+// next startup. The blob records the size and write time of every source
+// image and is ignored if any of them has changed.
+//-----------------------------------------------------------------------------
+
+#include <d3dx9.h>
+#include <wincodec.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define ATLAS_VERSION	1
+#define ATLAS_BORDER	1		// Texels around each sprite.
+#define ATLAS_MAX_SIZE	4096	// Widest or tallest atlas a cache is believed for.
+
+// Decoded image, 32 bit BGRA (D3DFMT_A8R8G8B8 order), rows top to bottom.
+struct IMAGE
+{
+	IMAGE() : width_(0), height_(0) {}
+
+	int width_, height_;
+	std::vector<unsigned int> pixels_;
+};
+
+// Decode 'filename' into 'image'. Safe to call from any thread.
+bool DecodeImage(const char *filename, IMAGE &image)
+{
+	wchar_t name[MAX_PATH];
+	if (MultiByteToWideChar(CP_ACP, 0, filename, -1, name, MAX_PATH) == 0) return false;
+
+	HRESULT init = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+	IWICImagingFactory *factory = NULL;
+	IWICBitmapDecoder *decoder = NULL;
+	IWICBitmapFrameDecode *frame = NULL;
+	IWICBitmapSource *bgra = NULL;
+	UINT width = 0, height = 0;
+
+	HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_IWICImagingFactory, (void **)&factory);
+	if (SUCCEEDED(hr)) hr = factory->CreateDecoderFromFilename(name, NULL, GENERIC_READ, WICDecodeMetadataCacheOnDemand, &decoder);
+	if (SUCCEEDED(hr)) hr = decoder->GetFrame(0, &frame);
+	if (SUCCEEDED(hr)) hr = WICConvertBitmapSource(GUID_WICPixelFormat32bppBGRA, frame, &bgra);
+	if (SUCCEEDED(hr)) hr = bgra->GetSize(&width, &height);
+
+	if (SUCCEEDED(hr))
+	{
+		image.width_ = (int)width;
+		image.height_ = (int)height;
+		image.pixels_.resize(width * height);
+		hr = bgra->CopyPixels(NULL, width * 4, width * height * 4, (BYTE *)&image.pixels_[0]);
+	}
+
+	SAFE_RELEASE(bgra);
+	SAFE_RELEASE(frame);
+	SAFE_RELEASE(decoder);
+	SAFE_RELEASE(factory);
+
+	if (SUCCEEDED(init)) CoUninitialize();
+
+	return SUCCEEDED(hr);
+}
+
+// Create a texture on 'device' from a decoded image, with a full mip chain. The size is
+// rounded to whatever the device supports, as D3DXCreateTextureFromFile does.
+HRESULT CreateTextureFromImage(LPDIRECT3DDEVICE9 device, const IMAGE &image, LPDIRECT3DTEXTURE9 *texture)
+{
+	if (image.pixels_.empty()) return E_FAIL;
+
+	if (FAILED(D3DXCreateTexture(device, image.width_, image.height_, D3DX_DEFAULT, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, texture))) return E_FAIL;
+
+	LPDIRECT3DSURFACE9 surface = NULL;
+	RECT source = { 0, 0, image.width_, image.height_ };
+
+	HRESULT hr = (*texture)->GetSurfaceLevel(0, &surface);
+	if (SUCCEEDED(hr)) hr = D3DXLoadSurfaceFromMemory(surface, NULL, NULL, &image.pixels_[0], D3DFMT_A8R8G8B8, image.width_ * 4, NULL, &source, D3DX_DEFAULT, 0);
+	if (SUCCEEDED(hr)) hr = D3DXFilterTexture(*texture, NULL, 0, D3DX_DEFAULT);
+
+	SAFE_RELEASE(surface);
+	if (FAILED(hr)) SAFE_RELEASE(*texture);
+
+	return hr;
+}
+
+//-----------------------------------------------------------------------------
+// Decodes a set of images, one worker thread each.
+
+class ASSET_LOADER
+{
+public:
+	~ASSET_LOADER()
+	{
+		wait();
+	}
+
+	// Start decoding 'filename', returns its index for image().
+	int load(const char *filename)
+	{
+		jobs_.push_back(JOB());
+		jobs_.back().filename_ = filename;
+		return (int)jobs_.size() - 1;
+	}
+
+	// Start every job added with load().
+	void start()
+	{
+		for (JOB &job : jobs_)
+		{
+			JOB *j = &job;
+			threads_.push_back(std::thread([j]() { j->decoded_ = DecodeImage(j->filename_.c_str(), j->image_); }));
+		}
+	}
+
+	// Wait for every image to be decoded.
+	void wait()
+	{
+		for (std::thread &t : threads_) t.join();
+		threads_.clear();
+	}
+
+	// Only valid after wait(). Empty if the file could not be decoded.
+	const IMAGE &image(int i) const { return jobs_[i].image_; }
+	bool decoded(int i) const { return jobs_[i].decoded_; }
+
+private:
+	struct JOB
+	{
+		JOB() : decoded_(false) {}
+
+		std::string filename_;
+		IMAGE image_;
+		bool decoded_;
+	};
+
+	std::vector<JOB> jobs_;				// Not added to once started - the threads hold pointers into it.
+	std::vector<std::thread> threads_;
+};
+
+//-----------------------------------------------------------------------------
+
+struct ATLAS_HEADER
+{
+	char			magic_[4];		// "FWAT"
+	unsigned int	version_;
+	int				width_, height_;
+	int				sprites_;
+};
+
+// Identifies a source image, to tell whether a cached atlas is still up to date.
+struct ATLAS_SOURCE
+{
+	unsigned int size_;
+	FILETIME written_;
+};
+
+class SPRITE_ATLAS
+{
+public:
+	SPRITE_ATLAS() : width_(0), height_(0), texture_(NULL), shader_(NULL) {}
+
+	~SPRITE_ATLAS()
+	{
+		release();
+	}
+
+	void release()
+	{
+		UntrackTexture(texture_);
+		SAFE_RELEASE(texture_);
+		SAFE_RELEASE(shader_);
+	}
+
+	// The atlas texture, NULL if it has not been created.
+	LPDIRECT3DTEXTURE9 texture() const { return texture_; }
+	LPDIRECT3DPIXELSHADER9 shader() const { return shader_; }
+
+	// UV rect of sprite 'i': u, v of its top left corner, then its width and height.
+	D3DXVECTOR4 rect(int i) const
+	{
+		if (i < 0 || i >= (int)rects_.size()) return D3DXVECTOR4(0, 0, 1, 1);
+		return rects_[i];
+	}
+
+	// Pack 'count' images into the atlas, in order.
+	bool build(const IMAGE *const *images, int count)
+	{
+		// Rows of sprites, wrapped at a power of two width that leaves it roughly square.
+		int area = 0, widest = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			if (images[i]->pixels_.empty()) return false;
+
+			int w = images[i]->width_ + 2 * ATLAS_BORDER, h = images[i]->height_ + 2 * ATLAS_BORDER;
+			area += w * h;
+			widest = w > widest ? w : widest;
+		}
+
+		int width = 1;
+		while (width < widest || width * width < area) width <<= 1;
+
+		std::vector<POINT> at(count);
+		int x = 0, y = 0, row = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			int w = images[i]->width_ + 2 * ATLAS_BORDER, h = images[i]->height_ + 2 * ATLAS_BORDER;
+			if (x + w > width)
+			{
+				x = 0;
+				y += row;
+				row = 0;
+			}
+
+			at[i].x = x;
+			at[i].y = y;
+			x += w;
+			row = h > row ? h : row;
+		}
+
+		int height = 1;
+		while (height < y + row) height <<= 1;
+
+		width_ = width;
+		height_ = height;
+		pixels_.assign(width * height, 0);
+		rects_.resize(count);
+
+		for (int i = 0; i < count; ++i)
+		{
+			const IMAGE &image = *images[i];
+
+			// Copy the sprite with its border - texels outside the image repeat its nearest edge.
+			for (int j = -ATLAS_BORDER; j < image.height_ + ATLAS_BORDER; ++j)
+			{
+				int sy = j < 0 ? 0 : (j >= image.height_ ? image.height_ - 1 : j);
+				unsigned int *row = &pixels_[(at[i].y + ATLAS_BORDER + j) * width + at[i].x];
+
+				for (int k = -ATLAS_BORDER; k < image.width_ + ATLAS_BORDER; ++k)
+				{
+					int sx = k < 0 ? 0 : (k >= image.width_ ? image.width_ - 1 : k);
+					row[k + ATLAS_BORDER] = image.pixels_[sy * image.width_ + sx];
+				}
+			}
+
+			rects_[i] = D3DXVECTOR4((float)(at[i].x + ATLAS_BORDER) / width, (float)(at[i].y + ATLAS_BORDER) / height,
+				(float)image.width_ / width, (float)image.height_ / height);
+		}
+
+		return true;
+	}
+
+	// Upload the packed atlas and compile the shader that draws from it.
+	HRESULT create(LPDIRECT3DDEVICE9 device)
+	{
+		release();
+		if (pixels_.empty()) return E_FAIL;
+
+		// Sprites are drawn at their own size or smaller, one level is enough with point sampling.
+		if (FAILED(device->CreateTexture(width_, height_, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &texture_, NULL))) return E_FAIL;
+
+		D3DLOCKED_RECT locked;
+		if (FAILED(texture_->LockRect(0, &locked, NULL, 0)))
+		{
+			release();
+			return E_FAIL;
+		}
+
+		for (int y = 0; y < height_; ++y)
+		{
+			memcpy((char *)locked.pBits + y * locked.Pitch, &pixels_[y * width_], width_ * 4);
+		}
+
+		texture_->UnlockRect(0);
+		TrackTexture(texture_);
+
+		if (FAILED(compile_shader(device)))
+		{
+			release();
+			return E_FAIL;
+		}
+
+		return S_OK;
+	}
+
+	// Load the packed atlas from 'filename', if it was built from 'sources' as they are now.
+	bool load_cache(const char *filename, const char *const *sources, int count)
+	{
+		FILE *f = NULL;
+		if (fopen_s(&f, filename, "rb") != 0 || f == NULL) return false;
+
+		long long length = _fseeki64(f, 0, SEEK_END) == 0 ? _ftelli64(f) : -1;
+		rewind(f);
+
+		ATLAS_HEADER header;
+		std::vector<ATLAS_SOURCE> stamps(count);
+		bool ok = fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic_, "FWAT", 4) == 0 && header.version_ == ATLAS_VERSION
+			&& header.sprites_ == count && fread(&stamps[0], sizeof(ATLAS_SOURCE), count, f) == (size_t)count;
+
+		// A size that is out of range, or doesn't account for the file exactly, is a broken cache - it is built again.
+		ok = ok && header.width_ > 0 && header.width_ <= ATLAS_MAX_SIZE && header.height_ > 0 && header.height_ <= ATLAS_MAX_SIZE
+			&& length == (long long)(sizeof(ATLAS_HEADER) + count * (sizeof(ATLAS_SOURCE) + sizeof(D3DXVECTOR4))) + 4LL * header.width_ * header.height_;
+
+		for (int i = 0; ok && i < count; ++i)
+		{
+			ATLAS_SOURCE now;
+			ok = stamp(sources[i], now) && now.size_ == stamps[i].size_ && CompareFileTime(&now.written_, &stamps[i].written_) == 0;
+		}
+
+		if (ok)
+		{
+			width_ = header.width_;
+			height_ = header.height_;
+			rects_.resize(count);
+			pixels_.resize(width_ * height_);
+
+			ok = fread(&rects_[0], sizeof(D3DXVECTOR4), count, f) == (size_t)count
+				&& fread(&pixels_[0], 4, pixels_.size(), f) == pixels_.size();
+		}
+
+		fclose(f);
+
+		if (!ok)
+		{
+			width_ = height_ = 0;
+			pixels_.clear();
+			rects_.clear();
+		}
+
+		return ok;
+	}
+
+	// Write the packed atlas to 'filename', stamped with the state of the 'count' source images.
+	bool save_cache(const char *filename, const char *const *sources, int count) const
+	{
+		if (pixels_.empty() || (int)rects_.size() != count) return false;
+
+		std::vector<ATLAS_SOURCE> stamps(count);
+		for (int i = 0; i < count; ++i)
+		{
+			if (!stamp(sources[i], stamps[i])) return false;
+		}
+
+		FILE *f = NULL;
+		if (fopen_s(&f, filename, "wb") != 0 || f == NULL) return false;
+
+		ATLAS_HEADER header;
+		memcpy(header.magic_, "FWAT", 4);
+		header.version_ = ATLAS_VERSION;
+		header.width_ = width_;
+		header.height_ = height_;
+		header.sprites_ = count;
+
+		fwrite(&header, sizeof(header), 1, f);
+		fwrite(&stamps[0], sizeof(ATLAS_SOURCE), count, f);
+		fwrite(&rects_[0], sizeof(D3DXVECTOR4), count, f);
+		fwrite(&pixels_[0], 4, pixels_.size(), f);
+
+		fclose(f);
+		return true;
+	}
+
+private:
+
+	static bool stamp(const char *filename, ATLAS_SOURCE &s)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesEx(filename, GetFileExInfoStandard, &data)) return false;
+
+		s.size_ = data.nFileSizeLow;
+		s.written_ = data.ftLastWriteTime;
+		return true;
+	}
+
+	// c0 - the sprite's UV rect, c1.x - 1 to fade the sprite by the diffuse alpha (compact stream), 0 to ignore it.
+	HRESULT compile_shader(LPDIRECT3DDEVICE9 device)
+	{
+		static const char source[] =
+			"sampler sprites : register(s0);\n"
+			"float4 rect : register(c0);\n"
+			"float4 fade : register(c1);\n"
+			"float4 main(float2 uv : TEXCOORD0, float4 colour : COLOR0) : COLOR\n"
+			"{\n"
+			"	float4 t = tex2D(sprites, rect.xy + uv * rect.zw);\n"
+			"	t.a *= lerp(1, colour.a, fade.x);\n"
+			"	return t;\n"
+			"}\n";
+
+		LPD3DXBUFFER code = NULL, errors = NULL;
+		HRESULT hr = D3DXCompileShader(source, sizeof(source) - 1, NULL, NULL, "main", "ps_2_0", 0, &code, &errors, NULL);
+
+		if (SUCCEEDED(hr))
+		{
+			hr = device->CreatePixelShader((const DWORD *)code->GetBufferPointer(), &shader_);
+		}
+
+		SAFE_RELEASE(code);
+		SAFE_RELEASE(errors);
+
+		return hr;
+	}
+
+	int width_, height_;
+	std::vector<unsigned int> pixels_;		// Packed sprites, BGRA.
+	std::vector<D3DXVECTOR4> rects_;
+
+	LPDIRECT3DTEXTURE9 texture_;
+	LPDIRECT3DPIXELSHADER9 shader_;
+};
+
+SPRITE_ATLAS g_SpriteAtlas;		// The particle sprites, once packed.
@@ -0,0 +1,1055 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// LIVE STREAMING TO REMOTE VIEWERS
+//
+// "-stream [port]" serves the running show to any number of viewers, which
+// are started with "-view <host>[:port]" and draw it without simulating.
+//
+// Every frame the server sends one record per system, keyed by the system's
+// serial_. Positions are quantized to 1 / STREAM_QUANT units relative to the
+// system's (quantized) origin, and after the first frame a system is sent as
+// the change in each value since the frame before, as zigzag varints:
+//   STREAM_FULL		the quantized positions themselves (new systems, key frames)
+//   STREAM_DELTA		the change since the last frame
+// Explosions are sent as parameters instead. Their particles move under fixed
+// rules, so the viewer rebuilds one from its launch state and steps it itself
+// with the frame's wind speed:
+//   STREAM_PARAMETERS	the explosion's settings and every particle's quantized
+//						position, velocity and lifetime
+//   STREAM_ADVANCE		nothing - step the rebuilt explosion a frame
+// The server steps the same rebuilt copy, and sends the parameters again
+// whenever it drifts more than STREAM_TOLERANCE from the real thing (after a
+// bounce off the ground, say). At both ends the rebuilt explosions are a
+// SHOW_WORLD of their own, so on the server they take no serial_ and no room
+// in the pool from the show being streamed.
+//
+// The records are then Huffman coded, if that makes them smaller. A key frame
+// (everything sent in full) goes out when a viewer joins and every
+// STREAM_KEY_INTERVAL frames.
+//
+// On the wire, per frame:
+//   unsigned int			size of the rest of the message
+//   STREAM_FRAME_HEADER
+//   records, or their Huffman coding (STREAM_HUFFMAN)
+//
+// Both ends report the bandwidth used against raw float positions, and the
+// viewer the latency from the end of a frame's simulation to its decode (only
+// meaningful when the server runs on the same machine, e.g. over loopback).
+//-----------------------------------------------------------------------------
+
+#include "Pipeline.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <functional>
+#include <map>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define STREAM_PORT				27962
+#define STREAM_MAGIC			0x4D525453	// "STRM"
+#define STREAM_QUANT			64.0f		// Position steps per unit.
+#define STREAM_VELOCITY_QUANT	1024.0f		// Velocity steps per unit per frame.
+#define STREAM_TOLERANCE		0.1f		// Furthest a rebuilt explosion may drift, in units, before it is sent again.
+#define STREAM_KEY_INTERVAL		300			// Frames between key frames.
+#define STREAM_MAX_MESSAGE		(64 << 20)	// Larger messages are taken as a broken stream.
+
+// Header flags.
+#define STREAM_KEY				0x01		// Everything in full - forget every system from earlier frames.
+#define STREAM_HUFFMAN			0x02		// The records are Huffman coded.
+
+enum STREAM_RECORD
+{
+	STREAM_FULL,
+	STREAM_DELTA,
+	STREAM_PARAMETERS,
+	STREAM_ADVANCE
+};
+
+struct STREAM_FRAME_HEADER
+{
+	unsigned int	magic_;
+	int				frame_;
+	unsigned int	flags_;
+	float			wind_;			// SHOW_WORLD::wind_speed_ for the frame - the rebuilt explosions need it.
+	LONGLONG		sent_;			// Performance counter when the frame was encoded.
+	int				vertices_;		// Vertices in the frame, for the bandwidth report.
+	int				bytes_;			// Size of the records before the Huffman coding.
+};
+
+//-----------------------------------------------------------------------------
+// Reading and writing the records.
+
+class STREAM_WRITER
+{
+public:
+	void clear() { bytes_.clear(); }
+
+	void byte(unsigned int v) { bytes_.push_back((unsigned char)v); }
+
+	void varint(unsigned int v)
+	{
+		while (v >= 0x80)
+		{
+			bytes_.push_back((unsigned char)(v | 0x80));
+			v >>= 7;
+		}
+		bytes_.push_back((unsigned char)v);
+	}
+
+	// Small numbers of either sign in few bytes.
+	void zigzag(int v) { varint(((unsigned int)v << 1) ^ (unsigned int)(v >> 31)); }
+
+	void real(float f)
+	{
+		const unsigned char *p = (const unsigned char *)&f;
+		bytes_.insert(bytes_.end(), p, p + sizeof(f));
+	}
+
+	std::vector<unsigned char> bytes_;
+};
+
+class STREAM_READER
+{
+public:
+	STREAM_READER(const unsigned char *data, size_t bytes) : p_(data), end_(data + bytes), ok_(true) {}
+
+	// False once anything has been read past the end.
+	bool ok() const { return ok_; }
+	bool done() const { return p_ >= end_; }
+
+	unsigned int byte()
+	{
+		if (p_ >= end_) return fail();
+		return *p_++;
+	}
+
+	unsigned int varint()
+	{
+		unsigned int v = 0;
+		for (int shift = 0; shift < 35; shift += 7)
+		{
+			if (p_ >= end_) return fail();
+			unsigned char b = *p_++;
+			v |= (unsigned int)(b & 0x7F) << shift;
+			if ((b & 0x80) == 0) return v;
+		}
+		return fail();
+	}
+
+	int zigzag()
+	{
+		unsigned int v = varint();
+		return (int)(v >> 1) ^ -(int)(v & 1);
+	}
+
+	float real()
+	{
+		float f = 0;
+		if (end_ - p_ < (ptrdiff_t)sizeof(f)) return (float)fail();
+		memcpy(&f, p_, sizeof(f));
+		p_ += sizeof(f);
+		return f;
+	}
+
+private:
+	unsigned int fail()
+	{
+		ok_ = false;
+		p_ = end_;
+		return 0;
+	}
+
+	const unsigned char *p_, *end_;
+	bool ok_;
+};
+
+//-----------------------------------------------------------------------------
+// Huffman coding of a whole frame of records - canonical codes of at most
+// HUFFMAN_MAX_BITS bits, written as a table of 256 code lengths (4 bits each),
+// the number of bytes coded, then the codes, most significant bit first.
+
+#define HUFFMAN_MAX_BITS 15
+
+// False if coding 'in' would not make it any smaller.
+bool HuffmanEncode(const std::vector<unsigned char> &in, std::vector<unsigned char> &out)
+{
+	if (in.empty()) return false;
+
+	unsigned int counts[256] = { 0 };
+	for (unsigned char b : in) ++counts[b];
+
+	// Build the tree - nodes 0 - 255 are the leaves, the rest joins.
+	int parent[511];
+	typedef std::pair<unsigned int, int> NODE;
+	std::priority_queue<NODE, std::vector<NODE>, std::greater<NODE>> nodes;
+
+	for (int i = 0; i < 256; ++i)
+	{
+		parent[i] = -1;
+		if (counts[i]) nodes.push(NODE(counts[i], i));
+	}
+
+	int next = 256;
+	while (nodes.size() > 1)
+	{
+		NODE a = nodes.top(); nodes.pop();
+		NODE b = nodes.top(); nodes.pop();
+
+		parent[a.second] = parent[b.second] = next;
+		parent[next] = -1;
+		nodes.push(NODE(a.first + b.first, next++));
+	}
+
+	// Code lengths are the leaves' depths - a lone symbol still needs one bit.
+	unsigned char lengths[256];
+	for (int i = 0; i < 256; ++i)
+	{
+		int depth = 0;
+		for (int n = i; counts[i] && parent[n] >= 0; n = parent[n]) ++depth;
+
+		if (depth > HUFFMAN_MAX_BITS) return false;
+		lengths[i] = (unsigned char)(counts[i] && depth == 0 ? 1 : depth);
+	}
+
+	// Canonical codes - shorter codes first, then in symbol order.
+	unsigned int length_counts[HUFFMAN_MAX_BITS + 1] = { 0 }, next_code[HUFFMAN_MAX_BITS + 2] = { 0 };
+	for (int i = 0; i < 256; ++i) ++length_counts[lengths[i]];
+	length_counts[0] = 0;
+
+	for (int bits = 1; bits <= HUFFMAN_MAX_BITS; ++bits) next_code[bits + 1] = (next_code[bits] + length_counts[bits]) << 1;
+
+	unsigned int codes[256];
+	for (int i = 0; i < 256; ++i)
+	{
+		if (lengths[i]) codes[i] = next_code[lengths[i]]++;
+	}
+
+	// Table, byte count, codes.
+	out.clear();
+	for (int i = 0; i < 256; i += 2) out.push_back((unsigned char)(lengths[i] | (lengths[i + 1] << 4)));
+
+	unsigned int n = (unsigned int)in.size();
+	out.insert(out.end(), (const unsigned char *)&n, (const unsigned char *)&n + sizeof(n));
+
+	unsigned int buffer = 0;
+	int bits = 0;
+	for (unsigned char b : in)
+	{
+		for (int bit = lengths[b] - 1; bit >= 0; --bit)
+		{
+			buffer = (buffer << 1) | ((codes[b] >> bit) & 1);
+			if (++bits == 8)
+			{
+				out.push_back((unsigned char)buffer);
+				buffer = 0;
+				bits = 0;
+			}
+		}
+
+		if (out.size() >= in.size()) return false;
+	}
+	if (bits) out.push_back((unsigned char)(buffer << (8 - bits)));
+
+	return out.size() < in.size();
+}
+
+bool HuffmanDecode(const unsigned char *in, size_t bytes, std::vector<unsigned char> &out)
+{
+	if (bytes < 128 + sizeof(unsigned int)) return false;
+
+	// Symbols in canonical order, and how many codes there are of each length.
+	int length_counts[HUFFMAN_MAX_BITS + 1] = { 0 };
+	unsigned char symbols[256];
+
+	for (int i = 0; i < 256; ++i) ++length_counts[(in[i / 2] >> ((i & 1) * 4)) & 0x0F];
+	length_counts[0] = 0;
+
+	int offsets[HUFFMAN_MAX_BITS + 1];
+	offsets[1] = 0;
+	for (int bits = 1; bits < HUFFMAN_MAX_BITS; ++bits) offsets[bits + 1] = offsets[bits] + length_counts[bits];
+
+	for (int i = 0; i < 256; ++i)
+	{
+		int length = (in[i / 2] >> ((i & 1) * 4)) & 0x0F;
+		if (length) symbols[offsets[length]++] = (unsigned char)i;
+	}
+
+	unsigned int n;
+	memcpy(&n, in + 128, sizeof(n));
+	if (n > STREAM_MAX_MESSAGE) return false;
+
+	const unsigned char *p = in + 128 + sizeof(n), *end = in + bytes;
+	out.resize(n);
+
+	int bit = 0;
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		// Walk down the lengths until the code falls inside the range for one.
+		int code = 0, first = 0, index = 0;
+		int length = 1;
+		for (; length <= HUFFMAN_MAX_BITS; ++length)
+		{
+			if (p >= end) return false;
+			code |= (*p >> (7 - bit)) & 1;
+			if (++bit == 8)
+			{
+				bit = 0;
+				++p;
+			}
+
+			int count = length_counts[length];
+			if (code - first < count)
+			{
+				out[i] = symbols[index + code - first];
+				break;
+			}
+
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+
+		if (length > HUFFMAN_MAX_BITS) return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// What both ends know about each system from the frames so far.
+
+struct STREAM_SYSTEM
+{
+	STREAM_SYSTEM() : sprite_(0), size_(1.0f) { origin_[0] = origin_[1] = origin_[2] = 0; }
+
+	int sprite_;
+	float size_;
+	int origin_[3];										// Quantized origin.
+	std::vector<int> points_;							// Quantized positions relative to 'origin_', 3 per vertex, as last sent.
+	std::shared_ptr<FIREWORK_EXPLOSION_CLASS> mirror_;	// Explosions only - rebuilt from the parameters, and stepped every frame.
+};
+
+typedef std::map<unsigned int, STREAM_SYSTEM> STREAM_STATE;
+
+inline int stream_quantize(float v, float steps)
+{
+	float q = v * steps;
+	return (int)(q < 0 ? q - 0.5f : q + 0.5f);
+}
+
+// The parts shared by the server and the viewer.
+class STREAM_CODEC
+{
+protected:
+
+	// Read or write an explosion's parameters, leaving 's.mirror_' rebuilt from them exactly as the other end will have it.
+	// 'e' is the real explosion when writing, NULL when reading.
+	void parameters(STREAM_WRITER *w, STREAM_READER *r, FIREWORK_EXPLOSION_CLASS *e, STREAM_SYSTEM &s)
+	{
+		WORLD_SCOPE scope(&mirrors_);
+
+		std::shared_ptr<FIREWORK_EXPLOSION_CLASS> m(new FIREWORK_EXPLOSION_CLASS);
+		PARTICLE_SYSTEM_BASE &mb = *m;
+
+		if (w)
+		{
+			w->real(e->gravity_);
+			w->real(e->time_increment_);
+			w->byte(e->ground_response_);
+			w->real(e->restitution_);
+			w->varint((unsigned int)((PARTICLE_SYSTEM_BASE *)e)->particles_.size());
+
+			m->gravity_ = e->gravity_;
+			m->time_increment_ = e->time_increment_;
+			m->ground_response_ = e->ground_response_;
+			m->restitution_ = e->restitution_;
+			mb.particles_.resize(((PARTICLE_SYSTEM_BASE *)e)->particles_.size());
+		}
+		else
+		{
+			m->gravity_ = r->real();
+			m->time_increment_ = r->real();
+			m->ground_response_ = (GROUND_RESPONSE)r->byte();
+			m->restitution_ = r->real();
+
+			unsigned int n = r->varint();
+			if (!r->ok() || n > STREAM_MAX_MESSAGE / 7) return;
+			mb.particles_.resize(n);
+		}
+
+		D3DXVECTOR3 origin(s.origin_[0] / STREAM_QUANT, s.origin_[1] / STREAM_QUANT, s.origin_[2] / STREAM_QUANT);
+		m->origin_ = origin;
+		m->sprite_ = s.sprite_;
+		m->particle_size_ = s.size_;
+
+		int alive = 0;
+		for (size_t i = 0; i < mb.particles_.size(); ++i)
+		{
+			int q[7];
+			if (w)
+			{
+				const PARTICLE &p = ((PARTICLE_SYSTEM_BASE *)e)->particles_[i];
+				q[0] = stream_quantize(p.position_.x, STREAM_QUANT) - s.origin_[0];
+				q[1] = stream_quantize(p.position_.y, STREAM_QUANT) - s.origin_[1];
+				q[2] = stream_quantize(p.position_.z, STREAM_QUANT) - s.origin_[2];
+				q[3] = stream_quantize(p.velocity_.x, STREAM_VELOCITY_QUANT);
+				q[4] = stream_quantize(p.velocity_.y, STREAM_VELOCITY_QUANT);
+				q[5] = stream_quantize(p.velocity_.z, STREAM_VELOCITY_QUANT);
+				q[6] = p.lifetime_;
+
+				for (int k = 0; k < 6; ++k) w->zigzag(q[k]);
+				w->varint((unsigned int)q[6]);
+			}
+			else
+			{
+				for (int k = 0; k < 6; ++k) q[k] = r->zigzag();
+				q[6] = (int)r->varint();
+			}
+
+			PARTICLE &p = mb.particles_[i];
+			p.position_ = origin + D3DXVECTOR3(q[0] / STREAM_QUANT, q[1] / STREAM_QUANT, q[2] / STREAM_QUANT);
+			p.velocity_ = D3DXVECTOR3(q[3] / STREAM_VELOCITY_QUANT, q[4] / STREAM_VELOCITY_QUANT, q[5] / STREAM_VELOCITY_QUANT);
+			p.lifetime_ = q[6];
+			p.time_ = 1;
+			if (p.lifetime_ > 0) ++alive;
+		}
+
+		mb.max_particles_ = (int)mb.particles_.size();
+		mb.alive_particles_ = alive;
+		mb.staging_.resize(mb.particles_.size());
+		mb.update_vertex_buffer();
+
+		s.mirror_ = m;
+		s.points_.clear();
+	}
+
+	// Step a rebuilt explosion on a frame.
+	void advance(STREAM_SYSTEM &s)
+	{
+		WORLD_SCOPE scope(&mirrors_);
+		if (s.mirror_) s.mirror_->update();
+	}
+
+	// Between frames, once the explosions no longer wanted have gone - close up the holes they left.
+	void tidy()
+	{
+		if (mirrors_.pool_.fragmented()) mirrors_.pool_.compact();
+	}
+
+	// The rebuilt explosions - made, stepped and pooled here, never in the show.
+	SHOW_WORLD mirrors_;
+};
+
+//-----------------------------------------------------------------------------
+// Turns the show's systems into a frame of records (server side).
+
+class STREAM_ENCODER : public STREAM_CODEC
+{
+public:
+	STREAM_ENCODER() : vertices_(0) {}
+
+	// Records for every system in the show. With 'key' nothing depends on earlier frames.
+	void encode(bool key, STREAM_WRITER &w)
+	{
+		if (key) state_.clear();
+
+		// Our copies move with the show's wind.
+		mirrors_.wind_speed_ = g_World->wind_speed_;
+
+		STREAM_STATE next;
+		unsigned int last = 0;
+		vertices_ = 0;
+
+		for (auto &p : g_World->particles_)
+		{
+			int n = p->staged_count();
+			if (n == 0 || p->safeToDelete) continue;
+
+			STREAM_STATE::iterator old = state_.find(p->serial_);
+			STREAM_SYSTEM &s = next[p->serial_];
+			if (old != state_.end()) s = old->second;
+
+			w.zigzag((int)(p->serial_ - last));
+			last = p->serial_;
+			vertices_ += n;
+
+			if (p->type() == SYSTEM_EXPLOSION)
+			{
+				FIREWORK_EXPLOSION_CLASS *e = (FIREWORK_EXPLOSION_CLASS *)p.get();
+
+				// Step our copy of what the viewers have, and only send the parameters again if it has wandered off.
+				if (s.mirror_)
+				{
+					advance(s);
+					if (matches(*s.mirror_, *e))
+					{
+						w.byte(STREAM_ADVANCE);
+						continue;
+					}
+				}
+
+				w.byte(STREAM_PARAMETERS);
+				header(w, *p, s);
+				parameters(&w, NULL, e, s);
+				continue;
+			}
+
+			// Everything else as positions - the changes since the last frame where there was one.
+			bool delta = old != state_.end() && !s.mirror_;
+			w.byte(delta ? STREAM_DELTA : STREAM_FULL);
+
+			int origin[3] = { stream_quantize(p->origin_.x, STREAM_QUANT), stream_quantize(p->origin_.y, STREAM_QUANT), stream_quantize(p->origin_.z, STREAM_QUANT) };
+			if (delta)
+			{
+				for (int k = 0; k < 3; ++k) w.zigzag(origin[k] - s.origin_[k]);
+				for (int k = 0; k < 3; ++k) s.origin_[k] = origin[k];
+			}
+			else
+			{
+				header(w, *p, s);
+			}
+
+			w.varint((unsigned int)n);
+
+			std::vector<int> points(n * 3);
+			const POINTVERTEX *v = p->staged_vertices();
+			for (int i = 0; i < n; ++i)
+			{
+				points[i * 3 + 0] = stream_quantize(v[i].position_.x, STREAM_QUANT) - s.origin_[0];
+				points[i * 3 + 1] = stream_quantize(v[i].position_.y, STREAM_QUANT) - s.origin_[1];
+				points[i * 3 + 2] = stream_quantize(v[i].position_.z, STREAM_QUANT) - s.origin_[2];
+			}
+
+			for (int i = 0; i < n * 3; ++i)
+			{
+				w.zigzag(points[i] - (delta && i < (int)s.points_.size() ? s.points_[i] : 0));
+			}
+
+			s.points_.swap(points);
+		}
+
+		// Systems not sent this frame are forgotten at both ends.
+		state_.swap(next);
+		next.clear();
+		tidy();
+	}
+
+	int vertices() const { return vertices_; }
+
+	void clear()
+	{
+		state_.clear();
+		tidy();
+	}
+
+private:
+
+	// Sprite, size and origin of a system sent from scratch.
+	static void header(STREAM_WRITER &w, const PARTICLE_SYSTEM_BASE &p, STREAM_SYSTEM &s)
+	{
+		s.sprite_ = p.sprite_;
+		s.size_ = p.particle_size_;
+		s.origin_[0] = stream_quantize(p.origin_.x, STREAM_QUANT);
+		s.origin_[1] = stream_quantize(p.origin_.y, STREAM_QUANT);
+		s.origin_[2] = stream_quantize(p.origin_.z, STREAM_QUANT);
+
+		w.varint((unsigned int)s.sprite_);
+		w.real(s.size_);
+		for (int k = 0; k < 3; ++k) w.zigzag(s.origin_[k]);
+	}
+
+	// True if the rebuilt explosion draws within STREAM_TOLERANCE of the real one.
+	static bool matches(const FIREWORK_EXPLOSION_CLASS &m, const FIREWORK_EXPLOSION_CLASS &e)
+	{
+		int n = m.staged_count();
+		if (n != e.staged_count()) return false;
+
+		const POINTVERTEX *a = m.staged_vertices(), *b = e.staged_vertices();
+		for (int i = 0; i < n; ++i)
+		{
+			D3DXVECTOR3 d = a[i].position_ - b[i].position_;
+			if (fabsf(d.x) > STREAM_TOLERANCE || fabsf(d.y) > STREAM_TOLERANCE || fabsf(d.z) > STREAM_TOLERANCE) return false;
+		}
+
+		return true;
+	}
+
+	STREAM_STATE state_;
+	int vertices_;
+};
+
+//-----------------------------------------------------------------------------
+// Rebuilds frames from the records (viewer side).
+
+class STREAM_DECODER : public STREAM_CODEC
+{
+public:
+
+	// Decode a frame of records into 's'. False if they do not make sense, in which case the stream cannot go on.
+	bool decode(const unsigned char *data, size_t bytes, const STREAM_FRAME_HEADER &h, FRAME_SNAPSHOT &s)
+	{
+		if (h.flags_ & STREAM_KEY) state_.clear();
+
+		// The rebuilt explosions move with the server's wind.
+		mirrors_.wind_speed_ = h.wind_;
+
+		s.frame_ = h.frame_;
+		s.text_ = "Wind Speed: " + std::to_string(h.wind_);
+		s.draws_.clear();
+		s.points_.clear();
+		s.compact_.clear();
+
+		STREAM_STATE next;
+		STREAM_READER r(data, bytes);
+		unsigned int serial = 0;
+
+		while (!r.done())
+		{
+			serial += (unsigned int)r.zigzag();
+			unsigned int record = r.byte();
+			if (!r.ok()) return false;
+
+			STREAM_STATE::iterator old = state_.find(serial);
+			if (record == STREAM_DELTA || record == STREAM_ADVANCE)
+			{
+				if (old == state_.end()) return false;	// Refers to a system we never had.
+			}
+
+			STREAM_SYSTEM &sys = next[serial];
+			if (old != state_.end()) sys = old->second;
+
+			switch (record)
+			{
+			case STREAM_ADVANCE:
+				if (!sys.mirror_) return false;
+				advance(sys);
+				break;
+
+			case STREAM_PARAMETERS:
+				header(r, sys);
+				parameters(NULL, &r, NULL, sys);
+				if (!r.ok() || !sys.mirror_) return false;
+				break;
+
+			case STREAM_FULL:
+			case STREAM_DELTA:
+			{
+				if (record == STREAM_FULL) header(r, sys);
+				else for (int k = 0; k < 3; ++k) sys.origin_[k] += r.zigzag();
+
+				unsigned int n = r.varint();
+				if (!r.ok() || n > STREAM_MAX_MESSAGE / 3) return false;
+
+				std::vector<int> points(n * 3);
+				for (unsigned int i = 0; i < n * 3; ++i)
+				{
+					points[i] = r.zigzag() + (record == STREAM_DELTA && i < sys.points_.size() ? sys.points_[i] : 0);
+				}
+
+				sys.points_.swap(points);
+				sys.mirror_ = NULL;
+				break;
+			}
+
+			default:
+				return false;
+			}
+
+			if (!r.ok()) return false;
+			draw(sys, s);
+		}
+
+		state_.swap(next);
+		next.clear();
+		tidy();
+		return true;
+	}
+
+	void clear()
+	{
+		state_.clear();
+		tidy();
+	}
+
+private:
+
+	static void header(STREAM_READER &r, STREAM_SYSTEM &s)
+	{
+		s.sprite_ = (int)r.varint();
+		s.size_ = r.real();
+		for (int k = 0; k < 3; ++k) s.origin_[k] = r.zigzag();
+
+		if (s.sprite_ < 0 || s.sprite_ >= TEXTURE_COUNT) s.sprite_ = 0;
+	}
+
+	// Add one system's vertices and draw to the snapshot.
+	static void draw(const STREAM_SYSTEM &sys, FRAME_SNAPSHOT &s)
+	{
+		SNAPSHOT_DRAW d;
+		d.sprite_ = sys.sprite_;
+		d.particle_size_ = sys.size_;
+		d.first_ = (int)s.points_.size();
+
+		if (sys.mirror_)
+		{
+			const POINTVERTEX *v = sys.mirror_->staged_vertices();
+			d.count_ = sys.mirror_->staged_count();
+			s.points_.insert(s.points_.end(), v, v + d.count_);
+		}
+		else
+		{
+			d.count_ = (int)sys.points_.size() / 3;
+			s.points_.resize(d.first_ + d.count_);
+
+			for (int i = 0; i < d.count_; ++i)
+			{
+				s.points_[d.first_ + i].position_ = D3DXVECTOR3((sys.origin_[0] + sys.points_[i * 3 + 0]) / STREAM_QUANT,
+																(sys.origin_[1] + sys.points_[i * 3 + 1]) / STREAM_QUANT,
+																(sys.origin_[2] + sys.points_[i * 3 + 2]) / STREAM_QUANT);
+			}
+		}
+
+		if (d.count_ == 0) return;
+
+		// The renderer wants the compact stream when that is in use.
+		if (g_CompactVertices)
+		{
+			D3DXVECTOR3 origin(sys.origin_[0] / STREAM_QUANT, sys.origin_[1] / STREAM_QUANT, sys.origin_[2] / STREAM_QUANT);
+			const POINTVERTEX *v = &s.points_[d.first_];
+			d.range_ = compact_range(&v->position_, d.count_, sizeof(POINTVERTEX), origin);
+
+			int first = (int)s.compact_.size();
+			s.compact_.resize(first + d.count_);
+			encode_compact_vertices(&v->position_, NULL, d.count_, sizeof(POINTVERTEX), d.range_, &s.compact_[first]);
+
+			s.points_.resize(d.first_);
+			d.first_ = first;
+		}
+
+		s.draws_.push_back(d);
+	}
+
+	STREAM_STATE state_;
+};
+
+//-----------------------------------------------------------------------------
+// The server - accepts viewers and sends each simulated frame to all of them.
+
+class STREAM_SERVER
+{
+public:
+	STREAM_SERVER() : listen_(INVALID_SOCKET), started_(false), last_key_(0), joined_(false), frames_(0), raw_bytes_(0), record_bytes_(0), sent_bytes_(0) {}
+
+	~STREAM_SERVER()
+	{
+		stop();
+	}
+
+	bool running() const { return listen_ != INVALID_SOCKET; }
+
+	// Listen for viewers on 'port', on every address.
+	bool start(unsigned short port)
+	{
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+		started_ = true;
+
+		listen_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listen_ == INVALID_SOCKET) return false;
+
+		sockaddr_in address;
+		ZeroMemory(&address, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(port);
+
+		if (bind(listen_, (const sockaddr *)&address, sizeof(address)) == SOCKET_ERROR || listen(listen_, SOMAXCONN) == SOCKET_ERROR)
+		{
+			stop();
+			return false;
+		}
+
+		return true;
+	}
+
+	// Send the frame just simulated to every viewer. Call on the simulation thread, after Update().
+	void send_frame(int frame)
+	{
+		if (!running()) return;
+
+		accept_viewers();
+		if (viewers_.empty()) return;
+
+		bool key = joined_ || frame - last_key_ >= STREAM_KEY_INTERVAL;
+		if (key) last_key_ = frame;
+		joined_ = false;
+
+		writer_.clear();
+		encoder_.encode(key, writer_);
+
+		STREAM_FRAME_HEADER h;
+		h.magic_ = STREAM_MAGIC;
+		h.frame_ = frame;
+		h.flags_ = key ? STREAM_KEY : 0;
+		h.wind_ = g_World->wind_speed_;
+		h.vertices_ = encoder_.vertices();
+		h.bytes_ = (int)writer_.bytes_.size();
+
+		const std::vector<unsigned char> *body = &writer_.bytes_;
+		if (HuffmanEncode(writer_.bytes_, coded_))
+		{
+			h.flags_ |= STREAM_HUFFMAN;
+			body = &coded_;
+		}
+
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		h.sent_ = t.QuadPart;
+
+		// One message - size, header, body.
+		unsigned int size = (unsigned int)(sizeof(h) + body->size());
+		message_.resize(sizeof(size) + size);
+		memcpy(&message_[0], &size, sizeof(size));
+		memcpy(&message_[sizeof(size)], &h, sizeof(h));
+		if (!body->empty()) memcpy(&message_[sizeof(size) + sizeof(h)], &(*body)[0], body->size());
+
+		for (size_t i = 0; i < viewers_.size();)
+		{
+			if (SendAll(viewers_[i], &message_[0], (int)message_.size())) ++i;
+			else
+			{
+				closesocket(viewers_[i]);
+				viewers_.erase(viewers_.begin() + i);
+			}
+		}
+
+		if (viewers_.empty()) encoder_.clear();
+
+		++frames_;
+		raw_bytes_ += (double)h.vertices_ * sizeof(POINTVERTEX);
+		record_bytes_ += h.bytes_;
+		sent_bytes_ += (double)message_.size();
+	}
+
+	// One line summary for the on screen text.
+	std::string status() const
+	{
+		if (frames_ == 0) return "Streaming: " + std::to_string(viewers_.size()) + " viewer(s)";
+
+		return "Streaming: " + std::to_string(viewers_.size()) + " viewer(s), " + std::to_string((int)(sent_bytes_ / frames_ / 1024)) + " KB/frame sent, "
+			+ std::to_string((int)(record_bytes_ / frames_ / 1024)) + " KB/frame before Huffman, " + std::to_string((int)(raw_bytes_ / frames_ / 1024)) + " KB/frame raw ("
+			+ std::to_string(sent_bytes_ > 0 ? raw_bytes_ / sent_bytes_ : 0.0) + ":1)";
+	}
+
+	void stop()
+	{
+		if (listen_ != INVALID_SOCKET) closesocket(listen_);
+		listen_ = INVALID_SOCKET;
+
+		for (SOCKET s : viewers_) closesocket(s);
+		viewers_.clear();
+
+		if (started_) WSACleanup();
+		started_ = false;
+	}
+
+private:
+
+	// Take any viewers waiting to connect, without blocking.
+	void accept_viewers()
+	{
+		for (;;)
+		{
+			fd_set ready;
+			FD_ZERO(&ready);
+			FD_SET(listen_, &ready);
+
+			timeval now = { 0, 0 };
+			if (select(0, &ready, NULL, NULL, &now) != 1) return;
+
+			SOCKET s = accept(listen_, NULL, NULL);
+			if (s == INVALID_SOCKET) return;
+
+			SetNoDelay(s);
+			viewers_.push_back(s);
+			joined_ = true;		// They need a key frame to start from.
+		}
+	}
+
+	SOCKET listen_;
+	bool started_;
+	std::vector<SOCKET> viewers_;
+
+	STREAM_ENCODER encoder_;
+	STREAM_WRITER writer_;
+	std::vector<unsigned char> coded_, message_;
+	int last_key_;						// Frame of the last key frame.
+	bool joined_;						// A viewer has joined since the last frame.
+
+	int frames_;						// Frames sent, and the bytes they took - for status().
+	double raw_bytes_, record_bytes_, sent_bytes_;
+};
+
+//-----------------------------------------------------------------------------
+// The viewer - receives and decodes frames on a thread of its own, for the
+// main thread to draw the newest one.
+
+class STREAM_VIEWER
+{
+public:
+	STREAM_VIEWER() : socket_(INVALID_SOCKET), started_(false), running_(false), frames_(0), bytes_(0), raw_bytes_(0), latency_ticks_(0), first_(0), last_(0)
+	{
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency_ = f.QuadPart;
+	}
+
+	~STREAM_VIEWER()
+	{
+		stop();
+	}
+
+	// Started with a server to view - still true once it has disconnected.
+	bool viewing() const { return !name_.empty(); }
+
+	// Connect to the server at 'host' ("name" or "name:port") and start receiving.
+	bool start(const std::string &host)
+	{
+		std::string name = host;
+		unsigned short port = STREAM_PORT;
+
+		size_t colon = host.find(':');
+		if (colon != std::string::npos)
+		{
+			name = host.substr(0, colon);
+			port = (unsigned short)atoi(host.substr(colon + 1).c_str());
+		}
+
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+		started_ = true;
+		name_ = host;
+
+		addrinfo hints, *found = NULL;
+		ZeroMemory(&hints, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+
+		if (getaddrinfo(name.c_str(), std::to_string(port).c_str(), &hints, &found) != 0 || !found) return fail();
+
+		socket_ = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+		bool connected = socket_ != INVALID_SOCKET && connect(socket_, found->ai_addr, (int)found->ai_addrlen) != SOCKET_ERROR;
+		freeaddrinfo(found);
+
+		if (!connected) return fail();
+		SetNoDelay(socket_);
+
+		running_ = true;
+		worker_ = std::thread(&STREAM_VIEWER::run, this);
+		return true;
+	}
+
+	void stop()
+	{
+		running_ = false;
+
+		// Closing the socket wakes the thread from its recv().
+		if (socket_ != INVALID_SOCKET) closesocket(socket_);
+		socket_ = INVALID_SOCKET;
+
+		if (worker_.joinable()) worker_.join();
+
+		if (started_) WSACleanup();
+		started_ = false;
+	}
+
+	// The newest frame decoded.
+	const FRAME_SNAPSHOT &acquire()
+	{
+		buffers_.acquire();
+		return buffers_.read_buffer();
+	}
+
+	// Bandwidth and latency for the on screen text.
+	std::string status() const
+	{
+		int frames = frames_;
+		if (frames == 0) return "Viewing " + name_ + ": waiting for the first frame";
+
+		double seconds = (double)(last_ - first_) / (double)frequency_;
+		double latency = (double)latency_ticks_ * 1000.0 / (double)frequency_ / frames;
+
+		return "Viewing " + name_ + ": " + std::to_string((int)(bytes_ / frames / 1024)) + " KB/frame, "
+			+ std::to_string(seconds > 0 ? (int)(bytes_ / seconds / 1024) : 0) + " KB/s, " + std::to_string(bytes_ > 0 ? raw_bytes_ / bytes_ : 0.0) + ":1 against raw, "
+			+ "latency " + std::to_string(latency) + " ms" + (running_ ? "" : " - disconnected");
+	}
+
+private:
+
+	bool fail()
+	{
+		stop();
+		return false;
+	}
+
+	void run()
+	{
+		std::vector<unsigned char> message, records;
+
+		while (running_)
+		{
+			unsigned int size;
+			if (!ReceiveAll(socket_, &size, sizeof(size)) || size < sizeof(STREAM_FRAME_HEADER) || size > STREAM_MAX_MESSAGE) break;
+
+			message.resize(size);
+			if (!ReceiveAll(socket_, &message[0], (int)size)) break;
+
+			STREAM_FRAME_HEADER h;
+			memcpy(&h, &message[0], sizeof(h));
+			if (h.magic_ != STREAM_MAGIC) break;
+
+			const unsigned char *body = &message[0] + sizeof(h);
+			size_t body_bytes = size - sizeof(h);
+
+			if (h.flags_ & STREAM_HUFFMAN)
+			{
+				if (!HuffmanDecode(body, body_bytes, records)) break;
+				body = records.empty() ? NULL : &records[0];
+				body_bytes = records.size();
+			}
+
+			if (!decoder_.decode(body, body_bytes, h, buffers_.write_buffer())) break;
+
+			LARGE_INTEGER t;
+			QueryPerformanceCounter(&t);
+			buffers_.write_buffer().captured_ = t.QuadPart;
+			buffers_.publish();
+
+			if (frames_ == 0) first_ = t.QuadPart;
+			last_ = t.QuadPart;
+			latency_ticks_ += t.QuadPart - h.sent_;
+			bytes_ += sizeof(size) + size;
+			raw_bytes_ += (double)h.vertices_ * sizeof(POINTVERTEX);
+			++frames_;
+		}
+
+		running_ = false;
+	}
+
+	SOCKET socket_;
+	bool started_;
+	std::atomic<bool> running_;
+	std::thread worker_;
+	std::string name_;
+
+	STREAM_DECODER decoder_;
+	TRIPLE_BUFFER<FRAME_SNAPSHOT> buffers_;
+
+	// Written by the receiving thread, read for status() - only ever an approximate report.
+	std::atomic<int> frames_;
+	double bytes_, raw_bytes_;
+	LONGLONG latency_ticks_, first_, last_, frequency_;
+};
@@ -0,0 +1,270 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// TIMER WHEEL
+//
+// Everything in the show that happens after a fixed number of frames - the
+// spawners' cues, rocket fuses and rocket emission bursts - is scheduled here
+// instead of counting down every frame. advance() is called once per frame and
+// only touches the events that are due, plus a cascade every 64 frames, so the
+// cost follows the number of events firing rather than the number waiting.
+//
+// TIMER_LEVELS levels of TIMER_SLOTS slots each: level 0 holds events due in
+// the next 64 frames, one slot per frame, level 1 those due within 64 * 64
+// frames, 64 frames per slot, and so on. When level 0 wraps, the next slot of
+// level 1 is spread out over level 0 (and likewise further up). Events further
+// away than the top level covers wait in its last slot and are re-filed when
+// it cascades.
+//
+// Events are identified by a TIMER_ID and can be cancelled at any time, even
+// after the wheel has been cleared - an id only ever refers to one event.
+//
+// Events due on the same frame fire in the order they were scheduled, not the
+// order they happen to sit in their slot. That order is part of the show (the
+// systems they start are added in it), so checkpoints save it with order() and
+// put it back with set_order() - see Checkpoint.h.
+//-----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#define TIMER_SLOT_BITS	6
+#define TIMER_SLOTS		(1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS	4
+
+struct TIMER_ID
+{
+	TIMER_ID() : index_(-1), generation_(0) {}
+
+	int index_;
+	unsigned int generation_;
+};
+
+class TIMER_WHEEL
+{
+public:
+	TIMER_WHEEL() : now_(0), pending_(0), free_(-1), order_(1)
+	{
+		for (int l = 0; l < TIMER_LEVELS; ++l)
+		{
+			for (int s = 0; s < TIMER_SLOTS; ++s) slots_[l][s] = -1;
+		}
+	}
+
+	// Frames advanced so far.
+	unsigned int now() const { return now_; }
+
+	// Number of events waiting to fire.
+	int pending() const { return pending_; }
+
+	// Call 'fire' on the advance() 'delay' frames from now (at least 1).
+	TIMER_ID schedule(unsigned int delay, const std::function<void()> &fire)
+	{
+		int i = allocate();
+
+		nodes_[i].due_ = now_ + (delay > 0 ? delay : 1);
+		nodes_[i].fire_ = fire;
+		nodes_[i].order_ = order_++;
+		insert(i);
+		++pending_;
+
+		TIMER_ID id;
+		id.index_ = i;
+		id.generation_ = nodes_[i].generation_;
+		return id;
+	}
+
+	// Stop 'id' from firing. Does nothing if it has already fired or been cancelled.
+	void cancel(TIMER_ID &id)
+	{
+		if (live(id))
+		{
+			// Left in its slot, and freed when the wheel gets to it.
+			++nodes_[id.index_].generation_;
+			nodes_[id.index_].fire_ = nullptr;
+			--pending_;
+		}
+
+		id = TIMER_ID();
+	}
+
+	// True if 'id' is still waiting to fire.
+	bool live(const TIMER_ID &id) const
+	{
+		return id.index_ >= 0 && id.index_ < (int)nodes_.size() && nodes_[id.index_].generation_ == id.generation_ && nodes_[id.index_].fire_;
+	}
+
+	// Position of 'id' among the events scheduled so far, 0 if it is not live.
+	unsigned int order(const TIMER_ID &id) const
+	{
+		return live(id) ? nodes_[id.index_].order_ : 0;
+	}
+
+	// Give 'id' the position 'order' (from order()) among events due on the same frame - restoring a checkpoint.
+	// Events scheduled after this go after it.
+	void set_order(const TIMER_ID &id, unsigned int order)
+	{
+		if (!live(id) || order == 0) return;
+
+		nodes_[id.index_].order_ = order;
+		if (order >= order_) order_ = order + 1;
+	}
+
+	// Frames until 'id' fires, 0 if it is not live.
+	unsigned int remaining(const TIMER_ID &id) const
+	{
+		return live(id) ? nodes_[id.index_].due_ - now_ : 0;
+	}
+
+	// Move on a frame and fire everything due.
+	void advance()
+	{
+		++now_;
+
+		// Level 0 has gone round - bring the next slot of level 1 down, then of each level above it for as long as the
+		// level below has wrapped too. Lowest first: each timer is put back relative to now_, so one brought down from
+		// level 2 lands in a level 1 slot still to come (or in level 0), never in the one just emptied.
+		for (int l = 1; l < TIMER_LEVELS; ++l)
+		{
+			if (((now_ >> ((l - 1) * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1)) != 0) break;
+			cascade(l, (now_ >> (l * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1));
+		}
+
+		// Take the slot's list first, so anything scheduled while firing goes into a fresh one.
+		int i = slots_[0][now_ & (TIMER_SLOTS - 1)];
+		slots_[0][now_ & (TIMER_SLOTS - 1)] = -1;
+
+		due_.clear();
+		while (i >= 0)
+		{
+			int next = nodes_[i].next_;
+
+			if (nodes_[i].fire_ && nodes_[i].due_ != now_)
+			{
+				insert(i);		// Beyond the top level when it was filed - not due yet.
+			}
+			else
+			{
+				due_.push_back(i);
+			}
+
+			i = next;
+		}
+
+		// In the order they were scheduled.
+		std::sort(due_.begin(), due_.end(), [this](int a, int b) { return nodes_[a].order_ < nodes_[b].order_; });
+
+		for (size_t d = 0; d < due_.size(); ++d)
+		{
+			int n = due_[d];
+
+			std::function<void()> fire;
+			fire.swap(nodes_[n].fire_);		// Empty if cancelled, maybe by an event that fired before it.
+
+			++nodes_[n].generation_;
+			release(n);
+
+			if (fire)
+			{
+				--pending_;
+				fire();			// May schedule more - 'nodes_' can grow.
+			}
+		}
+	}
+
+	// Drop every event without firing it (the clock carries on from where it was).
+	void clear()
+	{
+		for (int l = 0; l < TIMER_LEVELS; ++l)
+		{
+			for (int s = 0; s < TIMER_SLOTS; ++s) slots_[l][s] = -1;
+		}
+
+		free_ = -1;
+		for (int i = 0; i < (int)nodes_.size(); ++i)
+		{
+			if (nodes_[i].fire_) ++nodes_[i].generation_;
+			nodes_[i].fire_ = nullptr;
+			nodes_[i].next_ = free_;
+			free_ = i;
+		}
+
+		pending_ = 0;
+	}
+
+private:
+	struct NODE
+	{
+		NODE() : due_(0), order_(0), generation_(0), next_(-1) {}
+
+		unsigned int due_;
+		unsigned int order_;			// Value of 'order_' when it was scheduled - the firing order within a frame.
+		unsigned int generation_;		// Bumped whenever the event fires or is cancelled, so old ids stop matching.
+		int next_;						// Next node in the same slot, or on the free list.
+		std::function<void()> fire_;	// Empty once cancelled.
+	};
+
+	int allocate()
+	{
+		if (free_ < 0)
+		{
+			nodes_.push_back(NODE());
+			return (int)nodes_.size() - 1;
+		}
+
+		int i = free_;
+		free_ = nodes_[i].next_;
+		return i;
+	}
+
+	void release(int i)
+	{
+		nodes_[i].next_ = free_;
+		free_ = i;
+	}
+
+	// File node 'i' in the lowest level whose range reaches its due frame.
+	void insert(int i)
+	{
+		unsigned int due = nodes_[i].due_;
+		unsigned int delta = due - now_;
+
+		int l = 0;
+		while (l < TIMER_LEVELS - 1 && delta >= (1u << ((l + 1) * TIMER_SLOT_BITS))) ++l;
+
+		// Past the top level - wait in its furthest slot.
+		if (l == TIMER_LEVELS - 1 && delta >= (1u << (TIMER_LEVELS * TIMER_SLOT_BITS)))
+		{
+			due = now_ + (1u << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1;
+		}
+
+		int s = (due >> (l * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+		nodes_[i].next_ = slots_[l][s];
+		slots_[l][s] = i;
+	}
+
+	// Re-file everything in slot 's' of level 'l' - it is all now within reach of the levels below.
+	void cascade(int l, int s)
+	{
+		int i = slots_[l][s];
+		slots_[l][s] = -1;
+
+		while (i >= 0)
+		{
+			int next = nodes_[i].next_;
+
+			if (nodes_[i].fire_) insert(i);
+			else release(i);		// Cancelled.
+
+			i = next;
+		}
+	}
+
+	unsigned int now_;
+	int pending_;
+	int slots_[TIMER_LEVELS][TIMER_SLOTS];	// Head of each slot's list, -1 if empty.
+	std::vector<NODE> nodes_;
+	int free_;								// Head of the free list.
+	unsigned int order_;					// Given to the next event scheduled.
+	std::vector<int> due_;					// The events firing this frame (kept to save allocating every frame).
+};
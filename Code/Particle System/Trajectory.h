@@ -0,0 +1,849 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// TRAJECTORY LOG
+//
+// "-trajectory <file>" writes down where everything in the show was on every
+// frame, for working out afterwards where the fallout lands (see
+// LANDING_MAP). For each frame and each system it keeps the system's serial_,
+// type and origin, and a column each of its particles' X, Y and Z and
+// lifetime - the dead ones too, at lifetime 0, so every particle stays in the
+// same place in the columns from one frame to the next. A rocket's origin is
+// the rocket itself.
+//
+// The frames are gathered into chunks of TRAJECTORY_CHUNK_FRAMES. All the
+// simulation thread does is copy the columns into the chunk being filled -
+// coding and writing the full chunks is done by a thread of its own. The
+// chunks are kept in a pool of TRAJECTORY_QUEUE, reused; if the writer falls
+// that far behind, frames are dropped (and counted) rather than the show
+// waiting for the disk.
+//
+// In a chunk the positions are quantized to 1 / TRAJECTORY_QUANT units and
+// each value written as its difference from a prediction: the same particle
+// carried on from the two frames before at the speed it was going (or where
+// it was, with only one), or the system's origin for a new one. Lifetimes are
+// written as their difference from the last frame's less one, which is
+// almost always 0. The values are written column by column for the whole
+// chunk, lifetimes first, as zigzag varints, and the lot Huffman coded where
+// that makes it smaller (see Stream.h).
+//
+// The file:
+//   TRAJECTORY_HEADER
+//   float x, y, z			the Location of every spawner
+//   chunks					one after another, in the order they were written
+//   TRAJECTORY_ENTRY[]		the index - one per chunk, its frames, serials and place in the file
+//   TRAJECTORY_FOOTER		where the index is
+// The index lets a reader go straight to the chunk for a frame, or skip the
+// chunks a system does not appear in. A seek or restore starts a new chunk;
+// if frames were recorded twice the later chunk is the one read back.
+//-----------------------------------------------------------------------------
+
+#include "Stream.h"
+#include <float.h>
+#include <math.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TRAJECTORY_MAGIC		0x4A545746	// "FWTJ"
+#define TRAJECTORY_INDEX_MAGIC	0x58445446	// "FTDX"
+#define TRAJECTORY_VERSION		1
+#define TRAJECTORY_QUANT		64.0f		// Position steps per unit.
+#define TRAJECTORY_CHUNK_FRAMES	60			// Frames to a chunk (one second of the show).
+#define TRAJECTORY_QUEUE		4			// Chunks in the pool - how far the writer may fall behind.
+#define TRAJECTORY_MAX_CHUNK	(256 << 20)	// Larger chunks are taken as a broken file.
+
+// Chunk flags.
+#define TRAJECTORY_HUFFMAN		0x01		// The chunk is Huffman coded.
+
+struct TRAJECTORY_HEADER
+{
+	unsigned int	magic_;
+	unsigned int	version_;
+	float			quant_;
+	int				spawners_;			// Spawner Locations that follow.
+};
+
+struct TRAJECTORY_ENTRY
+{
+	unsigned int		first_frame_;
+	unsigned int		frames_;
+	unsigned long long	offset_;		// Of the chunk, from the start of the file.
+	unsigned int		bytes_;			// Size of the chunk in the file.
+	unsigned int		raw_bytes_;		// Size before the Huffman coding.
+	unsigned int		flags_;
+	unsigned int		first_serial_;	// Lowest and highest system serial_ in the chunk.
+	unsigned int		last_serial_;
+	unsigned int		particles_;		// Particle positions in the chunk, for the report.
+};
+
+struct TRAJECTORY_FOOTER
+{
+	unsigned long long	index_offset_;
+	unsigned int		chunks_;
+	unsigned int		magic_;
+};
+
+// One system on one frame. Its particles are 'count_' entries of the chunk's columns from 'first_'.
+struct TRAJECTORY_SYSTEM
+{
+	unsigned int	frame_;
+	unsigned int	serial_;
+	int				type_;				// SYSTEM_TYPE.
+	D3DXVECTOR3		origin_;
+	unsigned int	first_;
+	unsigned int	count_;
+};
+
+// A chunk of frames - as filled by the recorder, and as decoded by the reader.
+struct TRAJECTORY_CHUNK
+{
+	TRAJECTORY_CHUNK() : first_frame_(0), frames_(0) {}
+
+	// Empty, keeping the memory for the next chunk.
+	void clear()
+	{
+		first_frame_ = frames_ = 0;
+		systems_.clear();
+		x_.clear();
+		y_.clear();
+		z_.clear();
+		lifetime_.clear();
+	}
+
+	// System 'serial' on 'frame', NULL if it is not in the chunk.
+	const TRAJECTORY_SYSTEM *find(unsigned int frame, unsigned int serial) const
+	{
+		for (auto &s : systems_)
+		{
+			if (s.frame_ == frame && s.serial_ == serial) return &s;
+		}
+
+		return NULL;
+	}
+
+	// Code the chunk into 'w' (see the top of the file).
+	void encode(STREAM_WRITER &w) const
+	{
+		w.varint(first_frame_);
+		w.varint(frames_);
+		w.varint((unsigned int)systems_.size());
+
+		std::vector<int> origins(systems_.size() * 3);
+		unsigned int frame = first_frame_, serial = 0;
+
+		for (size_t i = 0; i < systems_.size(); ++i)
+		{
+			const TRAJECTORY_SYSTEM &s = systems_[i];
+			w.varint(s.frame_ - frame);
+			w.zigzag((int)(s.serial_ - serial));
+			w.byte((unsigned int)s.type_);
+			w.varint(s.count_);
+
+			origins[i * 3 + 0] = stream_quantize(s.origin_.x, TRAJECTORY_QUANT);
+			origins[i * 3 + 1] = stream_quantize(s.origin_.y, TRAJECTORY_QUANT);
+			origins[i * 3 + 2] = stream_quantize(s.origin_.z, TRAJECTORY_QUANT);
+			for (int k = 0; k < 3; ++k) w.zigzag(origins[i * 3 + k]);
+
+			frame = s.frame_;
+			serial = s.serial_;
+		}
+
+		// The lifetimes first - which particle was which on the frame before depends on them.
+		std::vector<int> previous, from;
+		previous_records(previous);
+		from.resize(lifetime_.size());
+
+		for (size_t i = 0; i < systems_.size(); ++i)
+		{
+			link(previous, i, from);
+
+			const TRAJECTORY_SYSTEM &s = systems_[i];
+			for (unsigned int j = s.first_; j < s.first_ + s.count_; ++j) w.zigzag(lifetime_[j] - predict_lifetime(from[j]));
+		}
+
+		std::vector<int> q(lifetime_.size());
+		const std::vector<float> *columns[3] = { &x_, &y_, &z_ };
+		for (int k = 0; k < 3; ++k)
+		{
+			const std::vector<float> &c = *columns[k];
+			for (size_t j = 0; j < c.size(); ++j) q[j] = stream_quantize(c[j], TRAJECTORY_QUANT);
+
+			for (size_t i = 0; i < systems_.size(); ++i)
+			{
+				const TRAJECTORY_SYSTEM &s = systems_[i];
+				for (unsigned int j = s.first_; j < s.first_ + s.count_; ++j) w.zigzag(q[j] - predict(q, from, j, origins[i * 3 + k]));
+			}
+		}
+	}
+
+	// Replace the chunk with the one coded in 'r'. False if it is broken.
+	bool decode(STREAM_READER &r)
+	{
+		clear();
+
+		first_frame_ = r.varint();
+		frames_ = r.varint();
+		unsigned int n = r.varint();
+		if (!r.ok() || n > TRAJECTORY_MAX_CHUNK / 8) return false;
+
+		systems_.resize(n);
+
+		std::vector<int> origins(n * 3);
+		unsigned int frame = first_frame_, serial = 0, particles = 0;
+
+		for (unsigned int i = 0; i < n; ++i)
+		{
+			TRAJECTORY_SYSTEM &s = systems_[i];
+			s.frame_ = frame + r.varint();
+			s.serial_ = serial + (unsigned int)r.zigzag();
+			s.type_ = (int)r.byte();
+			s.count_ = r.varint();
+			s.first_ = particles;
+
+			for (int k = 0; k < 3; ++k) origins[i * 3 + k] = r.zigzag();
+			s.origin_ = D3DXVECTOR3(origins[i * 3 + 0] / TRAJECTORY_QUANT, origins[i * 3 + 1] / TRAJECTORY_QUANT, origins[i * 3 + 2] / TRAJECTORY_QUANT);
+
+			if (!r.ok() || s.count_ > TRAJECTORY_MAX_CHUNK / 8 - particles) return false;
+
+			frame = s.frame_;
+			serial = s.serial_;
+			particles += s.count_;
+		}
+
+		std::vector<int> previous, from;
+		previous_records(previous);
+		from.resize(particles);
+		lifetime_.resize(particles);
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			link(previous, i, from);
+
+			const TRAJECTORY_SYSTEM &s = systems_[i];
+			for (unsigned int j = s.first_; j < s.first_ + s.count_; ++j) lifetime_[j] = predict_lifetime(from[j]) + r.zigzag();
+		}
+
+		// The quantized positions, to predict from, then the positions themselves.
+		std::vector<int> q(particles);
+		std::vector<float> *columns[3] = { &x_, &y_, &z_ };
+		for (int k = 0; k < 3; ++k)
+		{
+			std::vector<float> &c = *columns[k];
+			c.resize(particles);
+
+			for (size_t i = 0; i < n; ++i)
+			{
+				const TRAJECTORY_SYSTEM &s = systems_[i];
+				for (unsigned int j = s.first_; j < s.first_ + s.count_; ++j)
+				{
+					q[j] = predict(q, from, j, origins[i * 3 + k]) + r.zigzag();
+					c[j] = q[j] / TRAJECTORY_QUANT;
+				}
+			}
+		}
+
+		return r.ok();
+	}
+
+	unsigned int first_frame_;
+	unsigned int frames_;
+	std::vector<TRAJECTORY_SYSTEM> systems_;		// In frame order.
+	std::vector<float> x_, y_, z_;					// The columns.
+	std::vector<int> lifetime_;
+
+private:
+
+	// Quantized value 'j', as expected from the frames before - carried on at the speed it was going, or
+	// where it was if there is only the one frame, or 'origin' for a particle not seen before.
+	static int predict(const std::vector<int> &q, const std::vector<int> &from, unsigned int j, int origin)
+	{
+		int last = from[j];
+		if (last < 0) return origin;
+		if (from[last] < 0) return q[last];
+
+		return 2 * q[last] - q[from[last]];
+	}
+
+	// Lifetime of a particle that was at 'last' on the frame before - a frame less, or still dead.
+	int predict_lifetime(int last) const
+	{
+		if (last < 0 || lifetime_[last] <= 0) return 0;
+		return lifetime_[last] - 1;
+	}
+
+	// Where each particle of system record 'i' was on the frame before ('from', -1 for none). Explosions
+	// erase their dead particles, which moves the rest down; everything else keeps its particles in place.
+	void link(const std::vector<int> &previous, size_t i, std::vector<int> &from) const
+	{
+		const TRAJECTORY_SYSTEM &s = systems_[i];
+		const TRAJECTORY_SYSTEM *p = previous[i] < 0 ? NULL : &systems_[previous[i]];
+
+		unsigned int k = p ? p->first_ : 0, end = p ? p->first_ + p->count_ : 0;
+		for (unsigned int j = s.first_; j < s.first_ + s.count_; ++j, ++k)
+		{
+			if (s.type_ == SYSTEM_EXPLOSION)
+			{
+				while (k < end && lifetime_[k] <= 0) ++k;
+			}
+
+			from[j] = k < end ? (int)k : -1;
+		}
+	}
+
+	// For each system record, the record of the same system on the frame before, or -1.
+	void previous_records(std::vector<int> &previous) const
+	{
+		previous.assign(systems_.size(), -1);
+
+		std::map<unsigned int, int> last;
+		for (size_t i = 0; i < systems_.size(); ++i)
+		{
+			std::map<unsigned int, int>::iterator l = last.find(systems_[i].serial_);
+			if (l != last.end())
+			{
+				if (systems_[l->second].frame_ + 1 == systems_[i].frame_) previous[i] = l->second;
+				l->second = (int)i;
+			}
+			else last[systems_[i].serial_] = (int)i;
+		}
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Writes the log (-trajectory on the command line).
+
+class TRAJECTORY_RECORDER
+{
+public:
+	TRAJECTORY_RECORDER() : file_(NULL), filling_(NULL), stopping_(false), written_(0), frames_(0), dropped_(0), particles_(0), raw_bytes_(0), coded_bytes_(0) {}
+
+	~TRAJECTORY_RECORDER()
+	{
+		stop();
+	}
+
+	bool start(const char *filename, const std::vector<std::shared_ptr<FireworkSpawner>> &spawners)
+	{
+		stop();
+
+		if (fopen_s(&file_, filename, "wb") != 0 || file_ == NULL) return false;
+
+		TRAJECTORY_HEADER h;
+		h.magic_ = TRAJECTORY_MAGIC;
+		h.version_ = TRAJECTORY_VERSION;
+		h.quant_ = TRAJECTORY_QUANT;
+		h.spawners_ = (int)spawners.size();
+		fwrite(&h, sizeof(h), 1, file_);
+		written_ = sizeof(h);
+
+		for (auto &s : spawners)
+		{
+			float l[3] = { s->Location.x, s->Location.y, s->Location.z };
+			fwrite(l, sizeof(l), 1, file_);
+			written_ += sizeof(l);
+		}
+
+		for (int i = 0; i < TRAJECTORY_QUEUE; ++i)
+		{
+			pool_.push_back(std::unique_ptr<TRAJECTORY_CHUNK>(new TRAJECTORY_CHUNK));
+			free_.push_back(pool_.back().get());
+		}
+
+		stopping_ = false;
+		worker_ = std::thread(&TRAJECTORY_RECORDER::run, this);
+		return true;
+	}
+
+	// Write the last chunk and the index, and close the file.
+	void stop()
+	{
+		if (!file_) return;
+
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			if (filling_ && filling_->frames_ > 0) queue_.push_back(filling_);
+			filling_ = NULL;
+			stopping_ = true;
+		}
+		wake_.notify_one();
+		worker_.join();
+
+		TRAJECTORY_FOOTER f;
+		f.index_offset_ = written_;
+		f.chunks_ = (unsigned int)index_.size();
+		f.magic_ = TRAJECTORY_INDEX_MAGIC;
+		if (!index_.empty()) fwrite(&index_[0], sizeof(TRAJECTORY_ENTRY), index_.size(), file_);
+		fwrite(&f, sizeof(f), 1, file_);
+
+		fclose(file_);
+		file_ = NULL;
+
+		index_.clear();
+		queue_.clear();
+		free_.clear();
+		pool_.clear();
+	}
+
+	bool recording() const { return file_ != NULL; }
+
+	// Copy the frame just simulated into the chunk being filled. Call on the simulation thread, after Update().
+	void capture(unsigned int frame)
+	{
+		if (!file_) return;
+
+		// Hand the chunk to the writer when it is full, or when the show has jumped (a seek or restore).
+		if (filling_ && (filling_->frames_ == TRAJECTORY_CHUNK_FRAMES || filling_->first_frame_ + filling_->frames_ != frame))
+		{
+			{
+				std::lock_guard<std::mutex> lock(lock_);
+				queue_.push_back(filling_);
+			}
+			wake_.notify_one();
+			filling_ = NULL;
+		}
+
+		if (!filling_)
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			if (!free_.empty())
+			{
+				filling_ = free_.back();
+				free_.pop_back();
+			}
+		}
+
+		// The writer has every chunk - this frame is lost rather than waited for.
+		if (!filling_)
+		{
+			++dropped_;
+			return;
+		}
+
+		TRAJECTORY_CHUNK &c = *filling_;
+		if (c.frames_ == 0) c.first_frame_ = frame;
+		++c.frames_;
+
+		for (auto &p : g_World->particles_)
+		{
+			if (p->safeToDelete) continue;
+
+			TRAJECTORY_SYSTEM s;
+			s.frame_ = frame;
+			s.serial_ = p->serial_;
+			s.type_ = p->type();
+			s.origin_ = p->origin_;
+			s.first_ = (unsigned int)c.lifetime_.size();
+
+			for (auto &q : p->particles())
+			{
+				c.x_.push_back(q.position_.x);
+				c.y_.push_back(q.position_.y);
+				c.z_.push_back(q.position_.z);
+				c.lifetime_.push_back(q.lifetime_);
+			}
+
+			s.count_ = (unsigned int)c.lifetime_.size() - s.first_;
+			c.systems_.push_back(s);
+		}
+
+		++frames_;
+	}
+
+	// One line for the on screen text.
+	std::string status() const
+	{
+		unsigned long long raw = raw_bytes_.load(), coded = coded_bytes_.load();
+		int ratio = coded ? (int)(100 * raw / coded) : 0;
+
+		return "Trajectory: " + std::to_string(frames_.load()) + " frames, " + std::to_string(dropped_.load()) + " dropped, "
+			+ std::to_string(particles_.load()) + " positions in " + std::to_string((coded + 512) / 1024) + " KB ("
+			+ std::to_string(ratio / 100) + "." + std::to_string(ratio / 10 % 10) + "x smaller coded)";
+	}
+
+private:
+
+	// The writer thread - codes and writes the full chunks until stopped.
+	void run()
+	{
+		STREAM_WRITER w;
+		std::vector<unsigned char> coded;
+
+		for (;;)
+		{
+			TRAJECTORY_CHUNK *c = NULL;
+			{
+				std::unique_lock<std::mutex> lock(lock_);
+				wake_.wait(lock, [this]() { return !queue_.empty() || stopping_; });
+				if (queue_.empty()) return;
+
+				c = queue_.front();
+				queue_.pop_front();
+			}
+
+			w.clear();
+			c->encode(w);
+
+			TRAJECTORY_ENTRY e;
+			e.first_frame_ = c->first_frame_;
+			e.frames_ = c->frames_;
+			e.offset_ = written_;
+			e.raw_bytes_ = (unsigned int)w.bytes_.size();
+			e.flags_ = 0;
+			e.first_serial_ = e.last_serial_ = c->systems_.empty() ? 0 : c->systems_[0].serial_;
+			e.particles_ = (unsigned int)c->lifetime_.size();
+
+			for (auto &s : c->systems_)
+			{
+				if (s.serial_ < e.first_serial_) e.first_serial_ = s.serial_;
+				if (s.serial_ > e.last_serial_) e.last_serial_ = s.serial_;
+			}
+
+			const std::vector<unsigned char> *body = &w.bytes_;
+			if (HuffmanEncode(w.bytes_, coded))
+			{
+				e.flags_ |= TRAJECTORY_HUFFMAN;
+				body = &coded;
+			}
+
+			e.bytes_ = (unsigned int)body->size();
+			if (fwrite(&(*body)[0], 1, body->size(), file_) != body->size())
+			{
+				OutputDebugString("Trajectory: could not write the log.\n");
+			}
+
+			written_ += e.bytes_;
+			index_.push_back(e);
+
+			particles_ += e.particles_;
+			raw_bytes_ += (unsigned long long)e.particles_ * 4 * sizeof(float);
+			coded_bytes_ += e.bytes_;
+
+			c->clear();
+			std::lock_guard<std::mutex> lock(lock_);
+			free_.push_back(c);
+		}
+	}
+
+	FILE *file_;
+	std::thread worker_;
+	std::mutex lock_;
+	std::condition_variable wake_;
+
+	std::vector<std::unique_ptr<TRAJECTORY_CHUNK>> pool_;
+	std::vector<TRAJECTORY_CHUNK *> free_;		// Chunks ready to fill - under 'lock_'.
+	std::deque<TRAJECTORY_CHUNK *> queue_;		// Full chunks waiting for the writer - under 'lock_'.
+	TRAJECTORY_CHUNK *filling_;					// Simulation thread only.
+	bool stopping_;								// Under 'lock_'.
+
+	// Writer thread only, until it has stopped.
+	unsigned long long written_;				// Bytes in the file so far.
+	std::vector<TRAJECTORY_ENTRY> index_;
+
+	// For status() - the first two written by the simulation thread, the rest by the writer, read by the render thread.
+	std::atomic<unsigned int> frames_, dropped_;
+	std::atomic<unsigned long long> particles_, raw_bytes_, coded_bytes_;
+};
+
+//-----------------------------------------------------------------------------
+// Reads the log back - a chunk at a time, found through the index.
+
+class TRAJECTORY_READER
+{
+public:
+	TRAJECTORY_READER() : file_(NULL) {}
+
+	~TRAJECTORY_READER()
+	{
+		close();
+	}
+
+	bool open(const char *filename)
+	{
+		close();
+		if (fopen_s(&file_, filename, "rb") != 0 || file_ == NULL) return false;
+
+		TRAJECTORY_HEADER h;
+		if (fread(&h, sizeof(h), 1, file_) != 1 || h.magic_ != TRAJECTORY_MAGIC || h.version_ != TRAJECTORY_VERSION
+			|| h.spawners_ < 0 || h.spawners_ > 1024)
+		{
+			close();
+			return false;
+		}
+
+		for (int i = 0; i < h.spawners_; ++i)
+		{
+			float l[3];
+			if (fread(l, sizeof(l), 1, file_) != 1)
+			{
+				close();
+				return false;
+			}
+			spawners_.push_back(D3DXVECTOR3(l[0], l[1], l[2]));
+		}
+
+		TRAJECTORY_FOOTER f;
+		if (_fseeki64(file_, -(long long)sizeof(f), SEEK_END) != 0 || fread(&f, sizeof(f), 1, file_) != 1 || f.magic_ != TRAJECTORY_INDEX_MAGIC
+			|| f.chunks_ > TRAJECTORY_MAX_CHUNK / sizeof(TRAJECTORY_ENTRY))
+		{
+			OutputDebugString("Trajectory: no index - the log was not closed.\n");
+			close();
+			return false;
+		}
+
+		index_.resize(f.chunks_);
+		if (f.chunks_ > 0 && (_fseeki64(file_, (long long)f.index_offset_, SEEK_SET) != 0
+			|| fread(&index_[0], sizeof(TRAJECTORY_ENTRY), index_.size(), file_) != index_.size()))
+		{
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void close()
+	{
+		if (file_) fclose(file_);
+		file_ = NULL;
+		index_.clear();
+		spawners_.clear();
+	}
+
+	int chunks() const { return (int)index_.size(); }
+	const TRAJECTORY_ENTRY &entry(int i) const { return index_[i]; }
+	const std::vector<D3DXVECTOR3> &spawners() const { return spawners_; }
+
+	// The chunk holding 'frame' - the last written, if it was recorded more than once. -1 if it was not recorded.
+	int find(unsigned int frame) const
+	{
+		for (size_t i = index_.size(); i-- > 0;)
+		{
+			if (frame >= index_[i].first_frame_ && frame - index_[i].first_frame_ < index_[i].frames_) return (int)i;
+		}
+
+		return -1;
+	}
+
+	// True if chunk 'i' could hold system 'serial'.
+	bool may_hold(int i, unsigned int serial) const
+	{
+		return serial >= index_[i].first_serial_ && serial <= index_[i].last_serial_;
+	}
+
+	// Read and decode chunk 'i'.
+	bool read(int i, TRAJECTORY_CHUNK &chunk)
+	{
+		const TRAJECTORY_ENTRY &e = index_[i];
+		if (e.bytes_ == 0 || e.bytes_ > TRAJECTORY_MAX_CHUNK) return false;
+
+		bytes_.resize(e.bytes_);
+		if (_fseeki64(file_, (long long)e.offset_, SEEK_SET) != 0 || fread(&bytes_[0], 1, bytes_.size(), file_) != bytes_.size()) return false;
+
+		const std::vector<unsigned char> *body = &bytes_;
+		if (e.flags_ & TRAJECTORY_HUFFMAN)
+		{
+			if (!HuffmanDecode(&bytes_[0], bytes_.size(), decoded_) || decoded_.size() != e.raw_bytes_) return false;
+			body = &decoded_;
+		}
+
+		STREAM_READER r(&(*body)[0], body->size());
+		return chunk.decode(r);
+	}
+
+private:
+	FILE *file_;
+	std::vector<TRAJECTORY_ENTRY> index_;
+	std::vector<D3DXVECTOR3> spawners_;
+	std::vector<unsigned char> bytes_, decoded_;
+};
+
+//-----------------------------------------------------------------------------
+// Where the particles come down, around each spawner ("-landing <file> [csv]").
+//
+// A particle's landing point is where it was on its last live frame, however it
+// died - burnt out in the air, killed by the ground or by a floor
+// (terminate_on_floor_), or started again in the same frame. That is any slot
+// whose lifetime goes from above 0 to 0 (or jumps up) from one frame to the
+// next, and every live particle of a system that is gone the next frame
+// (systems are only deleted once their particles are dead). Particles still
+// alive on the last frame of the log, or before a jump in it, are not counted.
+// Each landing is counted against the spawner nearest its system's origin, in
+// LANDING_CELL squares of X/Z relative to the spawner's Location, out to
+// LANDING_RANGE either way.
+
+#define LANDING_CELL	5.0f
+#define LANDING_RANGE	200.0f
+#define LANDING_CELLS	((int)(2 * LANDING_RANGE / LANDING_CELL))
+
+class LANDING_MAP
+{
+public:
+	bool build(const char *filename)
+	{
+		TRAJECTORY_READER r;
+		if (!r.open(filename)) return false;
+
+		spawners_ = r.spawners();
+		if (spawners_.empty()) return false;
+
+		cells_.assign(spawners_.size() * LANDING_CELLS * LANDING_CELLS, 0);
+		landed_.assign(spawners_.size(), 0);
+		outside_.assign(spawners_.size(), 0);
+		furthest_.assign(spawners_.size(), 0.0f);
+		distance_.assign(spawners_.size(), 0.0);
+
+		std::map<unsigned int, LANDING_SYSTEM> last;	// Every system on the frame before, by serial_.
+		unsigned int frame = 0;
+		bool any = false;
+
+		TRAJECTORY_CHUNK c;
+		for (int i = 0; i < r.chunks(); ++i)
+		{
+			if (!r.read(i, c))
+			{
+				OutputDebugString(("Trajectory: chunk " + std::to_string(i) + " is broken, skipped.\n").c_str());
+				continue;
+			}
+
+			for (auto &s : c.systems_)
+			{
+				if (any && s.frame_ != frame) settle(last, frame);
+				frame = s.frame_;
+				any = true;
+
+				LANDING_SYSTEM &l = last[s.serial_];
+				l.owner_ = nearest(s.origin_);
+
+				// Slots that have died since the frame before land where they were then.
+				if (l.frame_ + 1 == s.frame_)
+				{
+					unsigned int n = s.count_ < l.lifetime_.size() ? s.count_ : (unsigned int)l.lifetime_.size();
+					for (unsigned int j = 0; j < n; ++j)
+					{
+						int was = l.lifetime_[j], now = c.lifetime_[s.first_ + j];
+						if (was > 0 && (now <= 0 || now > was)) land(l.owner_, l.x_[j] - spawners_[l.owner_].x, l.z_[j] - spawners_[l.owner_].z);
+					}
+				}
+
+				l.frame_ = s.frame_;
+				l.lifetime_.assign(c.lifetime_.begin() + s.first_, c.lifetime_.begin() + s.first_ + s.count_);
+				l.x_.assign(c.x_.begin() + s.first_, c.x_.begin() + s.first_ + s.count_);
+				l.z_.assign(c.z_.begin() + s.first_, c.z_.begin() + s.first_ + s.count_);
+			}
+		}
+
+		return true;
+	}
+
+	// A line per spawner, then "spawner,x,z,count" for every cell anything landed in - 'x' and 'z' the centre of the cell, relative to the spawner.
+	bool write(const char *filename) const
+	{
+		FILE *f = NULL;
+		if (fopen_s(&f, filename, "w") != 0 || f == NULL) return false;
+
+		for (size_t i = 0; i < spawners_.size(); ++i)
+		{
+			fprintf(f, "# spawner %d at (%.1f, %.1f, %.1f): %d landed, %d outside the map, mean distance %.1f, furthest %.1f\n", (int)i,
+				spawners_[i].x, spawners_[i].y, spawners_[i].z, landed_[i], outside_[i], landed_[i] ? distance_[i] / landed_[i] : 0.0, furthest_[i]);
+		}
+
+		fprintf(f, "spawner,x,z,count\n");
+		for (size_t i = 0; i < spawners_.size(); ++i)
+		{
+			for (int z = 0; z < LANDING_CELLS; ++z)
+			{
+				for (int x = 0; x < LANDING_CELLS; ++x)
+				{
+					int n = cells_[(i * LANDING_CELLS + z) * LANDING_CELLS + x];
+					if (n) fprintf(f, "%d,%.1f,%.1f,%d\n", (int)i, (x + 0.5f) * LANDING_CELL - LANDING_RANGE, (z + 0.5f) * LANDING_CELL - LANDING_RANGE, n);
+				}
+			}
+		}
+
+		fclose(f);
+		return true;
+	}
+
+private:
+	// A system as it was on the last frame it was logged.
+	struct LANDING_SYSTEM
+	{
+		LANDING_SYSTEM() : frame_(0), owner_(0) {}
+
+		unsigned int frame_;
+		size_t owner_;
+		std::vector<int> lifetime_;
+		std::vector<float> x_, z_;
+	};
+
+	// 'frame' is done with: the systems that were on the frame before it and not on it were deleted, and
+	// their live particles with them. The systems from before a jump in the log are dropped uncounted.
+	void settle(std::map<unsigned int, LANDING_SYSTEM> &last, unsigned int frame)
+	{
+		for (auto l = last.begin(); l != last.end();)
+		{
+			if (l->second.frame_ == frame)
+			{
+				++l;
+				continue;
+			}
+
+			if (l->second.frame_ + 1 == frame)
+			{
+				const LANDING_SYSTEM &s = l->second;
+				for (size_t j = 0; j < s.lifetime_.size(); ++j)
+				{
+					if (s.lifetime_[j] > 0) land(s.owner_, s.x_[j] - spawners_[s.owner_].x, s.z_[j] - spawners_[s.owner_].z);
+				}
+			}
+
+			l = last.erase(l);
+		}
+	}
+
+	size_t nearest(const D3DXVECTOR3 &p) const
+	{
+		size_t best = 0;
+		float best_d = FLT_MAX;
+		for (size_t i = 0; i < spawners_.size(); ++i)
+		{
+			float dx = p.x - spawners_[i].x, dz = p.z - spawners_[i].z;
+			if (dx * dx + dz * dz < best_d)
+			{
+				best_d = dx * dx + dz * dz;
+				best = i;
+			}
+		}
+
+		return best;
+	}
+
+	void land(size_t spawner, float dx, float dz)
+	{
+		float d = sqrtf(dx * dx + dz * dz);
+		++landed_[spawner];
+		distance_[spawner] += d;
+		if (d > furthest_[spawner]) furthest_[spawner] = d;
+
+		int x = (int)floorf((dx + LANDING_RANGE) / LANDING_CELL);
+		int z = (int)floorf((dz + LANDING_RANGE) / LANDING_CELL);
+		if (x < 0 || z < 0 || x >= LANDING_CELLS || z >= LANDING_CELLS)
+		{
+			++outside_[spawner];
+			return;
+		}
+
+		++cells_[(spawner * LANDING_CELLS + z) * LANDING_CELLS + x];
+	}
+
+	std::vector<D3DXVECTOR3> spawners_;
+	std::vector<int> cells_;				// LANDING_CELLS x LANDING_CELLS per spawner, row by row in Z.
+	std::vector<int> landed_, outside_;
+	std::vector<float> furthest_;
+	std::vector<double> distance_;
+};
@@ -0,0 +1,374 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// MULTIPLE VIEWS
+//
+// With -views on the command line the window is split between several cameras
+// on the one show: the audience's, a drone circling above it and one looking
+// straight down. The show is still simulated once a frame, and its vertices
+// captured once, into the FRAME_SNAPSHOT the pipelined renderer already draws
+// from. Every view draws from that same snapshot.
+//
+// Once a frame, for all the views: SHOW_VIEWS::prepare() puts a box round each
+// draw's vertices (straight from the compact range where there is one).
+// Then for each view, a VIEW_PASS works out its camera, drops the draws whose
+// box is outside its frustum, and orders the rest far to near along its own
+// line of sight - the sprites are alpha blended without writing depth, so each
+// view needs its own order.
+//
+// A pass is drawn by one of two backends:
+//   SNAPSHOT_RENDERER   - the device, into the view's part of the window. The
+//                         snapshot is uploaded once and every view draws from
+//                         the same vertex buffer.
+//   CPU_VIEW_TARGET     - no device: projects every vertex itself and adds it
+//                         into a small frame buffer, one pixel per sprite. For
+//                         the headless drivers (-viewshots), and for checking
+//                         what a camera sees.
+//-----------------------------------------------------------------------------
+
+#include "Pipeline.h"
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// A camera, and where its picture goes in the window.
+struct SHOW_VIEW
+{
+	std::string name_;
+	D3DXVECTOR3 eye_, at_, up_;
+	float fov_;							// Vertical, in radians.
+	float near_, far_;
+	float orbit_;						// Degrees a frame the eye turns about the Y axis through 'at_' - 0 for a fixed camera.
+	float left_, top_, width_, height_;	// Part of the window, 0 - 1.
+};
+
+// Box round one draw's vertices, in world space.
+struct DRAW_BOUNDS
+{
+	D3DXVECTOR3 min_, max_;
+};
+
+//-----------------------------------------------------------------------------
+// One view of one frame - the camera, and the draws it sees in the order to draw them.
+
+class VIEW_PASS
+{
+public:
+	VIEW_PASS(const SHOW_VIEW &view) : view_(view), drawn_(0), culled_(0) {}
+
+	// Set up the camera for frame 'frame' on a 'width' x 'height' target, and cull and order the draws.
+	void prepare(int frame, const std::vector<DRAW_BOUNDS> &bounds, int width, int height)
+	{
+		viewport_.X = (DWORD)(view_.left_ * width);
+		viewport_.Y = (DWORD)(view_.top_ * height);
+		viewport_.Width = (DWORD)(view_.width_ * width);
+		viewport_.Height = (DWORD)(view_.height_ * height);
+		viewport_.MinZ = 0.0f;
+		viewport_.MaxZ = 1.0f;
+
+		eye_ = view_.eye_;
+		if (view_.orbit_ != 0)
+		{
+			float a = D3DXToRadian(fmodf(view_.orbit_ * frame, 360.0f));
+			D3DXVECTOR3 d = view_.eye_ - view_.at_;
+			eye_ = view_.at_ + D3DXVECTOR3(d.x * cosf(a) - d.z * sinf(a), d.y, d.x * sinf(a) + d.z * cosf(a));
+		}
+
+		float aspect = viewport_.Height ? (float)viewport_.Width / (float)viewport_.Height : 1.0f;
+		D3DXMatrixLookAtLH(&view_matrix_, &eye_, &view_.at_, &view_.up_);
+		D3DXMatrixPerspectiveFovLH(&projection_, view_.fov_, aspect, view_.near_, view_.far_);
+		D3DXMatrixMultiply(&view_projection_, &view_matrix_, &projection_);
+
+		frustum();
+
+		// Far to near, by the depth of each box's centre.
+		std::vector<std::pair<float, int>> depth;
+		depth.reserve(bounds.size());
+		culled_ = 0;
+
+		for (int i = 0; i < (int)bounds.size(); ++i)
+		{
+			if (!visible(bounds[i]))
+			{
+				++culled_;
+				continue;
+			}
+
+			D3DXVECTOR3 centre = (bounds[i].min_ + bounds[i].max_) * 0.5f, v;
+			D3DXVec3TransformCoord(&v, &centre, &view_matrix_);
+			depth.push_back(std::make_pair(-v.z, i));
+		}
+
+		std::stable_sort(depth.begin(), depth.end());
+
+		order_.clear();
+		for (auto &d : depth) order_.push_back(d.second);
+		drawn_ = (int)order_.size();
+	}
+
+	const SHOW_VIEW &view() const { return view_; }
+	const D3DXVECTOR3 &eye() const { return eye_; }
+	const D3DXMATRIX &view_matrix() const { return view_matrix_; }
+	const D3DXMATRIX &projection() const { return projection_; }
+	const D3DXMATRIX &view_projection() const { return view_projection_; }
+	const D3DVIEWPORT9 &viewport() const { return viewport_; }
+
+	// Indices into the snapshot's draws_, far to near.
+	const std::vector<int> &order() const { return order_; }
+
+	int drawn() const { return drawn_; }
+	int culled() const { return culled_; }
+
+private:
+
+	// The six planes of the view frustum, from the combined matrix, pointing inwards.
+	void frustum()
+	{
+		const D3DXMATRIX &m = view_projection_;
+
+		set_plane(0, m._14 + m._11, m._24 + m._21, m._34 + m._31, m._44 + m._41);	// Left.
+		set_plane(1, m._14 - m._11, m._24 - m._21, m._34 - m._31, m._44 - m._41);	// Right.
+		set_plane(2, m._14 + m._12, m._24 + m._22, m._34 + m._32, m._44 + m._42);	// Bottom.
+		set_plane(3, m._14 - m._12, m._24 - m._22, m._34 - m._32, m._44 - m._42);	// Top.
+		set_plane(4, m._13, m._23, m._33, m._43);									// Near.
+		set_plane(5, m._14 - m._13, m._24 - m._23, m._34 - m._33, m._44 - m._43);	// Far.
+	}
+
+	void set_plane(int i, float a, float b, float c, float d)
+	{
+		planes_[i].a = a;
+		planes_[i].b = b;
+		planes_[i].c = c;
+		planes_[i].d = d;
+	}
+
+	// False if the box is wholly outside one of the planes.
+	bool visible(const DRAW_BOUNDS &b) const
+	{
+		for (int i = 0; i < 6; ++i)
+		{
+			const D3DXPLANE &p = planes_[i];
+
+			// The corner furthest along the plane's normal.
+			float x = p.a >= 0 ? b.max_.x : b.min_.x;
+			float y = p.b >= 0 ? b.max_.y : b.min_.y;
+			float z = p.c >= 0 ? b.max_.z : b.min_.z;
+
+			if (p.a * x + p.b * y + p.c * z + p.d < 0) return false;
+		}
+		return true;
+	}
+
+	SHOW_VIEW view_;
+	D3DXVECTOR3 eye_;					// Where the eye is this frame (the drone moves).
+	D3DXMATRIX view_matrix_, projection_, view_projection_;
+	D3DVIEWPORT9 viewport_;
+	D3DXPLANE planes_[6];
+	std::vector<int> order_;
+	int drawn_, culled_;
+};
+
+//-----------------------------------------------------------------------------
+// Every view of the show.
+
+class SHOW_VIEWS
+{
+public:
+	bool enabled() const { return !passes_.empty(); }
+
+	void add(const SHOW_VIEW &view) { passes_.push_back(VIEW_PASS(view)); }
+
+	// The audience's camera on the left, a drone and a camera looking down on the right.
+	void add_standard()
+	{
+		add(camera("audience", D3DXVECTOR3(0.0f, 0.0f, -600.0f), D3DXVECTOR3(0.0f, 0.0f, 0.0f), D3DXVECTOR3(0.0f, 1.0f, 0.0f), 800.0f, 0.0f, 0.0f, 0.0f, 2.0f / 3.0f, 1.0f));
+		add(camera("drone", D3DXVECTOR3(0.0f, 350.0f, -450.0f), D3DXVECTOR3(0.0f, 100.0f, 0.0f), D3DXVECTOR3(0.0f, 1.0f, 0.0f), 1400.0f, 0.1f, 2.0f / 3.0f, 0.0f, 1.0f / 3.0f, 0.5f));
+		add(camera("top down", D3DXVECTOR3(0.0f, 900.0f, 0.0f), D3DXVECTOR3(0.0f, 0.0f, 0.0f), D3DXVECTOR3(0.0f, 0.0f, 1.0f), 1400.0f, 0.0f, 2.0f / 3.0f, 0.5f, 1.0f / 3.0f, 0.5f));
+	}
+
+	// Box the snapshot's draws, then cull and order them for each view. Once a frame, before drawing any view.
+	void prepare(const FRAME_SNAPSHOT &s, int width, int height)
+	{
+		bounds_.resize(s.draws_.size());
+
+		for (size_t i = 0; i < s.draws_.size(); ++i)
+		{
+			const SNAPSHOT_DRAW &d = s.draws_[i];
+			DRAW_BOUNDS &b = bounds_[i];
+
+			if (g_CompactVertices)
+			{
+				// The quantized range is the box already.
+				D3DXVECTOR3 half = d.range_.scale_ * COMPACT_QUANT;
+				b.min_ = d.range_.offset_ - half;
+				b.max_ = d.range_.offset_ + half;
+				continue;
+			}
+
+			b.min_ = D3DXVECTOR3(FLT_MAX, FLT_MAX, FLT_MAX);
+			b.max_ = D3DXVECTOR3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+			const POINTVERTEX *v = &s.points_[d.first_];
+			for (int j = 0; j < d.count_; ++j)
+			{
+				const D3DXVECTOR3 &p = v[j].position_;
+				if (p.x < b.min_.x) b.min_.x = p.x;
+				if (p.y < b.min_.y) b.min_.y = p.y;
+				if (p.z < b.min_.z) b.min_.z = p.z;
+				if (p.x > b.max_.x) b.max_.x = p.x;
+				if (p.y > b.max_.y) b.max_.y = p.y;
+				if (p.z > b.max_.z) b.max_.z = p.z;
+			}
+		}
+
+		for (auto &p : passes_)
+		{
+			p.prepare(s.frame_, bounds_, width, height);
+		}
+	}
+
+	std::vector<VIEW_PASS> &passes() { return passes_; }
+	const std::vector<DRAW_BOUNDS> &bounds() const { return bounds_; }
+
+	// One line for the on screen text.
+	std::string status() const
+	{
+		std::string text = "Views:";
+		for (auto &p : passes_)
+		{
+			text += " " + p.view().name_ + " " + std::to_string(p.drawn()) + " drawn, " + std::to_string(p.culled()) + " culled;";
+		}
+		return text;
+	}
+
+private:
+
+	static SHOW_VIEW camera(const char *name, const D3DXVECTOR3 &eye, const D3DXVECTOR3 &at, const D3DXVECTOR3 &up, float far_plane, float orbit,
+		float left, float top, float width, float height)
+	{
+		SHOW_VIEW v;
+		v.name_ = name;
+		v.eye_ = eye;
+		v.at_ = at;
+		v.up_ = up;
+		v.fov_ = D3DX_PI / 4;
+		v.near_ = 1.0f;
+		v.far_ = far_plane;
+		v.orbit_ = orbit;
+		v.left_ = left;
+		v.top_ = top;
+		v.width_ = width;
+		v.height_ = height;
+		return v;
+	}
+
+	std::vector<VIEW_PASS> passes_;
+	std::vector<DRAW_BOUNDS> bounds_;		// One for each of the snapshot's draws - shared by every view.
+};
+
+//-----------------------------------------------------------------------------
+// Draws a view without a device - each sprite is one pixel, added into a
+// greyscale frame buffer the size of the view's viewport.
+
+class CPU_VIEW_TARGET
+{
+public:
+	CPU_VIEW_TARGET() : width_(0), height_(0), drawn_(0), clipped_(0) {}
+
+	void clear(int width, int height)
+	{
+		width_ = width;
+		height_ = height;
+		pixels_.assign(width * height, 0);
+		drawn_ = clipped_ = 0;
+	}
+
+	// Draw the snapshot's draws that 'pass' sees, in its order.
+	void draw(const FRAME_SNAPSHOT &s, const VIEW_PASS &pass)
+	{
+		std::vector<D3DXVECTOR3> positions;
+		std::vector<float> brightness;
+
+		for (int i : pass.order())
+		{
+			const SNAPSHOT_DRAW &d = s.draws_[i];
+
+			if (g_CompactVertices)
+			{
+				positions.resize(d.count_);
+				brightness.resize(d.count_);
+				decode_compact_vertices(&s.compact_[d.first_], d.count_, d.range_, &positions[0], NULL, &brightness[0]);
+
+				for (int j = 0; j < d.count_; ++j) plot(pass, positions[j], brightness[j]);
+			}
+			else
+			{
+				const POINTVERTEX *v = &s.points_[d.first_];
+				for (int j = 0; j < d.count_; ++j) plot(pass, v[j].position_, 1.0f);
+			}
+		}
+	}
+
+	// Write the frame buffer as a binary greyscale PGM. Returns false if the file could not be written.
+	bool save(const char *filename) const
+	{
+		FILE *f = NULL;
+		if (fopen_s(&f, filename, "wb") != 0 || f == NULL) return false;
+
+		std::string header = "P5\n" + std::to_string(width_) + " " + std::to_string(height_) + "\n255\n";
+		bool ok = fwrite(header.c_str(), 1, header.size(), f) == header.size();
+		if (ok && !pixels_.empty()) ok = fwrite(&pixels_[0], 1, pixels_.size(), f) == pixels_.size();
+		fclose(f);
+
+		return ok;
+	}
+
+	const std::vector<unsigned char> &pixels() const { return pixels_; }
+	int width() const { return width_; }
+	int height() const { return height_; }
+
+	// Sprites that landed in the view, and those outside it.
+	int drawn() const { return drawn_; }
+	int clipped() const { return clipped_; }
+
+	// Pixels with anything in them.
+	int lit() const
+	{
+		int n = 0;
+		for (unsigned char p : pixels_) n += p != 0;
+		return n;
+	}
+
+private:
+
+	void plot(const VIEW_PASS &pass, const D3DXVECTOR3 &position, float brightness)
+	{
+		D3DXVECTOR4 c;
+		D3DXVec3Transform(&c, &position, &pass.view_projection());
+
+		// The same clip volume as the device's.
+		if (c.w <= 0 || c.x < -c.w || c.x > c.w || c.y < -c.w || c.y > c.w || c.z < 0 || c.z > c.w)
+		{
+			++clipped_;
+			return;
+		}
+
+		int x = (int)((c.x / c.w + 1.0f) * 0.5f * width_);
+		int y = (int)((1.0f - c.y / c.w) * 0.5f * height_);
+		if (x >= width_) x = width_ - 1;
+		if (y >= height_) y = height_ - 1;
+
+		// Added in, as the alpha blending does - saturates at white.
+		unsigned char &p = pixels_[y * width_ + x];
+		int v = p + (int)(brightness * 64.0f);
+		p = (unsigned char)(v > 255 ? 255 : v);
+
+		++drawn_;
+	}
+
+	int width_, height_;
+	std::vector<unsigned char> pixels_;
+	int drawn_, clipped_;
+};
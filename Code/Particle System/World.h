@@ -0,0 +1,263 @@
+#pragma once
+//-----------------------------------------------------------------------------
+// SHOW WORLDS
+//
+// Everything that belongs to one show - its systems and spawners, the command
+// queue and type buckets, the timer wheel, the particle pool, the wind, the
+// random streams and the frame count - is kept in a SHOW_WORLD, rather than in
+// globals, so one process can run any number of shows side by side.
+//
+// g_World is the show the calling thread is running. It is a per thread
+// pointer, starting at g_MainWorld on every thread, so the window, the
+// pipeline's simulation thread and everything else that has only ever known
+// one show carry on running that one. A thread that runs some other show puts
+// it in place with a WORLD_SCOPE for as long as it is working on it - see
+// RunPreviews(), which simulates variants of the show on a pool of threads.
+//
+// What doesn't change while a show runs is shared by all of them instead: the
+// device and the textures, the sprite atlas, the direction tables, the ground,
+// and the wind noise tables, one per seed (see SharedNoise()). So are the
+// settings for the whole process - g_PipelinedRender, g_CompactVertices - and
+// g_Memory, which counts every show's allocations together.
+//-----------------------------------------------------------------------------
+
+#include <memory>
+#include <vector>
+#include "Memory.h"
+#include "TimerWheel.h"
+#include "ParticlePool.h"
+
+class PARTICLE_SYSTEM_BASE;
+class FOUNTAIN_CLASS;
+class FIREWORK_EXPLOSION_CLASS;
+class FIREWORK_ROCKET_CLASS;
+class FireworkSpawner;
+
+// Seedable generator (xorshift128) used in place of rand_s when a show has to be
+// reproducible - i.e. while recording or replaying it.
+struct SHOW_RANDOM
+{
+	unsigned int s_[4];
+
+	void seed(unsigned int seed)
+	{
+		// Spread the seed over the state with splitmix, xorshift must not start at all zero.
+		for (int i = 0; i < 4; ++i)
+		{
+			seed += 0x9E3779B9;
+			unsigned int z = seed;
+			z = (z ^ (z >> 16)) * 0x85EBCA6B;
+			z = (z ^ (z >> 13)) * 0xC2B2AE35;
+			s_[i] = (z ^ (z >> 16)) | (i == 0);
+		}
+	}
+
+	unsigned int next()
+	{
+		unsigned int t = s_[3];
+		unsigned int s = s_[0];
+		s_[3] = s_[2];
+		s_[2] = s_[1];
+		s_[1] = s;
+
+		t ^= t << 11;
+		t ^= t >> 8;
+		return s_[0] = t ^ s ^ (s >> 19);
+	}
+};
+
+// The show draws from RANDOM_STREAMS separate streams: stream 0 for the show
+// itself (the wind), and one for each spawner, which every system it launches
+// keeps using. A spawner's fireworks then come out the same whichever other
+// spawners are simulated alongside it (see Shard.h).
+#define RANDOM_STREAMS 16
+
+// The wind noise table, read a value at a time as the wind changes.
+typedef std::vector<double, TRACKED_ALLOCATOR<double, MEM_NOISE>> NOISE_TABLE;
+
+// The table for 'seed', shared by every show built from it.
+std::shared_ptr<const NOISE_TABLE> SharedNoise(unsigned int seed);
+
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+// Each system type is updated in a bucket of its own. SHOW_WORLD::particles_ keeps every
+// system in the order they were added - it is what is drawn, hashed, saved and
+// streamed - but the update runs over SYSTEM_BUCKETS instead: the fountains,
+// then the explosions, then the rockets, each a plain array of pointers to
+// that type, updated with a direct call to that type's update(). A loop over
+// one type makes the same call every time, so there is no virtual call through
+// the system's vtable and nothing for the branch predictor to guess, and no
+// shared_ptr is touched.
+//
+// Moving a system from one bucket to another never happens, so the only change
+// is in how the update is ordered - a rocket that is listed before a fountain
+// in particles_ is now updated after it. Nothing one type does in its update
+// is seen by another until the next frame (new systems wait for apply(), the
+// fuses and bursts go off from the timer wheel), so the show is the same.
+//
+// The buckets are rebuilt from particles_ whenever it changes (apply() and the
+// checkpoint restore).
+
+class SYSTEM_BUCKETS
+{
+	public:
+		// Sort 'systems' into the buckets, keeping their order within each.
+		void rebuild(const std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> &systems);
+
+		// Update every system, type by type. Returns the number that flagged themselves 'safeToDelete'.
+		int update();
+
+	private:
+		template <class T> static int update(const std::vector<T *> &bucket);
+
+		std::vector<FOUNTAIN_CLASS *> fountains_;
+		std::vector<FIREWORK_EXPLOSION_CLASS *> explosions_;
+		std::vector<FIREWORK_ROCKET_CLASS *> rockets_;
+};
+
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+// Systems are never added to or removed from particles_ while it is being updated.
+// New systems are queued here with spawn(), systems that have finished flag themselves
+// 'safeToDelete', and apply() makes both changes in one pass once every system has
+// been updated for the frame.
+
+class SYSTEM_COMMAND_QUEUE
+{
+	public:
+		SYSTEM_COMMAND_QUEUE() : retired_(0) {}
+
+		// Queue 's' to be initialised and added at the end of the frame.
+		void spawn(const std::shared_ptr<PARTICLE_SYSTEM_BASE> &s)
+		{
+			spawns_.push_back(s);
+		}
+
+		// Note that a system has flagged itself 'safeToDelete'.
+		void retire(int count = 1)
+		{
+			retired_ += count;
+		}
+
+		// Apply everything queued this frame to the current show's systems.
+		void apply();
+
+		// Remove every retired system in a single sweep (keeps the draw order).
+		void compact(std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> &systems);
+
+		// Initialise the new systems together and append them.
+		void append_spawns(std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> &systems);
+
+		// Drop anything queued (the show is being replaced).
+		void clear()
+		{
+			spawns_.clear();
+			retired_ = 0;
+		}
+
+	private:
+		static bool is_retired(const std::shared_ptr<PARTICLE_SYSTEM_BASE> &s);
+
+		std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> spawns_;
+		int retired_;
+};
+
+//-----------------------------------------------------------------------------
+
+class SHOW_WORLD
+{
+public:
+	SHOW_WORLD() : wind_speed_(0.0f), wind_drift_(0.0f), noise_seed_(0), deterministic_random_(false), random_stream_(0), random_draws_(0),
+		frame_(0), system_serial_(0), fast_forward_(false)
+	{}
+
+	~SHOW_WORLD();
+
+	// First, so it is the last to go - the systems give their particles back to it.
+	PARTICLE_POOL pool_;
+	TIMER_WHEEL timers_;					// Runs the show's cues, advanced once per frame by Update().
+
+	std::vector<std::shared_ptr<PARTICLE_SYSTEM_BASE>> particles_;	// Every live system, in the order they were added.
+	std::vector<std::shared_ptr<FireworkSpawner>> spawners_;
+	SYSTEM_COMMAND_QUEUE queue_;
+	SYSTEM_BUCKETS buckets_;
+
+	float wind_speed_;
+	float wind_drift_;						// Sum of wind_speed_ over every frame so far - the distance the wind has carried anything.
+	std::shared_ptr<const NOISE_TABLE> noise_;
+	NOISE_TABLE::const_iterator noise_cursor_;	// The value the wind was last set from.
+	unsigned int noise_seed_;				// Seed 'noise_' was built from (saved in checkpoints).
+
+	bool deterministic_random_;				// Draw from random_ instead of rand_s.
+	SHOW_RANDOM random_[RANDOM_STREAMS];
+	int random_stream_;						// Stream random_number() draws from.
+	unsigned int random_draws_;				// Number of random numbers drawn so far.
+
+	unsigned int frame_;					// Number of frames simulated so far.
+	unsigned int system_serial_;			// Serial number of the last system created.
+	bool fast_forward_;						// Seeking - the updates skip writing vertices, nothing is drawn until the seek is over (see Seek.h).
+};
+
+SHOW_WORLD g_MainWorld;										// The show in the window.
+SHOW_THREAD_LOCAL SHOW_WORLD *g_World = &g_MainWorld;		// The show this thread is running.
+
+// Run 'world' on this thread until the end of the scope.
+struct WORLD_SCOPE
+{
+	WORLD_SCOPE(SHOW_WORLD *world) : previous_(g_World) { g_World = world; }
+	~WORLD_SCOPE() { g_World = previous_; }
+
+	SHOW_WORLD *previous_;
+};
+
+SHOW_WORLD::~SHOW_WORLD()
+{
+	// The systems and spawners cancel their timers on the wheel they were made with (this show's), but anything
+	// else they look up through g_World as they go should be this show too.
+	WORLD_SCOPE scope(this);
+
+	queue_.clear();
+	spawners_.clear();
+	particles_.clear();
+	buckets_.rebuild(particles_);
+}
+
+PARTICLE_POOL &WorldParticlePool()
+{
+	return g_World->pool_;
+}
+
+// Seed every stream of the current show from 'seed'. Variants of a show (see
+// RunPreviews()) share stream 0, and so the wind and its noise table, but the
+// spawners' streams are seeded from 'variant' as well - variant 0 is the show.
+void seed_show_random(unsigned int seed, unsigned int variant = 0)
+{
+	for (int i = 0; i < RANDOM_STREAMS; ++i)
+	{
+		g_World->random_[i].seed(seed + i * 0x632BE5ABu + (i ? variant * 0x9E3779B9u : 0));
+	}
+}
+
+// Draw from 'stream' until the end of the scope.
+struct RANDOM_STREAM_SCOPE
+{
+	RANDOM_STREAM_SCOPE(int stream) : previous_(g_World->random_stream_) { g_World->random_stream_ = stream; }
+	~RANDOM_STREAM_SCOPE() { g_World->random_stream_ = previous_; }
+
+	int previous_;
+};
+
+unsigned int random_number()
+{
+	++g_World->random_draws_;
+
+	if (g_World->deterministic_random_) return g_World->random_[g_World->random_stream_].next();
+
+	unsigned int n;
+	rand_s(&n);
+	return n;
+}
+
+unsigned int random_number(unsigned int a, unsigned int b)	// return a random number between a and b.
+{
+	unsigned int n = random_number();
+	return a + (n % (b - a));
+}
@@ -0,0 +1,97 @@
+//-----------------------------------------------------------------------------
+// RING CONSUMER
+//
+// A reader for the frame ring (see FrameRing.h) that draws nothing - it takes
+// every frame the simulation hands over, reads it where it lies, and reports
+// how long the frames took to arrive and how fast they came.
+//
+//   ring_consumer [name] [frames]
+//
+// Start it beside "-ring <frames> [name]". It waits up to RING_WAIT_OPEN
+// seconds for the ring to appear, and stops after 'frames' frames (all of
+// them if 0), or once none has come for RING_WAIT_IDLE seconds. To try it
+// without the show, start RingProducer beside it instead.
+//
+// Needs nothing but FrameRing.h:
+//   g++ -std=c++11 -O2 -pthread RingConsumer.cpp -o ring_consumer -lrt		(Linux)
+//   cl /EHsc /O2 RingConsumer.cpp											(Windows)
+//-----------------------------------------------------------------------------
+
+#include "../Particle System/FrameRing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define RING_WAIT_OPEN	10		// Seconds to wait for the simulation to make the ring.
+#define RING_WAIT_IDLE	2		// Seconds without a frame before giving up.
+
+int main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : FRAME_RING_NAME;
+	int wanted = argc > 2 ? atoi(argv[2]) : 0;
+
+	FRAME_RING_READER reader;
+	for (int tries = 0; !reader.open(name); ++tries)
+	{
+		if (tries == RING_WAIT_OPEN * 100)
+		{
+			fprintf(stderr, "No frame ring called %s.\n", name);
+			return 1;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	double frequency = (double)ring_clock_frequency();
+	std::vector<double> latency;						// Publish to acquire for each frame, in microseconds.
+	unsigned int last_sequence = 0, gaps = 0;
+	long long lost = 0, idle_since = ring_clock();
+	double checksum = 0;
+
+	while (wanted <= 0 || (int)latency.size() < wanted)
+	{
+		const FRAME_RING_SLOT *s = reader.acquire();
+		long long now = ring_clock();
+
+		if (!s)
+		{
+			if (now - idle_since > RING_WAIT_IDLE * (long long)frequency) break;
+			std::this_thread::yield();
+			continue;
+		}
+
+		latency.push_back((double)(now - s->published_) * 1000000.0 / frequency);
+		idle_since = now;
+
+		// Each frame should follow the last, with nothing missed in between.
+		if (last_sequence && s->sequence_ != last_sequence + 1) ++gaps;
+		last_sequence = s->sequence_;
+		lost += s->lost_;
+
+		// Read every vertex, as a renderer uploading them would.
+		for (int i = 0; i < s->vertices_; ++i) checksum += s->vertex_[i].y_;
+
+		reader.release();
+	}
+
+	if (latency.empty())
+	{
+		fprintf(stderr, "No frames came.\n");
+		return 1;
+	}
+
+	std::vector<double> sorted(latency);
+	std::sort(sorted.begin(), sorted.end());
+
+	double mean = 0;
+	for (double l : latency) mean += l;
+	mean /= latency.size();
+
+	printf("frames %d, %.1f a second, %.2f MB/s\n", reader.frames(), reader.frame_rate(), reader.byte_rate() / (1024.0 * 1024.0));
+	printf("handover latency us: mean %.1f, median %.1f, 99%% %.1f, worst %.1f\n", mean, sorted[sorted.size() / 2], sorted[sorted.size() * 99 / 100], sorted.back());
+	printf("dropped by the writer %u, sequence gaps %u, vertices lost %lld, checksum %.3f\n", reader.dropped(), gaps, lost, checksum);
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+//-----------------------------------------------------------------------------
+// RING PRODUCER
+//
+// A stand-in for "-ring" that needs no device and no show: it makes the frame
+// ring (see FrameRing.h) and hands over frames of made up particles at a
+// steady rate, so RingConsumer can be tried on its own, on any system.
+//
+//   ring_producer [name] [frames] [fps]
+//
+// Start ring_consumer first, then this - with the same name and frames:
+//   ring_consumer FireworksTest 600 & ring_producer FireworksTest 600 60
+// Each frame is RING_TEST_DRAWS draws of RING_TEST_VERTICES vertices. It prints
+// the sum of every vertex's Y it handed over, which is the consumer's checksum
+// when no frame was dropped.
+//
+// Needs nothing but FrameRing.h:
+//   g++ -std=c++11 -O2 -pthread RingProducer.cpp -o ring_producer -lrt		(Linux)
+//   cl /EHsc /O2 RingProducer.cpp												(Windows)
+//-----------------------------------------------------------------------------
+
+#include "../Particle System/FrameRing.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+
+#define RING_TEST_DRAWS		8			// Draws a frame - one per made up system.
+#define RING_TEST_VERTICES	2000		// Vertices a draw.
+#define RING_TEST_LINGER	3			// Seconds to keep the ring open after the last frame, for the consumer to finish.
+
+int main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : FRAME_RING_NAME;
+	int frames = argc > 2 ? atoi(argv[2]) : 600;
+	double fps = argc > 3 ? atof(argv[3]) : 60.0;
+	if (frames <= 0 || fps <= 0)
+	{
+		fprintf(stderr, "ring_producer [name] [frames] [fps]\n");
+		return 1;
+	}
+
+	FRAME_RING_WRITER writer;
+	if (!writer.create(name))
+	{
+		fprintf(stderr, "Could not make a frame ring called %s.\n", name);
+		return 1;
+	}
+
+	double checksum = 0;
+	int handed = 0;
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	std::chrono::duration<double> period(1.0 / fps);
+
+	for (int f = 1; f <= frames; ++f)
+	{
+		std::this_thread::sleep_until(next);
+		next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+
+		// A full ring drops the frame, as the show does.
+		if (!writer.begin_frame((unsigned int)f)) continue;
+
+		double sum = 0;
+		for (int d = 0; d < RING_TEST_DRAWS; ++d)
+		{
+			// Written where reserve() says, as the systems do.
+			RING_VERTEX *v = writer.reserve(RING_TEST_VERTICES);
+			if (!v) break;
+
+			for (int i = 0; i < RING_TEST_VERTICES; ++i)
+			{
+				float t = (float)(f + i) * 0.01f;
+				v[i].x_ = (float)(d * 20 - 70) + cosf(t) * i * 0.01f;
+				v[i].y_ = (float)((f * 7 + i * 13 + d) % 256) * 0.5f;
+				v[i].z_ = sinf(t) * i * 0.01f;
+				sum += v[i].y_;
+			}
+
+			writer.commit(d % 4, 1.0f, RING_TEST_VERTICES, v);
+		}
+
+		writer.end_frame(0.0f);
+		checksum += sum;
+		++handed;
+	}
+
+	printf("%s\n", writer.status().c_str());
+	printf("frames %d of %d handed over, checksum %.3f\n", handed, frames, checksum);
+
+	std::this_thread::sleep_for(std::chrono::seconds(RING_TEST_LINGER));
+	writer.close();
+
+	return 0;
+}